@@ -1,19 +1,31 @@
+#define _GNU_SOURCE // for sendmmsg() and recvmmsg()
+
+#include <endian.h>
 #include <errno.h>
 #include <ifaddrs.h>
+#include <net/if.h>
 #include <netdb.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <linux/if_packet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
 
 #include "command_client.h"
 #include "defines.h"
+#include "file_index.h"
 #include "logger.h"
 #include "message_queue.h"
 #include "peer_list.h"
 #include "shutdown.h"
+#include "sync_scheduler.h"
+#include "timer_wheel.h"
 #include "util.h"
 
 #include "broadcast.h"
@@ -23,6 +35,29 @@
 
 #define MESSAGE_TYPE_DISCOVER 10
 #define MESSAGE_TYPE_AVAILABLE 11
+#define MESSAGE_TYPE_CHANGED 12
+
+#define DISCOVERY_INTERVAL_SECONDS 10.0 // the interval between two discovery broadcasts in small networks
+#define DISCOVERY_INTERVAL_JITTER 0.25 // the interval is randomized by +- this fraction, so the nodes do not synchronize
+#define DISCOVERY_INTERVAL_MAX_SECONDS 600.0
+#define DISCOVERY_GROUP_BUDGET 32.0 // in large networks the interval grows so that all nodes together send about this many discoveries per DISCOVERY_INTERVAL_SECONDS
+#define STARTUP_DELAY_SECONDS 1.0 // the first discovery is sent within this time after the start
+#define STARTUP_QUERY_COUNT 2 // how many discoveries after the start ask all peers to reply
+#define REPLY_DELAY_MAX_SECONDS 0.5 // replies are delayed randomly, so a new peer is not flooded with replies at once
+#define REPLY_SUPPRESSION_SECONDS 1.0 // no reply is sent if the own announcement went out to the group within this time
+
+#define DISCOVERY_STATE_VERSION 2 // newer versions may append fields to discovery_state_type
+#define DISCOVERY_STATE_V1_SIZE offsetof(discovery_state_type, flags) // version 1 had no flags
+
+#define DISCOVERY_FLAG_QUERY 0x01 // the sender wants a reply from every peer, e.g. because it just started
+
+#define RECEIVE_BATCH_SIZE 32 // how many datagrams are read with a single recvmmsg() call
+#define RECEIVE_BUFFER_SIZE 2048
+#define RECEIVE_CONTROL_SIZE (CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(struct in_pktinfo)))
+#define SEND_BATCH_MAX_SIZE 1024 // sendmmsg() sends at most UIO_MAXIOV messages at once
+
+#define CHANGED_PACKET_MAX_SIZE 1400 // stay below the usual MTU so change notifications do not get fragmented
+#define CHANGED_PACKET_MAX_COUNT 4 // if more packets would be needed the peers are told to check everything instead
 
 /// A packet wrapper structure for broadcast packets
 typedef struct {
@@ -31,50 +66,254 @@ typedef struct {
 	char sender_id[6]; //!< The sender id of the peer broadcasting this packet
 } __attribute__((packed)) packet_type; // should be packed for size and consistency across nodes
 
+/// The index state that is appended to MESSAGE_TYPE_DISCOVER and MESSAGE_TYPE_AVAILABLE packets
+typedef struct {
+	unsigned char version; //!< DISCOVERY_STATE_VERSION, peers accept any version >= 1 and ignore appended fields
+	uint64_t generation; //!< The change generation of the sender's index in network byte order
+	unsigned char root_hash[SHA256_HASH_SIZE]; //!< The merkle hash of the sender's whole tree
+	unsigned char flags; //!< DISCOVERY_FLAG bits, since version 2
+} __attribute__((packed)) discovery_state_type;
+
+/// A MESSAGE_TYPE_DISCOVER or MESSAGE_TYPE_AVAILABLE packet
+typedef struct {
+	packet_type header; //!< The common header
+	discovery_state_type state; //!< The index state of the sender
+} __attribute__((packed)) discovery_packet_type;
+
+// discovery packets that only consist of the header, as sent by peers from before the index state, are still
+// accepted, but every periodic sync with such a peer has to go through. The other way round does not work: those
+// peers drop every packet that is longer than the header, so they never see our announcements
+
+// discovery is done like mdns: every node announces itself to the whole group with a MESSAGE_TYPE_DISCOVER packet
+// once per interval, that interval grows with the count of known peers. Nobody replies to the announcements of known
+// peers, they have heard our own announcements already. Only new peers and peers that ask for it with
+// DISCOVERY_FLAG_QUERY get a MESSAGE_TYPE_AVAILABLE reply, which is sent to the whole group as well after a random
+// delay. If we announced ourselves within REPLY_SUPPRESSION_SECONDS anyway, the reply is skipped.
+// so every node sends about one packet per interval and the traffic grows linearly with the count of nodes
+
+// a MESSAGE_TYPE_CHANGED packet is a packet_type followed by a 2 byte path count and the paths
+// each path is prefixed with its 2 byte length, all numbers are in network byte order
+
+/// An interface of this host as seen by the last enumeration
+typedef struct {
+	unsigned int index; //!< The interface index
+	int link_speed; //!< The speed of the link in Mbit/s, 0 if unknown
+	int multicast; //!< 1 if the ipv6 group is joined and the announcements are sent on this interface
+} interface_type;
+
 // helper functions should be static so they are not visible outside of this module
+static void append_changed_path(unsigned char* packet, int* packet_size, const char* path);
 static int create_broadcast_listener();
+static void announce(unsigned char message_type, unsigned char flags);
+static void create_discovery_packet(discovery_packet_type* packet, unsigned char message_type, unsigned char flags, char sender_id[6]);
+static int create_netlink_socket();
+static void discovery_due(void* argument);
+static void drain_netlink_socket();
+static unsigned int get_interface_index(struct msghdr* header);
+static int get_link_speed(unsigned int interface_index);
+static double get_next_discovery_delay();
 static void get_own_id(char buffer[6]);
-static int is_packet_valid(packet_type* packet);
-static void peer_seen(char* peer_id, struct sockaddr* peer_ip);
-static int send_available_packet(struct sockaddr* destination_address, char sender_id[6]);
-static void send_ipv4_broadcast(char sender_id[6]);
-static void send_ipv6_multicast(char sender_id[6]);
+static void handle_changed_packet(packet_type* packet, int packet_size, struct sockaddr* sender_address);
+static void handle_packet(char* buffer, int size, struct sockaddr_storage* sender_address, unsigned int interface_index);
+static int is_packet_valid(packet_type* packet, int packet_size);
+static void open_sender_sockets();
+static int peer_seen(char* peer_id, struct sockaddr* peer_ip, unsigned int interface_index, discovery_state_type* state);
+static int read_link_speed(const char* interface_name);
+static void receive_packets(int listener_socket);
+static void refresh_interfaces();
+static void reply_due(void* argument);
+static void schedule_reply();
+static void send_batch(int socketfd, struct mmsghdr* messages, unsigned int count);
+static void send_ipv4_broadcast(const discovery_packet_type* packet);
+static void send_ipv6_multicast(const discovery_packet_type* packet);
+static void set_group_membership(unsigned int interface_index, int join);
+static void start_changed_packet(unsigned char* packet, int* packet_size);
+static void update_group_memberships(const interface_type* new_interfaces, size_t new_interface_count);
 
 // static variables for this module
 static message_queue_type* message_queue = NULL;
+static char own_id[6];
+static int own_id_set = 0; // own_id is also used by other threads through broadcast_changed_paths
+static struct timeval last_announcement; // when we last sent a discovery or a reply to the group
+static int reply_pending = 0;
+static int startup_queries_left = STARTUP_QUERY_COUNT;
+static unsigned int random_seed = 0;
+// the sockets and the interfaces are kept for the lifetime of the thread, the interfaces are refreshed on netlink events
+static int broadcast_listener = -1;
+static int listener_family = AF_UNSPEC;
+static int ipv4_socket = -1;
+static int ipv6_socket = -1;
+static int netlink_socket = -1;
+static struct sockaddr_in* broadcast_addresses = NULL;
+static size_t broadcast_address_count = 0;
+static interface_type* interfaces = NULL;
+static size_t interface_count = 0;
+static unsigned int* joined_interfaces = NULL; // the interfaces the listener joined the ipv6 group on, 0 is the default interface
+static size_t joined_interface_count = 0;
 
 void broadcast_thread_send_message(message_queue_entry_type* message) {
 	message_queue_push(message_queue, message);
 }
 
+int broadcast_get_own_id(char id[6]) {
+	if(!__atomic_load_n(&own_id_set, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	memcpy(id, own_id, 6);
+	return 1;
+}
+
+double broadcast_get_interval_scale(size_t peer_count) {
+	double scale = (peer_count + 1) / DISCOVERY_GROUP_BUDGET;
+	if(scale < 1.0) {
+		return 1.0;
+	}
+	if(scale > DISCOVERY_INTERVAL_MAX_SECONDS / DISCOVERY_INTERVAL_SECONDS) {
+		return DISCOVERY_INTERVAL_MAX_SECONDS / DISCOVERY_INTERVAL_SECONDS;
+	}
+	return scale;
+}
+
 // the broadcasting thread is responsible for discovering
 // new peers and responding to discovery packets sent by other peers
 // this status should be in the peerList
 // whenever the broadcastThread discovers a new peer it should add it to the
 // peerList
+void broadcast_changed_paths(char* const* paths, size_t path_count) {
+	if(!__atomic_load_n(&own_id_set, __ATOMIC_ACQUIRE) || path_count == 0) {
+		return;
+	}
+	known_peer_type* peers;
+	size_t peer_count = get_known_peers(&peers);
+	if(peer_count == 0) {
+		free(peers);
+		return;
+	}
+
+	// pack the paths into as few packets as possible
+	unsigned char packets[CHANGED_PACKET_MAX_COUNT][CHANGED_PACKET_MAX_SIZE];
+	int packet_sizes[CHANGED_PACKET_MAX_COUNT];
+	int packet_count = 0;
+	int too_many_paths = 0;
+	size_t i;
+	for(i = 0; i < path_count; i++) {
+		size_t path_length = strlen(paths[i]);
+		if(packet_count == 0 || packet_sizes[packet_count - 1] + 2 + path_length > CHANGED_PACKET_MAX_SIZE) {
+			if(packet_count == CHANGED_PACKET_MAX_COUNT || sizeof(packet_type) + 4 + path_length > CHANGED_PACKET_MAX_SIZE) {
+				too_many_paths = 1;
+				break;
+			}
+			start_changed_packet(packets[packet_count], &packet_sizes[packet_count]);
+			packet_count++;
+		}
+		append_changed_path(packets[packet_count - 1], &packet_sizes[packet_count - 1], paths[i]);
+	}
+	if(too_many_paths) {
+		// telling the peers that the root changed makes them check everything
+		start_changed_packet(packets[0], &packet_sizes[0]);
+		append_changed_path(packets[0], &packet_sizes[0], "/");
+		packet_count = 1;
+	}
+
+	// all packets for all peers of an address family are sent with a single system call
+	struct iovec packet_vectors[CHANGED_PACKET_MAX_COUNT];
+	int packet_index;
+	for(packet_index = 0; packet_index < packet_count; packet_index++) {
+		packet_vectors[packet_index].iov_base = packets[packet_index];
+		packet_vectors[packet_index].iov_len = packet_sizes[packet_index];
+	}
+	struct mmsghdr* messages[2]; // one batch for ipv4 and one for ipv6
+	unsigned int message_counts[2] = { 0, 0 };
+	messages[0] = (struct mmsghdr*)calloc(peer_count * packet_count, sizeof(struct mmsghdr));
+	messages[1] = (struct mmsghdr*)calloc(peer_count * packet_count, sizeof(struct mmsghdr));
+	if(messages[0] == NULL || messages[1] == NULL) {
+		LOGD("calloc failed\n");
+		free(messages[0]);
+		free(messages[1]);
+		free(peers);
+		return;
+	}
+	for(i = 0; i < peer_count; i++) {
+		struct sockaddr* address = (struct sockaddr*)&peers[i].address;
+		int family_index = address->sa_family == AF_INET ? 0 : 1;
+		socklen_t address_size;
+		if(address->sa_family == AF_INET) {
+			((struct sockaddr_in*)address)->sin_port = htons(BROADCAST_LISTENER_PORT);
+			address_size = sizeof(struct sockaddr_in);
+		} else {
+			((struct sockaddr_in6*)address)->sin6_port = htons(BROADCAST_LISTENER_PORT);
+			address_size = sizeof(struct sockaddr_in6);
+		}
+		for(packet_index = 0; packet_index < packet_count; packet_index++) {
+			struct msghdr* header = &messages[family_index][message_counts[family_index]++].msg_hdr;
+			header->msg_name = address;
+			header->msg_namelen = address_size;
+			header->msg_iov = &packet_vectors[packet_index];
+			header->msg_iovlen = 1;
+		}
+	}
+	int family_index;
+	for(family_index = 0; family_index < 2; family_index++) {
+		if(message_counts[family_index] > 0) {
+			int sender_socket = socket(family_index == 0 ? AF_INET : AF_INET6, SOCK_DGRAM, 0);
+			if(sender_socket == -1) {
+				LOGD("socket: %s\n", strerror(errno));
+			} else {
+				send_batch(sender_socket, messages[family_index], message_counts[family_index]);
+				close(sender_socket);
+			}
+		}
+		free(messages[family_index]);
+	}
+	LOGD("notified %zu peers about %zu changed paths\n", peer_count, path_count);
+	free(peers);
+}
+
 void* broadcast_thread(void* user_data) {
 	LOGD("started\n");
 
 	// this has to be called otherwise this thread will not be able to receive any messages
 	message_queue = message_queue_create_queue();
 
-	int broadcast_listener = create_broadcast_listener();
+	broadcast_listener = create_broadcast_listener();
 
 	// we also need our id so other clients can match ip addresses
-	char own_id[6];
 	get_own_id(own_id);
+	__atomic_store_n(&own_id_set, 1, __ATOMIC_RELEASE);
 
 	char hex_buffer[20];
 	get_hex_string((unsigned char*)own_id, 6, hex_buffer, sizeof(hex_buffer));
 	LOGD("own id is: %s\n", hex_buffer);
 
-	// initialize timer here so the first broadcast is done after the first timeout
-	struct timeval last_broadcast_discovery;
-	gettimeofday(&last_broadcast_discovery, NULL);
+	// the first discovery goes out right after the start, the random delay keeps nodes that are started together apart
+	random_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+	memset(&last_announcement, 0, sizeof(last_announcement));
+	reply_pending = 0;
+	startup_queries_left = STARTUP_QUERY_COUNT;
+	timer_wheel_start(STARTUP_DELAY_SECONDS * rand_r(&random_seed) / ((double)RAND_MAX + 1.0), discovery_due, NULL, 0);
+
+	open_sender_sockets();
+	netlink_socket = create_netlink_socket();
+	refresh_interfaces();
 
 	fd_set master_set;
 	FD_ZERO(&master_set);
 	FD_SET(broadcast_listener, &master_set);
+	int max_socket = broadcast_listener;
+	if(netlink_socket != -1) {
+		FD_SET(netlink_socket, &master_set);
+		if(netlink_socket > max_socket) {
+			max_socket = netlink_socket;
+		}
+	}
+	// the timers post their messages to the queue, so select() has to return for them right away
+	int queue_fd = message_queue_get_fd(message_queue);
+	if(queue_fd != -1) {
+		FD_SET(queue_fd, &master_set);
+		if(queue_fd > max_socket) {
+			max_socket = queue_fd;
+		}
+	}
 
 	LOGD("listening to broadcast @ %d\n", broadcast_listener);
 
@@ -82,27 +321,36 @@ void* broadcast_thread(void* user_data) {
 		// handle messages sent by other threads
 		message_queue_entry_type* message;
 		while((message = message_queue_pop(message_queue)) != NULL) {
-			LOGD("received message: %s\n", message->message_id);
+			if(strcmp(message->message_id, "discovery_due") == 0) {
+				// without any known peer we ask for replies, otherwise we would have to wait a whole interval of the others
+				unsigned char flags = 0;
+				if(startup_queries_left > 0 || get_peer_count() == 0) {
+					flags |= DISCOVERY_FLAG_QUERY;
+				}
+				announce(MESSAGE_TYPE_DISCOVER, flags);
+				LOGD("sending broadcast discovery\n");
+				double delay = get_next_discovery_delay();
+				if(startup_queries_left > 0) {
+					startup_queries_left--;
+				}
+				timer_wheel_start(delay, discovery_due, NULL, 0);
+			} else if(strcmp(message->message_id, "reply_due") == 0) {
+				reply_pending = 0;
+				if(get_passed_time(last_announcement) >= REPLY_SUPPRESSION_SECONDS) {
+					announce(MESSAGE_TYPE_AVAILABLE, 0);
+					LOGD("sending discovery reply\n");
+				}
+			} else {
+				LOGD("received message: %s\n", message->message_id);
+			}
 			message_queue_free_message(message);
 		}
 
-		if(get_passed_time(last_broadcast_discovery) > 10.0) {
-			// we want to rebroadcast after 10 seconds are over
-			// this should probably be random so the chance for collisions is low?!
-			// should this be something I need to think about with a layer 4 protocol like udp
-			// or is this automagically done by the lower layers?
-			gettimeofday(&last_broadcast_discovery, NULL); // reset the timer
-            send_ipv6_multicast(own_id);
-            send_ipv4_broadcast(own_id);
-            LOGD("sending broadcast discovery\n");
-            //print_peer_list();
-		}
-
 	    fd_set read_set = master_set;
 	    struct timeval timeout;
 	    memset(&timeout, 0, sizeof(timeout));
 	    timeout.tv_sec = 1; // block at maximum one second at a time
-	    int success = select(broadcast_listener + 1, &read_set, NULL, NULL, &timeout);
+	    int success = select(max_socket + 1, &read_set, NULL, NULL, &timeout);
 	    if(success == -1) {
 	    	LOGD("select: %s\n", strerror(errno));
 	    	continue;
@@ -111,57 +359,42 @@ void* broadcast_thread(void* user_data) {
 	    	// timed out
 	    	continue;
 	    }
-
-	    char receive_buffer[128];
-	    struct sockaddr_storage other_address;
-	    socklen_t other_length = sizeof(other_address);
-	    int received_bytes = recvfrom(broadcast_listener, receive_buffer, sizeof(receive_buffer)-1, 0, (struct sockaddr*)&other_address, &other_length);
-
-	    // TEST BROADCASTING WITH socat - udp-datagram:134.130.223.255:44700,broadcast
-	    // or socat - upd6-sendto:[ipv6_address]:port
-	    if(received_bytes == -1) {
-	    	LOGD("recvfrom failed %s\n", strerror(errno));
-	    	continue;
+	    if(netlink_socket != -1 && FD_ISSET(netlink_socket, &read_set)) {
+	    	// a burst of changes is handled with a single enumeration of the interfaces
+	    	drain_netlink_socket();
+	    	refresh_interfaces();
 	    }
-	    if(received_bytes == 0) {
-	    	LOGD("got zero bytes\n");
-	    	continue;
-	    }
-
-	    packet_type* packet = (packet_type*)receive_buffer;
-	    if(received_bytes == sizeof(packet_type) && is_packet_valid(packet)) {
-	    	if(memcmp(packet->sender_id, own_id, 6) == 0) {
-	    		// we do not want to deal with our own messages
-	    		continue;
-	    	}
-
-            // when we reach this point this is a valid message from some other peer
-            // check whether this is a discover request or an available message
-            switch(packet->message_type) {
-            case MESSAGE_TYPE_DISCOVER:
-            	// here should be some peerSeen() function that can also be called by the MESSAGE_TYPE_AVAILABLE case
-            	peer_seen(packet->sender_id, (struct sockaddr*)&other_address);
-            	send_available_packet((struct sockaddr*)&other_address, own_id);
-            	break;
-            case MESSAGE_TYPE_AVAILABLE:
-                // THOUGHTS
-                // the broadcast thread does not need to know about the peers, only the command_thread does
-            	// the broadcast thread just sends the command_thread a message whenever a new peer is discovered
-            	// or seen again. the command thread then handles it all.
-            	peer_seen(packet->sender_id, (struct sockaddr*)&other_address);
-            	break;
-            default:
-            	// this should never happen
-            	break;
-            }
-	    } else {
-	    	// either we did receive a wrong amount of bytes or printPacket failed (success == 0)
-	    	LOGD("received %d bytes: %*.*s\n", received_bytes, 0, received_bytes, receive_buffer);
+	    if(FD_ISSET(broadcast_listener, &read_set)) {
+	    	receive_packets(broadcast_listener);
 	    }
 	}
 
 	//cleanup
+	__atomic_store_n(&own_id_set, 0, __ATOMIC_RELEASE);
 	close(broadcast_listener);
+	broadcast_listener = -1;
+	listener_family = AF_UNSPEC;
+	if(netlink_socket != -1) {
+		close(netlink_socket);
+		netlink_socket = -1;
+	}
+	if(ipv4_socket != -1) {
+		close(ipv4_socket);
+		ipv4_socket = -1;
+	}
+	if(ipv6_socket != -1) {
+		close(ipv6_socket);
+		ipv6_socket = -1;
+	}
+	free(broadcast_addresses);
+	broadcast_addresses = NULL;
+	broadcast_address_count = 0;
+	free(interfaces);
+	interfaces = NULL;
+	interface_count = 0;
+	free(joined_interfaces);
+	joined_interfaces = NULL;
+	joined_interface_count = 0;
 	message_queue_free_queue(message_queue);
 	message_queue = NULL;
 
@@ -169,6 +402,27 @@ void* broadcast_thread(void* user_data) {
 	return NULL;
 }
 
+// sends a discovery packet to the whole group on every interface
+void announce(unsigned char message_type, unsigned char flags) {
+	discovery_packet_type packet;
+	create_discovery_packet(&packet, message_type, flags, own_id);
+	send_ipv6_multicast(&packet);
+	send_ipv4_broadcast(&packet);
+	gettimeofday(&last_announcement, NULL);
+}
+
+// appends a path to a MESSAGE_TYPE_CHANGED packet and increments its path count
+void append_changed_path(unsigned char* packet, int* packet_size, const char* path) {
+	size_t path_length = strlen(path);
+	packet[*packet_size] = (unsigned char)(path_length >> 8);
+	packet[*packet_size + 1] = (unsigned char)path_length;
+	memcpy(packet + *packet_size + 2, path, path_length);
+	*packet_size += 2 + path_length;
+	unsigned int path_count = ((packet[sizeof(packet_type)] << 8) | packet[sizeof(packet_type) + 1]) + 1;
+	packet[sizeof(packet_type)] = (unsigned char)(path_count >> 8);
+	packet[sizeof(packet_type) + 1] = (unsigned char)path_count;
+}
+
 // we cannot use the socketUtil functions for this because in case we get
 // an ipv6 socket we have to join the multicast group as well
 int create_broadcast_listener() {
@@ -201,15 +455,13 @@ int create_broadcast_listener() {
 			LOGD("setsockopt(SO_REUSEADDR) failed: %s\n", strerror(errno));
 			continue;
 		}
-		// try to join the ipv6 multicast group
+		// the multicast group is joined on every interface by refresh_interfaces()
 		if(bind(listener_socket, iterator->ai_addr, iterator->ai_addrlen) == 0) {
-            // join membership
-            struct ipv6_mreq group;
-            group.ipv6mr_interface = 0;
-            inet_pton(AF_INET6, IPV6_MULTICAST_ADDRESS, &group.ipv6mr_multiaddr);
-            if(setsockopt(listener_socket, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &group, sizeof(group)) == -1) {
-            	LOGD("setsockopt %s\n", strerror(errno));
-            }
+			// tells us the interface a packet arrived on, ipv4 packets included
+			if(setsockopt(listener_socket, IPPROTO_IPV6, IPV6_RECVPKTINFO, &(int){ 1 }, sizeof(int)) == -1) {
+				LOGD("setsockopt(IPV6_RECVPKTINFO): %s\n", strerror(errno));
+			}
+			listener_family = AF_INET6;
 			break;
 		}
 		close(listener_socket);
@@ -231,6 +483,10 @@ int create_broadcast_listener() {
 				LOGD("setsockopt(SO_REUSEADDR) failed: %s\n", strerror(errno));
 			}
 			if(bind(listener_socket, iterator->ai_addr, iterator->ai_addrlen) == 0) {
+				if(setsockopt(listener_socket, IPPROTO_IP, IP_PKTINFO, &(int){ 1 }, sizeof(int)) == -1) {
+					LOGD("setsockopt(IP_PKTINFO): %s\n", strerror(errno));
+				}
+				listener_family = AF_INET;
 				break;
 			}
 			close(listener_socket);
@@ -240,6 +496,93 @@ int create_broadcast_listener() {
 	return listener_socket;
 }
 
+// the kernel tells us about new and removed links and addresses, so the interfaces only have to be enumerated then
+int create_netlink_socket() {
+	int netlink = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if(netlink == -1) {
+		LOGD("socket(AF_NETLINK): %s\n", strerror(errno));
+		return -1;
+	}
+	struct sockaddr_nl address;
+	memset(&address, 0, sizeof(address));
+	address.nl_family = AF_NETLINK;
+	address.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if(bind(netlink, (struct sockaddr*)&address, sizeof(address)) == -1) {
+		LOGD("bind(AF_NETLINK): %s\n", strerror(errno));
+		close(netlink);
+		return -1;
+	}
+	return netlink;
+}
+
+// fills in the header and the current state of the local index
+void create_discovery_packet(discovery_packet_type* packet, unsigned char message_type, unsigned char flags, char sender_id[6]) {
+	memset(packet, 0, sizeof(discovery_packet_type));
+	memcpy(packet->header.protocol_id, "P2PFSYNC", 8);
+	packet->header.message_type = message_type;
+	memcpy(packet->header.sender_id, sender_id, 6);
+	packet->state.version = DISCOVERY_STATE_VERSION;
+	packet->state.generation = htobe64(file_index_get_root_hash(packet->state.root_hash));
+	packet->state.flags = flags;
+}
+
+// called by the timer wheel, the broadcast is sent from the broadcast thread
+void discovery_due(void* argument) {
+	broadcast_thread_send_message(message_queue_create_message("discovery_due", NULL, 0));
+}
+
+// the content of the events does not matter, the interfaces are enumerated again anyway
+void drain_netlink_socket() {
+	char buffer[8192];
+	ssize_t received;
+	while((received = recv(netlink_socket, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0 || (received == -1 && errno == ENOBUFS)) {
+		// on ENOBUFS events were dropped, which does not matter either
+	}
+}
+
+// the interface a packet arrived on, for link local senders it is in the scope id as well
+unsigned int get_interface_index(struct msghdr* header) {
+	struct cmsghdr* control;
+	for(control = CMSG_FIRSTHDR(header); control != NULL; control = CMSG_NXTHDR(header, control)) {
+		if(control->cmsg_level == IPPROTO_IPV6 && control->cmsg_type == IPV6_PKTINFO) {
+			struct in6_pktinfo packet_info;
+			memcpy(&packet_info, CMSG_DATA(control), sizeof(packet_info));
+			return packet_info.ipi6_ifindex;
+		}
+		if(control->cmsg_level == IPPROTO_IP && control->cmsg_type == IP_PKTINFO) {
+			struct in_pktinfo packet_info;
+			memcpy(&packet_info, CMSG_DATA(control), sizeof(packet_info));
+			return packet_info.ipi_ifindex;
+		}
+	}
+	struct sockaddr* sender_address = (struct sockaddr*)header->msg_name;
+	if(sender_address->sa_family == AF_INET6) {
+		return ((struct sockaddr_in6*)sender_address)->sin6_scope_id;
+	}
+	return 0;
+}
+
+// looks the interface up in the cache, 0 if the speed is unknown
+int get_link_speed(unsigned int interface_index) {
+	size_t i;
+	for(i = 0; i < interface_count; i++) {
+		if(interfaces[i].index == interface_index) {
+			return interfaces[i].link_speed;
+		}
+	}
+	return 0;
+}
+
+// the startup queries are sent quickly, afterwards the interval grows with the count of peers
+double get_next_discovery_delay() {
+	double random_fraction = rand_r(&random_seed) / ((double)RAND_MAX + 1.0);
+	if(startup_queries_left > 1) {
+		return STARTUP_DELAY_SECONDS * (1.0 + random_fraction);
+	}
+	double interval = DISCOVERY_INTERVAL_SECONDS * broadcast_get_interval_scale(get_peer_count());
+	return interval * (1.0 - DISCOVERY_INTERVAL_JITTER + 2.0 * DISCOVERY_INTERVAL_JITTER * random_fraction);
+}
+
 void get_own_id(char buffer[6]) {
 	struct ifaddrs* interface_list;
 	int success;
@@ -277,14 +620,123 @@ void get_own_id(char buffer[6]) {
 	}
 }
 
-int is_packet_valid(packet_type* packet) {
+void handle_changed_packet(packet_type* packet, int packet_size, struct sockaddr* sender_address) {
+	message_data_paths_changed_type paths_changed_data;
+	memset(&paths_changed_data, 0, sizeof(paths_changed_data));
+	memcpy(paths_changed_data.peer_id, packet->sender_id, 6);
+	memcpy(&paths_changed_data.address, sender_address, sender_address->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+
+	unsigned char* data = (unsigned char*)packet + sizeof(packet_type);
+	int data_size = packet_size - sizeof(packet_type);
+	unsigned int path_count = (data[0] << 8) | data[1];
+	int data_index = 2;
+	size_t paths_index = 0;
+	unsigned int i;
+	for(i = 0; i < path_count; i++) {
+		if(data_index + 2 > data_size) {
+			LOGD("malformed change notification\n");
+			return;
+		}
+		unsigned int path_length = (data[data_index] << 8) | data[data_index + 1];
+		data_index += 2;
+		if(path_length == 0 || data_index + path_length > data_size || paths_index + path_length + 1 > sizeof(paths_changed_data.paths) || data[data_index] != '/' || memchr(data + data_index, 0, path_length) != NULL) {
+			LOGD("malformed change notification\n");
+			return;
+		}
+		memcpy(paths_changed_data.paths + paths_index, data + data_index, path_length);
+		paths_index += path_length + 1; // the buffer is zeroed so the path is terminated already
+		data_index += path_length;
+		paths_changed_data.path_count++;
+	}
+	if(paths_changed_data.path_count == 0) {
+		return;
+	}
+	// only the used part of the paths buffer is copied into the message
+	size_t message_size = offsetof(message_data_paths_changed_type, paths) + paths_index;
+	message_queue_entry_type* message = message_queue_create_message("paths_changed", &paths_changed_data, message_size);
+	command_client_thread_send_message(message);
+}
+
+// checks a single received packet and passes it on depending on its type
+void handle_packet(char* buffer, int size, struct sockaddr_storage* sender_address, unsigned int interface_index) {
+	packet_type* packet = (packet_type*)buffer;
+	if(is_packet_valid(packet, size)) {
+		if(memcmp(packet->sender_id, own_id, 6) == 0) {
+			// we do not want to deal with our own messages
+			return;
+		}
+
+		// when we reach this point this is a valid message from some other peer
+		// check whether this is a discover request or an available message
+		// the index state is only there if the peer is new enough
+		discovery_state_type* state = NULL;
+		if((packet->message_type == MESSAGE_TYPE_DISCOVER || packet->message_type == MESSAGE_TYPE_AVAILABLE) && size > sizeof(packet_type)) {
+			state = &((discovery_packet_type*)packet)->state;
+		}
+		switch(packet->message_type) {
+		case MESSAGE_TYPE_DISCOVER:
+			// known peers have heard our announcements already, only new peers and explicit queries get a reply
+			if(peer_seen(packet->sender_id, (struct sockaddr*)sender_address, interface_index, state) || (state != NULL && state->version >= 2 && size >= sizeof(discovery_packet_type) && (state->flags & DISCOVERY_FLAG_QUERY))) {
+				schedule_reply();
+			}
+			break;
+		case MESSAGE_TYPE_AVAILABLE:
+		    // THOUGHTS
+		    // the broadcast thread does not need to know about the peers, only the command_thread does
+			// the broadcast thread just sends the command_thread a message whenever a new peer is discovered
+			// or seen again. the command thread then handles it all.
+			peer_seen(packet->sender_id, (struct sockaddr*)sender_address, interface_index, state);
+			break;
+		case MESSAGE_TYPE_CHANGED:
+			// a known peer changed some files, the command client should fetch them right away
+			peer_seen(packet->sender_id, (struct sockaddr*)sender_address, interface_index, NULL);
+			handle_changed_packet(packet, size, (struct sockaddr*)sender_address);
+			break;
+		default:
+			// this should never happen
+			break;
+		}
+	} else {
+		// either we did receive a wrong amount of bytes or printPacket failed (success == 0)
+		LOGD("received %d bytes: %*.*s\n", size, 0, size, buffer);
+	}
+}
+
+// the sockets for the announcements are opened once and kept until the thread ends
+void open_sender_sockets() {
+	ipv4_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if(ipv4_socket == -1) {
+		LOGD("socket: %s\n", strerror(errno));
+	} else if(setsockopt(ipv4_socket, SOL_SOCKET, SO_BROADCAST, &(int){ 1 }, sizeof(int)) < 0) {
+		LOGD("setsockopt(SO_BROADCAST): %s\n", strerror(errno));
+	}
+	ipv6_socket = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if(ipv6_socket == -1) {
+		LOGD("socket: %s\n", strerror(errno));
+	}
+}
+
+
+int is_packet_valid(packet_type* packet, int packet_size) {
+	if(packet_size < sizeof(packet_type)) {
+		return 0;
+	}
 	if(memcmp(packet->protocol_id, "P2PFSYNC", 8) != 0) {
 		return 0;
 	}
 	switch((unsigned int)(packet->message_type)) {
 	case MESSAGE_TYPE_DISCOVER:
-		break;
 	case MESSAGE_TYPE_AVAILABLE:
+		// either an old packet without the index state or a complete state of any version, version 1 has no flags
+		if(packet_size != sizeof(packet_type) && (packet_size < sizeof(packet_type) + DISCOVERY_STATE_V1_SIZE || ((discovery_packet_type*)packet)->state.version == 0)) {
+			return 0;
+		}
+		break;
+	case MESSAGE_TYPE_CHANGED:
+		// there has to be at least the path count
+		if(packet_size < sizeof(packet_type) + 2) {
+			return 0;
+		}
 		break;
 	default:
 		return 0;
@@ -293,120 +745,308 @@ int is_packet_valid(packet_type* packet) {
 	return 1;
 }
 
-void peer_seen(char* peer_id, struct sockaddr* peer_ip) {
-	if(!is_peer_in_list(peer_id)) {
+// returns 1 if the peer is new, the peer list is only locked once per packet
+int peer_seen(char* peer_id, struct sockaddr* peer_ip, unsigned int interface_index, discovery_state_type* state) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int is_new = add_ip_to_peer(peer_id, peer_ip, interface_index, get_link_speed(interface_index), now);
+	if(is_new) {
         message_data_peer_seen_type peer_seen_data;
         memset(&peer_seen_data, 0, sizeof(peer_seen_data));
         memcpy(peer_seen_data.peer_id, peer_id, 6);
         gettimeofday(&peer_seen_data.timestamp, NULL);
         memcpy(&peer_seen_data.address, peer_ip, peer_ip->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+        if(state != NULL) {
+        	peer_seen_data.has_state = 1;
+        	peer_seen_data.generation = be64toh(state->generation);
+        	memcpy(peer_seen_data.root_hash, state->root_hash, SHA256_HASH_SIZE);
+        }
         message_queue_entry_type* message = message_queue_create_message("peer_seen", &peer_seen_data, sizeof(peer_seen_data));
         command_client_thread_send_message(message);
+	} else if(state != NULL) {
+		// the scheduler only makes the peer due if its state changed since the last sync, so idle peers cost no connections
+		sync_scheduler_peer_state(peer_id, be64toh(state->generation), state->root_hash);
 	}
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    add_ip_to_peer(peer_id, peer_ip, now);
+	return is_new;
 }
 
-int send_available_packet(struct sockaddr* destination_address, char sender_id[6]) {
-	packet_type packet;
-	memset(&packet, 0, sizeof(packet_type));
-	memcpy(packet.protocol_id, "P2PFSYNC", 8);
-	packet.message_type = MESSAGE_TYPE_AVAILABLE;
-	memcpy(packet.sender_id, sender_id, 6);
-
-	int sender_socket = socket(destination_address->sa_family, SOCK_DGRAM, 0);
-	if(sender_socket == -1) {
-		LOGD("socket: %s\n", strerror(errno));
-		return -1;
+// the kernel knows the speed of most wired links, it is used to prefer addresses on fast links
+int read_link_speed(const char* interface_name) {
+	char path[64 + IF_NAMESIZE];
+	snprintf(path, sizeof(path), "/sys/class/net/%s/speed", interface_name);
+	FILE* speed_file = fopen(path, "r");
+	if(speed_file == NULL) {
+		return 0;
 	}
-    if(destination_address->sa_family == AF_INET6) {
-        ((struct sockaddr_in6*)destination_address)->sin6_port = htons(BROADCAST_LISTENER_PORT);
-    } else if(destination_address->sa_family == AF_INET) {
-        ((struct sockaddr_in*)destination_address)->sin_port = htons(BROADCAST_LISTENER_PORT);
-    }
-
-	socklen_t destinationAddressSize = destination_address->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
-	if(sendto(sender_socket, &packet, sizeof(packet), 0, destination_address, destinationAddressSize) == -1) {
-		LOGD("sendto: %s\n", strerror(errno));
-		return -1;
+	int link_speed = 0;
+	if(fscanf(speed_file, "%d", &link_speed) != 1 || link_speed < 0) {
+		// wireless and virtual links often report -1 or nothing at all
+		link_speed = 0;
 	}
-	//logger("sent an available packet\n");
-	return 0;
+	fclose(speed_file);
+	return link_speed;
 }
 
-// the broadcast has to be sent for every device
-void send_ipv4_broadcast(char sender_id[6]) {
-	int broadcast_socket = socket(AF_INET6, SOCK_DGRAM, 0);
-	if(broadcast_socket == -1) {
-		LOGD("socket %s\n", strerror(errno));
-	}
-
-	if(setsockopt(broadcast_socket, SOL_SOCKET, SO_BROADCAST, &(int){1}, sizeof(int)) < 0) {
-		LOGD("setsockopt: %s\n", strerror(errno));
-	}
+// reads all waiting packets, a burst of discoveries costs one system call per RECEIVE_BATCH_SIZE packets
+void receive_packets(int listener_socket) {
+	static char buffers[RECEIVE_BATCH_SIZE][RECEIVE_BUFFER_SIZE];
+	struct sockaddr_storage addresses[RECEIVE_BATCH_SIZE];
+	struct iovec vectors[RECEIVE_BATCH_SIZE];
+	struct mmsghdr messages[RECEIVE_BATCH_SIZE];
+	union {
+		char buffer[RECEIVE_CONTROL_SIZE];
+		struct cmsghdr alignment;
+	} controls[RECEIVE_BATCH_SIZE];
+	int received_count;
+	do {
+		memset(messages, 0, sizeof(messages));
+		int i;
+		for(i = 0; i < RECEIVE_BATCH_SIZE; i++) {
+			vectors[i].iov_base = buffers[i];
+			vectors[i].iov_len = RECEIVE_BUFFER_SIZE - 1;
+			messages[i].msg_hdr.msg_name = &addresses[i];
+			messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+			messages[i].msg_hdr.msg_iov = &vectors[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+			messages[i].msg_hdr.msg_control = controls[i].buffer;
+			messages[i].msg_hdr.msg_controllen = sizeof(controls[i].buffer);
+		}
+		// TEST BROADCASTING WITH socat - udp-datagram:134.130.223.255:44700,broadcast
+		// or socat - upd6-sendto:[ipv6_address]:port
+		received_count = recvmmsg(listener_socket, messages, RECEIVE_BATCH_SIZE, MSG_DONTWAIT, NULL);
+		if(received_count == -1) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				LOGD("recvmmsg failed %s\n", strerror(errno));
+			}
+			return;
+		}
+		for(i = 0; i < received_count; i++) {
+			if(messages[i].msg_len == 0) {
+				LOGD("got zero bytes\n");
+				continue;
+			}
+			handle_packet(buffers[i], messages[i].msg_len, &addresses[i], get_interface_index(&messages[i].msg_hdr));
+		}
+		// a full batch means there might be more waiting
+	} while(received_count == RECEIVE_BATCH_SIZE && !get_shutdown());
+}
 
+// enumerates the interfaces, caches the ipv4 broadcast addresses and joins the ipv6 group on every multicast link
+void refresh_interfaces() {
 	struct ifaddrs* interface_list;
-	int success;
-	if((success = getifaddrs(&interface_list)) != 0) {
-		LOGD("getifaddrs: %s\n", gai_strerror(success));
-		close(broadcast_socket);
+	if(getifaddrs(&interface_list) != 0) {
+		LOGD("getifaddrs: %s\n", strerror(errno));
 		return;
 	}
-
-	// now we can iterate over the interfaces
+	size_t count = 0;
 	struct ifaddrs* interface;
 	for(interface = interface_list; interface != NULL; interface = interface->ifa_next) {
-		if(interface->ifa_addr == NULL || interface->ifa_addr->sa_family != AF_INET) {
-			// only consider interfaces that have a valid ipv4 address
+		count++;
+	}
+	struct sockaddr_in* addresses = (struct sockaddr_in*)calloc(count > 0 ? count : 1, sizeof(struct sockaddr_in));
+	interface_type* new_interfaces = (interface_type*)calloc(count > 0 ? count : 1, sizeof(interface_type));
+	if(addresses == NULL || new_interfaces == NULL) {
+		LOGD("calloc failed\n");
+		free(addresses);
+		free(new_interfaces);
+		freeifaddrs(interface_list);
+		return;
+	}
+	size_t address_count = 0;
+	size_t new_interface_count = 0;
+	for(interface = interface_list; interface != NULL; interface = interface->ifa_next) {
+		unsigned int interface_index = if_nametoindex(interface->ifa_name);
+		if(interface_index == 0 || !(interface->ifa_flags & IFF_UP)) {
+			continue;
+		}
+		// getifaddrs() returns one entry per address, so an interface shows up several times
+		size_t i;
+		for(i = 0; i < new_interface_count && new_interfaces[i].index != interface_index; i++);
+		if(i == new_interface_count) {
+			new_interfaces[i].index = interface_index;
+			new_interfaces[i].link_speed = read_link_speed(interface->ifa_name);
+			new_interface_count++;
+		}
+		if(interface->ifa_addr == NULL) {
+			continue;
+		}
+		if(interface->ifa_addr->sa_family == AF_INET6 && (interface->ifa_flags & IFF_MULTICAST)) {
+			// the loopback interface has no IFF_MULTICAST by default so it is skipped here
+			new_interfaces[i].multicast = 1;
+		}
+		if(interface->ifa_addr->sa_family != AF_INET || interface->ifa_netmask == NULL) {
+			// only consider interfaces that have a valid ipv4 address for the broadcast
 			continue;
 		}
-
 		// now we have to calculate the broadcast address for the interface
-        struct sockaddr_in ipv4_address;
-        memset(&ipv4_address, 0, sizeof(ipv4_address));
-        ipv4_address.sin_addr.s_addr = ((struct sockaddr_in*)interface->ifa_addr)->sin_addr.s_addr | (~((struct sockaddr_in*)interface->ifa_netmask)->sin_addr.s_addr);
-        ipv4_address.sin_family = AF_INET;
-        ipv4_address.sin_port = htons(BROADCAST_LISTENER_PORT);
-
-        packet_type packet;
-        memcpy(packet.protocol_id, "P2PFSYNC", 8);
-        packet.message_type = MESSAGE_TYPE_DISCOVER;
-        memcpy(packet.sender_id, sender_id, 6);
-        if(sendto(broadcast_socket, &packet, sizeof(packet), 0, (struct sockaddr*)&ipv4_address, sizeof(ipv4_address)) == -1) {
-            LOGD("sendto: %s\n", strerror(errno));
-        }
+		addresses[address_count].sin_family = AF_INET;
+		addresses[address_count].sin_port = htons(BROADCAST_LISTENER_PORT);
+		addresses[address_count].sin_addr.s_addr = ((struct sockaddr_in*)interface->ifa_addr)->sin_addr.s_addr | (~((struct sockaddr_in*)interface->ifa_netmask)->sin_addr.s_addr);
+		address_count++;
 	}
 	freeifaddrs(interface_list);
-	close(broadcast_socket);
-}
-
-// the multicast is sent once to the multicast address
-// I am not sure atm if this needs to be done per interface
-// for ipv4 it is easy as every interface has a different
-// ipv4 broadcast address. The multicast address for ipv6
-// is unique as far as i know
-// there are actually ways to set the interface for sending
-// ipv6 multicasts but it is not trivial. Idk if it is even possible
-// without root priviliges so we will stick with a single multicast here
-void send_ipv6_multicast(char sender_id[6]) {
-	int multicast_socket = socket(AF_INET6, SOCK_DGRAM, 0);
-	if(multicast_socket == -1) {
-		LOGD("socket %s\n", strerror(errno));
-	}
-
-	struct sockaddr_in6 ipv6_address;
-	memset(&ipv6_address, 0, sizeof(ipv6_address));
-	ipv6_address.sin6_family = AF_INET6;
-	ipv6_address.sin6_port = htons(BROADCAST_LISTENER_PORT);
-	inet_pton(AF_INET6, IPV6_MULTICAST_ADDRESS, &ipv6_address.sin6_addr);
-
-	packet_type packet;
-    memcpy(packet.protocol_id, "P2PFSYNC", 8);
-	packet.message_type = MESSAGE_TYPE_DISCOVER;
-	memcpy(packet.sender_id, sender_id, 6);
-	if(sendto(multicast_socket, &packet, sizeof(packet), 0, (struct sockaddr*)&ipv6_address, sizeof(ipv6_address)) == -1) {
-		LOGD("sendto: %s\n", strerror(errno));
-	}
-	close(multicast_socket);
+	update_group_memberships(new_interfaces, new_interface_count);
+	free(broadcast_addresses);
+	broadcast_addresses = addresses;
+	broadcast_address_count = address_count;
+	free(interfaces);
+	interfaces = new_interfaces;
+	interface_count = new_interface_count;
+	LOGD("%zu interfaces, %zu ipv4 broadcast addresses, ipv6 group joined on %zu\n", interface_count, broadcast_address_count, joined_interface_count);
+}
+
+// called by the timer wheel, the reply is sent from the broadcast thread
+void reply_due(void* argument) {
+	broadcast_thread_send_message(message_queue_create_message("reply_due", NULL, 0));
+}
+
+// replies after a random delay, all queries within that time are answered by the same reply
+void schedule_reply() {
+	if(reply_pending || get_passed_time(last_announcement) < REPLY_SUPPRESSION_SECONDS) {
+		return;
+	}
+	reply_pending = 1;
+	timer_wheel_start(REPLY_DELAY_MAX_SECONDS * rand_r(&random_seed) / ((double)RAND_MAX + 1.0), reply_due, NULL, 0);
+}
+
+// sends the messages in as few system calls as possible, a message that fails is skipped
+void send_batch(int socketfd, struct mmsghdr* messages, unsigned int count) {
+	unsigned int sent = 0;
+	while(sent < count) {
+		unsigned int batch_size = count - sent > SEND_BATCH_MAX_SIZE ? SEND_BATCH_MAX_SIZE : count - sent;
+		int success = sendmmsg(socketfd, messages + sent, batch_size, 0);
+		if(success == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			// sendmmsg only fails if the first message fails, the rest is tried again
+			LOGD("sendmmsg: %s\n", strerror(errno));
+			success = 1;
+		}
+		sent += success;
+	}
+}
+
+// the broadcast has to be sent for every device, the cached interfaces are all served by a single system call
+void send_ipv4_broadcast(const discovery_packet_type* packet) {
+	if(netlink_socket == -1) {
+		// without change events we cannot trust the cache
+		refresh_interfaces();
+	}
+	if(ipv4_socket == -1 || broadcast_address_count == 0) {
+		return;
+	}
+	struct mmsghdr* messages = (struct mmsghdr*)calloc(broadcast_address_count, sizeof(struct mmsghdr));
+	if(messages == NULL) {
+		LOGD("calloc failed\n");
+		return;
+	}
+	struct iovec vector;
+	vector.iov_base = (void*)packet;
+	vector.iov_len = sizeof(discovery_packet_type);
+	size_t i;
+	for(i = 0; i < broadcast_address_count; i++) {
+		messages[i].msg_hdr.msg_name = &broadcast_addresses[i];
+		messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		messages[i].msg_hdr.msg_iov = &vector;
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+	send_batch(ipv4_socket, messages, broadcast_address_count);
+	free(messages);
+}
+
+// the multicast is sent on every interface the group was joined on, all of them with a single system call
+// the scope id of a link local multicast address selects the interface just like IPV6_MULTICAST_IF would,
+// but it can be given per message so there is no setsockopt() call for every interface
+void send_ipv6_multicast(const discovery_packet_type* packet) {
+	if(ipv6_socket == -1 || joined_interface_count == 0) {
+		return;
+	}
+	struct sockaddr_in6* ipv6_addresses = (struct sockaddr_in6*)calloc(joined_interface_count, sizeof(struct sockaddr_in6));
+	struct mmsghdr* messages = (struct mmsghdr*)calloc(joined_interface_count, sizeof(struct mmsghdr));
+	if(ipv6_addresses == NULL || messages == NULL) {
+		LOGD("calloc failed\n");
+		free(ipv6_addresses);
+		free(messages);
+		return;
+	}
+	struct iovec vector;
+	vector.iov_base = (void*)packet;
+	vector.iov_len = sizeof(discovery_packet_type);
+	size_t i;
+	for(i = 0; i < joined_interface_count; i++) {
+		ipv6_addresses[i].sin6_family = AF_INET6;
+		ipv6_addresses[i].sin6_port = htons(BROADCAST_LISTENER_PORT);
+		ipv6_addresses[i].sin6_scope_id = joined_interfaces[i]; // 0 leaves the choice to the routing table
+		inet_pton(AF_INET6, IPV6_MULTICAST_ADDRESS, &ipv6_addresses[i].sin6_addr);
+		messages[i].msg_hdr.msg_name = &ipv6_addresses[i];
+		messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+		messages[i].msg_hdr.msg_iov = &vector;
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+	send_batch(ipv6_socket, messages, joined_interface_count);
+	free(messages);
+	free(ipv6_addresses);
+}
+
+// joins or leaves the ipv6 group on a single interface
+void set_group_membership(unsigned int interface_index, int join) {
+	struct ipv6_mreq group;
+	group.ipv6mr_interface = interface_index;
+	inet_pton(AF_INET6, IPV6_MULTICAST_ADDRESS, &group.ipv6mr_multiaddr);
+	if(setsockopt(broadcast_listener, IPPROTO_IPV6, join ? IPV6_ADD_MEMBERSHIP : IPV6_DROP_MEMBERSHIP, &group, sizeof(group)) == -1) {
+		// leaving fails if the interface is gone already, the kernel dropped the membership then anyway
+		LOGD("setsockopt(%s) on interface %u: %s\n", join ? "IPV6_ADD_MEMBERSHIP" : "IPV6_DROP_MEMBERSHIP", interface_index, strerror(errno));
+	}
+}
+
+// writes the header and an empty path list to a MESSAGE_TYPE_CHANGED packet
+void start_changed_packet(unsigned char* packet, int* packet_size) {
+	packet_type* header = (packet_type*)packet;
+	memcpy(header->protocol_id, "P2PFSYNC", 8);
+	header->message_type = MESSAGE_TYPE_CHANGED;
+	memcpy(header->sender_id, own_id, 6);
+	packet[sizeof(packet_type)] = 0;
+	packet[sizeof(packet_type) + 1] = 0;
+	*packet_size = sizeof(packet_type) + 2;
+}
+
+// joins the group on new multicast interfaces and leaves it on the ones that are gone
+// without any multicast interface the group is joined on the default interface like before
+void update_group_memberships(const interface_type* new_interfaces, size_t new_interface_count) {
+	if(broadcast_listener == -1 || listener_family != AF_INET6) {
+		return;
+	}
+	unsigned int* wanted_interfaces = (unsigned int*)calloc(new_interface_count + 1, sizeof(unsigned int));
+	if(wanted_interfaces == NULL) {
+		LOGD("calloc failed\n");
+		return;
+	}
+	size_t wanted_count = 0;
+	size_t i;
+	for(i = 0; i < new_interface_count; i++) {
+		if(new_interfaces[i].multicast) {
+			wanted_interfaces[wanted_count++] = new_interfaces[i].index;
+		}
+	}
+	if(wanted_count == 0) {
+		wanted_interfaces[wanted_count++] = 0;
+	}
+	// leave first, the default interface might be one of the new ones
+	size_t j;
+	for(i = 0; i < joined_interface_count; i++) {
+		for(j = 0; j < wanted_count && wanted_interfaces[j] != joined_interfaces[i]; j++);
+		if(j == wanted_count) {
+			set_group_membership(joined_interfaces[i], 0);
+		}
+	}
+	for(i = 0; i < wanted_count; i++) {
+		for(j = 0; j < joined_interface_count && joined_interfaces[j] != wanted_interfaces[i]; j++);
+		if(j == joined_interface_count) {
+			set_group_membership(wanted_interfaces[i], 1);
+		}
+	}
+	free(joined_interfaces);
+	joined_interfaces = wanted_interfaces;
+	joined_interface_count = wanted_count;
 }
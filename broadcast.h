@@ -5,9 +5,26 @@
  * This module has its own thread and is responsible for managing the peer discovery.
  * The thread periodically sends a broadcast packet to the local network containing the peer id. If a
  * broadcast packet of another peer is received, the broadcast thread does two things. First it sends
- * back a response so the discovering peer knows about this peer as well. Second a "peer seen" message
+ * back a response if the discovering peer might not know about this peer yet. Second a "peer seen" message
  * is generated an send to the command client thread so it can checkout the files that the remote peer
  * has.
+ *
+ * The discovery works like mDNS. Every node announces itself to the whole group once per interval, the interval is
+ * jittered and grows with the count of known peers. Only new peers and peers that just started get a reply, which is
+ * sent to the group after a random delay and skipped if the node announced itself a moment ago anyway.
+ *
+ * Discovery packets carry the change generation and the root hash of the local index. They are handed to the sync
+ * scheduler, which only syncs with a known peer again when they differ from what was last reconciled. Packets of
+ * older peers without this state are still accepted.
+ *
+ * The sockets are opened once when the thread starts. The broadcast addresses of the interfaces are cached and only
+ * enumerated again when the kernel reports a change of the links or addresses over netlink. All broadcasts of an
+ * announcement go out with a single sendmmsg() call and bursts of received packets are read with recvmmsg().
+ * The IPv6 group is joined and announced on every multicast capable interface, so peers on several links are
+ * discovered on all of them. Every address of a peer is recorded with the interface it was learned on.
+ *
+ * Local changes are pushed to all known peers as "changed" packets on the same port. When such a packet is
+ * received a "paths_changed" message is sent to the command client thread.
  */
 
 #ifndef BROADCAST_H
@@ -26,11 +43,38 @@
 void* broadcast_thread(void* user_data);
 
 /**
- * @brief This function could be used to send messages to the broadcast thread.
+ * @brief Gets by how much the discovery interval is stretched in a network with this many peers.
  *
- * This is currently not used.
+ * In large networks the nodes announce themselves less often, so the discovery traffic grows linearly with the count
+ * of nodes. Everything that depends on the discovery interval, like the expiry of peers, has to grow by the same factor.
+ * @param peer_count The count of known peers
+ * @return The factor, at least 1
+ */
+double broadcast_get_interval_scale(size_t peer_count);
+
+/**
+ * @brief Gets the id of this node, it is derived from a mac address when the broadcast thread starts.
+ * @param id Receives the id
+ * @return 1 if the id is known already, 0 if the broadcast thread did not set it yet
+ */
+int broadcast_get_own_id(char id[6]);
+
+/**
+ * @brief This function is used to send messages to the broadcast thread.
+ *
+ * The timer wheel sends a "discovery_due" message whenever the next discovery broadcast is due.
  * @param message The message's parameters
  */
 void broadcast_thread_send_message(message_queue_entry_type* message);
 
+/**
+ * @brief Notifies all known peers that some of our files changed.
+ *
+ * The peers are notified with small udp packets containing the changed paths, so they can fetch the changes
+ * right away instead of waiting until they rediscover us. This can be called from any thread.
+ * @param paths The changed paths relative to BASE_PATH
+ * @param path_count The count of paths
+ */
+void broadcast_changed_paths(char* const* paths, size_t path_count);
+
 #endif
@@ -1,8 +1,11 @@
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#define __USE_XOPEN
-#include <time.h> // __USE_XOPEN is needed otherwise strptime is not defined
+#include <time.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -10,18 +13,101 @@
 
 #include "defines.h"
 #include "file_client.h"
+#include "file_index.h"
+#include "local_file.h"
 #include "logger.h"
+#include "manifest.h"
+#include "peer_list.h"
+#include "reconcile.h"
 #include "shutdown.h"
+#include "sync_scheduler.h"
 #include "util.h"
 
 #include "command_client.h"
 
+#define WORKER_COUNT MAX_CONCURRENT_SYNCS // the scheduler never hands out more peers at a time
+#define SYNC_DEADLINE_SECONDS 30.0 // a sync with a single peer has to be done within this time, so a slow peer cannot block a worker for long
+#define REQUEST_TIMEOUT_SECONDS 2.0 // the maximum time to wait for a single listing
+#define CONNECT_TIMEOUT_SECONDS 5.0
+#define INLINE_BATCH_MAX_COUNT 128 // the maximum count of files fetched with a single request
+#define RECONCILE_GROWTH_FACTOR 8 // if a table cannot be decoded the next one has this many times more cells
+
+/// The state of a single connection to a peer while its files are enumerated
+typedef struct {
+	int socketfd; //!< The connection to the peer's command server
+	struct sockaddr_storage address; //!< The address of the peer
+	char peer_id[6]; //!< The id of the peer
+	unsigned int download_count; //!< How many download jobs were created so far
+	struct timeval deadline; //!< When the sync is given up
+	uint32_t inline_limit; //!< Files up to this size can be fetched over the connection, 0 if the peer does not support it
+	int manifest_supported; //!< 1 if the peer can send its manifest
+	int extents_supported; //!< 1 if the file server of the peer can skip the holes of sparse files
+	int want_manifest; //!< 1 if the manifest should be used instead of requesting every listing
+	manifest_type manifest; //!< The manifest of the peer, it is not mapped if the listings are requested one by one
+} sync_context_type;
+
+/// A single entry of a remote directory listing
+typedef struct {
+	const char* name; //!< The name of the entry, this points into the received listing
+	char type; //!< 'F' for files, 'D' for directories
+	uint64_t size; //!< The size of the file in bytes
+	int64_t mtime_ns; //!< The modification time in nanoseconds since the epoch
+	uint32_t mode; //!< The permission bits
+	unsigned char hash[SHA256_HASH_SIZE]; //!< The content hash, for directories the merkle hash
+	unsigned char synced_hash[SHA256_HASH_SIZE]; //!< The content hash of the last version the peer synced, see file_index_entry_type
+	int has_metadata; //!< 0 if the peer did not send size and modification time
+	int has_hash; //!< 0 if the peer did not send mode and hashes
+} remote_entry_type;
+
+/// What has to be done with an entry after comparing the remote with the local directory
+typedef enum {
+	SYNC_DECISION_NONE = 0, //!< Both sides are equal or the local version wins
+	SYNC_DECISION_ADD = 1, //!< The entry only exists remotely
+	SYNC_DECISION_MODIFY = 2, //!< Only the remote file changed or it is newer
+	SYNC_DECISION_CONFLICT = 3, //!< The types differ or the versions cannot be ordered, the local version is kept
+	SYNC_DECISION_KEEP_BOTH = 4 //!< Both files changed and the remote one is newer, the local one is kept as a conflict copy
+} sync_decision_type;
+
+/// A file that is fetched over the command connection instead of being downloaded by the file client
+typedef struct {
+	const remote_entry_type* remote_entry; //!< The listing entry of the file
+	int keep_local_copy; //!< 1 if the local version has to be kept as a conflict copy
+} inline_file_type;
+
+/// A job for the workers to reconcile with a single peer
+typedef struct {
+	char peer_id[6]; //!< The id of the peer
+	struct sockaddr_storage address; //!< The last known address of the peer
+} sync_job_type;
+
 // helper functions for this module
-static void download_remote_directory(const int socketfd, const struct sockaddr* remote_address, const char* path);
+static sync_decision_type compare_entries(const remote_entry_type* remote_entry, const file_index_entry_type* local_entry);
+static int compare_remote_entries_by_name(const void* a, const void* b);
+static void create_local_directory(const char* path, const remote_entry_type* remote_entry);
+static int download_remote_directory(sync_context_type* context, const char* path, const char* only_name);
+static int download_remote_entries(sync_context_type* context, const uint64_t* ids, size_t id_count);
+static int download_remote_path(sync_context_type* context, const char* path);
+static int fetch_inline_files(sync_context_type* context, const char* path, const inline_file_type* files, size_t count);
+static int fetch_manifest(sync_context_type* context);
+static double get_remaining_time(const sync_context_type* context);
+static int is_valid_remote_path(const char* path);
+static size_t list_manifest_directory(const manifest_type* manifest, const char* path, remote_entry_type** entries);
+static int open_sync_context(sync_context_type* context, char peer_id[6], const struct sockaddr_storage* address);
+static size_t parse_remote_listing(char* listing, remote_entry_type** entries, sync_context_type* context, int full_paths);
 static void print_peer_seen_data(message_data_peer_seen_type* message_data);
+static void queue_download(sync_context_type* context, const char* path, const remote_entry_type* remote_entry, int keep_local_copy);
+static int reconcile_with_peer(sync_context_type* context);
+static long request_remote_listing(sync_context_type* context, const char* path, char** listing, remote_entry_type** entries);
+static int request_remote_table(sync_context_type* context, uint32_t cell_count, reconcile_table_type* table);
+static void reroute_downloads();
+static void sync_changed_paths(message_data_paths_changed_type* paths_changed_data);
+static void sync_with_peer(char peer_id[6], const struct sockaddr_storage* address);
+static void* worker_thread(void* user_data);
 
 // static variables for this module
 static message_queue_type* message_queue = NULL;
+static message_queue_type* job_queue = NULL; // jobs for the workers, peers to sync and changed paths to check
+static pthread_t worker_thread_ids[WORKER_COUNT];
 
 void command_client_thread_send_message(message_queue_entry_type* message) {
 	message_queue_push(message_queue, message);
@@ -31,6 +117,14 @@ void* command_client_thread(void* user_data) {
 	LOGD("started\n");
 	// this has to be called otherwise this thread will not be able to receive any messages
 	message_queue = message_queue_create_queue();
+	job_queue = message_queue_create_queue();
+	int i;
+	for(i = 0; i < WORKER_COUNT; i++) {
+		int success = pthread_create(&worker_thread_ids[i], NULL, worker_thread, (void*)0);
+		if(success != 0) {
+			LOGE("pthread_create failed with return code %d\n", success);
+		}
+	}
 	while(!get_shutdown()) {
 		// handle messages sent by other threads
 		message_queue_entry_type* message;
@@ -40,14 +134,30 @@ void* command_client_thread(void* user_data) {
 				// extract the peer_seen data from the message
 				message_data_peer_seen_type* peer_seen_data = (message_data_peer_seen_type*)message->arguments;
 				print_peer_seen_data(peer_seen_data);
-				int commandfd = connect_with_timeout((struct sockaddr*)&peer_seen_data->address, COMMAND_LISTENER_PORT, 5);
-				if(commandfd == -1) {
-					// the connection failed
-					// continue with the next message
-					continue;
+				// the scheduler takes care of the initial sync and of all periodic reconciliations
+				sync_scheduler_peer_seen(peer_seen_data->peer_id, (struct sockaddr*)&peer_seen_data->address);
+				if(peer_seen_data->has_state) {
+					sync_scheduler_peer_state(peer_seen_data->peer_id, peer_seen_data->generation, peer_seen_data->root_hash);
+				}
+			}
+			else if(strcmp(message->message_id, "paths_changed") == 0) {
+				// the message is handed over to the workers as it is, so it must not be freed here
+				message_queue_push(job_queue, message);
+				continue;
+			}
+			else if(strcmp(message->message_id, "sync_due") == 0) {
+				// hand all peers that are due to the workers
+				sync_job_type job;
+				while(sync_scheduler_next_due(job.peer_id, &job.address)) {
+					message_queue_push(job_queue, message_queue_create_message("sync_peer", &job, sizeof(job)));
+				}
+			}
+			else if(strcmp(message->message_id, "peer_lost") == 0) {
+				message_data_peer_lost_type* peer_lost_data = (message_data_peer_lost_type*)message->arguments;
+				// the files that were queued for the lost peer are fetched from the others instead
+				if(sync_scheduler_peer_lost(peer_lost_data->peer_id) > 0) {
+					reroute_downloads();
 				}
-				download_remote_directory(commandfd, (const struct sockaddr*)&peer_seen_data->address, "/");
-            	close(commandfd);
 			}
 			else {
 				LOGD("\tunkown message id :(\n");
@@ -55,95 +165,726 @@ void* command_client_thread(void* user_data) {
 			// free the message
 			message_queue_free_message(message);
 		}
-		sleep(1);
+		message_queue_wait(message_queue, 1.0); // wake up at least once a second to check for the shutdown
 	}
 	// cleanup
+	for(i = 0; i < WORKER_COUNT; i++) {
+		pthread_join(worker_thread_ids[i], NULL);
+	}
+	message_queue_free_queue(job_queue);
+	job_queue = NULL;
 	message_queue_free_queue(message_queue);
 	message_queue = NULL;
 	LOGD("ended\n");
 	return NULL;
 }
 
-void download_remote_directory(const int socketfd, const struct sockaddr* remote_address, const char* path) {
-	char request_buffer[PATH_MAX];
-	memset(request_buffer, 0, sizeof(request_buffer));
+// compares a remote entry with the local entry of the same name, local_entry is NULL if there is none
+sync_decision_type compare_entries(const remote_entry_type* remote_entry, const file_index_entry_type* local_entry) {
+	if(local_entry == NULL) {
+		return SYNC_DECISION_ADD;
+	}
+	if(remote_entry->type != local_entry->type) {
+		return SYNC_DECISION_CONFLICT;
+	}
+	if(remote_entry->type == 'D' || !remote_entry->has_metadata) {
+		// directories are compared by their contents, older peers only tell us that the file exists
+		return SYNC_DECISION_NONE;
+	}
+	if(!remote_entry->has_hash) {
+		// older peers do not send hashes, so all we can do is to trust the modification times
+		if(remote_entry->mtime_ns > local_entry->mtime_ns) {
+			return SYNC_DECISION_MODIFY;
+		}
+		if(remote_entry->mtime_ns == local_entry->mtime_ns && remote_entry->size != local_entry->size) {
+			// we cannot tell which one is the newer version
+			return SYNC_DECISION_CONFLICT;
+		}
+		return SYNC_DECISION_NONE;
+	}
+	if(memcmp(remote_entry->hash, local_entry->hash, SHA256_HASH_SIZE) == 0) {
+		// the contents are equal, different modification times do not matter
+		return SYNC_DECISION_NONE;
+	}
+	if(memcmp(remote_entry->synced_hash, local_entry->synced_hash, SHA256_HASH_SIZE) == 0) {
+		// both sides remember the same synced version, so we know which side changed since then
+		if(memcmp(local_entry->hash, local_entry->synced_hash, SHA256_HASH_SIZE) == 0) {
+			return SYNC_DECISION_MODIFY;
+		}
+		if(memcmp(remote_entry->hash, local_entry->synced_hash, SHA256_HASH_SIZE) == 0) {
+			// the remote peer picks up our version
+			return SYNC_DECISION_NONE;
+		}
+	}
+	// both sides changed, the last writer wins and the other version is kept as a conflict copy
+	// equal modification times are decided by the hashes, so both peers come to the same result
+	int order = remote_entry->mtime_ns != local_entry->mtime_ns ? (remote_entry->mtime_ns > local_entry->mtime_ns ? 1 : -1) : memcmp(remote_entry->hash, local_entry->hash, SHA256_HASH_SIZE);
+	return order > 0 ? SYNC_DECISION_KEEP_BOTH : SYNC_DECISION_NONE;
+}
+
+int compare_remote_entries_by_name(const void* a, const void* b) {
+	return strcmp(((const remote_entry_type*)a)->name, ((const remote_entry_type*)b)->name);
+}
 
-	// request the directory
-	strcpy(request_buffer, "GET ");
-	strcat(request_buffer, path);
+// creates a directory that only exists remotely, so empty directories are synced as well
+void create_local_directory(const char* path, const remote_entry_type* remote_entry) {
+	char local_path[PATH_MAX];
+	if(snprintf(local_path, sizeof(local_path), "%s%s", BASE_PATH, path) >= sizeof(local_path)) {
+		return;
+	}
+	mkdirp(local_path);
+	if(remote_entry->has_hash && chmod(local_path, remote_entry->mode & 07777) != 0) {
+		LOGD("chmod %s\n", strerror(errno));
+	}
+	file_index_update_path(path);
+}
 
-	int sent_bytes = tcp_message_send(socketfd, request_buffer, strlen(request_buffer), 0);
-    if(sent_bytes < 0) {
-        LOGE("send %s\n", strerror(errno));
-        return;
+// if only_name is not NULL only the entry with this name is considered
+// returns 1 if the directory (and all directories below it) could be listed, 0 otherwise
+int download_remote_directory(sync_context_type* context, const char* path, const char* only_name) {
+    remote_entry_type* remote_entries;
+    char* listing = NULL;
+    long remote_count;
+    if(context->manifest.data != NULL) {
+        // the manifest describes the whole tree of the peer, so nothing has to be requested
+        remote_count = list_manifest_directory(&context->manifest, path, &remote_entries);
+    } else {
+        remote_count = request_remote_listing(context, path, &listing, &remote_entries);
+        if(remote_count == -1) {
+            return 0;
+        }
+        if(context->want_manifest && context->manifest_supported && strcmp(path, "/") == 0 && !fetch_manifest(context)) {
+            free(remote_entries);
+            free(listing);
+            return 0;
+        }
     }
-    // this buffer size should be big enough to hold all files in a directory, this should probably be dynamic
-    char receive_buffer[8096 * 8];
-    int received_bytes = tcp_message_receive(socketfd, receive_buffer, sizeof(receive_buffer), 2.0);
-    const char* delim = "<";
-    receive_buffer[received_bytes] = 0;
+    // small files are collected and fetched over this connection when the whole directory is compared
+    uint32_t inline_limit = context->inline_limit;
+    inline_file_type* inline_files = (inline_file_type*)malloc(remote_count * sizeof(inline_file_type) + 1);
+    size_t inline_count = 0;
+    // both sides are sorted by name so they can be compared in a single pass
+    qsort(remote_entries, remote_count, sizeof(remote_entry_type), compare_remote_entries_by_name);
+    file_index_entry_type* local_entries;
+    size_t local_count;
+    if(!file_index_list_directory(path, &local_entries, &local_count)) {
+        // the directory does not exist locally yet
+        local_entries = NULL;
+        local_count = 0;
+    }
+
+    int success = 1;
+    char entry_path[PATH_MAX];
+    size_t remote_index = 0;
+    size_t local_index = 0;
+    while(remote_index < remote_count || local_index < local_count) {
+        const remote_entry_type* remote_entry = remote_index < remote_count ? &remote_entries[remote_index] : NULL;
+        const file_index_entry_type* local_entry = local_index < local_count ? &local_entries[local_index] : NULL;
+        int order = remote_entry == NULL ? 1 : local_entry == NULL ? -1 : strcmp(remote_entry->name, local_entry->name);
+        if(order < 0) {
+            local_entry = NULL;
+            remote_index++;
+        } else if(order > 0) {
+            remote_entry = NULL;
+            local_index++;
+        } else {
+            remote_index++;
+            local_index++;
+        }
+        const char* name = remote_entry != NULL ? remote_entry->name : local_entry->name;
+        if(only_name != NULL && strcmp(name, only_name) != 0) {
+            // we are not interested in this entry
+            continue;
+        }
+        if(snprintf(entry_path, sizeof(entry_path), "%s%s", path, name) >= sizeof(entry_path)) {
+            LOGD("path too long %s%s\n", path, name);
+            continue;
+        }
+        if(remote_entry == NULL) {
+            // deletions are not propagated: without tombstones a file deleted remotely looks exactly like a file added locally
+            LOGD("only present locally: %s\n", entry_path);
+            continue;
+        }
+        sync_decision_type decision = compare_entries(remote_entry, local_entry);
+        if(decision == SYNC_DECISION_CONFLICT) {
+            LOGI("conflict, keeping the local version: %s\n", entry_path);
+            continue;
+        }
+        if(remote_entry->type == 'D') {
+            if(decision == SYNC_DECISION_ADD) {
+                create_local_directory(entry_path, remote_entry);
+            } else if(remote_entry->has_hash && memcmp(remote_entry->hash, local_entry->hash, SHA256_HASH_SIZE) == 0) {
+                // equal merkle hashes mean that everything below this directory is equal as well
+                continue;
+            }
+            // the contents of a directory have to be compared as well
+            // for directories we need to append a /
+            strncat(entry_path, "/", sizeof(entry_path) - strlen(entry_path) - 1);
+            success &= download_remote_directory(context, entry_path, NULL);
+            continue;
+        }
+        if(decision == SYNC_DECISION_NONE) {
+            if(remote_entry->has_hash && memcmp(remote_entry->hash, local_entry->hash, SHA256_HASH_SIZE) == 0 && memcmp(local_entry->synced_hash, local_entry->hash, SHA256_HASH_SIZE) != 0) {
+                // both sides have the same version, so it is the common ancestor from now on
+                file_index_mark_synced(entry_path, local_entry->hash);
+            }
+            continue;
+        }
+        LOGI("%s: %s\n", decision == SYNC_DECISION_ADD ? "file not present" : decision == SYNC_DECISION_MODIFY ? "remote file changed" : "both files changed, keeping a conflict copy", entry_path);
+        if(remote_entry->has_hash && local_file_store_local_copy(entry_path, remote_entry->hash, remote_entry->size, remote_entry->mode, remote_entry->mtime_ns, decision == SYNC_DECISION_KEEP_BOTH) == 0) {
+            // the contents are here already, e.g. because the file was moved on the peer
+            continue;
+        }
+        if(remote_entry->has_metadata && remote_entry->size <= inline_limit) {
+            inline_files[inline_count].remote_entry = remote_entry;
+            inline_files[inline_count].keep_local_copy = decision == SYNC_DECISION_KEEP_BOTH;
+            inline_count++;
+            continue;
+        }
+        queue_download(context, entry_path, remote_entry, decision == SYNC_DECISION_KEEP_BOTH);
+    }
+    if(inline_count > 0) {
+        success &= fetch_inline_files(context, path, inline_files, inline_count);
+    }
+    free(inline_files);
+    free(remote_entries);
+    free(local_entries);
+    free(listing);
+    return success;
+}
+
+// requests the listing entries of ids only the peer has and handles them like the entries of a directory listing
+// directories are only created, the entries below them have their own ids
+// returns 1 if all entries were handled, 0 if the connection failed
+int download_remote_entries(sync_context_type* context, const uint64_t* ids, size_t id_count) {
+	size_t batch_max_count = (REQUEST_MAX_SIZE - 8) / sizeof(uint64_t);
+	char* request_buffer = (char*)malloc(REQUEST_MAX_SIZE);
+	char* listing = (char*)malloc(LISTING_MAX_SIZE + 1);
+	int success = 1;
+	size_t batch_start;
+	for(batch_start = 0; success && batch_start < id_count; batch_start += batch_max_count) {
+		size_t batch_count = id_count - batch_start < batch_max_count ? id_count - batch_start : batch_max_count;
+		memcpy(request_buffer, "ENTRIES ", 8);
+		size_t i;
+		for(i = 0; i < batch_count; i++) {
+			uint64_t id = htole64(ids[batch_start + i]);
+			memcpy(request_buffer + 8 + i * sizeof(uint64_t), &id, sizeof(uint64_t));
+		}
+		double remaining_time = get_remaining_time(context);
+		if(remaining_time <= 0 || tcp_message_send(context->socketfd, request_buffer, 8 + batch_count * sizeof(uint64_t), 0) <= 0) {
+			LOGE("requesting entries failed\n");
+			success = 0;
+			break;
+		}
+		int received_bytes = tcp_message_receive(context->socketfd, listing, LISTING_MAX_SIZE, remaining_time < REQUEST_TIMEOUT_SECONDS ? remaining_time : REQUEST_TIMEOUT_SECONDS);
+		if(received_bytes < 0) {
+			LOGE("receive failed for entries\n");
+			success = 0;
+			break;
+		}
+		listing[received_bytes] = 0;
+		remote_entry_type* remote_entries;
+		size_t remote_count = parse_remote_listing(listing, &remote_entries, context, 1);
+		// parents sort before their children, so directories are created before anything is stored in them
+		qsort(remote_entries, remote_count, sizeof(remote_entry_type), compare_remote_entries_by_name);
+		inline_file_type* inline_files = (inline_file_type*)malloc(remote_count * sizeof(inline_file_type) + 1);
+		size_t inline_count = 0;
+		char inline_path[PATH_MAX] = "";
+		char entry_path[PATH_MAX];
+		for(i = 0; i < remote_count && success; i++) {
+			remote_entry_type* remote_entry = &remote_entries[i];
+			strncpy(entry_path, remote_entry->name, sizeof(entry_path) - 1);
+			entry_path[sizeof(entry_path) - 1] = 0;
+			file_index_entry_type local_entry;
+			int has_local_entry = file_index_lookup(entry_path, &local_entry);
+			sync_decision_type decision = compare_entries(remote_entry, has_local_entry ? &local_entry : NULL);
+			if(decision == SYNC_DECISION_CONFLICT) {
+				LOGI("conflict, keeping the local version: %s\n", entry_path);
+				continue;
+			}
+			if(remote_entry->type == 'D') {
+				if(decision == SYNC_DECISION_ADD) {
+					create_local_directory(entry_path, remote_entry);
+				}
+				continue;
+			}
+			if(decision == SYNC_DECISION_NONE) {
+				continue;
+			}
+			LOGI("%s: %s\n", decision == SYNC_DECISION_ADD ? "file not present" : decision == SYNC_DECISION_MODIFY ? "remote file changed" : "both files changed, keeping a conflict copy", entry_path);
+			if(remote_entry->has_hash && local_file_store_local_copy(entry_path, remote_entry->hash, remote_entry->size, remote_entry->mode, remote_entry->mtime_ns, decision == SYNC_DECISION_KEEP_BOTH) == 0) {
+				continue;
+			}
+			if(!remote_entry->has_metadata || remote_entry->size > context->inline_limit) {
+				queue_download(context, entry_path, remote_entry, decision == SYNC_DECISION_KEEP_BOTH);
+				continue;
+			}
+			// small files are fetched together with the other files of the same directory
+			const char* name = strrchr(remote_entry->name, '/') + 1;
+			size_t parent_length = name - remote_entry->name;
+			if(inline_count > 0 && (strlen(inline_path) != parent_length || strncmp(inline_path, remote_entry->name, parent_length) != 0)) {
+				success &= fetch_inline_files(context, inline_path, inline_files, inline_count);
+				inline_count = 0;
+			}
+			memcpy(inline_path, remote_entry->name, parent_length);
+			inline_path[parent_length] = 0;
+			remote_entry->name = name;
+			inline_files[inline_count].remote_entry = remote_entry;
+			inline_files[inline_count].keep_local_copy = decision == SYNC_DECISION_KEEP_BOTH;
+			inline_count++;
+		}
+		if(success && inline_count > 0) {
+			success &= fetch_inline_files(context, inline_path, inline_files, inline_count);
+		}
+		free(inline_files);
+		free(remote_entries);
+	}
+	free(request_buffer);
+	free(listing);
+	return success;
+}
+
+// checks a single remote path, which can be a file or a directory
+// returns 1 if the path could be checked, 0 otherwise
+int download_remote_path(sync_context_type* context, const char* path) {
+	if(strcmp(path, "/") == 0) {
+		return download_remote_directory(context, "/", NULL);
+	}
+	// we list the parent directory and only look at the entry we are interested in
+	char parent_path[PATH_MAX];
+	strncpy(parent_path, path, sizeof(parent_path) - 1);
+	parent_path[sizeof(parent_path) - 1] = 0;
+	char* last_slash = strrchr(parent_path, '/');
+	if(last_slash == NULL || last_slash[1] == 0) {
+		LOGD("invalid path %s\n", path);
+		return 1;
+	}
+	char name[NAME_MAX + 1];
+	strncpy(name, last_slash + 1, NAME_MAX);
+	name[NAME_MAX] = 0;
+	last_slash[1] = 0;
+	return download_remote_directory(context, parent_path, name);
+}
+
+// fetches small files over the command connection, the peer sends them right away so no download jobs are needed
+// files the peer could not send are handed to the file client instead
+// returns 1 if all files were fetched or queued, 0 if the connection failed
+int fetch_inline_files(sync_context_type* context, const char* path, const inline_file_type* files, size_t count) {
+	char* request_buffer = (char*)malloc(REQUEST_MAX_SIZE);
+	char* reply_buffer = (char*)malloc(INLINE_FILE_MAX_SIZE + 2);
+	char entry_path[PATH_MAX];
+	int success = 1;
+	size_t batch_start = 0;
+	while(success && batch_start < count) {
+		// as many names as fit into a single request
+		size_t request_size = snprintf(request_buffer, REQUEST_MAX_SIZE, "FETCH %s", path) + 1;
+		size_t batch_end = batch_start;
+		while(batch_end < count && batch_end - batch_start < INLINE_BATCH_MAX_COUNT) {
+			size_t name_size = strlen(files[batch_end].remote_entry->name) + 1;
+			if(request_size + name_size > REQUEST_MAX_SIZE) {
+				break;
+			}
+			memcpy(request_buffer + request_size, files[batch_end].remote_entry->name, name_size);
+			request_size += name_size;
+			batch_end++;
+		}
+		if(batch_end == batch_start || tcp_message_send(context->socketfd, request_buffer, request_size, 0) <= 0) {
+			LOGE("fetching files of %s failed\n", path);
+			success = 0;
+			break;
+		}
+		size_t i;
+		for(i = batch_start; i < batch_end; i++) {
+			const remote_entry_type* remote_entry = files[i].remote_entry;
+			snprintf(entry_path, sizeof(entry_path), "%s%s", path, remote_entry->name);
+			double remaining_time = get_remaining_time(context);
+			int received_bytes = remaining_time <= 0 ? -1 : tcp_message_receive(context->socketfd, reply_buffer, INLINE_FILE_MAX_SIZE + 1, remaining_time < REQUEST_TIMEOUT_SECONDS ? remaining_time : REQUEST_TIMEOUT_SECONDS);
+			if(received_bytes <= 0) {
+				// the replies are out of sync now, so the connection is useless
+				LOGE("receive failed for %s\n", entry_path);
+				success = 0;
+				break;
+			}
+			if(reply_buffer[0] != 'F' || local_file_store_remote(entry_path, reply_buffer + 1, received_bytes - 1, remote_entry->has_hash ? remote_entry->mode : 0, remote_entry->mtime_ns, files[i].keep_local_copy) == -1) {
+				LOGD("could not fetch %s, downloading it instead\n", entry_path);
+				queue_download(context, entry_path, remote_entry, files[i].keep_local_copy);
+			}
+		}
+		batch_start = batch_end;
+	}
+	free(request_buffer);
+	free(reply_buffer);
+	return success;
+}
+
+// downloads the manifest of the peer and maps it, afterwards all listings are taken from the manifest
+// returns 1 if the connection is still usable, 0 otherwise
+int fetch_manifest(sync_context_type* context) {
+	char id_buffer[13];
+	get_hex_string((unsigned char*)context->peer_id, 6, id_buffer, sizeof(id_buffer));
+	char file_path[PATH_MAX];
+	snprintf(file_path, sizeof(file_path), "%s/manifest_%s", STATE_PATH, id_buffer);
+	int fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(fd == -1) {
+		LOGE("open %s %s\n", file_path, strerror(errno));
+		return 1;
+	}
+	char request_buffer[] = "MANIFEST";
+	int64_t size = -1;
+	double remaining_time = get_remaining_time(context);
+	if(remaining_time > 0 && tcp_message_send(context->socketfd, request_buffer, strlen(request_buffer), 0) > 0) {
+		size = tcp_message_receive_file(context->socketfd, fd, UINT32_MAX, remaining_time);
+	}
+	close(fd);
+	// the mapping stays valid after the file is removed
+	if(size > 0 && manifest_map(file_path, &context->manifest) == 0) {
+		LOGD("[%s] received a manifest with %llu entries\n", id_buffer, (unsigned long long)context->manifest.entry_count);
+	}
+	unlink(file_path);
+	// an empty manifest means that the peer could not write it, we just request the listings instead
+	return size >= 0;
+}
+
+// returns how many seconds are left until the deadline of the sync, this can be negative
+double get_remaining_time(const sync_context_type* context) {
+	return -get_passed_time(context->deadline);
+}
+
+// checks that a path received from a peer starts with a slash and stays inside of BASE_PATH
+int is_valid_remote_path(const char* path) {
+	if(*path != '/') {
+		return 0;
+	}
+	while(*path == '/') {
+		const char* component = path + 1;
+		path = strchr(component, '/');
+		if(path == NULL) {
+			path = component + strlen(component);
+		}
+		size_t length = path - component;
+		if(length == 0 || length > NAME_MAX || (length == 1 && component[0] == '.') || (length == 2 && component[0] == '.' && component[1] == '.')) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// gets the entries of a directory from the manifest, the names point into the mapping
+// the returned array has to be freed by the caller
+size_t list_manifest_directory(const manifest_type* manifest, const char* path, remote_entry_type** entries) {
+	*entries = NULL;
+	int64_t directory = manifest_find(manifest, path);
+	if(directory == -1) {
+		return 0;
+	}
+	manifest_entry_info_type directory_info;
+	manifest_get_entry(manifest, directory, &directory_info);
+	if(directory_info.type != 'D') {
+		return 0;
+	}
+	*entries = (remote_entry_type*)malloc((directory_info.subtree_end - directory - 1) * sizeof(remote_entry_type) + 1);
+	size_t count = 0;
+	uint64_t child;
+	for(child = directory + 1; child < directory_info.subtree_end; child = manifest_next_child(manifest, child)) {
+		manifest_entry_info_type info;
+		manifest_get_entry(manifest, child, &info);
+		if(info.type != 'D' && info.type != 'F') {
+			continue;
+		}
+		// the names come from the peer, so just like the listings they must not lead out of the directory
+		if(*info.name == 0 || strchr(info.name, '/') != NULL || strcmp(info.name, ".") == 0 || strcmp(info.name, "..") == 0 || strlen(info.name) > NAME_MAX) {
+			LOGW("ignoring the invalid name %s in the manifest of %s\n", info.name, path);
+			continue;
+		}
+		remote_entry_type* remote_entry = &(*entries)[count++];
+		memset(remote_entry, 0, sizeof(remote_entry_type));
+		remote_entry->name = info.name;
+		remote_entry->type = info.type;
+		remote_entry->size = info.size;
+		remote_entry->mtime_ns = info.mtime_ns;
+		remote_entry->mode = info.mode;
+		memcpy(remote_entry->hash, info.hash, SHA256_HASH_SIZE);
+		memcpy(remote_entry->synced_hash, info.synced_hash, SHA256_HASH_SIZE);
+		remote_entry->has_metadata = 1;
+		remote_entry->has_hash = 1;
+	}
+	return count;
+}
+
+// connects to the command server of a peer, returns 1 on success
+int open_sync_context(sync_context_type* context, char peer_id[6], const struct sockaddr_storage* address) {
+	memset(context, 0, sizeof(sync_context_type));
+	memcpy(context->peer_id, peer_id, 6);
+	gettimeofday(&context->deadline, NULL);
+	context->deadline.tv_sec += (time_t)SYNC_DEADLINE_SECONDS;
+	// the peer list knows the best address of the peer, the given one is only a fallback
+	context->socketfd = connect_to_peer(peer_id, address, COMMAND_LISTENER_PORT, CONNECT_TIMEOUT_SECONDS, &context->address);
+	return context->socketfd != -1;
+}
+
+// enumerates all files of a peer and reports the outcome to the sync scheduler
+void sync_with_peer(char peer_id[6], const struct sockaddr_storage* address) {
+	char id_buffer[13];
+	get_hex_string((unsigned char*)peer_id, 6, id_buffer, sizeof(id_buffer));
+	sync_context_type context;
+	if(!open_sync_context(&context, peer_id, address)) {
+		LOGD("[%s] sync failed, could not connect\n", id_buffer);
+		sync_scheduler_listing_finished(peer_id, 0, 0);
+		return;
+	}
+	// the first sync compares everything, so we get the whole tree at once instead of a listing per directory
+	// later syncs only exchange the entries that differ, if that is not possible the directories whose merkle hashes differ are listed
+	sync_peer_status_type status;
+	context.want_manifest = sync_scheduler_get_status(peer_id, &status) && status.last_success.tv_sec == 0;
+	int success = context.want_manifest ? -1 : reconcile_with_peer(&context);
+	if(success == -1) {
+		success = download_remote_directory(&context, "/", NULL);
+	}
+	close(context.socketfd);
+	manifest_unmap(&context.manifest);
+	sync_scheduler_listing_finished(peer_id, success, context.download_count);
+	if(!sync_scheduler_get_status(peer_id, &status)) {
+		return;
+	}
+	if(status.state == SYNC_STATE_DOWNLOADING) {
+		// the next sync is scheduled when all downloads are done
+		LOGD("[%s] listing done after %.3fs, %u downloads queued\n", id_buffer, status.last_listing_seconds, context.download_count);
+	} else {
+		LOGD("[%s] sync %s after %.3fs, next sync in %.1fs\n", id_buffer, success ? "done" : "failed", status.last_listing_seconds, -get_passed_time(status.next_sync));
+	}
+}
+
+// splits a listing into its entries, the entries point into listing which is modified
+// the returned array has to be freed by the caller
+// the last entries tell what the peer supports, this is stored in the context
+// full_paths is 1 if the names are full paths as in the reply to ENTRIES
+size_t parse_remote_listing(char* listing, remote_entry_type** entries, sync_context_type* context, int full_paths) {
+    context->inline_limit = 0;
+    context->manifest_supported = 0;
+    context->extents_supported = 0;
+    size_t count = 0;
+    size_t capacity = 64;
+    *entries = (remote_entry_type*)malloc(capacity * sizeof(remote_entry_type));
     char* entry_token = NULL;
-    char* entry = strtok_r(receive_buffer, delim, &entry_token);
+    char* entry = strtok_r(listing, "<", &entry_token);
     while(entry != NULL) {
-        // here are all entries
-        // we should act upon them
-        // directories should not be considered for now, only files
         // the format is
-        // F/D>name>lastchangedtime the delimiter is >
+        // F/D>name>lastchangedtime>size>mtime_ns>mode>hash>synced_hash the delimiter is >
+        // older peers do not send the fields after lastchangedtime or after mtime_ns
         // so we strtok again
         char* element_token = NULL;
         const char* type = strtok_r(entry, ">", &element_token);
         const char* name = strtok_r(NULL, ">", &element_token);
         const char* last_changed = strtok_r(NULL, ">", &element_token);
+        const char* size = strtok_r(NULL, ">", &element_token);
+        const char* mtime_ns = strtok_r(NULL, ">", &element_token);
+        const char* mode = strtok_r(NULL, ">", &element_token);
+        const char* hash = strtok_r(NULL, ">", &element_token);
+        const char* synced_hash = strtok_r(NULL, ">", &element_token);
 
-        if(type == NULL || name == NULL || last_changed == NULL || (strcmp(type, "D") != 0 && strcmp(type, "F") != 0)) {
+        if(type != NULL && name != NULL && strcmp(type, "I") == 0) {
+            // this is not a file but tells us that the peer supports FETCH requests
+            context->inline_limit = strtoul(name, NULL, 10);
+            if(context->inline_limit > INLINE_FILE_MAX_SIZE) {
+                context->inline_limit = INLINE_FILE_MAX_SIZE;
+            }
+        } else if(type != NULL && strcmp(type, "M") == 0) {
+            context->manifest_supported = 1;
+        } else if(type != NULL && strcmp(type, "E") == 0) {
+            context->extents_supported = 1;
+        } else if(type == NULL || name == NULL || last_changed == NULL || (strcmp(type, "D") != 0 && strcmp(type, "F") != 0)
+                || (full_paths ? !is_valid_remote_path(name) : strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)) {
             LOGD("entry not recognized %s\n", entry);
         } else {
-            struct tm remote_time_utc;
-            memset(&remote_time_utc, 0, sizeof(remote_time_utc));
-            strptime(last_changed, "%d.%m.%Y %a %T", &remote_time_utc);
-
-            char date_buffer[128];
-            strftime(date_buffer, sizeof(date_buffer), "%d.%m.%Y %a %T", &remote_time_utc);
-
-            LOGD("%s %s %s\n", type, name, date_buffer);
-
-            if(strcmp(type, "D") == 0) {
-            	// this is a directory, so we want to download that as well
-            	// reuse the request_buffer
-            	// for directories we need to append a /
-                strcpy(request_buffer, path);
-                strcat(request_buffer, name);
-            	strcat(request_buffer, "/");
-            	download_remote_directory(socketfd, remote_address, request_buffer);
+            if(count == capacity) {
+                capacity *= 2;
+                *entries = (remote_entry_type*)realloc(*entries, capacity * sizeof(remote_entry_type));
+            }
+            remote_entry_type* remote_entry = &(*entries)[count++];
+            memset(remote_entry, 0, sizeof(remote_entry_type));
+            remote_entry->name = name;
+            remote_entry->type = type[0];
+            if(size != NULL && mtime_ns != NULL) {
+                remote_entry->size = strtoull(size, NULL, 10);
+                remote_entry->mtime_ns = strtoll(mtime_ns, NULL, 10);
+                remote_entry->has_metadata = 1;
             }
-            else {
-            	// this is a file, so we need to check whether it is locally present and the download it
-            	// so check now if the file exists locally
-            	// when testing for the local path we have to prepend the base directory
-            	strcpy(request_buffer, BASE_PATH);
-                strcat(request_buffer, path);
-                strcat(request_buffer, name);
-
-            	struct stat info;
-            	memset(&info, 0, sizeof(info));
-            	if(lstat(request_buffer, &info) != 0 || !S_ISREG(info.st_mode)) {
-            		// not found or not a file
-            		// so we need to download it
-            		LOGI("file not present: %s\n", request_buffer);
-            		// create a download job for the file
-            		// now the path has to be again relative to BASE_PATH
-                    message_data_download_file_type download_file_data;
-                    memset(&download_file_data, 0, sizeof(download_file_data));
-                    strcpy(download_file_data.file_path, request_buffer + strlen(BASE_PATH));
-                    memcpy(&download_file_data.address, remote_address, sizeof(struct sockaddr_storage));
-                    message_queue_entry_type* message = message_queue_create_message("download_file", (void*)&download_file_data, sizeof(download_file_data));
-                    file_client_thread_send_message(message);
-            	}
+            if(remote_entry->has_metadata && mode != NULL && hash != NULL && synced_hash != NULL && parse_hex_string(hash, remote_entry->hash, SHA256_HASH_SIZE) == 0 && parse_hex_string(synced_hash, remote_entry->synced_hash, SHA256_HASH_SIZE) == 0) {
+                remote_entry->mode = strtoul(mode, NULL, 8);
+                remote_entry->has_hash = 1;
             }
         }
-        entry = strtok_r(NULL, delim, &entry_token);
+        entry = strtok_r(NULL, "<", &entry_token);
     }
+    return count;
+}
+
+// creates a download job for a file, the path is relative to BASE_PATH
+void queue_download(sync_context_type* context, const char* path, const remote_entry_type* remote_entry, int keep_local_copy) {
+	message_data_download_file_type download_file_data;
+	memset(&download_file_data, 0, sizeof(download_file_data));
+	memcpy(download_file_data.peer_id, context->peer_id, 6);
+	strncpy(download_file_data.file_path, path, sizeof(download_file_data.file_path) - 1);
+	memcpy(&download_file_data.address, &context->address, sizeof(struct sockaddr_storage));
+	download_file_data.mtime_ns = remote_entry->has_metadata ? remote_entry->mtime_ns : 0;
+	download_file_data.mode = remote_entry->has_hash ? remote_entry->mode : 0;
+	download_file_data.keep_local_copy = keep_local_copy;
+	download_file_data.extents_supported = context->extents_supported;
+	if(remote_entry->has_hash) {
+		download_file_data.has_hash = 1;
+		memcpy(download_file_data.hash, remote_entry->hash, SHA256_HASH_SIZE);
+		download_file_data.size = remote_entry->size;
+	}
+	message_queue_entry_type* message = message_queue_create_message("download_file", (void*)&download_file_data, sizeof(download_file_data));
+	file_client_thread_send_message(message);
+	context->download_count++;
+}
+
+// finds the entries that differ from the peer with tables of growing size and only handles those
+// returns 1 if the sync is done, 0 if the connection failed or -1 if the whole tree has to be compared instead
+int reconcile_with_peer(sync_context_type* context) {
+	char id_buffer[13];
+	get_hex_string((unsigned char*)context->peer_id, 6, id_buffer, sizeof(id_buffer));
+	uint32_t cell_count;
+	for(cell_count = RECONCILE_MIN_CELLS; cell_count <= RECONCILE_MAX_CELLS; cell_count *= RECONCILE_GROWTH_FACTOR) {
+		reconcile_table_type remote_table;
+		int result = request_remote_table(context, cell_count, &remote_table);
+		if(result != 1) {
+			return result;
+		}
+		reconcile_table_type local_table;
+		reconcile_create_local_table(cell_count, &local_table);
+		uint64_t* remote_ids;
+		size_t remote_id_count;
+		size_t local_id_count;
+		result = reconcile_find_differences(&remote_table, &local_table, &remote_ids, &remote_id_count, &local_id_count);
+		reconcile_free_table(&remote_table);
+		reconcile_free_table(&local_table);
+		if(result == 0) {
+			LOGD("[%s] %lu entries only remote, %lu only local\n", id_buffer, (unsigned long)remote_id_count, (unsigned long)local_id_count);
+			int success = remote_id_count == 0 || download_remote_entries(context, remote_ids, remote_id_count);
+			free(remote_ids);
+			return success;
+		}
+		LOGD("[%s] too many differences for %u cells\n", id_buffer, cell_count);
+	}
+	// with this many differences the manifest is cheaper than even larger tables
+	context->want_manifest = 1;
+	return -1;
+}
+
+// requests the listing of a single directory, the entries point into listing which has to be freed by the caller
+// returns the count of entries or -1 if the connection failed
+long request_remote_listing(sync_context_type* context, const char* path, char** listing, remote_entry_type** entries) {
+	char request_buffer[PATH_MAX];
+	if(snprintf(request_buffer, sizeof(request_buffer), "GET %s", path) >= sizeof(request_buffer)) {
+		LOGD("path too long %s\n", path);
+		*listing = NULL;
+		*entries = NULL;
+		return 0;
+	}
+	double remaining_time = get_remaining_time(context);
+	if(remaining_time <= 0) {
+		LOGD("deadline exceeded, not listing %s\n", path);
+		return -1;
+	}
+	if(tcp_message_send(context->socketfd, request_buffer, strlen(request_buffer), 0) <= 0) {
+		LOGE("send %s\n", strerror(errno));
+		return -1;
+	}
+	*listing = (char*)malloc(LISTING_MAX_SIZE + 1);
+	int received_bytes = tcp_message_receive(context->socketfd, *listing, LISTING_MAX_SIZE, remaining_time < REQUEST_TIMEOUT_SECONDS ? remaining_time : REQUEST_TIMEOUT_SECONDS);
+	if(received_bytes < 0) {
+		LOGE("receive failed for %s\n", path);
+		free(*listing);
+		return -1;
+	}
+	(*listing)[received_bytes] = 0;
+	return parse_remote_listing(*listing, entries, context, 0);
+}
+
+// requests the table of all entries of the peer
+// returns 1 on success, 0 if the connection failed or -1 if the peer does not support this size or reconciliation at all
+int request_remote_table(sync_context_type* context, uint32_t cell_count, reconcile_table_type* table) {
+	char request_buffer[32];
+	snprintf(request_buffer, sizeof(request_buffer), "RECONCILE %u", cell_count);
+	double remaining_time = get_remaining_time(context);
+	if(remaining_time <= 0) {
+		LOGD("deadline exceeded, not reconciling\n");
+		return 0;
+	}
+	if(tcp_message_send(context->socketfd, request_buffer, strlen(request_buffer), 0) <= 0) {
+		LOGE("send %s\n", strerror(errno));
+		return 0;
+	}
+	char* reply_buffer = (char*)malloc(RECONCILE_MAX_CELLS * RECONCILE_CELL_SIZE);
+	int received_bytes = tcp_message_receive(context->socketfd, reply_buffer, RECONCILE_MAX_CELLS * RECONCILE_CELL_SIZE, remaining_time < REQUEST_TIMEOUT_SECONDS ? remaining_time : REQUEST_TIMEOUT_SECONDS);
+	if(received_bytes < 0) {
+		LOGE("receive failed for the table\n");
+		free(reply_buffer);
+		return 0;
+	}
+	// older peers answer with an error message that is no valid table
+	int result = received_bytes == cell_count * RECONCILE_CELL_SIZE && reconcile_decode_table(reply_buffer, received_bytes, table) == 0 ? 1 : -1;
+	free(reply_buffer);
+	return result;
+}
+
+// makes all remaining peers due, so the files that were queued for a lost peer are fetched from them
+void reroute_downloads() {
+	known_peer_type* peers;
+	size_t peer_count = get_known_peers(&peers);
+	size_t i;
+	for(i = 0; i < peer_count; i++) {
+		sync_scheduler_request_sync(peers[i].id);
+	}
+	free(peers);
+	LOGD("rerouting the downloads of a lost peer to %zu peers\n", peer_count);
+}
+
+// checks the paths a peer told us about and reports the created downloads to the sync scheduler
+void sync_changed_paths(message_data_paths_changed_type* paths_changed_data) {
+	sync_context_type context;
+	if(!open_sync_context(&context, paths_changed_data->peer_id, &paths_changed_data->address)) {
+		sync_scheduler_request_sync(paths_changed_data->peer_id);
+		return;
+	}
+	int success = 1;
+	const char* path = paths_changed_data->paths;
+	unsigned int i;
+	for(i = 0; i < paths_changed_data->path_count; i++) {
+		LOGD("\tchanged: %s\n", path);
+		success &= download_remote_path(&context, path);
+		path += strlen(path) + 1;
+	}
+	close(context.socketfd);
+	sync_scheduler_downloads_added(context.peer_id, context.download_count);
+	if(!success) {
+		// let the next reconciliation pick up whatever we missed
+		sync_scheduler_request_sync(context.peer_id);
+	}
+}
+
+// the workers process the jobs from the job queue, every worker handles one peer at a time
+void* worker_thread(void* user_data) {
+	while(!get_shutdown()) {
+		message_queue_entry_type* job = message_queue_pop(job_queue);
+		if(job == NULL) {
+			// another worker might take the job we were woken up for, then we simply wait again
+			message_queue_wait(job_queue, 1.0);
+			continue;
+		}
+		if(strcmp(job->message_id, "sync_peer") == 0) {
+			sync_job_type* sync_job = (sync_job_type*)job->arguments;
+			sync_with_peer(sync_job->peer_id, &sync_job->address);
+		}
+		else if(strcmp(job->message_id, "paths_changed") == 0) {
+			// a peer told us which of its files changed, so we only check those
+			sync_changed_paths((message_data_paths_changed_type*)job->arguments);
+		}
+		message_queue_free_message(job);
+	}
+	return NULL;
 }
 
 void print_peer_seen_data(message_data_peer_seen_type* message_data) {
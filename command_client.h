@@ -4,15 +4,20 @@
  *
  * This module has its own thread. It is responsible for enumerating the files of remote peers
  * and creating "download file" jobs for the file client to process. For files that are locally
- * present (identified by their path only) no download jobs are created.
+ * present (identified by their path only) no download jobs are created. When a peer notifies us
+ * about changed paths only those paths are enumerated. Apart from that every known peer is reconciled
+ * periodically, the sync scheduler decides which peer is due (see sync_scheduler.h). Peers that advertise
+ * the state of their index in discovery packets are only reconciled again when that state changed.
  */
 
 #ifndef COMMAND_CLIENT_H
 #define COMMAND_CLIENT_H
 
+#include <stdint.h>
 #include <sys/socket.h>
 
 #include "message_queue.h"
+#include "sha256.h"
 
 /**
  * @brief This is the thread's main function. It is started from the main thread.
@@ -30,10 +35,25 @@ typedef struct message_peer_seen {
 	char peer_id[6]; //!< The id of the newly discovered peer
 	struct sockaddr_storage address; //!< The address of the newly discovered peer
 	struct timeval timestamp; //!< The time when the peer was discovered
+	int has_state; //!< 1 if the peer advertised the state of its index, old peers do not
+	uint64_t generation; //!< The change generation of the peer's index
+	unsigned char root_hash[SHA256_HASH_SIZE]; //!< The merkle hash of the peer's whole tree
 } message_data_peer_seen_type;
 
+/// The maximum size of the paths in a "paths_changed" message including their terminating zeros
+#define PATHS_CHANGED_BUFFER_SIZE 2048
+
+// this is sent along as arguments with messages of type "paths_changed"
+/// This is a wrapper structure to tell the command client which paths changed at a remote peer
+typedef struct message_paths_changed {
+	char peer_id[6]; //!< The id of the peer whose files changed
+	struct sockaddr_storage address; //!< The address the notification came from
+	unsigned int path_count; //!< How many paths are in paths
+	char paths[PATHS_CHANGED_BUFFER_SIZE]; //!< The changed paths relative to BASE_PATH, each one terminated by a zero
+} message_data_paths_changed_type;
+
 /**
- * @brief This function is used to inform the command client that a new peer was discovered
+ * @brief This function is used to inform the command client that a new peer was discovered or that files of a peer changed
  * @param message The message containing the job parameters.
  */
 void command_client_thread_send_message(message_queue_entry_type* message);
@@ -1,28 +1,67 @@
-#include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 
 #include "defines.h"
 #include "file_client.h"
+#include "file_index.h"
+#include "file_watcher.h"
 #include "logger.h"
+#include "manifest.h"
 #include "message_queue.h"
+#include "reconcile.h"
 #include "shutdown.h"
 #include "util.h"
 
 #include "command_server.h"
 
+#define LISTING_CACHE_BUDGET (16 * 1024 * 1024) // the maximum memory used by cached listings
+#define LISTING_CACHE_BUCKET_COUNT 4096
+
+/// An encoded listing of a single directory, the cached listings form a hash table and a least recently used list
+typedef struct listing_cache_entry {
+	struct listing_cache_entry* next_in_bucket; //!< A link to the next entry in the same hash bucket
+	struct listing_cache_entry* newer; //!< The next more recently used entry, NULL for the most recently used one
+	struct listing_cache_entry* older; //!< The next less recently used entry, NULL for the least recently used one
+	char* path; //!< The requested path
+	uint64_t generation; //!< The change generation of the directory the listing was encoded at
+	char* listing; //!< The encoded listing as it is sent
+	size_t listing_size; //!< The size of listing in bytes
+} listing_cache_entry_type;
+
 // helper functions for this module
+static void cache_listing(const char* path, uint64_t generation, char* listing, size_t listing_size);
+static int encode_entry(const file_index_entry_type* entry, const char* name, char* buffer, size_t buffer_size);
+static char* encode_listing(const char* path, size_t* listing_size);
+static size_t encode_trailer(char* buffer, size_t buffer_size);
+static listing_cache_entry_type* find_cached_listing(const char* path);
+static void free_listing_cache();
 static void handle_client(int socketfd, char* receive_buffer, int received_bytes);
+static void handle_entries(int socketfd, const char* receive_buffer, int received_bytes);
+static void handle_fetch(int socketfd, char* receive_buffer, int received_bytes);
+static void handle_manifest(int socketfd);
+static void handle_reconcile(int socketfd, char* receive_buffer, int received_bytes);
+static void remove_cached_listing(listing_cache_entry_type* entry);
+static void touch_cached_listing(listing_cache_entry_type* entry);
 
 // static variables for this module
 static message_queue_type* message_queue = NULL;
 
+// the cache is only used by the command server thread so it needs no lock
+static listing_cache_entry_type* cache_buckets[LISTING_CACHE_BUCKET_COUNT];
+static listing_cache_entry_type* newest_cached_listing = NULL;
+static listing_cache_entry_type* oldest_cached_listing = NULL;
+static size_t cache_size = 0;
+
 void command_server_thread_send_message(message_queue_entry_type* message) {
 	message_queue_push(message_queue, message);
 }
@@ -87,26 +126,19 @@ void* command_server_thread(void* user_data) {
                     }
 	    		} else {
 	    			// this is a regular client socket that either closed the connection or wants something from us
-                    char receive_buffer[1024];
-                    int received_bytes = tcp_message_receive(socketfd, receive_buffer, sizeof(receive_buffer - 1), 5.0);
+                    char receive_buffer[REQUEST_MAX_SIZE + 1];
+                    int received_bytes = tcp_message_receive(socketfd, receive_buffer, sizeof(receive_buffer) - 1, 5.0);
                     if(received_bytes == -1) {
-                    	// error on recv
+                    	// error on recv or connection closed by remote
                     	// if this happens we want to close this socket and remove it from the master_fds
-                    	LOGD("recv %s\n", strerror(errno));
-                    	FD_CLR(socketfd, &master_read_set);
-                    	continue;
-                    }
-                    if(received_bytes == 0) {
-                    	// connection closed by remote
                     	FD_CLR(socketfd, &master_read_set);
+                    	close(socketfd);
                     	continue;
                     }
                     handle_client(socketfd, receive_buffer, received_bytes);
 	    		}
 	    	}
 	    }
-	    // if we reach this point we can accept an incoming connection
-		sleep(1);
 	}
 
 	// cleanup
@@ -117,81 +149,335 @@ void* command_server_thread(void* user_data) {
 			close(socketfd);
 		}
 	}
+	free_listing_cache();
 	message_queue_free_queue(message_queue);
 	message_queue = NULL;
 	LOGD("ended\n");
 	return NULL;
 }
 
+// takes ownership of listing
+// an older listing of path is replaced and the least recently used listings are evicted until the cache fits the budget again
+void cache_listing(const char* path, uint64_t generation, char* listing, size_t listing_size) {
+	listing_cache_entry_type* entry = find_cached_listing(path);
+	if(entry != NULL) {
+		remove_cached_listing(entry);
+	}
+	entry = (listing_cache_entry_type*)malloc(sizeof(listing_cache_entry_type));
+	memset(entry, 0, sizeof(listing_cache_entry_type));
+	entry->path = strdup(path);
+	entry->generation = generation;
+	entry->listing = listing;
+	entry->listing_size = listing_size;
+	size_t bucket = get_string_hash(path) % LISTING_CACHE_BUCKET_COUNT;
+	entry->next_in_bucket = cache_buckets[bucket];
+	cache_buckets[bucket] = entry;
+	entry->older = newest_cached_listing;
+	if(newest_cached_listing != NULL) {
+		newest_cached_listing->newer = entry;
+	}
+	newest_cached_listing = entry;
+	if(oldest_cached_listing == NULL) {
+		oldest_cached_listing = entry;
+	}
+	cache_size += listing_size + strlen(path) + sizeof(listing_cache_entry_type);
+	while(cache_size > LISTING_CACHE_BUDGET && oldest_cached_listing != newest_cached_listing) {
+		remove_cached_listing(oldest_cached_listing);
+	}
+}
+
+// encodes a single listing entry as type>name>date>size>mtime_ns>mode>hash>synced_hash<
+// returns the length of the entry or -1 if it does not fit into the buffer
+int encode_entry(const file_index_entry_type* entry, const char* name, char* buffer, size_t buffer_size) {
+    // now convert the changed date to a string representation so we do not have do deal with endianness
+    char date_buffer[128];
+    struct tm changed_time;
+    time_t changed_seconds = entry->mtime_ns / 1000000000LL;
+    gmtime_r(&changed_seconds, &changed_time);
+    strftime(date_buffer, sizeof(date_buffer), "%d.%m.%Y %a %T", &changed_time);
+    // for directories the hash is the merkle hash, so whole subtrees can be skipped if they are equal
+    char hash_buffer[2 * SHA256_HASH_SIZE + 1];
+    get_hex_string(entry->hash, SHA256_HASH_SIZE, hash_buffer, sizeof(hash_buffer));
+    char synced_hash_buffer[2 * SHA256_HASH_SIZE + 1];
+    get_hex_string(entry->synced_hash, SHA256_HASH_SIZE, synced_hash_buffer, sizeof(synced_hash_buffer));
+    // the new fields come last so older peers can still parse the first three fields
+    int entry_length = snprintf(buffer, buffer_size, "%c>%s>%s>%llu>%lld>%o>%s>%s<", entry->type, name, date_buffer, (unsigned long long)entry->size, (long long)entry->mtime_ns, (unsigned int)entry->mode, hash_buffer, synced_hash_buffer);
+    if(entry_length < 0 || entry_length >= buffer_size) {
+        return -1;
+    }
+    return entry_length;
+}
+
+// the last entries of a listing tell the peer that it can fetch files up to this size and the manifest over this connection
+// and that the file server can skip holes, older peers ignore them
+// returns the length of the trailer or 0 if it does not fit into the buffer
+size_t encode_trailer(char* buffer, size_t buffer_size) {
+    int trailer_length = snprintf(buffer, buffer_size, "I>%d<M>1<E>1<", INLINE_FILE_MAX_SIZE);
+    if(trailer_length < 0 || trailer_length >= buffer_size) {
+        return 0;
+    }
+    return trailer_length;
+}
+
+// encodes the listing of a directory from the file index, the returned buffer has to be freed by the caller
+// the format is type>name>date>size>mtime_ns>mode>hash>synced_hash< for every entry, see command_server.h
+char* encode_listing(const char* path, size_t* listing_size) {
+    file_index_entry_type* entries;
+    size_t entry_count;
+    if(!file_index_list_directory(path, &entries, &entry_count)) {
+        return NULL;
+    }
+    char* listing = (char*)malloc(LISTING_MAX_SIZE);
+    size_t current_pos = 0;
+    size_t i;
+    for(i = 0; i < entry_count; i++) {
+        int entry_length = encode_entry(&entries[i], entries[i].name, listing + current_pos, LISTING_MAX_SIZE - current_pos);
+        if(entry_length == -1) {
+        	LOGW("listing of %s is too long, it was truncated\n", path);
+        	break;
+        }
+        current_pos += entry_length;
+    }
+    free(entries);
+    current_pos += encode_trailer(listing + current_pos, LISTING_MAX_SIZE - current_pos);
+    // the listing is cached, so it should not hold on to the whole maximum size
+    listing = (char*)realloc(listing, current_pos + 1);
+    *listing_size = current_pos;
+    return listing;
+}
+
+listing_cache_entry_type* find_cached_listing(const char* path) {
+	listing_cache_entry_type* entry;
+	for(entry = cache_buckets[get_string_hash(path) % LISTING_CACHE_BUCKET_COUNT]; entry != NULL; entry = entry->next_in_bucket) {
+		if(strcmp(entry->path, path) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+void free_listing_cache() {
+	while(oldest_cached_listing != NULL) {
+		remove_cached_listing(oldest_cached_listing);
+	}
+}
+
 void handle_client(int socketfd, char* receive_buffer, int received_bytes) {
+    if(received_bytes > 6 && strncmp(receive_buffer, "FETCH ", 6) == 0) {
+        handle_fetch(socketfd, receive_buffer, received_bytes);
+        return;
+    }
+    if(received_bytes == 8 && strncmp(receive_buffer, "MANIFEST", 8) == 0) {
+        handle_manifest(socketfd);
+        return;
+    }
+    if(received_bytes > 10 && strncmp(receive_buffer, "RECONCILE ", 10) == 0) {
+        handle_reconcile(socketfd, receive_buffer, received_bytes);
+        return;
+    }
+    if(received_bytes > 8 && strncmp(receive_buffer, "ENTRIES ", 8) == 0) {
+        handle_entries(socketfd, receive_buffer, received_bytes);
+        return;
+    }
     receive_buffer[received_bytes] = ' '; // for strtok
     const char* delim = " ";
     const char* request_id = strtok(receive_buffer, delim);
     const char* request_path = strtok(NULL, delim);
-    char* local_path = malloc(strlen(BASE_PATH) + strlen(request_path) + 1);
-    memcpy(local_path, BASE_PATH, strlen(BASE_PATH));
-    strcpy(local_path + strlen(BASE_PATH), request_path);
-    //LOGD("id: %s, path: %s\n", request_id, local_path);
-
-    // now we enumerate files in the requested directory and return them as csv
-    char reply[8096 * 8];
-    memset(reply, 0, sizeof(reply));
-
-    struct stat info;
+    if(request_id == NULL || request_path == NULL) {
+    	LOGD("invalid request\n");
+    	return;
+    }
+    //LOGD("id: %s, path: %s\n", request_id, request_path);
 
-    if(lstat(local_path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+    // the listing comes from the file index which is kept up to date by the file watcher
+    // without the watcher we at least check whether the directory itself changed
+    if(!file_watcher_is_active()) {
+        file_index_refresh_directory(request_path);
+    }
+    // the generation is read before the listing is encoded, so a change in between can only cause a needless reencoding later
+    uint64_t generation;
+    if(!file_index_get_directory_generation(request_path, &generation)) {
         // the directory does not exist or is not a directory
-        strcpy(reply, "requested invalid directory");
-    }
-    else {
-        // valid directory so list its contents
-        DIR* directory;
-        directory = opendir(local_path);
-        if(!directory) {
-            // error :/
+        char reply[] = "requested invalid directory";
+        if(tcp_message_send(socketfd, reply, strlen(reply), 2.0) <= 0) {
+        	LOGD("send %s\n", strerror(errno));
         }
-        int current_pos = 0;
-        while(1) {
-            struct dirent* entry;
-            entry = readdir(directory);
-            if(!entry) {
-                // there are no more entrys so we break
-                break;
-            }
-            if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                // do not send current and parent directory
-                continue;
-            }
-            if(entry->d_type != DT_DIR && entry->d_type != DT_REG) {
-            	// we only want to deal with regular files and directories
-            	continue;
+        return;
+    }
+    // popular directories are requested by every peer, so the encoded listing is only built once per change
+    listing_cache_entry_type* entry = find_cached_listing(request_path);
+    if(entry != NULL && entry->generation == generation) {
+        touch_cached_listing(entry);
+    } else {
+        size_t listing_size;
+        char* listing = encode_listing(request_path, &listing_size);
+        if(listing == NULL) {
+        	// the directory was removed in the meantime
+        	return;
+        }
+        cache_listing(request_path, generation, listing, listing_size);
+        entry = newest_cached_listing;
+    }
+    if(tcp_message_send(socketfd, entry->listing, entry->listing_size, 2.0) <= 0) {
+    	LOGD("send %s\n", strerror(errno));
+    }
+}
+
+// sends the listing entries of the ids a peer is missing, the request is "ENTRIES " followed by the ids as 64 bit little endian numbers
+// the reply is a listing like the one of a directory, but every name is the full path, ids that are not in the index (anymore) are skipped
+void handle_entries(int socketfd, const char* receive_buffer, int received_bytes) {
+    size_t id_count = (received_bytes - 8) / sizeof(uint64_t);
+    uint64_t* ids = (uint64_t*)malloc(id_count * sizeof(uint64_t) + 1);
+    size_t i;
+    for(i = 0; i < id_count; i++) {
+        memcpy(&ids[i], receive_buffer + 8 + i * sizeof(uint64_t), sizeof(uint64_t));
+        ids[i] = le64toh(ids[i]);
+    }
+    char* paths;
+    size_t path_count = reconcile_find_paths(ids, id_count, &paths);
+    free(ids);
+    char* listing = (char*)malloc(LISTING_MAX_SIZE);
+    size_t current_pos = 0;
+    const char* path = paths;
+    for(i = 0; i < path_count; i++, path += strlen(path) + 1) {
+        file_index_entry_type entry;
+        if(!file_index_lookup(path, &entry)) {
+            continue;
+        }
+        int entry_length = encode_entry(&entry, path, listing + current_pos, LISTING_MAX_SIZE - current_pos);
+        if(entry_length == -1) {
+            // the peer finds the rest with the next reconciliation
+            LOGW("entries do not fit into a single listing, %lu of %lu sent\n", (unsigned long)i, (unsigned long)path_count);
+            break;
+        }
+        current_pos += entry_length;
+    }
+    free(paths);
+    current_pos += encode_trailer(listing + current_pos, LISTING_MAX_SIZE - current_pos);
+    if(tcp_message_send(socketfd, listing, current_pos, 2.0) <= 0) {
+        LOGD("send %s\n", strerror(errno));
+    }
+    free(listing);
+}
+
+// sends the contents of small files, the request is "FETCH <directory>" followed by the names of the files each terminated by a 0
+// every file is answered with its own message, "F<contents>" if the file could be read or "N" if it has to be downloaded
+void handle_fetch(int socketfd, char* receive_buffer, int received_bytes) {
+    receive_buffer[received_bytes] = 0;
+    const char* directory = receive_buffer + 6;
+    const char* name = directory + strlen(directory) + 1;
+    const char* request_end = receive_buffer + received_bytes;
+    char reply[INLINE_FILE_MAX_SIZE + 2];
+    while(name < request_end) {
+        int reply_size = 1;
+        reply[0] = 'N';
+        char path[PATH_MAX];
+        char local_path[PATH_MAX];
+        file_index_entry_type entry;
+        // only indexed files are sent, the index also rejects paths leaving BASE_PATH
+        if(strchr(name, '/') == NULL && snprintf(path, sizeof(path), "%s%s", directory, name) < sizeof(path) && snprintf(local_path, sizeof(local_path), "%s%s", BASE_PATH, path) < sizeof(local_path)
+                && file_index_lookup(path, &entry) && entry.type == 'F' && entry.size <= INLINE_FILE_MAX_SIZE) {
+            int fd = open(local_path, O_RDONLY);
+            struct stat info;
+            if(fd != -1 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size <= INLINE_FILE_MAX_SIZE) {
+                ssize_t read_bytes = 0;
+                ssize_t read_return;
+                // one byte more than allowed is read so we notice if the file grew in the meantime
+                while((read_return = read(fd, reply + 1 + read_bytes, INLINE_FILE_MAX_SIZE + 1 - read_bytes)) > 0) {
+                    read_bytes += read_return;
+                }
+                if(read_return == 0 && read_bytes <= INLINE_FILE_MAX_SIZE) {
+                    reply[0] = 'F';
+                    reply_size = 1 + read_bytes;
+                    if(entry.size == (uint64_t)info.st_size && entry.mtime_ns == (int64_t)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec) {
+                        // the peer has the indexed version now, see file_index_mark_synced()
+                        file_index_mark_synced(path, entry.hash);
+                    }
+                }
             }
-            char path_buffer[PATH_MAX];
-            strcpy(path_buffer, local_path);
-            strcat(path_buffer, "/");
-            strcat(path_buffer, entry->d_name);
-            if(lstat(path_buffer, &info) != 0 || (!S_ISREG(info.st_mode) && !S_ISDIR(info.st_mode))) {
-            	LOGD("invalid file/dir %s\n", path_buffer);
+            if(fd != -1) {
+                close(fd);
             }
-            reply[current_pos++] = S_ISREG(info.st_mode) ? 'F' : 'D';
-            reply[current_pos++] = '>'; // delimiter
-            memcpy(reply + current_pos, entry->d_name, strlen(entry->d_name));
-            current_pos += strlen(entry->d_name);
-            reply[current_pos++] = '>';
-            // now convert the changed date to a string representation so we do not have do deal with endianness
-            char date_buffer[128];
-            struct tm changed_time;
-            gmtime_r(&info.st_ctim.tv_sec, &changed_time);
-            strftime(date_buffer, sizeof(date_buffer), "%d.%m.%Y %a %T", &changed_time);
-            memcpy(reply + current_pos, date_buffer, strlen(date_buffer));
-            current_pos += strlen(date_buffer);
-            reply[current_pos++] = '<'; // delimiter between file
         }
-        reply[current_pos] = 0; // end of string instead of <
-        //LOGD("sending %s\n", reply);
+        if(tcp_message_send(socketfd, reply, reply_size, 2.0) <= 0) {
+            LOGD("send %s\n", strerror(errno));
+            return;
+        }
+        name += strlen(name) + 1;
     }
-    if(tcp_message_send(socketfd, reply, strlen(reply), 2.0) <= 0) {
-    	LOGD("send %s\n", strerror(errno));
+}
+
+// sends the manifest of the whole index, the file watcher keeps it up to date
+// an empty message tells the peer to fall back to requesting the listings one by one
+void handle_manifest(int socketfd) {
+    uint64_t size;
+    int fd = manifest_open_local(&size);
+    if(fd == -1) {
+        if(tcp_message_send(socketfd, "", 0, 2.0) <= 0) {
+            LOGD("send %s\n", strerror(errno));
+        }
+        return;
+    }
+    if(tcp_message_send_file(socketfd, fd, 0, size) <= 0) {
+        LOGD("sending the manifest failed %s\n", strerror(errno));
+    }
+    close(fd);
+}
+
+// sends a table with the ids of all local entries, the request is "RECONCILE <count of cells>"
+// an empty message tells the peer that the count is not supported
+void handle_reconcile(int socketfd, char* receive_buffer, int received_bytes) {
+    receive_buffer[received_bytes] = 0;
+    reconcile_table_type table;
+    if(reconcile_create_local_table(strtoul(receive_buffer + 10, NULL, 10), &table) == -1) {
+        if(tcp_message_send(socketfd, "", 0, 2.0) <= 0) {
+            LOGD("send %s\n", strerror(errno));
+        }
+        return;
     }
-    free(local_path);
+    size_t size = table.cell_count * RECONCILE_CELL_SIZE;
+    char* buffer = (char*)malloc(size);
+    reconcile_encode_table(&table, buffer);
+    reconcile_free_table(&table);
+    if(tcp_message_send(socketfd, buffer, size, 2.0) <= 0) {
+        LOGD("send %s\n", strerror(errno));
+    }
+    free(buffer);
+}
+
+void remove_cached_listing(listing_cache_entry_type* entry) {
+	listing_cache_entry_type** link;
+	for(link = &cache_buckets[get_string_hash(entry->path) % LISTING_CACHE_BUCKET_COUNT]; *link != entry; link = &(*link)->next_in_bucket);
+	*link = entry->next_in_bucket;
+	if(entry->newer != NULL) {
+		entry->newer->older = entry->older;
+	} else {
+		newest_cached_listing = entry->older;
+	}
+	if(entry->older != NULL) {
+		entry->older->newer = entry->newer;
+	} else {
+		oldest_cached_listing = entry->newer;
+	}
+	cache_size -= entry->listing_size + strlen(entry->path) + sizeof(listing_cache_entry_type);
+	free(entry->path);
+	free(entry->listing);
+	free(entry);
+}
+
+// makes an entry the most recently used one
+void touch_cached_listing(listing_cache_entry_type* entry) {
+	if(entry == newest_cached_listing) {
+		return;
+	}
+	entry->newer->older = entry->older;
+	if(entry->older != NULL) {
+		entry->older->newer = entry->newer;
+	} else {
+		oldest_cached_listing = entry->newer;
+	}
+	entry->newer = NULL;
+	entry->older = newest_cached_listing;
+	newest_cached_listing->newer = entry;
+	newest_cached_listing = entry;
 }
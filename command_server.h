@@ -5,7 +5,26 @@
  * This module has its own thread. It behaves like a seperate process with complete isolation from the rest of the application.
  * This module is responsible for responding to file enumeration requests from other peers. When another peer sends a message of the format
  * "GET <path to some directory>" the command server enumerates all files that are locally present in the requested directory and sends
- * this list back to the peer.
+ * this list back to the peer. Every entry of the list has the format "type>name>date>size>mtime_ns>mode>hash>synced_hash<" where type is
+ * F for files and D for directories, date is human readable, mtime_ns is the modification time in nanoseconds since the epoch, mode are
+ * the permission bits in octal, hash is the SHA-256 hash of the file contents (the merkle hash for directories) and synced_hash is the
+ * hash of the last synced version of a file (zero for directories), both in hex. A listing is at most LISTING_MAX_SIZE bytes long.
+ * It ends with the entry "I>size<" which tells the peer that files up to this size can be fetched over the same connection
+ * and the entry "M>1<" which tells the peer that it can request the manifest. The entry "E>1<" tells the peer that the file server
+ * understands EXTENTS requests, see file_server.h.
+ *
+ * Small files are not worth a connection to the file server each, so a peer can request many of them at once with
+ * "FETCH <path to some directory>" followed by the file names, each terminated by a 0. Every file is answered with a separate
+ * message which is "F" followed by the file contents or just "N" if the file cannot be sent (e.g. because it grew) and has to
+ * be downloaded from the file server.
+ *
+ * To compare everything at once a peer can request "MANIFEST". The reply is a binary snapshot of the whole index, see
+ * manifest.h. It is sent straight from a file in STATE_PATH and only rebuilt when the index changed.
+ *
+ * Peers that synced before mostly differ in a few files, so they first exchange "RECONCILE <count of cells>". The reply is
+ * a table with the ids of all entries of the index, see reconcile.h, or an empty message if the count is not supported.
+ * The ids the peer is missing are requested with "ENTRIES " followed by the ids as 64 bit little endian numbers. The reply
+ * is a listing like the one of a directory, except that every name is the full path of the entry.
  */
 
 #ifndef COMMAND_SERVER_H
@@ -6,8 +6,20 @@
 #define COMMAND_LISTENER_PORT			44701
 #define COMMAND_LISTENER_PORT_STRING	"44701"
 
+#define LISTING_MAX_SIZE (1024 * 1024) // the maximum size of a single directory listing sent by the command server
+#define REQUEST_MAX_SIZE (64 * 1024) // the maximum size of a single request to the command server
+#define FILE_CHUNK_MAX_SIZE (1024 * 1024) // the maximum size of a single data message sent by the file server
+#define INLINE_FILE_MAX_SIZE 8192 // files up to this size are sent over the command connection instead of being downloaded from the file server
+
+// both TTLs are meant for small networks, they grow together with the discovery interval in large ones
+#define ADDRESS_TTL_SECONDS 45.0 // an address of a peer is forgotten if no packet came from it for this long
+#define PEER_TTL_SECONDS 120.0 // a peer is forgotten if no packet came from it for this long, this must not be shorter than ADDRESS_TTL_SECONDS
+
 #define IPV6_MULTICAST_ADDRESS "ff02::14:2857" // ff02 is for local link multicast 14:2857 is just an identifier for the group
 
 #define BASE_PATH "./sync_files"
 
+#define STATE_PATH "./state" // persistent state of this node, must not be inside of BASE_PATH
+#define FILE_INDEX_PATH STATE_PATH "/file_index"
+
 #endif
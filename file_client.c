@@ -1,29 +1,56 @@
+#define _GNU_SOURCE // for SEEK_DATA and SEEK_HOLE
+#include <endian.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "defines.h"
+#include "file_index.h"
+#include "local_file.h"
 #include "logger.h"
+#include "peer_list.h"
+#include "sha256.h"
 #include "shutdown.h"
+#include "sync_scheduler.h"
 #include "util.h"
 
 #include "file_client.h"
 
+#define CONNECT_TIMEOUT_SECONDS 5.0
+#define CHUNK_TIMEOUT_SECONDS 30.0 // the maximum time to wait for a single chunk of a file
+#define WHOLE_FILE_MAX_SIZE 20000000 // the maximum size of a file sent by older peers
+#define FILE_CLIENT_QUEUE_CAPACITY 4096 // the maximum count of queued download jobs, each one takes about 4 KiB
+
 // helper functions for this module
-static void download_file(struct sockaddr* address, const char* file_path);
+static int download_file(message_data_download_file_type* job);
+static int hash_received_file(int fd, uint64_t size, unsigned char hash[SHA256_HASH_SIZE]);
+static int is_peer_lost(char peer_id[6]);
+static int receive_extents(int socketfd, message_data_download_file_type* job, uint64_t* received_size);
+static int receive_whole_file(int socketfd, message_data_download_file_type* job, uint64_t* received_size);
 
 // static variables for this module
 static message_queue_type* message_queue = NULL;
+static char (*lost_peers)[6] = NULL; // only used by the file client thread
+static size_t lost_peer_count = 0;
 
 void file_client_thread_send_message(message_queue_entry_type* message) {
 	message_queue_push(message_queue, message);
 }
 
+void file_client_peer_lost(char peer_id[6]) {
+	message_data_peer_lost_type peer_lost_data;
+	memcpy(peer_lost_data.peer_id, peer_id, 6);
+	message_queue_push_front(message_queue, message_queue_create_message("peer_lost", &peer_lost_data, sizeof(peer_lost_data)));
+}
+
 void* file_client_thread(void* user_data) {
 	LOGD("started\n");
 	// this has to be called otherwise this thread will not be able to receive any messages
-	message_queue = message_queue_create_queue();
+	// a sync that finds lots of changed files waits here instead of piling up all download jobs in memory
+	message_queue = message_queue_create_bounded_queue(FILE_CLIENT_QUEUE_CAPACITY);
 	while(!get_shutdown()) {
 		// handle messages sent by other threads
 		message_queue_entry_type* message;
@@ -33,7 +60,20 @@ void* file_client_thread(void* user_data) {
 				// extract the download_file_data from the message
 				message_data_download_file_type* download_file_data = (message_data_download_file_type*)message->arguments;
 
-				download_file((struct sockaddr*)&download_file_data->address, download_file_data->file_path);
+				int success = 0;
+				if(is_peer_lost(download_file_data->peer_id)) {
+					LOGI("dropping download of %s, the peer is gone\n", download_file_data->file_path);
+				} else {
+					success = download_file(download_file_data);
+				}
+				sync_scheduler_download_finished(download_file_data->peer_id, success);
+			}
+			else if(strcmp(message->message_id, "peer_lost") == 0) {
+				message_data_peer_lost_type* peer_lost_data = (message_data_peer_lost_type*)message->arguments;
+				if(!is_peer_lost(peer_lost_data->peer_id)) {
+					lost_peers = realloc(lost_peers, (lost_peer_count + 1) * sizeof(lost_peers[0]));
+					memcpy(lost_peers[lost_peer_count++], peer_lost_data->peer_id, 6);
+				}
 			}
 			else {
 				LOGD("unkown message id :(\n");
@@ -41,78 +81,196 @@ void* file_client_thread(void* user_data) {
 			// free the message
 			message_queue_free_message(message);
 		}
-		sleep(1);
+		message_queue_wait(message_queue, 1.0); // wake up at least once a second to check for the shutdown
 	}
 	// cleanup
+	// command client workers may still wait for space to queue their downloads
+	message_queue_close(message_queue);
 	message_queue_free_queue(message_queue);
 	message_queue = NULL;
+	free(lost_peers);
+	lost_peers = NULL;
+	lost_peer_count = 0;
 	LOGD("ended\n");
 	return NULL;
 }
 
-void download_file(struct sockaddr* address, const char* file_path) {
-    char ip_buffer[128];
-    get_ip_address_string_prefixed(address, ip_buffer, sizeof(ip_buffer));
-    LOGI("downloading %s from %s\n", file_path, ip_buffer);
-
-    // create a tcp connection to the remote
-    int socketfd = connect_with_timeout(address, FILE_LISTENER_PORT, 5);
+// returns 1 if the file was downloaded and written, 0 otherwise
+int download_file(message_data_download_file_type* job) {
+    // duplicates of the same file in one sync are only downloaded once, the other jobs find the first one here
+    if(job->has_hash && local_file_store_local_copy(job->file_path, job->hash, job->size, job->mode, job->mtime_ns, job->keep_local_copy) == 0) {
+    	return 1;
+    }
+    // create a tcp connection to the remote, the best address might be another one than when the job was created
+    struct sockaddr_storage address;
+    int socketfd = connect_to_peer(job->peer_id, &job->address, FILE_LISTENER_PORT, CONNECT_TIMEOUT_SECONDS, &address);
     if(socketfd == -1) {
-    	LOGE("connect_with_timeout failed\n");
-    	return;
+    	LOGE("connect_to_peer failed\n");
+    	return 0;
     }
-    // the request should look like GET <path>
-    char request_buffer[PATH_MAX];
-    strcpy(request_buffer, "GET ");
-    strcat(request_buffer, file_path);
+    char ip_buffer[128];
+    get_ip_address_string_prefixed((struct sockaddr*)&address, ip_buffer, sizeof(ip_buffer));
+    LOGI("downloading %s from %s\n", job->file_path, ip_buffer);
+
+    // the request should look like GET <path> or EXTENTS <path>
+    char request_buffer[PATH_MAX + 16];
+    snprintf(request_buffer, sizeof(request_buffer), "%s %s", job->extents_supported ? "EXTENTS" : "GET", job->file_path);
     int send_return = tcp_message_send(socketfd, request_buffer, strlen(request_buffer), 5.0);
     if(send_return <= 0) {
     	LOGE("send_tcp_message failed\n");
     	close(socketfd);
-    	return;
+    	return 0;
     }
-    // maximum 20mb file for now...
-    char* file_buffer = (char*)malloc(20000000);
+    struct timeval start_time;
+    gettimeofday(&start_time, NULL);
+    uint64_t received_size = 0;
+    int success = job->extents_supported ? receive_extents(socketfd, job, &received_size) : receive_whole_file(socketfd, job, &received_size);
+    close(socketfd);
+    if(success) {
+    	// the measured throughput decides which address the next transfers use
+    	report_peer_transfer(job->peer_id, (struct sockaddr*)&address, received_size, get_passed_time(start_time));
+    }
+    return success;
+}
+
+// hashes a received file including its holes, which read as zeros just like on the peer
+// returns 0 on success, -1 otherwise
+// hashes a received file, the holes are hashed as zeros without reading them like send_extents() skips them
+int hash_received_file(int fd, uint64_t size, unsigned char hash[SHA256_HASH_SIZE]) {
+	static const char zeros[65536];
+	sha256_context_type context;
+	sha256_init(&context);
+	char buffer[65536];
+	uint64_t offset = 0;
+	while(offset < size) {
+		off_t data_start = lseek(fd, offset, SEEK_DATA);
+		off_t data_end;
+		if(data_start == -1 && errno == ENXIO) {
+			// there is only a hole left
+			data_start = size;
+			data_end = size;
+		} else if(data_start == -1) {
+			// the file system cannot tell where the holes are, so everything is data
+			data_start = offset;
+			data_end = size;
+		} else {
+			data_end = lseek(fd, data_start, SEEK_HOLE);
+		}
+		if((uint64_t)data_start > size) {
+			data_start = size;
+		}
+		if(data_end == -1 || (uint64_t)data_end > size) {
+			data_end = size;
+		}
+		while(offset < (uint64_t)data_start) {
+			size_t zero_bytes = data_start - offset < sizeof(zeros) ? data_start - offset : sizeof(zeros);
+			sha256_update(&context, zeros, zero_bytes);
+			offset += zero_bytes;
+		}
+		while(offset < (uint64_t)data_end) {
+			ssize_t read_bytes = pread(fd, buffer, data_end - offset < sizeof(buffer) ? data_end - offset : sizeof(buffer), offset);
+			if(read_bytes <= 0) {
+				return -1;
+			}
+			sha256_update(&context, buffer, read_bytes);
+			offset += read_bytes;
+		}
+	}
+	sha256_final(&context, hash);
+	return 0;
+}
+
+// returns 1 if the peer was lost and is not back in the peer list
+// a peer that is back is forgotten here, so its jobs are processed again
+int is_peer_lost(char peer_id[6]) {
+	size_t i;
+	for(i = 0; i < lost_peer_count; i++) {
+		if(memcmp(lost_peers[i], peer_id, 6) == 0) {
+			if(!is_peer_in_list(peer_id)) {
+				return 1;
+			}
+			memcpy(lost_peers[i], lost_peers[--lost_peer_count], 6);
+			return 0;
+		}
+	}
+	return 0;
+}
+
+// receives a file chunk by chunk straight into a temporary file, the holes between the chunks are never written
+// returns 1 if the file was received and written, 0 otherwise
+int receive_extents(int socketfd, message_data_download_file_type* job, uint64_t* received_size) {
+	uint64_t number;
+	if(tcp_message_receive(socketfd, (char*)&number, sizeof(number), CHUNK_TIMEOUT_SECONDS) != sizeof(number)) {
+		LOGE("receiving the size of %s failed\n", job->file_path);
+		return 0;
+	}
+	uint64_t size = le64toh(number);
+	char temp_path[PATH_MAX];
+	int fd = local_file_create_temporary(job->file_path, temp_path, sizeof(temp_path));
+	if(fd == -1) {
+		return 0;
+	}
+	// the file starts out as a single hole of the final size, so the holes of the remote file are recreated by skipping them
+	if(ftruncate(fd, size) != 0) {
+		LOGE("ftruncate %s %s\n", temp_path, strerror(errno));
+		local_file_discard(fd, temp_path);
+		return 0;
+	}
+	*received_size = 0;
+	while(1) {
+		int received_bytes = tcp_message_receive(socketfd, (char*)&number, sizeof(number), CHUNK_TIMEOUT_SECONDS);
+		if(received_bytes == 0) {
+			// the end of the file
+			break;
+		}
+		uint64_t offset = le64toh(number);
+		int64_t chunk_size = -1;
+		if(received_bytes == sizeof(number) && offset < size && lseek(fd, offset, SEEK_SET) != -1) {
+			chunk_size = tcp_message_receive_file(socketfd, fd, size - offset < FILE_CHUNK_MAX_SIZE ? size - offset : FILE_CHUNK_MAX_SIZE, CHUNK_TIMEOUT_SECONDS);
+		}
+		if(chunk_size == -1) {
+			LOGE("receiving %s failed\n", job->file_path);
+			local_file_discard(fd, temp_path);
+			return 0;
+		}
+		*received_size += chunk_size;
+	}
+	// the hash of the listing is only what the file should be, a transfer that broke off or a file that changed
+	// meanwhile must not be remembered as synced, otherwise it would never be downloaded again
+	unsigned char hash[SHA256_HASH_SIZE];
+	if(hash_received_file(fd, size, hash) == -1) {
+		LOGE("hashing %s failed\n", temp_path);
+		local_file_discard(fd, temp_path);
+		return 0;
+	}
+	if(job->has_hash && memcmp(hash, job->hash, SHA256_HASH_SIZE) != 0) {
+		LOGW("%s does not match the hash of the listing, discarding it\n", job->file_path);
+		local_file_discard(fd, temp_path);
+		return 0;
+	}
+	LOGI("writing to file system: %s, %llu of %llu bytes are data\n", job->file_path, (unsigned long long)*received_size, (unsigned long long)size);
+	return local_file_commit_remote(fd, temp_path, job->file_path, hash, job->mode, job->mtime_ns, job->keep_local_copy) == 0;
+}
+
+// older peers send the whole file as a single message, so it has to fit into memory
+// returns 1 if the file was received and written, 0 otherwise
+int receive_whole_file(int socketfd, message_data_download_file_type* job, uint64_t* received_size) {
+    char* file_buffer = (char*)malloc(WHOLE_FILE_MAX_SIZE);
     if(file_buffer == NULL) {
     	LOGE("out of memory :/\n");
-    	close(socketfd);
-    	return;
+    	return 0;
     }
-    int recv_return = tcp_message_receive(socketfd, file_buffer, 20000000, 20000.0);
-    if(recv_return <= 0) {
+    int recv_return = tcp_message_receive(socketfd, file_buffer, WHOLE_FILE_MAX_SIZE, 20000.0);
+    if(recv_return == -1) {
     	LOGE("receive_tcp_message failed\n");
-    	close(socketfd);
     	free(file_buffer);
-    	return;
+    	return 0;
     }
     // we should have the remote file in memory now
-    // WE SHOULD PROBABLY CALCULATE SOME CHECKSUM HERE
-    //LOGI("remote file: %s has contents: %*.*s", file_path, 0, recv_return, file_buffer);
-
-    char local_file_path[PATH_MAX];
-    strcpy(local_file_path, BASE_PATH);
-    strcat(local_file_path, file_path);
-    LOGI("writing to file system: %s\n", local_file_path);
-    // first create parent directories, so we can open
-    // remove the file name first
-    char* p;
-    for(p = local_file_path + strlen(local_file_path) - 1; *p != '/'; p--);
-    *p = 0;
-    mkdirp(local_file_path);
-    *p = '/';
-
-    int filefd = open(local_file_path, O_RDWR | O_CREAT, 0666);
-    if(filefd == -1) {
-    	// file creation failed
-    	LOGE("open: %s\n", strerror(errno));
-    	close(socketfd);
-    	free(file_buffer);
-    	return;
-    }
-    int written_bytes = write(filefd, file_buffer, recv_return);
-    if(written_bytes == -1) {
-    	LOGE("write: %s\n", strerror(errno));
-    }
-    close(socketfd);
+    *received_size = recv_return;
+    LOGI("writing to file system: %s\n", job->file_path);
+    int success = local_file_store_remote(job->file_path, file_buffer, recv_return, job->mode, job->mtime_ns, job->keep_local_copy) == 0;
     free(file_buffer);
+    return success;
 }
+
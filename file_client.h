@@ -4,16 +4,24 @@
  *
  * This module has its own thread. The file client is responsible for processing "download file" jobs created
  * by the command client. Each job is a single file to download from a single peer. So for each job the file
- * client connects to a peer and downloads a single file which is the written to the local file system.
+ * client connects to a peer and downloads a single file which is the written to the local file system. The file is
+ * written with the local file module, so it gets the modification time and the permission bits of the remote file.
+ * Files are received in chunks straight into a temporary file, so their size is not limited by the memory. Only the
+ * chunks with data are transferred, the holes of sparse files stay holes.
+ * If another job or a local change produced a file with the same contents in the meantime, that file is copied
+ * instead, see local_file_store_local_copy().
+ * The queued jobs of a peer that is lost are dropped without connecting, see file_client_peer_lost().
  */
 
 #ifndef FILE_DOWNLOAD_H
 #define FILE_DOWNLOAD_H
 
 #include <limits.h>
+#include <stdint.h>
 #include <sys/socket.h>
 
 #include "message_queue.h"
+#include "sha256.h"
 
 /**
  * @brief This is the thread's main function. It is started from the main thread.
@@ -27,8 +35,16 @@ void* file_client_thread(void* user_data);
 
  /// This is a wrapper structure to send message arguments to the file client thread.
 typedef struct message_download_file {
+	char peer_id[6]; //!< The id of the peer the file is downloaded from, the sync scheduler is told when the job is done
 	struct sockaddr_storage address; //!< The address where the file resides
 	char file_path[PATH_MAX]; //!< The path of the file to download
+	int64_t mtime_ns; //!< The remote modification time in nanoseconds, the local file gets the same one. 0 if unknown
+	uint32_t mode; //!< The remote permission bits, the local file gets the same ones. 0 if unknown
+	int keep_local_copy; //!< 1 if the local file conflicts with the remote one, it is kept as a conflict copy before it is replaced
+	int has_hash; //!< 1 if hash and size are known
+	unsigned char hash[SHA256_HASH_SIZE]; //!< The remote content hash, a local file with the same contents is copied instead of downloading the file
+	uint64_t size; //!< The remote size in bytes
+	int extents_supported; //!< 1 if the file server of the peer understands EXTENTS requests, see file_server.h
 } message_data_download_file_type;
 
 /**
@@ -37,4 +53,13 @@ typedef struct message_download_file {
  */
 void file_client_thread_send_message(message_queue_entry_type* message);
 
+/**
+ * @brief Tells the file client that a peer is gone.
+ *
+ * The event is put in front of all queued jobs, so the jobs of the peer that are still queued are dropped instead
+ * of waiting for the connect timeout one by one. Jobs are only dropped while the peer is not in the peer list again.
+ * @param peer_id The id of the lost peer
+ */
+void file_client_peer_lost(char peer_id[6]);
+
 #endif
@@ -0,0 +1,922 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "defines.h"
+#include "local_file.h"
+#include "logger.h"
+#include "tree_scanner.h"
+#include "util.h"
+
+#include "file_index.h"
+
+#define INDEX_MAGIC "P2PFIDX2" // the last character is the format version
+#define INDEX_MAGIC_SIZE 8
+
+#define RECORD_OPERATION_PUT 1
+#define RECORD_OPERATION_REMOVE 2
+
+#define INITIAL_BUCKET_COUNT 1024
+#define COMPACTION_MINIMUM_RECORDS 4096 // the log is only compacted if it has at least this many superfluous records
+
+/// The fixed size part of a record in the index log, the path follows directly after it
+typedef struct {
+	uint8_t operation; //!< One of the RECORD_OPERATION defines
+	uint8_t type; //!< 'F' or 'D', unused for removals
+	uint16_t path_length; //!< The length of the path following this record
+	uint32_t mode; //!< The permission bits
+	uint64_t size; //!< The size in bytes
+	int64_t mtime_ns; //!< The modification time in nanoseconds
+	uint64_t inode; //!< The inode number
+	unsigned char hash[SHA256_HASH_SIZE]; //!< The content hash
+	unsigned char synced_hash[SHA256_HASH_SIZE]; //!< The content hash of the last version that was synced with a peer
+} __attribute__((packed)) index_record_type; // the log is only read by the node that wrote it so native byte order is fine
+
+/// A single node of the in memory index. Nodes are stored in a hash table and linked to form the directory tree
+typedef struct index_node {
+	struct index_node* next_in_bucket; //!< A link to the next node in the same hash bucket
+	struct index_node* next_with_content; //!< For files: a link to the next file in the same content hash bucket
+	struct index_node* parent; //!< The directory containing this node, NULL for the root
+	struct index_node* first_child; //!< The first entry of this directory
+	struct index_node* next_sibling; //!< The next entry in the parent directory
+	struct index_node* previous_sibling; //!< The previous entry in the parent directory
+	uint64_t path_hash; //!< The hash of path, used for the hash table
+	char* path; //!< The full path relative to BASE_PATH
+	const char* name; //!< Points to the name inside of path
+	unsigned int scan_stamp; //!< Used to find entries that disappeared during a scan
+	uint64_t generation; //!< Set to the new index generation whenever anything below this directory changes
+	int merkle_dirty; //!< Set if merkle_hash has to be recalculated because something below this directory changed
+	unsigned char merkle_hash[SHA256_HASH_SIZE]; //!< The hash over all children of this directory
+	char type; //!< 'F' or 'D'
+	uint32_t mode; //!< The permission bits
+	uint64_t size; //!< The size in bytes
+	int64_t mtime_ns; //!< The modification time in nanoseconds
+	uint64_t inode; //!< The inode number
+	unsigned char hash[SHA256_HASH_SIZE]; //!< The content hash
+	unsigned char synced_hash[SHA256_HASH_SIZE]; //!< The content hash of the last version that was synced with a peer, zero for directories
+} index_node_type;
+
+static void append_record(index_node_type* node, const char* path, uint8_t operation);
+static void compact_log();
+static int compare_entries_by_name(const void* a, const void* b);
+static int compare_nodes_by_name(const void* a, const void* b);
+static void copy_entry(index_node_type* node, file_index_entry_type* entry);
+static index_node_type* find_node(const char* path);
+static size_t get_content_bucket(const unsigned char hash[SHA256_HASH_SIZE], size_t count);
+static int hash_file(const char* local_path, unsigned char hash[SHA256_HASH_SIZE]);
+static void index_directory(const char* path, const struct stat* info, tree_scanner_entry_type* entries, size_t entry_count, void* user_data);
+static int index_file(const char* path, const struct stat* info, unsigned int scan_stamp);
+static int join_path(const char* directory, const char* name, char* buffer, size_t buffer_size);
+static void link_content(index_node_type* node);
+static void mark_changed(index_node_type* directory);
+static int normalize_path(const char* path, char* buffer, size_t buffer_size);
+static index_node_type* put_node(const char* path, char type, uint32_t mode, uint64_t size, int64_t mtime_ns, uint64_t inode, const unsigned char hash[SHA256_HASH_SIZE], unsigned int scan_stamp, int write_log);
+static void remove_node(index_node_type* node);
+static void replay_log(const char* data, size_t size);
+static void scan_directory(const char* path, int recursive);
+static int64_t stat_mtime_ns(const struct stat* info);
+static void unlink_content(index_node_type* node);
+static void update_merkle_hash(index_node_type* node);
+static void write_node_records(int fd, index_node_type* node);
+static int write_record(int fd, index_node_type* node, const char* path, uint8_t operation);
+
+static pthread_mutex_t file_index_lock;
+
+static index_node_type** buckets = NULL;
+static index_node_type** content_buckets = NULL; // files by their content hash, it has bucket_count buckets as well
+static size_t bucket_count = 0;
+static size_t node_count = 0;
+
+static int log_file = -1;
+static size_t log_record_count = 0;
+static unsigned int current_scan_stamp = 0;
+static uint64_t index_generation = 0;
+
+void initialize_file_index_lock() {
+	if(pthread_mutex_init(&file_index_lock, NULL) != 0) {
+		printf("pthread_mutex_init failed\n");
+	}
+}
+
+void destroy_file_index_lock() {
+	if(pthread_mutex_destroy(&file_index_lock) != 0) {
+		printf("pthread_mutex_destroy failed\n");
+	}
+}
+
+int file_index_load() {
+	int loaded = -1;
+	pthread_mutex_lock(&file_index_lock);
+	int fd = open(FILE_INDEX_PATH, O_RDONLY);
+	if(fd != -1) {
+		struct stat info;
+		if(fstat(fd, &info) == 0 && info.st_size >= INDEX_MAGIC_SIZE) {
+			char* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(data == MAP_FAILED) {
+				LOGE("mmap %s\n", strerror(errno));
+			} else {
+				if(memcmp(data, INDEX_MAGIC, INDEX_MAGIC_SIZE) == 0) {
+					replay_log(data + INDEX_MAGIC_SIZE, info.st_size - INDEX_MAGIC_SIZE);
+					loaded = (int)node_count;
+				} else {
+					LOGW("index has an unknown format, it will be rebuilt\n");
+				}
+				munmap(data, info.st_size);
+			}
+		}
+		close(fd);
+	}
+	// we always start with a freshly compacted log, this also creates the file if it did not exist
+	compact_log();
+	pthread_mutex_unlock(&file_index_lock);
+	LOGD("loaded %d index entries\n", loaded);
+	return loaded;
+}
+
+void file_index_scan() {
+	struct timeval start_time;
+	gettimeofday(&start_time, NULL);
+	scan_directory("/", 1);
+	pthread_mutex_lock(&file_index_lock);
+	size_t count = node_count;
+	pthread_mutex_unlock(&file_index_lock);
+	LOGD("scanned %zu entries in %.3f seconds\n", count, get_passed_time(start_time));
+}
+
+void file_index_update_path(const char* path) {
+	char normalized_path[PATH_MAX];
+	if(normalize_path(path, normalized_path, sizeof(normalized_path)) == -1) {
+		LOGD("invalid path %s\n", path);
+		return;
+	}
+	if(local_file_is_temporary(strrchr(normalized_path, '/') + 1)) {
+		// files that are still being written are picked up when they are renamed
+		return;
+	}
+	char local_path[PATH_MAX];
+	if(snprintf(local_path, sizeof(local_path), "%s%s", BASE_PATH, normalized_path) >= sizeof(local_path)) {
+		return;
+	}
+	struct stat info;
+	if(lstat(local_path, &info) != 0 || (!S_ISREG(info.st_mode) && !S_ISDIR(info.st_mode))) {
+		// the path is gone or is something we do not sync
+		pthread_mutex_lock(&file_index_lock);
+		index_node_type* node = find_node(normalized_path);
+		if(node != NULL) {
+			append_record(NULL, normalized_path, RECORD_OPERATION_REMOVE);
+			remove_node(node);
+		}
+		pthread_mutex_unlock(&file_index_lock);
+		return;
+	}
+	if(S_ISREG(info.st_mode)) {
+		index_file(normalized_path, &info, 0);
+	} else {
+		scan_directory(normalized_path, 0);
+	}
+}
+
+void file_index_rescan_directory(const char* path) {
+	char normalized_path[PATH_MAX];
+	if(normalize_path(path, normalized_path, sizeof(normalized_path)) == -1) {
+		return;
+	}
+	scan_directory(normalized_path, 0);
+}
+
+void file_index_refresh_directory(const char* path) {
+	char normalized_path[PATH_MAX];
+	if(normalize_path(path, normalized_path, sizeof(normalized_path)) == -1) {
+		return;
+	}
+	char local_path[PATH_MAX];
+	if(snprintf(local_path, sizeof(local_path), "%s%s", BASE_PATH, normalized_path) >= sizeof(local_path)) {
+		return;
+	}
+	struct stat info;
+	int changed = 1;
+	if(lstat(local_path, &info) == 0) {
+		pthread_mutex_lock(&file_index_lock);
+		index_node_type* node = find_node(normalized_path);
+		if(node != NULL && node->type == 'D' && node->mtime_ns == stat_mtime_ns(&info)) {
+			changed = 0;
+		}
+		pthread_mutex_unlock(&file_index_lock);
+	}
+	if(changed) {
+		scan_directory(normalized_path, 0);
+	}
+}
+
+int file_index_lookup(const char* path, file_index_entry_type* entry) {
+	char normalized_path[PATH_MAX];
+	if(normalize_path(path, normalized_path, sizeof(normalized_path)) == -1) {
+		return 0;
+	}
+	int found = 0;
+	pthread_mutex_lock(&file_index_lock);
+	index_node_type* node = find_node(normalized_path);
+	if(node != NULL) {
+		copy_entry(node, entry);
+		found = 1;
+	}
+	pthread_mutex_unlock(&file_index_lock);
+	return found;
+}
+
+int file_index_find_content(const unsigned char hash[SHA256_HASH_SIZE], uint64_t size, char* path, size_t path_size) {
+	int found = 0;
+	pthread_mutex_lock(&file_index_lock);
+	if(bucket_count != 0) {
+		index_node_type* node;
+		for(node = content_buckets[get_content_bucket(hash, bucket_count)]; node != NULL; node = node->next_with_content) {
+			if(node->size == size && memcmp(node->hash, hash, SHA256_HASH_SIZE) == 0 && strlen(node->path) < path_size) {
+				strcpy(path, node->path);
+				found = 1;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&file_index_lock);
+	return found;
+}
+
+int file_index_list_directory(const char* path, file_index_entry_type** entries, size_t* count) {
+	char normalized_path[PATH_MAX];
+	if(normalize_path(path, normalized_path, sizeof(normalized_path)) == -1) {
+		return 0;
+	}
+	pthread_mutex_lock(&file_index_lock);
+	index_node_type* node = find_node(normalized_path);
+	if(node == NULL || node->type != 'D') {
+		pthread_mutex_unlock(&file_index_lock);
+		return 0;
+	}
+	size_t child_count = 0;
+	index_node_type* child;
+	for(child = node->first_child; child != NULL; child = child->next_sibling) {
+		child_count++;
+	}
+	*entries = (file_index_entry_type*)malloc(child_count * sizeof(file_index_entry_type) + 1);
+	size_t i = 0;
+	for(child = node->first_child; child != NULL; child = child->next_sibling) {
+		copy_entry(child, &(*entries)[i++]);
+	}
+	*count = child_count;
+	pthread_mutex_unlock(&file_index_lock);
+	// sorting is done outside of the lock, the entries are our own copy
+	qsort(*entries, child_count, sizeof(file_index_entry_type), compare_entries_by_name);
+	return 1;
+}
+
+int file_index_get_directory_generation(const char* path, uint64_t* generation) {
+	char normalized_path[PATH_MAX];
+	if(normalize_path(path, normalized_path, sizeof(normalized_path)) == -1) {
+		return 0;
+	}
+	int found = 0;
+	pthread_mutex_lock(&file_index_lock);
+	index_node_type* node = find_node(normalized_path);
+	if(node != NULL && node->type == 'D') {
+		*generation = node->generation;
+		found = 1;
+	}
+	pthread_mutex_unlock(&file_index_lock);
+	return found;
+}
+
+int file_index_mark_synced(const char* path, const unsigned char hash[SHA256_HASH_SIZE]) {
+	char normalized_path[PATH_MAX];
+	if(normalize_path(path, normalized_path, sizeof(normalized_path)) == -1) {
+		return 0;
+	}
+	int marked = 0;
+	pthread_mutex_lock(&file_index_lock);
+	index_node_type* node = find_node(normalized_path);
+	// if the file changed in the meantime the new version was never synced
+	if(node != NULL && node->type == 'F' && memcmp(node->hash, hash, SHA256_HASH_SIZE) == 0) {
+		if(memcmp(node->synced_hash, hash, SHA256_HASH_SIZE) != 0) {
+			memcpy(node->synced_hash, hash, SHA256_HASH_SIZE);
+			append_record(node, node->path, RECORD_OPERATION_PUT);
+			// the synced hash is part of the listing of the parent
+			mark_changed(node->parent);
+		}
+		marked = 1;
+	}
+	pthread_mutex_unlock(&file_index_lock);
+	return marked;
+}
+
+uint64_t file_index_get_generation() {
+	pthread_mutex_lock(&file_index_lock);
+	uint64_t generation = index_generation;
+	pthread_mutex_unlock(&file_index_lock);
+	return generation;
+}
+
+uint64_t file_index_get_root_hash(unsigned char hash[SHA256_HASH_SIZE]) {
+	pthread_mutex_lock(&file_index_lock);
+	index_node_type* root = find_node("/");
+	if(root != NULL) {
+		update_merkle_hash(root);
+		memcpy(hash, root->merkle_hash, SHA256_HASH_SIZE);
+	} else {
+		memset(hash, 0, SHA256_HASH_SIZE);
+	}
+	uint64_t generation = index_generation;
+	pthread_mutex_unlock(&file_index_lock);
+	return generation;
+}
+
+void file_index_free() {
+	pthread_mutex_lock(&file_index_lock);
+	compact_log();
+	if(log_file != -1) {
+		close(log_file);
+		log_file = -1;
+	}
+	index_node_type* root = find_node("/");
+	if(root != NULL) {
+		remove_node(root);
+	}
+	free(buckets);
+	buckets = NULL;
+	free(content_buckets);
+	content_buckets = NULL;
+	bucket_count = 0;
+	pthread_mutex_unlock(&file_index_lock);
+}
+
+// MODULE SCOPED FUNTCIONS BEGIN
+
+// appends a record to the log and compacts it if there are too many superfluous records
+// MUST BE CALLED WITH THE LOCK HELD
+void append_record(index_node_type* node, const char* path, uint8_t operation) {
+	if(log_file == -1) {
+		return;
+	}
+	if(write_record(log_file, node, path, operation) == -1) {
+		LOGE("write %s\n", strerror(errno));
+		return;
+	}
+	log_record_count++;
+	if(log_record_count > 2 * node_count + COMPACTION_MINIMUM_RECORDS) {
+		compact_log();
+	}
+}
+
+// writes all nodes to a new log file and replaces the old one with it
+// MUST BE CALLED WITH THE LOCK HELD
+void compact_log() {
+	char temp_path[PATH_MAX];
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", FILE_INDEX_PATH);
+	int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(fd == -1) {
+		LOGE("open %s %s\n", temp_path, strerror(errno));
+		return;
+	}
+	if(write(fd, INDEX_MAGIC, INDEX_MAGIC_SIZE) != INDEX_MAGIC_SIZE) {
+		LOGE("write %s\n", strerror(errno));
+		close(fd);
+		return;
+	}
+	// the nodes are written parents first so they can be replayed in order
+	index_node_type* root = find_node("/");
+	if(root != NULL) {
+		write_node_records(fd, root);
+	}
+	if(rename(temp_path, FILE_INDEX_PATH) != 0) {
+		LOGE("rename %s\n", strerror(errno));
+		close(fd);
+		return;
+	}
+	if(log_file != -1) {
+		close(log_file);
+	}
+	log_file = fd;
+	log_record_count = node_count;
+}
+
+int compare_entries_by_name(const void* a, const void* b) {
+	return strcmp(((const file_index_entry_type*)a)->name, ((const file_index_entry_type*)b)->name);
+}
+
+int compare_nodes_by_name(const void* a, const void* b) {
+	return strcmp((*(index_node_type* const*)a)->name, (*(index_node_type* const*)b)->name);
+}
+
+void copy_entry(index_node_type* node, file_index_entry_type* entry) {
+	memset(entry, 0, sizeof(file_index_entry_type));
+	strncpy(entry->name, node->name, NAME_MAX);
+	entry->type = node->type;
+	entry->mode = node->mode;
+	entry->size = node->size;
+	entry->mtime_ns = node->mtime_ns;
+	entry->inode = node->inode;
+	entry->generation = node->generation;
+	if(node->type == 'D') {
+		update_merkle_hash(node);
+		memcpy(entry->hash, node->merkle_hash, SHA256_HASH_SIZE);
+	} else {
+		memcpy(entry->hash, node->hash, SHA256_HASH_SIZE);
+		memcpy(entry->synced_hash, node->synced_hash, SHA256_HASH_SIZE);
+	}
+}
+
+// the content hash is already evenly distributed, so its first bytes are used as they are
+size_t get_content_bucket(const unsigned char hash[SHA256_HASH_SIZE], size_t count) {
+	uint64_t value;
+	memcpy(&value, hash, sizeof(value));
+	return value & (count - 1);
+}
+
+// MUST BE CALLED WITH THE LOCK HELD
+index_node_type* find_node(const char* path) {
+	if(bucket_count == 0) {
+		return NULL;
+	}
+	uint64_t path_hash = get_string_hash(path);
+	index_node_type* node;
+	for(node = buckets[path_hash & (bucket_count - 1)]; node != NULL; node = node->next_in_bucket) {
+		if(node->path_hash == path_hash && strcmp(node->path, path) == 0) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+int hash_file(const char* local_path, unsigned char hash[SHA256_HASH_SIZE]) {
+	int fd = open(local_path, O_RDONLY);
+	if(fd == -1) {
+		LOGD("open %s %s\n", local_path, strerror(errno));
+		return -1;
+	}
+	sha256_context_type context;
+	sha256_init(&context);
+	char buffer[65536];
+	ssize_t read_bytes;
+	while((read_bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+		sha256_update(&context, buffer, read_bytes);
+	}
+	close(fd);
+	if(read_bytes == -1) {
+		LOGD("read %s %s\n", local_path, strerror(errno));
+		return -1;
+	}
+	sha256_final(&context, hash);
+	return 0;
+}
+
+// this is called by the tree scanner for every directory, possibly from many threads at once
+// user_data points to the recursive flag of scan_directory()
+void index_directory(const char* path, const struct stat* info, tree_scanner_entry_type* entries, size_t entry_count, void* user_data) {
+	int recursive = *(int*)user_data;
+	char child_path[PATH_MAX];
+	size_t i;
+
+	pthread_mutex_lock(&file_index_lock);
+	unsigned int scan_stamp = ++current_scan_stamp;
+	// the directory itself keeps the stamp of its parent scan
+	index_node_type* node = find_node(path);
+	unsigned int own_stamp = node != NULL ? node->scan_stamp : 0;
+	unsigned char empty_hash[SHA256_HASH_SIZE] = { 0 };
+	node = put_node(path, 'D', info->st_mode & 07777, 0, stat_mtime_ns(info), info->st_ino, empty_hash, own_stamp, 1);
+	if(node == NULL) {
+		pthread_mutex_unlock(&file_index_lock);
+		for(i = 0; i < entry_count; i++) {
+			entries[i].descend = 0;
+		}
+		return;
+	}
+	// subdirectories are indexed when the tree scanner reports them, here we only decide whether it has to
+	for(i = 0; i < entry_count; i++) {
+		if(!S_ISDIR(entries[i].info.st_mode)) {
+			continue;
+		}
+		if(join_path(path, entries[i].name, child_path, sizeof(child_path)) == -1) {
+			entries[i].descend = 0;
+			continue;
+		}
+		index_node_type* child = find_node(child_path);
+		int is_new = child == NULL || child->type != 'D';
+		if(child != NULL) {
+			child->scan_stamp = scan_stamp;
+		} else {
+			// a new directory has to exist before the sweep below, its contents follow later
+			put_node(child_path, 'D', entries[i].info.st_mode & 07777, 0, stat_mtime_ns(&entries[i].info), entries[i].info.st_ino, empty_hash, scan_stamp, 1);
+		}
+		entries[i].descend = recursive || is_new;
+	}
+	pthread_mutex_unlock(&file_index_lock);
+
+	// files are hashed without holding the lock
+	for(i = 0; i < entry_count; i++) {
+		if(S_ISREG(entries[i].info.st_mode) && !local_file_is_temporary(entries[i].name) && join_path(path, entries[i].name, child_path, sizeof(child_path)) == 0) {
+			index_file(child_path, &entries[i].info, scan_stamp);
+		}
+	}
+
+	// everything that was not seen during this scan does not exist anymore
+	pthread_mutex_lock(&file_index_lock);
+	node = find_node(path);
+	if(node != NULL) {
+		index_node_type* child = node->first_child;
+		while(child != NULL) {
+			index_node_type* saved_next = child->next_sibling;
+			if(child->scan_stamp != scan_stamp) {
+				append_record(NULL, child->path, RECORD_OPERATION_REMOVE);
+				remove_node(child);
+			}
+			child = saved_next;
+		}
+	}
+	pthread_mutex_unlock(&file_index_lock);
+}
+
+// makes sure a regular file is indexed with an up to date hash
+// the hash is calculated without holding the lock so other threads are not blocked by large files
+// returns 1 if the entry changed, otherwise 0
+int index_file(const char* path, const struct stat* info, unsigned int scan_stamp) {
+	pthread_mutex_lock(&file_index_lock);
+	index_node_type* node = find_node(path);
+	if(node != NULL && node->type == 'F' && node->size == (uint64_t)info->st_size && node->mtime_ns == stat_mtime_ns(info) && node->inode == (uint64_t)info->st_ino) {
+		// the file did not change so we trust the stored hash
+		if(scan_stamp != 0) {
+			node->scan_stamp = scan_stamp;
+		}
+		if(node->mode != (info->st_mode & 07777)) {
+			put_node(path, 'F', info->st_mode & 07777, node->size, node->mtime_ns, node->inode, node->hash, scan_stamp, 1);
+		}
+		pthread_mutex_unlock(&file_index_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&file_index_lock);
+
+	char local_path[PATH_MAX];
+	snprintf(local_path, sizeof(local_path), "%s%s", BASE_PATH, path);
+	unsigned char hash[SHA256_HASH_SIZE];
+	if(hash_file(local_path, hash) == -1) {
+		return 0;
+	}
+	pthread_mutex_lock(&file_index_lock);
+	put_node(path, 'F', info->st_mode & 07777, info->st_size, stat_mtime_ns(info), info->st_ino, hash, scan_stamp, 1);
+	pthread_mutex_unlock(&file_index_lock);
+	return 1;
+}
+
+// builds directory + "/" + name without doubling the slash for the root directory
+int join_path(const char* directory, const char* name, char* buffer, size_t buffer_size) {
+	int length = snprintf(buffer, buffer_size, "%s%s%s", directory, strcmp(directory, "/") == 0 ? "" : "/", name);
+	if(length < 0 || length >= buffer_size) {
+		return -1;
+	}
+	return 0;
+}
+
+// adds a file to the content hash table, directories are not added
+// MUST BE CALLED WITH THE LOCK HELD
+void link_content(index_node_type* node) {
+	if(node->type != 'F') {
+		return;
+	}
+	size_t bucket = get_content_bucket(node->hash, bucket_count);
+	node->next_with_content = content_buckets[bucket];
+	content_buckets[bucket] = node;
+}
+
+// invalidates the listings and the merkle hashes of a directory and all its parents
+// the parents have to get the new generation as well, because their listings contain the merkle hashes of their children
+// MUST BE CALLED WITH THE LOCK HELD
+void mark_changed(index_node_type* directory) {
+	// directories take the generation of the whole index, so a generation is never reused, not even by a recreated directory
+	uint64_t generation = ++index_generation;
+	index_node_type* iterator;
+	for(iterator = directory; iterator != NULL; iterator = iterator->parent) {
+		iterator->generation = generation;
+		iterator->merkle_dirty = 1;
+	}
+}
+
+// removes duplicate and trailing slashes and makes sure the path starts with a slash
+// paths containing ".." are rejected so nobody can escape BASE_PATH
+int normalize_path(const char* path, char* buffer, size_t buffer_size) {
+	size_t index = 0;
+	const char* p = path;
+	buffer[index++] = '/';
+	while(*p) {
+		if(*p == '/') {
+			p++;
+			continue;
+		}
+		// p is at the start of a path component
+		const char* component_end = strchr(p, '/');
+		size_t component_length = component_end == NULL ? strlen(p) : (size_t)(component_end - p);
+		if((component_length == 2 && strncmp(p, "..", 2) == 0) || (component_length == 1 && *p == '.')) {
+			return -1;
+		}
+		if(index > 1) {
+			buffer[index++] = '/';
+		}
+		if(index + component_length + 1 >= buffer_size) {
+			return -1;
+		}
+		memcpy(buffer + index, p, component_length);
+		index += component_length;
+		p += component_length;
+	}
+	buffer[index] = 0;
+	return 0;
+}
+
+// inserts or updates a node, missing parent directories are looked up in the file system
+// MUST BE CALLED WITH THE LOCK HELD
+index_node_type* put_node(const char* path, char type, uint32_t mode, uint64_t size, int64_t mtime_ns, uint64_t inode, const unsigned char hash[SHA256_HASH_SIZE], unsigned int scan_stamp, int write_log) {
+	index_node_type* node = find_node(path);
+	if(node != NULL && node->type != type) {
+		// a file was replaced by a directory or the other way round
+		if(write_log) {
+			append_record(NULL, path, RECORD_OPERATION_REMOVE);
+		}
+		remove_node(node);
+		node = NULL;
+	}
+	int is_new = node == NULL;
+	if(is_new) {
+		index_node_type* parent = NULL;
+		if(strcmp(path, "/") != 0) {
+			char parent_path[PATH_MAX];
+			strncpy(parent_path, path, sizeof(parent_path) - 1);
+			parent_path[sizeof(parent_path) - 1] = 0;
+			char* last_slash = strrchr(parent_path, '/');
+			if(last_slash == parent_path) {
+				last_slash[1] = 0;
+			} else {
+				*last_slash = 0;
+			}
+			parent = find_node(parent_path);
+			if(parent == NULL && write_log) {
+				char local_path[PATH_MAX];
+				struct stat info;
+				if(snprintf(local_path, sizeof(local_path), "%s%s", BASE_PATH, parent_path) >= sizeof(local_path)) {
+					LOGW("path too long: %s\n", parent_path);
+				} else if(lstat(local_path, &info) == 0 && S_ISDIR(info.st_mode)) {
+					unsigned char empty_hash[SHA256_HASH_SIZE] = { 0 };
+					parent = put_node(parent_path, 'D', info.st_mode & 07777, 0, stat_mtime_ns(&info), info.st_ino, empty_hash, scan_stamp, write_log);
+				}
+			}
+			if(parent == NULL || parent->type != 'D') {
+				LOGD("parent of %s is not indexed\n", path);
+				return NULL;
+			}
+		}
+		node = (index_node_type*)malloc(sizeof(index_node_type));
+		memset(node, 0, sizeof(index_node_type));
+		node->path = strdup(path);
+		node->name = strrchr(node->path, '/') + 1;
+		node->path_hash = get_string_hash(path);
+		node->type = type;
+		node->parent = parent;
+		node->merkle_dirty = 1;
+		if(parent != NULL) {
+			node->next_sibling = parent->first_child;
+			if(parent->first_child != NULL) {
+				parent->first_child->previous_sibling = node;
+			}
+			parent->first_child = node;
+		}
+		// grow the hash table so the chains stay short
+		if(node_count + 1 > bucket_count) {
+			size_t new_bucket_count = bucket_count == 0 ? INITIAL_BUCKET_COUNT : bucket_count * 2;
+			index_node_type** new_buckets = (index_node_type**)calloc(new_bucket_count, sizeof(index_node_type*));
+			size_t i;
+			for(i = 0; i < bucket_count; i++) {
+				index_node_type* iterator = buckets[i];
+				while(iterator != NULL) {
+					index_node_type* saved_next = iterator->next_in_bucket;
+					size_t bucket = iterator->path_hash & (new_bucket_count - 1);
+					iterator->next_in_bucket = new_buckets[bucket];
+					new_buckets[bucket] = iterator;
+					iterator = saved_next;
+				}
+			}
+			free(buckets);
+			buckets = new_buckets;
+			index_node_type** new_content_buckets = (index_node_type**)calloc(new_bucket_count, sizeof(index_node_type*));
+			for(i = 0; i < bucket_count; i++) {
+				index_node_type* iterator = content_buckets[i];
+				while(iterator != NULL) {
+					index_node_type* saved_next = iterator->next_with_content;
+					size_t bucket = get_content_bucket(iterator->hash, new_bucket_count);
+					iterator->next_with_content = new_content_buckets[bucket];
+					new_content_buckets[bucket] = iterator;
+					iterator = saved_next;
+				}
+			}
+			free(content_buckets);
+			content_buckets = new_content_buckets;
+			bucket_count = new_bucket_count;
+		}
+		size_t bucket = node->path_hash & (bucket_count - 1);
+		node->next_in_bucket = buckets[bucket];
+		buckets[bucket] = node;
+		node_count++;
+	} else if(node->mode == mode && node->size == size && node->mtime_ns == mtime_ns && node->inode == inode && memcmp(node->hash, hash, SHA256_HASH_SIZE) == 0) {
+		// nothing changed so there is nothing to log
+		if(scan_stamp != 0) {
+			node->scan_stamp = scan_stamp;
+		}
+		return node;
+	}
+	if(!is_new) {
+		unlink_content(node);
+	}
+	node->mode = mode;
+	node->size = size;
+	node->mtime_ns = mtime_ns;
+	node->inode = inode;
+	memcpy(node->hash, hash, SHA256_HASH_SIZE);
+	link_content(node);
+	if(is_new) {
+		// until we know better we assume that the peers have the version we see first
+		memcpy(node->synced_hash, hash, SHA256_HASH_SIZE);
+	}
+	if(node->parent != NULL) {
+		mark_changed(node->parent);
+	}
+	if(scan_stamp != 0) {
+		// a stamp of 0 means the update did not come from a directory scan
+		node->scan_stamp = scan_stamp;
+	}
+	if(write_log) {
+		append_record(node, node->path, RECORD_OPERATION_PUT);
+	}
+	return node;
+}
+
+// removes a node and all its children
+// MUST BE CALLED WITH THE LOCK HELD
+void remove_node(index_node_type* node) {
+	while(node->first_child != NULL) {
+		remove_node(node->first_child);
+	}
+	// unlink from the parent directory
+	if(node->previous_sibling != NULL) {
+		node->previous_sibling->next_sibling = node->next_sibling;
+	} else if(node->parent != NULL) {
+		node->parent->first_child = node->next_sibling;
+	}
+	if(node->next_sibling != NULL) {
+		node->next_sibling->previous_sibling = node->previous_sibling;
+	}
+	if(node->parent != NULL) {
+		mark_changed(node->parent);
+	}
+	unlink_content(node);
+	// unlink from the hash table
+	index_node_type** link = &buckets[node->path_hash & (bucket_count - 1)];
+	while(*link != node) {
+		link = &(*link)->next_in_bucket;
+	}
+	*link = node->next_in_bucket;
+	node_count--;
+	free(node->path);
+	free(node);
+}
+
+// MUST BE CALLED WITH THE LOCK HELD
+void replay_log(const char* data, size_t size) {
+	size_t offset = 0;
+	while(offset + sizeof(index_record_type) <= size) {
+		index_record_type record;
+		memcpy(&record, data + offset, sizeof(record));
+		if(offset + sizeof(record) + record.path_length > size || record.path_length >= PATH_MAX) {
+			// a truncated record at the end happens if we crashed while writing, just ignore it
+			LOGW("index log is truncated\n");
+			break;
+		}
+		char path[PATH_MAX];
+		memcpy(path, data + offset + sizeof(record), record.path_length);
+		path[record.path_length] = 0;
+		offset += sizeof(record) + record.path_length;
+
+		if(record.operation == RECORD_OPERATION_PUT) {
+			index_node_type* node = put_node(path, record.type, record.mode, record.size, record.mtime_ns, record.inode, record.hash, 0, 0);
+			if(node != NULL) {
+				memcpy(node->synced_hash, record.synced_hash, SHA256_HASH_SIZE);
+			}
+		} else if(record.operation == RECORD_OPERATION_REMOVE) {
+			index_node_type* node = find_node(path);
+			if(node != NULL) {
+				remove_node(node);
+			}
+		} else {
+			LOGW("index log contains an invalid record\n");
+			break;
+		}
+	}
+}
+
+// indexes a directory and its contents
+// if recursive is 0 only subdirectories that are not yet indexed are descended into
+void scan_directory(const char* path, int recursive) {
+	// full scans can be huge so they use all cores, single directories are scanned in the calling thread
+	tree_scanner_scan(BASE_PATH, path, recursive ? 0 : 1, index_directory, &recursive);
+}
+
+int64_t stat_mtime_ns(const struct stat* info) {
+	return (int64_t)info->st_mtim.tv_sec * 1000000000LL + info->st_mtim.tv_nsec;
+}
+
+// MUST BE CALLED WITH THE LOCK HELD
+void unlink_content(index_node_type* node) {
+	if(node->type != 'F') {
+		return;
+	}
+	index_node_type** link;
+	for(link = &content_buckets[get_content_bucket(node->hash, bucket_count)]; *link != NULL; link = &(*link)->next_with_content) {
+		if(*link == node) {
+			*link = node->next_with_content;
+			return;
+		}
+	}
+}
+
+// recalculates the merkle hash of a directory if something below it changed
+// the hash covers type, name, size and content hash of every child so equal trees have equal hashes
+// MUST BE CALLED WITH THE LOCK HELD
+void update_merkle_hash(index_node_type* node) {
+	if(node->type != 'D' || !node->merkle_dirty) {
+		return;
+	}
+	size_t child_count = 0;
+	index_node_type* child;
+	for(child = node->first_child; child != NULL; child = child->next_sibling) {
+		update_merkle_hash(child);
+		child_count++;
+	}
+	// the children have to be hashed in a defined order, so we sort them by name
+	index_node_type** children = (index_node_type**)malloc(child_count * sizeof(index_node_type*) + 1);
+	size_t i = 0;
+	for(child = node->first_child; child != NULL; child = child->next_sibling) {
+		children[i++] = child;
+	}
+	qsort(children, child_count, sizeof(index_node_type*), compare_nodes_by_name);
+	sha256_context_type context;
+	sha256_init(&context);
+	for(i = 0; i < child_count; i++) {
+		unsigned char size_buffer[8];
+		int byte;
+		for(byte = 0; byte < 8; byte++) {
+			size_buffer[byte] = (unsigned char)(children[i]->size >> (56 - 8 * byte));
+		}
+		sha256_update(&context, &children[i]->type, 1);
+		sha256_update(&context, children[i]->name, strlen(children[i]->name) + 1);
+		sha256_update(&context, size_buffer, sizeof(size_buffer));
+		sha256_update(&context, children[i]->type == 'D' ? children[i]->merkle_hash : children[i]->hash, SHA256_HASH_SIZE);
+	}
+	sha256_final(&context, node->merkle_hash);
+	free(children);
+	node->merkle_dirty = 0;
+}
+
+// writes a node and all its children to the given file, parents first
+void write_node_records(int fd, index_node_type* node) {
+	if(write_record(fd, node, node->path, RECORD_OPERATION_PUT) == -1) {
+		LOGE("write %s\n", strerror(errno));
+		return;
+	}
+	index_node_type* child;
+	for(child = node->first_child; child != NULL; child = child->next_sibling) {
+		write_node_records(fd, child);
+	}
+}
+
+int write_record(int fd, index_node_type* node, const char* path, uint8_t operation) {
+	char buffer[sizeof(index_record_type) + PATH_MAX];
+	index_record_type record;
+	memset(&record, 0, sizeof(record));
+	record.operation = operation;
+	record.path_length = strlen(path);
+	if(node != NULL) {
+		record.type = node->type;
+		record.mode = node->mode;
+		record.size = node->size;
+		record.mtime_ns = node->mtime_ns;
+		record.inode = node->inode;
+		memcpy(record.hash, node->hash, SHA256_HASH_SIZE);
+		memcpy(record.synced_hash, node->synced_hash, SHA256_HASH_SIZE);
+	}
+	memcpy(buffer, &record, sizeof(record));
+	memcpy(buffer + sizeof(record), path, record.path_length);
+	size_t length = sizeof(record) + record.path_length;
+	if(write(fd, buffer, length) != (ssize_t)length) {
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,162 @@
+/**
+ * @file file_index.h
+ * @brief This module keeps a persistent index of all files in BASE_PATH.
+ *
+ * For every file and directory below BASE_PATH the index stores the size, the modification time, the inode
+ * and (for files) a SHA-256 hash of the contents. The index is kept in memory and every change is appended to a
+ * log file in STATE_PATH, so the index can be loaded on startup without walking or hashing the whole tree. When
+ * the tree is scanned the stored hash is trusted as long as size, modification time and inode did not change.
+ * The log is compacted periodically so it does not grow without bound.
+ *
+ * Every directory has a change generation that changes whenever anything below it changes and a
+ * merkle hash over its contents. Both can be used to find out cheaply whether anything changed, e.g. to validate
+ * cached listings or to compare whole trees with other peers. Merkle hashes are only recalculated when they are
+ * requested and only for directories below which something changed.
+ *
+ * For every file the index also remembers the content hash of the last version that was synced with a peer. If
+ * both peers remember the same version it is the common ancestor of both sides when a file is compared, so it
+ * tells whether the local file, the remote file or both changed since then. A file that shows up in the index for
+ * the first time starts out with its current hash.
+ *
+ * All paths passed to this module are relative to BASE_PATH and start with a '/', e.g. "/sub1/file.txt". The
+ * root directory is "/". All functions are thread safe.
+ */
+
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/// A copy of a single index entry
+typedef struct {
+	char name[NAME_MAX + 1]; //!< The name of the file or directory without its parent path
+	char type; //!< 'F' for regular files, 'D' for directories
+	uint32_t mode; //!< The permission bits of the file
+	uint64_t size; //!< The size of the file in bytes, 0 for directories
+	int64_t mtime_ns; //!< The modification time in nanoseconds since the epoch
+	uint64_t inode; //!< The inode number, used to detect replaced files
+	unsigned char hash[SHA256_HASH_SIZE]; //!< The SHA-256 hash of the file contents, for directories the merkle hash of the directory contents
+	uint64_t generation; //!< For directories: changes whenever anything below it changes, a value is never used twice in the whole index
+	unsigned char synced_hash[SHA256_HASH_SIZE]; //!< For files: the content hash of the last version that was synced with a peer, zero for directories
+} file_index_entry_type;
+
+/**
+ * @brief This function initializes the mutex of the file index. This should be called before first usage
+ */
+void initialize_file_index_lock();
+
+/**
+ * @brief When the file index is not needed anymore its mutex should be destroyed by calling this function.
+ */
+void destroy_file_index_lock();
+
+/**
+ * @brief Loads the index from its log file in STATE_PATH.
+ *
+ * This only replays the log, the file system is not touched. Call file_index_scan() afterwards to pick up
+ * changes that happened while the application was not running.
+ * @return The count of loaded entries or -1 if no usable index was found.
+ */
+int file_index_load();
+
+/**
+ * @brief Walks BASE_PATH and brings the index up to date.
+ *
+ * Files whose size, modification time and inode match the index keep their stored hash, all other files are hashed.
+ * Entries that do not exist anymore are removed.
+ */
+void file_index_scan();
+
+/**
+ * @brief Brings a single path up to date.
+ *
+ * If the path does not exist anymore it is removed from the index (including all children if it was a directory).
+ * For directories the direct children are rescanned and new subdirectories are added including their contents.
+ * @param path The path relative to BASE_PATH
+ */
+void file_index_update_path(const char* path);
+
+/**
+ * @brief Rescans the direct children of a directory.
+ *
+ * Unlike file_index_update_path() subdirectories are only descended into if they were not indexed before.
+ * @param path The path of the directory relative to BASE_PATH
+ */
+void file_index_rescan_directory(const char* path);
+
+/**
+ * @brief Rescans the direct children of a directory if its modification time changed since it was indexed.
+ * @param path The path of the directory relative to BASE_PATH
+ */
+void file_index_refresh_directory(const char* path);
+
+/**
+ * @brief Looks up a single path.
+ * @param path The path relative to BASE_PATH
+ * @param entry A memory location the entry is copied to
+ * @return 1 if the path is in the index. Otherwise 0 is returned.
+ */
+int file_index_lookup(const char* path, file_index_entry_type* entry);
+
+/**
+ * @brief Finds a file with the given contents, e.g. to copy it instead of downloading a file that moved.
+ *
+ * The file is only known to have these contents as long as its size and modification time match the index.
+ * @param hash The content hash
+ * @param size The size in bytes, it has to match as well
+ * @param path Receives the path of the file relative to BASE_PATH
+ * @param path_size The size of @p path, PATH_MAX is enough
+ * @return 1 if a file was found. Otherwise 0 is returned.
+ */
+int file_index_find_content(const unsigned char hash[SHA256_HASH_SIZE], uint64_t size, char* path, size_t path_size);
+
+/**
+ * @brief Gets all direct children of a directory sorted by name.
+ * @param path The path of the directory relative to BASE_PATH
+ * @param entries Receives an array of entries allocated with malloc, the caller has to free it
+ * @param count Receives the count of entries
+ * @return 1 if the path is a directory in the index. Otherwise 0 is returned and nothing is allocated.
+ */
+int file_index_list_directory(const char* path, file_index_entry_type** entries, size_t* count);
+
+/**
+ * @brief Gets the change generation of a single directory without calculating any hashes.
+ *
+ * This is cheaper than file_index_lookup() which has to calculate the merkle hash of the directory.
+ * @param path The path of the directory relative to BASE_PATH
+ * @param generation Receives the change generation of the directory
+ * @return 1 if the path is a directory in the index. Otherwise 0 is returned.
+ */
+int file_index_get_directory_generation(const char* path, uint64_t* generation);
+
+/**
+ * @brief Remembers that a file was synced with a peer, see file_index_entry_type::synced_hash.
+ * @param path The path of the file relative to BASE_PATH
+ * @param hash The content hash both sides agreed on
+ * @return 1 if the file is in the index and still has this content hash. Otherwise 0 is returned and nothing is changed.
+ */
+int file_index_mark_synced(const char* path, const unsigned char hash[SHA256_HASH_SIZE]);
+
+/**
+ * @brief Gets the change generation of the whole index without calculating any hashes.
+ * @return The change generation of the whole index. It is incremented whenever anything in the index changes.
+ */
+uint64_t file_index_get_generation();
+
+/**
+ * @brief Gets the merkle hash of the whole tree.
+ * @param hash A memory location the hash is copied to
+ * @return The change generation of the whole index. It is incremented whenever anything in the index changes.
+ */
+uint64_t file_index_get_root_hash(unsigned char hash[SHA256_HASH_SIZE]);
+
+/**
+ * @brief Compacts the log, closes it and frees all memory held by the index.
+ */
+void file_index_free();
+
+#endif
@@ -1,10 +1,17 @@
+#define _GNU_SOURCE // for SEEK_DATA and SEEK_HOLE
+
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include "defines.h"
+#include "file_index.h"
 #include "logger.h"
 #include "shutdown.h"
 #include "util.h"
@@ -13,6 +20,7 @@
 
 // helper functions for this module
 static void handle_client(int socketfd, char* receive_buffer, size_t received_bytes);
+static int send_extents(int socketfd, int fd, uint64_t size);
 
 // static variables for this module
 static message_queue_type* message_queue = NULL;
@@ -87,18 +95,12 @@ void* file_server_thread(void* user_data) {
             } else {
                 // this is a regular client socket that either closed the connection or wants something from us
                 char receive_buffer[1024];
-                int received_bytes = tcp_message_receive(socketfd, receive_buffer, sizeof(receive_buffer - 1), 0);
-                if(received_bytes == -1) {
-                    // error on recv
+                int received_bytes = tcp_message_receive(socketfd, receive_buffer, sizeof(receive_buffer) - 1, 5.0);
+                if(received_bytes <= 0) {
+                    // error on recv, connection closed by remote or an empty request
                     // if this happens we want to close this socket and remove it from the master_fds
-                    LOGD("recv %s\n", strerror(errno));
-                    FD_CLR(socketfd, &master_read_set);
-                    continue;
-                }
-                if(received_bytes == 0) {
-                    // connection closed by remote
-                	LOGD("file server received 0 bytes...\n");
                     FD_CLR(socketfd, &master_read_set);
+                    close(socketfd);
                     continue;
                 }
                 FD_CLR(socketfd, &master_read_set);
@@ -106,7 +108,6 @@ void* file_server_thread(void* user_data) {
                 close(socketfd);
             }
 		}
-		sleep(1);
 	}
 	// cleanup
 	message_queue_free_queue(message_queue);
@@ -119,44 +120,86 @@ void handle_client(int socketfd, char* receive_buffer, size_t received_bytes) {
     receive_buffer[received_bytes] = '>'; // for strtok
     const char* request_id = strtok(receive_buffer, " ");
     char* request_path = strtok(NULL, ">");
-    if(request_id == NULL) {
-    	LOGE("invalid request: %s\n", request_id);
+    if(request_id == NULL || request_path == NULL || (strcmp(request_id, "GET") != 0 && strcmp(request_id, "EXTENTS") != 0)) {
+    	LOGE("invalid request\n");
     	return;
     }
-    char* local_path = malloc(strlen(BASE_PATH) + strlen(request_path) + 1);
-    memcpy(local_path, BASE_PATH, strlen(BASE_PATH));
-    strcpy(local_path + strlen(BASE_PATH), request_path);
-
+    // only indexed files are sent, the index also rejects paths leaving BASE_PATH
+    // if we cannot send the file we just close the connection, any reply would be taken as the file contents
+    file_index_entry_type entry;
+    char local_path[PATH_MAX];
+    if(!file_index_lookup(request_path, &entry) || entry.type != 'F' || snprintf(local_path, sizeof(local_path), "%s%s", BASE_PATH, request_path) >= sizeof(local_path)) {
+    	LOGD("not an indexed file: %s\n", request_path);
+    	return;
+    }
+    int file = open(local_path, O_RDONLY);
     struct stat info;
-    if(lstat(local_path, &info) != 0 || !S_ISREG(info.st_mode)) {
-    	// the path does not point to a file
-    	LOGD("not a file: %s\n", local_path);
-    	char reply[1000];
-        strcpy(reply, "requested invalid directory");
-        if(tcp_message_send(socketfd, reply, strlen(reply), 2.0) <= 0) {
-            LOGD("send %s\n", strerror(errno));
-        }
+    if(file == -1 || fstat(file, &info) != 0 || !S_ISREG(info.st_mode)) {
+    	LOGD("%s could not be opened!\n", local_path);
+    	if(file != -1) {
+    		close(file);
+    	}
+    	return;
+    }
+    // the file is sent straight from the page cache, so it never has to fit into memory
+    int success;
+    if(strcmp(request_id, "EXTENTS") == 0) {
+    	success = send_extents(socketfd, file, info.st_size) > 0;
+    } else {
+    	success = tcp_message_send_file(socketfd, file, 0, info.st_size) > 0;
+    }
+    close(file);
+    if(!success) {
+    	LOGD("sending %s failed\n", local_path);
+    	return;
     }
-    else {
-        char* file_buffer = (char*)malloc(info.st_size);
-        int file = open(local_path, O_RDONLY);
-        if(file == -1) {
-        	LOGD("%s could not be opened!\n", local_path);
-        	free(file_buffer); // avoid memory leaks
-        	close(file);
-        }
-        else if(read(file, file_buffer, info.st_size) != info.st_size) {
-        	// we want to have the whole file in memory
-        	// if this is not possible there is nothing we can do
-        	LOGD("%s could not be read!\n", local_path);
-        	close(file);
-        	free(file_buffer);
-        }
-        // the file is in memory now
-        //LOGD("sending %s\n", file_buffer);
-        if(tcp_message_send(socketfd, file_buffer, info.st_size, 20.0) <= 0) {
-        	LOGD("send_tcp_message failed\n");
-        }
+    // the peer has this version now, if it is the indexed one it is the common ancestor for the next comparison
+    if(entry.size == (uint64_t)info.st_size && entry.mtime_ns == (int64_t)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec) {
+    	file_index_mark_synced(request_path, entry.hash);
     }
-    free(local_path);
+}
+
+// sends the size of a file and all chunks that contain data, see file_server.h
+// returns 1 on success, otherwise 0 or -1
+int send_extents(int socketfd, int fd, uint64_t size) {
+	uint64_t encoded_size = htole64(size);
+	int send_return = tcp_message_send(socketfd, (char*)&encoded_size, sizeof(encoded_size), 0);
+	if(send_return <= 0) {
+		return send_return;
+	}
+	uint64_t offset = 0;
+	while(offset < size) {
+		off_t data_start = lseek(fd, offset, SEEK_DATA);
+		if(data_start == -1 && errno == ENXIO) {
+			// there is only a hole left
+			break;
+		}
+		off_t data_end;
+		if(data_start == -1) {
+			// the file system cannot tell where the holes are, so everything is data
+			data_start = offset;
+			data_end = size;
+		} else {
+			data_end = lseek(fd, data_start, SEEK_HOLE);
+		}
+		if(data_end == -1 || (uint64_t)data_end > size) {
+			data_end = size;
+		}
+		uint64_t chunk_start;
+		for(chunk_start = data_start; chunk_start < (uint64_t)data_end; chunk_start += FILE_CHUNK_MAX_SIZE) {
+			uint64_t chunk_size = data_end - chunk_start < FILE_CHUNK_MAX_SIZE ? data_end - chunk_start : FILE_CHUNK_MAX_SIZE;
+			uint64_t encoded_offset = htole64(chunk_start);
+			send_return = tcp_message_send(socketfd, (char*)&encoded_offset, sizeof(encoded_offset), 0);
+			if(send_return <= 0) {
+				return send_return;
+			}
+			send_return = tcp_message_send_file(socketfd, fd, chunk_start, chunk_size);
+			if(send_return <= 0) {
+				return send_return;
+			}
+		}
+		offset = data_end;
+	}
+	// the end of the file
+	return tcp_message_send(socketfd, "", 0, 0);
 }
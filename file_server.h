@@ -4,7 +4,12 @@
  *
  * This module has its own thread. It is responsible to serve files requested by the file client module. This module works like a seperate process
  * in total isolation from the rest of the application. When a peer requests a file the file server checks if the file is locally present and if so
- * reads it from memory and sends it to the remote peer.
+ * sends it to the remote peer.
+ *
+ * The request "GET <path>" is answered with the whole file as a single message. The request "EXTENTS <path>" is answered with the file size as
+ * a 64 bit little endian number, followed by a pair of messages for every chunk of data: the offset of the chunk as a 64 bit little endian
+ * number and then the data itself, at most FILE_CHUNK_MAX_SIZE bytes. An empty message ends the file. Holes of sparse files are skipped, so a
+ * disk image that is mostly empty only costs the data it actually contains. If the file cannot be sent the connection is closed without a reply.
  */
 
 #ifndef FILE_UPLOAD_H
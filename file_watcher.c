@@ -0,0 +1,334 @@
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+
+#include "broadcast.h"
+#include "defines.h"
+#include "file_index.h"
+#include "local_file.h"
+#include "logger.h"
+#include "manifest.h"
+#include "shutdown.h"
+#include "util.h"
+
+#include "file_watcher.h"
+
+#define WATCH_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+#define EVENT_SETTLE_SECONDS 0.05 // events are collected for this long before the index is updated, so bursts are handled at once
+
+/// A single inotify watch, the watches are stored in an array indexed by the watch descriptor
+typedef struct {
+	char* path; //!< The watched directory relative to BASE_PATH, NULL if the slot is unused
+} watch_type;
+
+// helper functions for this module
+static void add_pending_path(const char* path);
+static void add_watches(const char* path);
+static int compare_strings(const void* a, const void* b);
+static void handle_event(const struct inotify_event* event);
+static void handle_overflow();
+static void process_pending_paths();
+static int read_events();
+static void remove_watch(int watch_descriptor);
+static void remove_watches_below(const char* path);
+
+// static variables for this module
+static message_queue_type* message_queue = NULL;
+static int inotify_fd = -1;
+static int active = 0;
+
+static watch_type* watches = NULL;
+static int watch_capacity = 0;
+
+static char** pending_paths = NULL;
+static size_t pending_count = 0;
+static size_t pending_capacity = 0;
+
+void file_watcher_thread_send_message(message_queue_entry_type* message) {
+	message_queue_push(message_queue, message);
+}
+
+int file_watcher_is_active() {
+	return __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+}
+
+void* file_watcher_thread(void* user_data) {
+	LOGD("started\n");
+	// this has to be called otherwise this thread will not be able to receive any messages
+	message_queue = message_queue_create_queue();
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotify_fd == -1) {
+		LOGE("inotify_init1 %s, local changes are only noticed when directories are listed\n", strerror(errno));
+	} else {
+		// the watches have to be in place before the scan, otherwise we could miss changes in between
+		add_watches("/");
+	}
+	file_index_scan();
+	if(inotify_fd != -1) {
+		__atomic_store_n(&active, 1, __ATOMIC_RELEASE);
+	}
+
+	while(!get_shutdown()) {
+		// handle messages sent by other threads
+		message_queue_entry_type* message;
+		while((message = message_queue_pop(message_queue)) != NULL) {
+			LOGD("received message: %s\n", message->message_id);
+			message_queue_free_message(message);
+		}
+		// the manifest is written here, so the command server only has to send it
+		manifest_refresh_local();
+		if(inotify_fd == -1) {
+			message_queue_wait(message_queue, 1.0);
+			continue;
+		}
+
+		fd_set read_set;
+		FD_ZERO(&read_set);
+		FD_SET(inotify_fd, &read_set);
+		struct timeval timeout;
+		timeout.tv_sec = 1; // block at maximum one second at a time
+		timeout.tv_usec = 0;
+		int select_return = select(inotify_fd + 1, &read_set, NULL, NULL, &timeout);
+		if(select_return == -1) {
+			LOGE("select: %s\n", strerror(errno));
+			continue;
+		}
+		if(select_return == 0) {
+			// timeout
+			continue;
+		}
+		// collect all events of a burst before touching the index
+		while(read_events() > 0) {
+			FD_ZERO(&read_set);
+			FD_SET(inotify_fd, &read_set);
+			timeout.tv_sec = 0;
+			timeout.tv_usec = (int)(EVENT_SETTLE_SECONDS * 1000000);
+			if(select(inotify_fd + 1, &read_set, NULL, NULL, &timeout) <= 0) {
+				break;
+			}
+		}
+		process_pending_paths();
+	}
+
+	// cleanup
+	__atomic_store_n(&active, 0, __ATOMIC_RELEASE);
+	if(inotify_fd != -1) {
+		close(inotify_fd); // this also removes all watches
+		inotify_fd = -1;
+	}
+	int i;
+	for(i = 0; i < watch_capacity; i++) {
+		free(watches[i].path);
+	}
+	free(watches);
+	watches = NULL;
+	watch_capacity = 0;
+	size_t j;
+	for(j = 0; j < pending_count; j++) {
+		free(pending_paths[j]);
+	}
+	free(pending_paths);
+	pending_paths = NULL;
+	pending_count = pending_capacity = 0;
+	message_queue_free_queue(message_queue);
+	message_queue = NULL;
+	LOGD("ended\n");
+	return NULL;
+}
+
+void add_pending_path(const char* path) {
+	if(pending_count == pending_capacity) {
+		pending_capacity = pending_capacity == 0 ? 64 : pending_capacity * 2;
+		pending_paths = (char**)realloc(pending_paths, pending_capacity * sizeof(char*));
+	}
+	pending_paths[pending_count++] = strdup(path);
+}
+
+// watches a directory and all directories below it
+void add_watches(const char* path) {
+	char local_path[PATH_MAX];
+	if(snprintf(local_path, sizeof(local_path), "%s%s", BASE_PATH, path) >= sizeof(local_path)) {
+		return;
+	}
+	int watch_descriptor = inotify_add_watch(inotify_fd, local_path, WATCH_MASK);
+	if(watch_descriptor == -1) {
+		if(errno == ENOSPC) {
+			LOGW("out of inotify watches, changes below %s are not noticed. Consider raising fs.inotify.max_user_watches\n", path);
+		} else if(errno != ENOENT && errno != ENOTDIR) {
+			LOGD("inotify_add_watch %s %s\n", local_path, strerror(errno));
+		}
+		return;
+	}
+	if(watch_descriptor >= watch_capacity) {
+		int new_capacity = watch_capacity == 0 ? 1024 : watch_capacity;
+		while(new_capacity <= watch_descriptor) {
+			new_capacity *= 2;
+		}
+		watches = (watch_type*)realloc(watches, new_capacity * sizeof(watch_type));
+		memset(watches + watch_capacity, 0, (new_capacity - watch_capacity) * sizeof(watch_type));
+		watch_capacity = new_capacity;
+	}
+	free(watches[watch_descriptor].path);
+	watches[watch_descriptor].path = strdup(path);
+
+	DIR* directory = opendir(local_path);
+	if(directory == NULL) {
+		return;
+	}
+	struct dirent* entry;
+	while((entry = readdir(directory)) != NULL) {
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		char child_path[PATH_MAX];
+		if(snprintf(child_path, sizeof(child_path), "%s%s%s", path, strcmp(path, "/") == 0 ? "" : "/", entry->d_name) >= sizeof(child_path)) {
+			continue;
+		}
+		if(entry->d_type == DT_UNKNOWN) {
+			// some file systems do not fill in d_type
+			char child_local_path[PATH_MAX];
+			struct stat info;
+			if(snprintf(child_local_path, sizeof(child_local_path), "%s%s", BASE_PATH, child_path) >= sizeof(child_local_path)) {
+				LOGW("path too long, not watching %s\n", child_path);
+				continue;
+			}
+			if(lstat(child_local_path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+				continue;
+			}
+		} else if(entry->d_type != DT_DIR) {
+			continue;
+		}
+		add_watches(child_path);
+	}
+	closedir(directory);
+}
+
+int compare_strings(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void handle_event(const struct inotify_event* event) {
+	if(event->mask & IN_Q_OVERFLOW) {
+		handle_overflow();
+		return;
+	}
+	if(event->wd < 0 || event->wd >= watch_capacity || watches[event->wd].path == NULL) {
+		return;
+	}
+	if(event->mask & IN_IGNORED) {
+		// the watch was removed because the directory is gone
+		remove_watch(event->wd);
+		return;
+	}
+	watch_type* watch = &watches[event->wd];
+	if(event->len == 0) {
+		// the event is about the watched directory itself
+		add_pending_path(watch->path);
+		return;
+	}
+	if(local_file_is_temporary(event->name)) {
+		// downloads in progress, the final file shows up with IN_MOVED_TO
+		return;
+	}
+	char path[PATH_MAX];
+	if(snprintf(path, sizeof(path), "%s%s%s", watch->path, strcmp(watch->path, "/") == 0 ? "" : "/", event->name) >= sizeof(path)) {
+		return;
+	}
+	if(event->mask & IN_ISDIR) {
+		if(event->mask & IN_MOVED_FROM) {
+			// the watches below a moved directory would report wrong paths from now on
+			remove_watches_below(path);
+		}
+		if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+			add_watches(path);
+		}
+	}
+	add_pending_path(path);
+}
+
+// the kernel dropped events, so we do not know what changed
+// every watched directory is rescanned, then new directories get their watches
+void handle_overflow() {
+	LOGW("inotify event queue overflowed, rescanning\n");
+	// the dropped events could be about any file, and a file changed in place does not change the modification time
+	// of its directory, so the children of every watched directory are checked again
+	// only files whose size, modification time or inode changed are hashed again, so this is mostly stat() calls
+	int i;
+	for(i = 0; i < watch_capacity; i++) {
+		if(watches[i].path != NULL) {
+			file_index_rescan_directory(watches[i].path);
+		}
+	}
+	// new directories might have been created while events were dropped
+	add_watches("/");
+}
+
+void process_pending_paths() {
+	// the same path is often reported many times in one burst so we only update each path once
+	qsort(pending_paths, pending_count, sizeof(char*), compare_strings);
+	char** changed_paths = (char**)malloc(pending_count * sizeof(char*) + 1);
+	size_t changed_count = 0;
+	size_t i;
+	for(i = 0; i < pending_count; i++) {
+		if(i == 0 || strcmp(pending_paths[i], pending_paths[i - 1]) != 0) {
+			uint64_t generation = file_index_get_generation();
+			file_index_update_path(pending_paths[i]);
+			if(file_index_get_generation() != generation) {
+				changed_paths[changed_count++] = pending_paths[i];
+			}
+		}
+	}
+	// the whole burst is pushed to the other peers at once
+	broadcast_changed_paths(changed_paths, changed_count);
+	free(changed_paths);
+	for(i = 0; i < pending_count; i++) {
+		free(pending_paths[i]);
+	}
+	pending_count = 0;
+}
+
+// reads all currently available events and returns how many were read
+int read_events() {
+	char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int event_count = 0;
+	while(1) {
+		ssize_t read_bytes = read(inotify_fd, buffer, sizeof(buffer));
+		if(read_bytes <= 0) {
+			if(read_bytes == -1 && errno != EAGAIN) {
+				LOGE("read %s\n", strerror(errno));
+			}
+			break;
+		}
+		char* p;
+		for(p = buffer; p < buffer + read_bytes; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+			handle_event((struct inotify_event*)p);
+			event_count++;
+		}
+	}
+	return event_count;
+}
+
+void remove_watch(int watch_descriptor) {
+	free(watches[watch_descriptor].path);
+	watches[watch_descriptor].path = NULL;
+}
+
+void remove_watches_below(const char* path) {
+	size_t length = strlen(path);
+	int i;
+	for(i = 0; i < watch_capacity; i++) {
+		if(watches[i].path != NULL && strncmp(watches[i].path, path, length) == 0 && (watches[i].path[length] == 0 || watches[i].path[length] == '/')) {
+			inotify_rm_watch(inotify_fd, i);
+			remove_watch(i);
+		}
+	}
+}
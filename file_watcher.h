@@ -0,0 +1,47 @@
+/**
+ * @file file_watcher.h
+ * @brief This is the file watcher module.
+ *
+ * This module has its own thread. It subscribes to changes of all directories below BASE_PATH with inotify and
+ * updates the file index whenever something changes, so the index (and everything derived from it like listings
+ * and merkle hashes) is always up to date without walking the tree. On startup the thread performs the initial
+ * scan of the tree after all watches are established so no change can slip through in between. Every burst of
+ * changes that actually changed the index is pushed to the known peers, see broadcast_changed_paths().
+ *
+ * If the kernel event queue overflows, the children of every watched directory are checked again, because the
+ * dropped events could have been about any file. The peers learn about those changes from the changed root hash
+ * that is announced with the discovery.
+ *
+ * The thread also keeps the manifest of the local index up to date, see manifest_refresh_local().
+ */
+
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include "message_queue.h"
+
+/**
+ * @brief This is the thread's main function. It is started from the main thread.
+ *
+ * \code{.c}
+ * pthread_create(&file_watcher_thread_id, NULL, file_watcher_thread, (void*)0);
+ * \endcode
+ * @param user_data This parameter can be used to supply user data to the thread
+ */
+void* file_watcher_thread(void* user_data);
+
+/**
+ * @brief This function could be used to send messages to the file watcher thread.
+ *
+ * This is currently not used.
+ * @param message The message's parameters
+ */
+void file_watcher_thread_send_message(message_queue_entry_type* message);
+
+/**
+ * @brief Tells whether the file watcher is running and keeps the file index up to date.
+ * @return 1 if the watcher is active. 0 if it is not (yet) running, in this case the index may be stale.
+ */
+int file_watcher_is_active();
+
+#endif
@@ -0,0 +1,966 @@
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "broadcast.h"
+#include "command_client.h"
+#include "logger.h"
+#include "message_queue.h"
+#include "peer_list.h"
+#include "shutdown.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+#include "gossip.h"
+
+#define MESSAGE_TYPE_PING 20
+#define MESSAGE_TYPE_ACK 21
+#define MESSAGE_TYPE_PING_REQUEST 22 // asks the receiver to ping the member in the packet on behalf of the sender
+#define MESSAGE_TYPE_SYNC 23 // carries the whole member list of the sender, the receiver replies with its own
+#define MESSAGE_TYPE_SYNC_REPLY 24
+
+#define MEMBER_STATUS_ALIVE 1
+#define MEMBER_STATUS_SUSPECT 2
+#define MEMBER_STATUS_DEAD 3
+
+#define GOSSIP_PROBE_INTERVAL_SECONDS 1.0 // one member is pinged per interval
+#define GOSSIP_PROBE_TIMEOUT_SECONDS 0.5 // after this the member is pinged indirectly, the rest of the interval is left for that
+#define GOSSIP_INDIRECT_PROBE_COUNT 3 // how many members are asked to ping a member that did not answer
+#define GOSSIP_SUSPICION_MULTIPLIER 4 // a suspect is declared dead after this many intervals times log(N)
+#define GOSSIP_RETRANSMIT_MULTIPLIER 4 // a change is piggybacked this many times log(N)
+#define GOSSIP_DEAD_RETENTION_SECONDS 60.0 // dead members are kept so old messages do not bring them back
+#define GOSSIP_JOIN_INTERVAL_SECONDS 10.0 // the seeds are pinged this often as long as no member is known
+#define GOSSIP_SYNC_INTERVAL_SECONDS 30.0 // the member lists are exchanged with a random member this often
+#define GOSSIP_ID_POLL_MILLISECONDS 100 // how often to check whether the broadcast discovery has chosen our id
+#define GOSSIP_PACKET_MAX_SIZE 1400 // stay below the usual MTU
+#define GOSSIP_PIGGYBACK_MAX_COUNT 16 // how many updates are piggybacked on a ping or an ack
+#define GOSSIP_INDIRECT_MAX_COUNT 32 // how many indirect pings for other members are remembered at the same time
+#define GOSSIP_SEED_MAX_COUNT 16
+
+/// The header of all gossip packets
+typedef struct {
+	char protocol_id[8]; //!< The protocol id, this must be "P2PFSYNC" otherwise the packet gets discarded
+	unsigned char message_type; //!< One of the MESSAGE_TYPE defines of this module
+	char sender_id[6]; //!< The id of the sender
+	uint32_t incarnation; //!< The incarnation of the sender in network byte order, the packet tells that it is alive
+	uint32_t sequence; //!< Matches acks to pings in network byte order
+} __attribute__((packed)) gossip_header_type;
+
+/// What a node knows about a member, this is piggybacked on the packets
+typedef struct {
+	unsigned char status; //!< One of the MEMBER_STATUS defines
+	char id[6]; //!< The id of the member
+	unsigned char address[16]; //!< The IPv6 address of the member or an IPv4 mapped one, all zero means the sender of the packet
+	uint16_t port; //!< The gossip port of the member in network byte order
+	uint32_t incarnation; //!< The incarnation of the member in network byte order
+} __attribute__((packed)) gossip_update_type;
+
+/// A member of the gossip network, members are identified by their id and their port
+typedef struct {
+	char id[6]; //!< The id of the member
+	struct sockaddr_storage address; //!< The address and gossip port of the member
+	uint32_t incarnation; //!< Only the member itself increments this, to refute a suspicion
+	unsigned char status; //!< One of the MEMBER_STATUS defines
+	unsigned int transmit_count; //!< How often the current status was piggybacked already
+	uint64_t suspicion_timer; //!< The timer that declares the member dead, 0 if it is not suspected
+	struct timeval status_changed; //!< When the status changed last
+} gossip_member_type;
+
+/// The argument of the suspicion timer
+typedef struct {
+	char id[6]; //!< The id of the suspect
+	uint16_t port; //!< The port of the suspect
+	uint32_t incarnation; //!< The incarnation the suspicion is about
+} suspicion_argument_type;
+
+/// A ping that is sent on behalf of another member
+typedef struct {
+	int used; //!< 1 if this entry is in use
+	uint32_t sequence; //!< The sequence of our own ping
+	uint32_t requester_sequence; //!< The sequence the requester waits for
+	struct sockaddr_storage requester_address; //!< Where the ack is forwarded to
+} indirect_ping_type;
+
+// helper functions for this module
+static void add_member(const char id[6], const struct sockaddr_storage* address, uint32_t incarnation, unsigned char status);
+static void add_peer_address(const gossip_member_type* member);
+static void apply_update(const gossip_update_type* update, const char sender_id[6], const struct sockaddr_storage* sender_address);
+static int create_gossip_socket();
+static void decode_address(const gossip_update_type* update, struct sockaddr_storage* address);
+static void encode_member(const gossip_member_type* member, gossip_update_type* update);
+static void encode_self(gossip_update_type* update);
+static int find_member(const char id[6], uint16_t port);
+static int get_destination(const struct sockaddr_storage* address, struct sockaddr_storage* destination, socklen_t* destination_size);
+static unsigned int get_log_scale();
+static uint16_t get_port(const struct sockaddr_storage* address);
+static int get_random_member(int excluded_index);
+static void handle_packet(unsigned char* buffer, int size, struct sockaddr_storage* sender_address);
+static void handle_probe_due();
+static void handle_probe_timeout(uint32_t sequence);
+static void handle_suspicion_timeout(const suspicion_argument_type* argument);
+static int is_zero_address(const unsigned char address[16]);
+static void join();
+static void load_config();
+static void probe_due(void* argument);
+static void probe_timeout(void* argument);
+static void receive_packets();
+static void remove_dead_members();
+static void send_packet(unsigned char message_type, uint32_t sequence, const gossip_update_type* target, const struct sockaddr_storage* address, int receiver_index);
+static void send_sync(unsigned char message_type, const struct sockaddr_storage* address);
+static void set_member_status(gossip_member_type* member, unsigned char status, uint32_t incarnation);
+static void shuffle_members();
+static void suspicion_timeout(void* argument);
+
+static message_queue_type* message_queue = NULL;
+// all the state below is only touched by the gossip thread
+static int gossip_socket = -1;
+static int socket_family = AF_INET6;
+static uint16_t own_port = GOSSIP_PORT;
+static char own_id[6];
+static uint32_t own_incarnation = 0;
+static unsigned int own_transmit_count = 0;
+static gossip_member_type* members = NULL;
+static size_t member_count = 0;
+static size_t member_capacity = 0;
+static size_t probe_position = 0; // the members are probed round robin in a random order
+static uint32_t next_sequence = 1;
+static unsigned int random_seed = 0;
+static struct timeval last_join;
+static struct timeval last_sync;
+static struct sockaddr_storage seeds[GOSSIP_SEED_MAX_COUNT];
+static size_t seed_count = 0;
+static indirect_ping_type indirect_pings[GOSSIP_INDIRECT_MAX_COUNT];
+static size_t next_indirect_ping = 0;
+
+/// The member that is probed in the current interval
+static struct {
+	int active; //!< 1 if a probe was sent in this interval
+	int acked; //!< 1 if an ack arrived, directly or indirectly
+	uint32_t sequence; //!< The sequence of the ping
+	char id[6]; //!< The id of the probed member
+	uint16_t port; //!< The port of the probed member
+} probe;
+
+void gossip_thread_send_message(message_queue_entry_type* message) {
+	message_queue_push(message_queue, message);
+}
+
+void* gossip_thread(void* user_data) {
+	LOGD("started\n");
+
+	// this has to be called otherwise this thread will not be able to receive any messages
+	message_queue = message_queue_create_queue();
+
+	load_config();
+	gossip_socket = create_gossip_socket();
+	if(gossip_socket == -1) {
+		LOGD("no gossip socket could be created, gossip is disabled\n");
+	}
+
+	// members are identified by the same id as the broadcast discovery uses
+	while(!get_shutdown() && !broadcast_get_own_id(own_id)) {
+		usleep(GOSSIP_ID_POLL_MILLISECONDS * 1000);
+	}
+
+	random_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid() ^ own_port;
+	memset(&probe, 0, sizeof(probe));
+	memset(indirect_pings, 0, sizeof(indirect_pings));
+	memset(&last_join, 0, sizeof(last_join));
+	gettimeofday(&last_sync, NULL);
+	if(gossip_socket != -1) {
+		timer_wheel_start(GOSSIP_PROBE_INTERVAL_SECONDS, probe_due, NULL, 0);
+	}
+
+	while(!get_shutdown()) {
+		// handle messages sent by other threads
+		message_queue_entry_type* message;
+		while((message = message_queue_pop(message_queue)) != NULL) {
+			if(strcmp(message->message_id, "probe_due") == 0) {
+				handle_probe_due();
+			} else if(strcmp(message->message_id, "probe_timeout") == 0) {
+				handle_probe_timeout(*(uint32_t*)message->arguments);
+			} else if(strcmp(message->message_id, "suspicion_timeout") == 0) {
+				handle_suspicion_timeout((suspicion_argument_type*)message->arguments);
+			} else {
+				LOGD("received message: %s\n", message->message_id);
+			}
+			message_queue_free_message(message);
+		}
+
+		if(gossip_socket == -1) {
+			message_queue_wait(message_queue, 1.0);
+			continue;
+		}
+		// the timers post their messages to the queue, so select() returns for them as well as for packets
+		fd_set read_set;
+		FD_ZERO(&read_set);
+		FD_SET(gossip_socket, &read_set);
+		int max_fd = gossip_socket;
+		int queue_fd = message_queue_get_fd(message_queue);
+		if(queue_fd != -1) {
+			FD_SET(queue_fd, &read_set);
+			max_fd = queue_fd > max_fd ? queue_fd : max_fd;
+		}
+		struct timeval timeout;
+		timeout.tv_sec = 1; // block at maximum one second at a time
+		timeout.tv_usec = 0;
+		int success = select(max_fd + 1, &read_set, NULL, NULL, &timeout);
+		if(success == -1) {
+			LOGD("select: %s\n", strerror(errno));
+			continue;
+		}
+		if(FD_ISSET(gossip_socket, &read_set)) {
+			receive_packets();
+		}
+	}
+
+	//cleanup
+	if(gossip_socket != -1) {
+		close(gossip_socket);
+		gossip_socket = -1;
+	}
+	free(members);
+	members = NULL;
+	member_count = 0;
+	member_capacity = 0;
+	message_queue_free_queue(message_queue);
+	message_queue = NULL;
+
+	LOGD("ended\n");
+	return NULL;
+}
+
+// MODULE SCOPED FUNTCIONS BEGIN
+
+// a new member starts with its status not transmitted yet, so it is spread right away
+void add_member(const char id[6], const struct sockaddr_storage* address, uint32_t incarnation, unsigned char status) {
+	if(member_count == member_capacity) {
+		size_t new_capacity = member_capacity == 0 ? 16 : member_capacity * 2;
+		gossip_member_type* new_members = (gossip_member_type*)realloc(members, new_capacity * sizeof(gossip_member_type));
+		if(new_members == NULL) {
+			LOGD("realloc failed\n");
+			return;
+		}
+		members = new_members;
+		member_capacity = new_capacity;
+	}
+	gossip_member_type* member = &members[member_count++];
+	memset(member, 0, sizeof(gossip_member_type));
+	memcpy(member->id, id, 6);
+	memcpy(&member->address, address, sizeof(struct sockaddr_storage));
+	member->incarnation = incarnation;
+	member->status = MEMBER_STATUS_ALIVE;
+	gettimeofday(&member->status_changed, NULL);
+
+	char id_buffer[13];
+	get_hex_string((unsigned char*)id, 6, id_buffer, sizeof(id_buffer));
+	char ip_buffer[128];
+	get_ip_address_string_prefixed((struct sockaddr*)address, ip_buffer, sizeof(ip_buffer));
+	LOGD("member %s joined: %s port %u, %zu members\n", id_buffer, ip_buffer, get_port(address), member_count);
+
+	if(status == MEMBER_STATUS_ALIVE) {
+		add_peer_address(member);
+	} else {
+		set_member_status(member, status, incarnation);
+	}
+}
+
+// the file sync uses the same address as the gossip, only with other ports
+void add_peer_address(const gossip_member_type* member) {
+	if(memcmp(member->id, own_id, 6) == 0) {
+		// this happens when several nodes are run on the same host
+		return;
+	}
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	if(add_ip_to_peer((char*)member->id, (struct sockaddr*)&member->address, 0, 0, now)) {
+		// just like a peer found by the broadcast discovery the command client has to schedule the first sync
+		message_data_peer_seen_type peer_seen_data;
+		memset(&peer_seen_data, 0, sizeof(peer_seen_data));
+		memcpy(peer_seen_data.peer_id, member->id, 6);
+		peer_seen_data.timestamp = now;
+		memcpy(&peer_seen_data.address, &member->address, sizeof(struct sockaddr_storage));
+		command_client_thread_send_message(message_queue_create_message("peer_seen", &peer_seen_data, sizeof(peer_seen_data)));
+	}
+}
+
+// merges what the sender knows about a member with what we know, the higher incarnation wins
+// for the same incarnation dead overrides suspect and suspect overrides alive
+void apply_update(const gossip_update_type* update, const char sender_id[6], const struct sockaddr_storage* sender_address) {
+	uint16_t port = ntohs(update->port);
+	uint32_t incarnation = ntohl(update->incarnation);
+	if(memcmp(update->id, own_id, 6) == 0 && port == own_port) {
+		if(update->status != MEMBER_STATUS_ALIVE && incarnation >= own_incarnation) {
+			// somebody suspects us, we are obviously alive so we refute with a higher incarnation
+			own_incarnation = incarnation + 1;
+			own_transmit_count = 0;
+			LOGD("refuting suspicion with incarnation %u\n", own_incarnation);
+		}
+		return;
+	}
+
+	struct sockaddr_storage address;
+	memset(&address, 0, sizeof(address));
+	if(!is_zero_address(update->address)) {
+		decode_address(update, &address);
+	} else if(memcmp(update->id, sender_id, 6) == 0 && port == get_port(sender_address)) {
+		// nodes do not know their own address, the receiver takes it from the packet
+		memcpy(&address, sender_address, sizeof(address));
+	}
+
+	int index = find_member(update->id, port);
+	if(index == -1) {
+		// dead members are not learned, they would only be removed again
+		if(update->status != MEMBER_STATUS_DEAD && address.ss_family != AF_UNSPEC) {
+			add_member(update->id, &address, incarnation, update->status);
+		}
+		return;
+	}
+
+	gossip_member_type* member = &members[index];
+	switch(update->status) {
+	case MEMBER_STATUS_ALIVE:
+		if(incarnation > member->incarnation) {
+			if(address.ss_family != AF_UNSPEC) {
+				memcpy(&member->address, &address, sizeof(address));
+			}
+			set_member_status(member, MEMBER_STATUS_ALIVE, incarnation);
+		}
+		break;
+	case MEMBER_STATUS_SUSPECT:
+		if((member->status == MEMBER_STATUS_ALIVE && incarnation >= member->incarnation) || (member->status == MEMBER_STATUS_SUSPECT && incarnation > member->incarnation)) {
+			set_member_status(member, MEMBER_STATUS_SUSPECT, incarnation);
+		}
+		break;
+	case MEMBER_STATUS_DEAD:
+		if((member->status != MEMBER_STATUS_DEAD && incarnation >= member->incarnation) || incarnation > member->incarnation) {
+			set_member_status(member, MEMBER_STATUS_DEAD, incarnation);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+// the same socket is used for sending, so the source port of our packets is our gossip port
+int create_gossip_socket() {
+	int gossip_socket = socket(AF_INET6, SOCK_DGRAM, 0);
+	if(gossip_socket != -1) {
+		struct sockaddr_in6 address;
+		memset(&address, 0, sizeof(address));
+		address.sin6_family = AF_INET6;
+		address.sin6_port = htons(own_port);
+		address.sin6_addr = in6addr_any;
+		// the socket has to be dual stack so ipv4 members can be reached as well
+		if(setsockopt(gossip_socket, IPPROTO_IPV6, IPV6_V6ONLY, &(int){ 0 }, sizeof(int)) == -1) {
+			LOGD("setsockopt(IPV6_V6ONLY): %s\n", strerror(errno));
+		}
+		if(bind(gossip_socket, (struct sockaddr*)&address, sizeof(address)) == 0) {
+			socket_family = AF_INET6;
+			return gossip_socket;
+		}
+		LOGD("bind: %s\n", strerror(errno));
+		close(gossip_socket);
+	}
+	LOGD("no ipv6 socket could be created, trying for ipv4 instead\n");
+	gossip_socket = socket(AF_INET, SOCK_DGRAM, 0);
+	if(gossip_socket == -1) {
+		LOGD("socket: %s\n", strerror(errno));
+		return -1;
+	}
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(own_port);
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	if(bind(gossip_socket, (struct sockaddr*)&address, sizeof(address)) == -1) {
+		LOGD("bind: %s\n", strerror(errno));
+		close(gossip_socket);
+		return -1;
+	}
+	socket_family = AF_INET;
+	return gossip_socket;
+}
+
+// addresses are stored the way the socket reports them, ipv4 mapped on a dual stack socket
+void decode_address(const gossip_update_type* update, struct sockaddr_storage* address) {
+	memset(address, 0, sizeof(struct sockaddr_storage));
+	static const unsigned char mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+	if(socket_family == AF_INET) {
+		if(memcmp(update->address, mapped_prefix, 12) != 0) {
+			// an ipv6 member cannot be reached without an ipv6 socket
+			return;
+		}
+		struct sockaddr_in* ipv4_address = (struct sockaddr_in*)address;
+		ipv4_address->sin_family = AF_INET;
+		ipv4_address->sin_port = update->port;
+		memcpy(&ipv4_address->sin_addr, update->address + 12, 4);
+	} else {
+		struct sockaddr_in6* ipv6_address = (struct sockaddr_in6*)address;
+		ipv6_address->sin6_family = AF_INET6;
+		ipv6_address->sin6_port = update->port;
+		memcpy(&ipv6_address->sin6_addr, update->address, 16);
+	}
+}
+
+void encode_member(const gossip_member_type* member, gossip_update_type* update) {
+	memset(update, 0, sizeof(gossip_update_type));
+	update->status = member->status;
+	memcpy(update->id, member->id, 6);
+	if(member->address.ss_family == AF_INET6) {
+		memcpy(update->address, &((struct sockaddr_in6*)&member->address)->sin6_addr, 16);
+	} else {
+		update->address[10] = 0xff;
+		update->address[11] = 0xff;
+		memcpy(update->address + 12, &((struct sockaddr_in*)&member->address)->sin_addr, 4);
+	}
+	update->port = htons(get_port(&member->address));
+	update->incarnation = htonl(member->incarnation);
+}
+
+// we do not know under which address the others reach us, so the address is left empty
+void encode_self(gossip_update_type* update) {
+	memset(update, 0, sizeof(gossip_update_type));
+	update->status = MEMBER_STATUS_ALIVE;
+	memcpy(update->id, own_id, 6);
+	update->port = htons(own_port);
+	update->incarnation = htonl(own_incarnation);
+}
+
+int find_member(const char id[6], uint16_t port) {
+	size_t i;
+	for(i = 0; i < member_count; i++) {
+		if(memcmp(members[i].id, id, 6) == 0 && get_port(&members[i].address) == port) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// converts an address to the family of the socket, returns 0 if the socket cannot reach it
+int get_destination(const struct sockaddr_storage* address, struct sockaddr_storage* destination, socklen_t* destination_size) {
+	memcpy(destination, address, sizeof(struct sockaddr_storage));
+	*destination_size = sizeof(struct sockaddr_in6);
+	if(socket_family == AF_INET6 && destination->ss_family == AF_INET) {
+		// a dual stack socket needs an ipv4 mapped address
+		struct sockaddr_in ipv4_address = *(struct sockaddr_in*)address;
+		struct sockaddr_in6* ipv6_address = (struct sockaddr_in6*)destination;
+		memset(destination, 0, sizeof(struct sockaddr_storage));
+		ipv6_address->sin6_family = AF_INET6;
+		ipv6_address->sin6_port = ipv4_address.sin_port;
+		ipv6_address->sin6_addr.s6_addr[10] = 0xff;
+		ipv6_address->sin6_addr.s6_addr[11] = 0xff;
+		memcpy(&ipv6_address->sin6_addr.s6_addr[12], &ipv4_address.sin_addr, 4);
+	} else if(socket_family == AF_INET) {
+		if(destination->ss_family != AF_INET) {
+			// only ipv4 mapped addresses can be reached without an ipv6 socket
+			struct sockaddr_in6 ipv6_address = *(struct sockaddr_in6*)address;
+			if(!is_ipv4_mapped((struct sockaddr*)&ipv6_address)) {
+				return 0;
+			}
+			struct sockaddr_in* ipv4_address = (struct sockaddr_in*)destination;
+			memset(destination, 0, sizeof(struct sockaddr_storage));
+			ipv4_address->sin_family = AF_INET;
+			ipv4_address->sin_port = ipv6_address.sin6_port;
+			memcpy(&ipv4_address->sin_addr, &ipv6_address.sin6_addr.s6_addr[12], 4);
+		}
+		*destination_size = sizeof(struct sockaddr_in);
+	}
+	return 1;
+}
+
+// ceil(log10(N + 1)) but at least 1, this is how many more rounds a larger network needs
+unsigned int get_log_scale() {
+	unsigned int scale = 1;
+	size_t limit = 10;
+	while(limit <= member_count + 1) {
+		scale++;
+		limit *= 10;
+	}
+	return scale;
+}
+
+uint16_t get_port(const struct sockaddr_storage* address) {
+	if(address->ss_family == AF_INET) {
+		return ntohs(((struct sockaddr_in*)address)->sin_port);
+	}
+	return ntohs(((struct sockaddr_in6*)address)->sin6_port);
+}
+
+// returns a random member that is not dead or -1 if there is none
+int get_random_member(int excluded_index) {
+	if(member_count == 0) {
+		return -1;
+	}
+	size_t start = rand_r(&random_seed) % member_count;
+	size_t i;
+	for(i = 0; i < member_count; i++) {
+		size_t index = (start + i) % member_count;
+		if((int)index != excluded_index && members[index].status != MEMBER_STATUS_DEAD) {
+			return index;
+		}
+	}
+	return -1;
+}
+
+void handle_packet(unsigned char* buffer, int size, struct sockaddr_storage* sender_address) {
+	if(size < sizeof(gossip_header_type) + 1) {
+		LOGD("received %d bytes, too short for a gossip packet\n", size);
+		return;
+	}
+	gossip_header_type* header = (gossip_header_type*)buffer;
+	if(memcmp(header->protocol_id, "P2PFSYNC", 8) != 0) {
+		return;
+	}
+	uint16_t sender_port = get_port(sender_address);
+	if(memcmp(header->sender_id, own_id, 6) == 0 && sender_port == own_port) {
+		// e.g. we are one of our own seeds
+		return;
+	}
+	int offset = sizeof(gossip_header_type);
+	gossip_update_type target;
+	if(header->message_type == MESSAGE_TYPE_PING_REQUEST) {
+		if(size < offset + sizeof(gossip_update_type) + 1) {
+			return;
+		}
+		memcpy(&target, buffer + offset, sizeof(target));
+		offset += sizeof(gossip_update_type);
+	}
+	unsigned int update_count = buffer[offset++];
+	if(size < offset + update_count * sizeof(gossip_update_type)) {
+		LOGD("received a truncated gossip packet\n");
+		return;
+	}
+
+	// every packet tells that its sender is alive, a new member gets our whole list right away
+	int first_contact = find_member(header->sender_id, sender_port) == -1;
+	gossip_update_type sender_update;
+	memset(&sender_update, 0, sizeof(sender_update));
+	sender_update.status = MEMBER_STATUS_ALIVE;
+	memcpy(sender_update.id, header->sender_id, 6);
+	sender_update.port = htons(sender_port);
+	sender_update.incarnation = header->incarnation;
+	apply_update(&sender_update, header->sender_id, sender_address);
+	int sender_index = find_member(header->sender_id, sender_port);
+	if(sender_index != -1 && members[sender_index].status == MEMBER_STATUS_ALIVE) {
+		// direct contact is the best proof for the address
+		memcpy(&members[sender_index].address, sender_address, sizeof(struct sockaddr_storage));
+		add_peer_address(&members[sender_index]);
+	}
+
+	unsigned int i;
+	for(i = 0; i < update_count; i++) {
+		gossip_update_type update;
+		memcpy(&update, buffer + offset + i * sizeof(gossip_update_type), sizeof(update));
+		apply_update(&update, header->sender_id, sender_address);
+	}
+	// the updates might have changed the order of the members
+	sender_index = find_member(header->sender_id, sender_port);
+
+	uint32_t sequence = ntohl(header->sequence);
+	switch(header->message_type) {
+	case MESSAGE_TYPE_PING:
+		send_packet(MESSAGE_TYPE_ACK, sequence, NULL, sender_address, sender_index);
+		break;
+	case MESSAGE_TYPE_ACK:
+		if(probe.active && probe.sequence == sequence) {
+			probe.acked = 1;
+			break;
+		}
+		for(i = 0; i < GOSSIP_INDIRECT_MAX_COUNT; i++) {
+			if(indirect_pings[i].used && indirect_pings[i].sequence == sequence) {
+				// we pinged for somebody else, the ack is forwarded with the sequence the requester waits for
+				indirect_pings[i].used = 0;
+				send_packet(MESSAGE_TYPE_ACK, indirect_pings[i].requester_sequence, NULL, &indirect_pings[i].requester_address, -1);
+				break;
+			}
+		}
+		break;
+	case MESSAGE_TYPE_PING_REQUEST: {
+		struct sockaddr_storage target_address;
+		decode_address(&target, &target_address);
+		if(target_address.ss_family == AF_UNSPEC) {
+			break;
+		}
+		// the oldest entry is overwritten, its ack is late anyway
+		indirect_ping_type* indirect_ping = &indirect_pings[next_indirect_ping];
+		next_indirect_ping = (next_indirect_ping + 1) % GOSSIP_INDIRECT_MAX_COUNT;
+		indirect_ping->used = 1;
+		indirect_ping->sequence = next_sequence++;
+		indirect_ping->requester_sequence = sequence;
+		memcpy(&indirect_ping->requester_address, sender_address, sizeof(struct sockaddr_storage));
+		send_packet(MESSAGE_TYPE_PING, indirect_ping->sequence, NULL, &target_address, find_member(target.id, ntohs(target.port)));
+		break;
+	}
+	case MESSAGE_TYPE_SYNC:
+		send_sync(MESSAGE_TYPE_SYNC_REPLY, sender_address);
+		first_contact = 0;
+		break;
+	case MESSAGE_TYPE_SYNC_REPLY:
+		first_contact = 0;
+		break;
+	default:
+		break;
+	}
+	if(first_contact) {
+		send_sync(MESSAGE_TYPE_SYNC, sender_address);
+	}
+}
+
+// starts the next probe, the member of the last probe is suspected if it did not answer
+void handle_probe_due() {
+	timer_wheel_start(GOSSIP_PROBE_INTERVAL_SECONDS, probe_due, NULL, 0);
+
+	if(probe.active && !probe.acked) {
+		int index = find_member(probe.id, probe.port);
+		if(index != -1 && members[index].status == MEMBER_STATUS_ALIVE) {
+			set_member_status(&members[index], MEMBER_STATUS_SUSPECT, members[index].incarnation);
+		}
+	}
+	probe.active = 0;
+
+	if(get_random_member(-1) == -1 && get_passed_time(last_join) >= GOSSIP_JOIN_INTERVAL_SECONDS) {
+		join();
+	}
+	if(get_passed_time(last_sync) >= GOSSIP_SYNC_INTERVAL_SECONDS) {
+		// exchanging the whole lists now and then heals partitions and lost updates
+		gettimeofday(&last_sync, NULL);
+		int index = get_random_member(-1);
+		if(index != -1) {
+			send_sync(MESSAGE_TYPE_SYNC, &members[index].address);
+		}
+	}
+
+	size_t step;
+	for(step = 0; step < member_count; step++) {
+		if(probe_position >= member_count) {
+			// a new round starts in a new random order, so every member is probed once per round
+			remove_dead_members();
+			shuffle_members();
+			probe_position = 0;
+			if(member_count == 0) {
+				break;
+			}
+		}
+		gossip_member_type* member = &members[probe_position++];
+		if(member->status == MEMBER_STATUS_DEAD) {
+			continue;
+		}
+		probe.active = 1;
+		probe.acked = 0;
+		probe.sequence = next_sequence++;
+		memcpy(probe.id, member->id, 6);
+		probe.port = get_port(&member->address);
+		send_packet(MESSAGE_TYPE_PING, probe.sequence, NULL, &member->address, probe_position - 1);
+		timer_wheel_start(GOSSIP_PROBE_TIMEOUT_SECONDS, probe_timeout, &probe.sequence, sizeof(probe.sequence));
+		break;
+	}
+}
+
+// the probed member did not answer directly, maybe only the path between us is broken
+void handle_probe_timeout(uint32_t sequence) {
+	if(!probe.active || probe.acked || probe.sequence != sequence) {
+		return;
+	}
+	int target_index = find_member(probe.id, probe.port);
+	if(target_index == -1) {
+		return;
+	}
+	gossip_update_type target;
+	encode_member(&members[target_index], &target);
+	int sent[GOSSIP_INDIRECT_PROBE_COUNT];
+	int sent_count = 0;
+	int attempt;
+	for(attempt = 0; attempt < GOSSIP_INDIRECT_PROBE_COUNT * 2 && sent_count < GOSSIP_INDIRECT_PROBE_COUNT; attempt++) {
+		int index = get_random_member(target_index);
+		if(index == -1) {
+			break;
+		}
+		int i;
+		for(i = 0; i < sent_count && sent[i] != index; i++);
+		if(i < sent_count) {
+			continue;
+		}
+		sent[sent_count++] = index;
+		send_packet(MESSAGE_TYPE_PING_REQUEST, sequence, &target, &members[index].address, index);
+	}
+}
+
+void handle_suspicion_timeout(const suspicion_argument_type* argument) {
+	int index = find_member(argument->id, argument->port);
+	if(index == -1) {
+		return;
+	}
+	gossip_member_type* member = &members[index];
+	if(member->status == MEMBER_STATUS_SUSPECT && member->incarnation == argument->incarnation) {
+		set_member_status(member, MEMBER_STATUS_DEAD, member->incarnation);
+	}
+}
+
+int is_zero_address(const unsigned char address[16]) {
+	int i;
+	for(i = 0; i < 16; i++) {
+		if(address[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// pings the seeds and the peers of the local network, every answer brings the whole member list along
+void join() {
+	gettimeofday(&last_join, NULL);
+	size_t i;
+	for(i = 0; i < seed_count; i++) {
+		send_packet(MESSAGE_TYPE_PING, next_sequence++, NULL, &seeds[i], -1);
+	}
+	known_peer_type* peers;
+	size_t peer_count = get_known_peers(&peers);
+	for(i = 0; i < peer_count; i++) {
+		if(peers[i].address.ss_family == AF_INET) {
+			((struct sockaddr_in*)&peers[i].address)->sin_port = htons(GOSSIP_PORT);
+		} else {
+			((struct sockaddr_in6*)&peers[i].address)->sin6_port = htons(GOSSIP_PORT);
+		}
+		send_packet(MESSAGE_TYPE_PING, next_sequence++, NULL, &peers[i].address, -1);
+	}
+	free(peers);
+	if(seed_count + peer_count > 0) {
+		LOGD("joining over %zu seeds and %zu peers\n", seed_count, peer_count);
+	}
+}
+
+// the configuration is optional, without it the default port is used and only the local peers are joined
+void load_config() {
+	FILE* config_file = fopen(GOSSIP_CONFIG_PATH, "r");
+	if(config_file == NULL) {
+		return;
+	}
+	char line[512];
+	while(fgets(line, sizeof(line), config_file) != NULL) {
+		char key[16];
+		char value[256];
+		unsigned int port = GOSSIP_PORT;
+		int field_count = sscanf(line, "%15s %255s %u", key, value, &port);
+		if(field_count < 2 || key[0] == '#') {
+			continue;
+		}
+		if(strcmp(key, "port") == 0) {
+			own_port = (uint16_t)atoi(value);
+			LOGD("gossip port is %u\n", own_port);
+		} else if(strcmp(key, "seed") == 0 && seed_count < GOSSIP_SEED_MAX_COUNT) {
+			struct addrinfo hints;
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_DGRAM;
+			struct addrinfo* result_list;
+			int success = getaddrinfo(value, NULL, &hints, &result_list);
+			if(success != 0) {
+				LOGD("getaddrinfo(%s): %s\n", value, gai_strerror(success));
+				continue;
+			}
+			memset(&seeds[seed_count], 0, sizeof(struct sockaddr_storage));
+			memcpy(&seeds[seed_count], result_list->ai_addr, result_list->ai_addrlen);
+			if(seeds[seed_count].ss_family == AF_INET) {
+				((struct sockaddr_in*)&seeds[seed_count])->sin_port = htons(port);
+			} else {
+				((struct sockaddr_in6*)&seeds[seed_count])->sin6_port = htons(port);
+			}
+			seed_count++;
+			freeaddrinfo(result_list);
+		}
+	}
+	fclose(config_file);
+}
+
+// called by the timer wheel, the probe is sent from the gossip thread
+void probe_due(void* argument) {
+	gossip_thread_send_message(message_queue_create_message("probe_due", NULL, 0));
+}
+
+// called by the timer wheel
+void probe_timeout(void* argument) {
+	gossip_thread_send_message(message_queue_create_message("probe_timeout", argument, sizeof(uint32_t)));
+}
+
+void receive_packets() {
+	while(1) {
+		unsigned char receive_buffer[2048];
+		struct sockaddr_storage sender_address;
+		socklen_t sender_length = sizeof(sender_address);
+		memset(&sender_address, 0, sizeof(sender_address));
+		int received_bytes = recvfrom(gossip_socket, receive_buffer, sizeof(receive_buffer), MSG_DONTWAIT, (struct sockaddr*)&sender_address, &sender_length);
+		if(received_bytes == -1) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				LOGD("recvfrom failed %s\n", strerror(errno));
+			}
+			return;
+		}
+		handle_packet(receive_buffer, received_bytes, &sender_address);
+	}
+}
+
+// dead members are forgotten once their death was spread and old messages about them cannot arrive anymore
+void remove_dead_members() {
+	size_t i = 0;
+	while(i < member_count) {
+		gossip_member_type* member = &members[i];
+		if(member->status == MEMBER_STATUS_DEAD && get_passed_time(member->status_changed) > GOSSIP_DEAD_RETENTION_SECONDS) {
+			members[i] = members[--member_count];
+		} else {
+			i++;
+		}
+	}
+}
+
+// piggybacks the updates that were sent least often, the receiver's own entry is always added if it is not alive
+// so it can refute the suspicion
+void send_packet(unsigned char message_type, uint32_t sequence, const gossip_update_type* target, const struct sockaddr_storage* address, int receiver_index) {
+	unsigned char buffer[GOSSIP_PACKET_MAX_SIZE];
+	gossip_header_type* header = (gossip_header_type*)buffer;
+	memcpy(header->protocol_id, "P2PFSYNC", 8);
+	header->message_type = message_type;
+	memcpy(header->sender_id, own_id, 6);
+	header->incarnation = htonl(own_incarnation);
+	header->sequence = htonl(sequence);
+	int size = sizeof(gossip_header_type);
+	if(target != NULL) {
+		memcpy(buffer + size, target, sizeof(gossip_update_type));
+		size += sizeof(gossip_update_type);
+	}
+	unsigned char* update_count = &buffer[size++];
+	*update_count = 0;
+	gossip_update_type* updates = (gossip_update_type*)(buffer + size);
+
+	unsigned int retransmit_limit = GOSSIP_RETRANSMIT_MULTIPLIER * get_log_scale();
+	if(own_transmit_count < retransmit_limit) {
+		encode_self(&updates[(*update_count)++]);
+		own_transmit_count++;
+	}
+	if(receiver_index != -1 && members[receiver_index].status != MEMBER_STATUS_ALIVE) {
+		encode_member(&members[receiver_index], &updates[(*update_count)++]);
+	}
+	int selected[GOSSIP_PIGGYBACK_MAX_COUNT];
+	int selected_count = 0;
+	while(*update_count < GOSSIP_PIGGYBACK_MAX_COUNT) {
+		int best_index = -1;
+		size_t i;
+		for(i = 0; i < member_count; i++) {
+			if(members[i].transmit_count >= retransmit_limit || (int)i == receiver_index) {
+				continue;
+			}
+			int j;
+			for(j = 0; j < selected_count && selected[j] != (int)i; j++);
+			if(j == selected_count && (best_index == -1 || members[i].transmit_count < members[best_index].transmit_count)) {
+				best_index = i;
+			}
+		}
+		if(best_index == -1) {
+			break;
+		}
+		selected[selected_count++] = best_index;
+		encode_member(&members[best_index], &updates[(*update_count)++]);
+		members[best_index].transmit_count++;
+	}
+	size += *update_count * sizeof(gossip_update_type);
+
+	struct sockaddr_storage destination;
+	socklen_t destination_size;
+	if(!get_destination(address, &destination, &destination_size)) {
+		return;
+	}
+	if(sendto(gossip_socket, buffer, size, 0, (struct sockaddr*)&destination, destination_size) == -1) {
+		LOGD("sendto: %s\n", strerror(errno));
+	}
+}
+
+// sends our whole member list, split into as many packets as needed
+void send_sync(unsigned char message_type, const struct sockaddr_storage* address) {
+	struct sockaddr_storage destination;
+	socklen_t destination_size;
+	if(!get_destination(address, &destination, &destination_size)) {
+		return;
+	}
+	const size_t updates_per_packet = (GOSSIP_PACKET_MAX_SIZE - sizeof(gossip_header_type) - 1) / sizeof(gossip_update_type);
+	size_t member_index = 0;
+	int self_sent = 0;
+	do {
+		unsigned char buffer[GOSSIP_PACKET_MAX_SIZE];
+		gossip_header_type* header = (gossip_header_type*)buffer;
+		memcpy(header->protocol_id, "P2PFSYNC", 8);
+		header->message_type = message_type;
+		memcpy(header->sender_id, own_id, 6);
+		header->incarnation = htonl(own_incarnation);
+		header->sequence = htonl(next_sequence++);
+		int size = sizeof(gossip_header_type);
+		unsigned char* update_count = &buffer[size++];
+		*update_count = 0;
+		gossip_update_type* updates = (gossip_update_type*)(buffer + size);
+		if(!self_sent) {
+			encode_self(&updates[(*update_count)++]);
+			self_sent = 1;
+		}
+		for(; member_index < member_count && *update_count < updates_per_packet; member_index++) {
+			encode_member(&members[member_index], &updates[(*update_count)++]);
+		}
+		size += *update_count * sizeof(gossip_update_type);
+		if(sendto(gossip_socket, buffer, size, 0, (struct sockaddr*)&destination, destination_size) == -1) {
+			LOGD("sendto: %s\n", strerror(errno));
+			return;
+		}
+	} while(member_index < member_count);
+}
+
+// every change is spread again, a suspect gets some time to refute the suspicion before it is declared dead
+void set_member_status(gossip_member_type* member, unsigned char status, uint32_t incarnation) {
+	if(member->suspicion_timer != 0) {
+		timer_wheel_cancel(member->suspicion_timer);
+		member->suspicion_timer = 0;
+	}
+	int status_changed = member->status != status;
+	member->status = status;
+	member->incarnation = incarnation;
+	member->transmit_count = 0;
+	if(status_changed) {
+		gettimeofday(&member->status_changed, NULL);
+		char id_buffer[13];
+		get_hex_string((unsigned char*)member->id, 6, id_buffer, sizeof(id_buffer));
+		LOGD("member %s port %u is %s now (incarnation %u)\n", id_buffer, get_port(&member->address), status == MEMBER_STATUS_ALIVE ? "alive" : status == MEMBER_STATUS_SUSPECT ? "suspect" : "dead", incarnation);
+	}
+	if(status == MEMBER_STATUS_ALIVE) {
+		add_peer_address(member);
+	} else if(status == MEMBER_STATUS_SUSPECT) {
+		// larger networks need more rounds until the suspect hears about the suspicion
+		suspicion_argument_type argument;
+		memset(&argument, 0, sizeof(argument));
+		memcpy(argument.id, member->id, 6);
+		argument.port = get_port(&member->address);
+		argument.incarnation = incarnation;
+		member->suspicion_timer = timer_wheel_start(GOSSIP_SUSPICION_MULTIPLIER * get_log_scale() * GOSSIP_PROBE_INTERVAL_SECONDS, suspicion_timeout, &argument, sizeof(argument));
+	}
+}
+
+// fisher yates
+void shuffle_members() {
+	size_t i;
+	for(i = member_count; i > 1; i--) {
+		size_t j = rand_r(&random_seed) % i;
+		gossip_member_type member = members[i - 1];
+		members[i - 1] = members[j];
+		members[j] = member;
+	}
+}
+
+// called by the timer wheel
+void suspicion_timeout(void* argument) {
+	gossip_thread_send_message(message_queue_create_message("suspicion_timeout", argument, sizeof(suspicion_argument_type)));
+}
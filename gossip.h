@@ -0,0 +1,52 @@
+/**
+ * @file gossip.h
+ * @brief This module keeps the membership of peers beyond the local network with a SWIM like gossip protocol.
+ *
+ * This module has its own thread. The discovery of broadcast.c only reaches the local network segment, so peers in
+ * other networks are found by gossip instead. Every node knows a list of members. Once per GOSSIP_PROBE_INTERVAL_SECONDS
+ * it pings the next member of that list, which is shuffled after every round, and expects an ack. If the ack does not
+ * arrive in time, GOSSIP_INDIRECT_PROBE_COUNT other members are asked to ping it on our behalf. If none of them gets an
+ * ack either, the member is suspected. A suspected member has some time to refute the suspicion by announcing itself
+ * with a higher incarnation number, otherwise it is declared dead.
+ *
+ * Changes of the membership are not sent in extra packets. They are piggybacked on the pings and acks, every change
+ * about GOSSIP_RETRANSMIT_MULTIPLIER * log(N) times. So every node sends a constant amount of packets per interval no
+ * matter how large the network is, and a change reaches all N nodes within O(log N) intervals.
+ *
+ * A new node joins by pinging the seeds from GOSSIP_CONFIG_PATH and the peers found by the broadcast discovery. On the
+ * first contact both nodes exchange their whole member lists, and the same is done with a random member every
+ * GOSSIP_SYNC_INTERVAL_SECONDS so separated parts of the network find each other again.
+ *
+ * The configuration file is optional, every line is either "port <port>" to listen on another port than GOSSIP_PORT
+ * or "seed <address> [port]". With different ports many nodes can be run on a single host over the loopback interface.
+ *
+ * Members that are alive are added to the peer list with the address they were reached at, see peer_list.h.
+ */
+
+#ifndef GOSSIP_H
+#define GOSSIP_H
+
+#include "message_queue.h"
+
+#define GOSSIP_PORT 44703 // the default port, it can be changed in the configuration file
+#define GOSSIP_CONFIG_PATH "./gossip.conf"
+
+/**
+ * @brief This is the thread's main function. It is started from the main thread.
+ *
+ * \code{.c}
+ * pthread_create(&gossip_thread_id, NULL, gossip_thread, (void*)0);
+ * \endcode
+ * @param user_data This parameter can be used to supply user data to the thread
+ */
+void* gossip_thread(void* user_data);
+
+/**
+ * @brief This function is used to send messages to the gossip thread.
+ *
+ * The timer wheel sends "probe_due", "probe_timeout" and "suspicion_timeout" messages.
+ * @param message The message's parameters
+ */
+void gossip_thread_send_message(message_queue_entry_type* message);
+
+#endif
@@ -5,7 +5,12 @@
 #include "ip_address_list.h"
 #include "logger.h"
 
-// internal helper function
+// internal helper functions
+static double get_expected_seconds(const ip_address_entry_type* entry);
+static int is_avoided(const ip_address_entry_type* entry);
+static int is_ranked_before(const ip_address_entry_type* entry, const ip_address_entry_type* other_entry);
+static double update_average(double average, double sample);
+
 ip_address_entry_type* find_entry(ip_address_entry_type** list, struct sockaddr* ip_address) {
 	ip_address_entry_type* ip_address_iterator;
 	for(ip_address_iterator = *list; ip_address_iterator != NULL; ip_address_iterator = ip_address_iterator->next_entry) {
@@ -40,33 +45,45 @@ void free_ip_address_list(ip_address_entry_type** list) {
 }
 
 int get_best_address(ip_address_entry_type** list, struct sockaddr_storage* ip_address) {
-	int found = 0;
-	ip_address_entry_type* best_ip_address_entry = NULL;
-	ip_address_entry_type* ip_address_iterator;
-	for(ip_address_iterator = *list; ip_address_iterator != NULL; ip_address_iterator = ip_address_iterator->next_entry) {
-		// if we have no ip address we take any
-		if(best_ip_address_entry == NULL) {
-			best_ip_address_entry = ip_address_iterator;
+	return get_ranked_addresses(list, ip_address, 1) == 1;
+}
+
+size_t get_ranked_addresses(ip_address_entry_type** list, struct sockaddr_storage* ip_addresses, size_t max_count) {
+	// the lists are short, so the best remaining entry is simply searched again for every place
+	size_t count = 0;
+	ip_address_entry_type* previous_entry = NULL;
+	while(count < max_count) {
+		ip_address_entry_type* best_ip_address_entry = NULL;
+		ip_address_entry_type* ip_address_iterator;
+		for(ip_address_iterator = *list; ip_address_iterator != NULL; ip_address_iterator = ip_address_iterator->next_entry) {
+			// only entries that rank behind the previous one are left
+			if(previous_entry != NULL && !is_ranked_before(previous_entry, ip_address_iterator)) {
+				continue;
+			}
+			// if we have no ip address we take any
+			if(best_ip_address_entry == NULL || is_ranked_before(ip_address_iterator, best_ip_address_entry)) {
+				best_ip_address_entry = ip_address_iterator;
+			}
 		}
-		else if(ip_address_iterator->ip_address.ss_family == AF_INET6) {
-			best_ip_address_entry = ip_address_iterator;
+		if(best_ip_address_entry == NULL) {
+			break;
 		}
-	}
-	if(best_ip_address_entry != NULL) {
 		// copy the ip address to the output variable
-		memcpy(ip_address, &best_ip_address_entry->ip_address, sizeof(struct sockaddr_storage));
-		found = 1;
+		memcpy(&ip_addresses[count++], &best_ip_address_entry->ip_address, sizeof(struct sockaddr_storage));
+		previous_entry = best_ip_address_entry;
 	}
-	return found;
+	return count;
 }
 
-void add_or_update_entry(ip_address_entry_type** list, struct sockaddr* ip_address, struct timeval last_seen) {
+void add_or_update_entry(ip_address_entry_type** list, struct sockaddr* ip_address, unsigned int interface_index, int link_speed, struct timeval last_seen) {
 	if(*list == NULL) {
 		// this is the first element
 		ip_address_entry_type* new_entry = (ip_address_entry_type*)malloc(sizeof(ip_address_entry_type));
 		memset(new_entry, 0, sizeof(ip_address_entry_type));
 		memcpy(&new_entry->ip_address, ip_address, ip_address->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
 		memcpy(&new_entry->last_seen, &last_seen, sizeof(struct timeval));
+		new_entry->interface_index = interface_index;
+		new_entry->link_speed = link_speed;
 		*list = new_entry;
 		return;
 	}
@@ -82,13 +99,81 @@ void add_or_update_entry(ip_address_entry_type** list, struct sockaddr* ip_addre
 		memset(new_entry, 0, sizeof(ip_address_entry_type));
 		memcpy(&new_entry->ip_address, ip_address, ip_address->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
 		memcpy(&new_entry->last_seen, &last_seen, sizeof(struct timeval));
+		new_entry->interface_index = interface_index;
+		new_entry->link_speed = link_speed;
 		last_entry->next_entry = new_entry;
 	} else {
-		// we only need to update the entry
+		// we only need to update the entry, the address might have moved to another link
 		memcpy(&entry->last_seen, &last_seen, sizeof(struct timeval));
+		entry->interface_index = interface_index;
+		entry->link_speed = link_speed;
 	}
 }
 
+int record_connect_result(ip_address_entry_type** list, const struct sockaddr* ip_address, double seconds, int success) {
+	ip_address_entry_type* entry = find_entry(list, (struct sockaddr*)ip_address);
+	if(entry == NULL) {
+		return 0;
+	}
+	entry->failure_rate = update_average(entry->failure_rate, success ? 0.0 : 1.0);
+	if(success) {
+		// a failed connect says nothing about the latency, it just timed out or was refused
+		entry->connect_seconds = entry->connect_seconds == 0 ? seconds : update_average(entry->connect_seconds, seconds);
+		entry->failure_count = 0;
+	} else {
+		entry->failure_count++;
+		gettimeofday(&entry->last_failure, NULL);
+	}
+	return 1;
+}
+
+int record_transfer(ip_address_entry_type** list, const struct sockaddr* ip_address, uint64_t bytes, double seconds) {
+	ip_address_entry_type* entry = find_entry(list, (struct sockaddr*)ip_address);
+	if(entry == NULL) {
+		return 0;
+	}
+	if(bytes < ADDRESS_THROUGHPUT_MIN_BYTES || seconds <= 0) {
+		return 1;
+	}
+	double throughput = bytes / seconds;
+	entry->throughput = entry->throughput == 0 ? throughput : update_average(entry->throughput, throughput);
+	return 1;
+}
+
+size_t remove_expired_entries(ip_address_entry_type** list, double ttl_seconds) {
+	size_t removed_count = 0;
+	ip_address_entry_type** link = list;
+	while(*link != NULL) {
+		ip_address_entry_type* entry = *link;
+		if(get_passed_time(entry->last_seen) > ttl_seconds) {
+			char ip_buffer[128];
+			get_ip_address_string_prefixed((struct sockaddr*)&entry->ip_address, ip_buffer, sizeof(ip_buffer));
+			LOGD("address expired: %s\n", ip_buffer);
+			*link = entry->next_entry;
+			free(entry);
+			removed_count++;
+		} else {
+			link = &entry->next_entry;
+		}
+	}
+	return removed_count;
+}
+
+int get_oldest_entry(ip_address_entry_type** list, struct timeval* last_seen) {
+	ip_address_entry_type* oldest_entry = NULL;
+	ip_address_entry_type* ip_address_iterator;
+	for(ip_address_iterator = *list; ip_address_iterator != NULL; ip_address_iterator = ip_address_iterator->next_entry) {
+		if(oldest_entry == NULL || get_passed_time(ip_address_iterator->last_seen) > get_passed_time(oldest_entry->last_seen)) {
+			oldest_entry = ip_address_iterator;
+		}
+	}
+	if(oldest_entry == NULL) {
+		return 0;
+	}
+	*last_seen = oldest_entry->last_seen;
+	return 1;
+}
+
 void print_ip_address_list(ip_address_entry_type** list) {
 	if(*list == NULL) {
 		// the list is empty
@@ -100,6 +185,53 @@ void print_ip_address_list(ip_address_entry_type** list) {
 		// \t[ipversion ip]
 		char ip_buffer[128];
 		get_ip_address_string_prefixed((struct sockaddr*)&ip_address_iterator->ip_address, ip_buffer, sizeof(ip_buffer));
-		LOGD("\t[%s]\n", ip_buffer);
+		LOGD("\t[%s on interface %u, %d Mbit/s, connect %.1f ms, %.1f MB/s, %.0f%% failed]\n", ip_buffer, ip_address_iterator->interface_index, ip_address_iterator->link_speed,
+				ip_address_iterator->connect_seconds * 1000, ip_address_iterator->throughput / 1000000, ip_address_iterator->failure_rate * 100);
+	}
+}
+
+// MODULE SCOPED FUNTCIONS BEGIN
+
+// how long a transfer of ADDRESS_SCORE_REFERENCE_BYTES is expected to take over this address including the connect
+double get_expected_seconds(const ip_address_entry_type* entry) {
+	double connect_seconds = entry->connect_seconds > 0 ? entry->connect_seconds : ADDRESS_DEFAULT_CONNECT_SECONDS;
+	double throughput = entry->throughput;
+	if(throughput == 0) {
+		// nothing was transferred yet, so the link speed is all we know
+		throughput = (entry->link_speed > 0 ? entry->link_speed : ADDRESS_DEFAULT_LINK_SPEED) * 1000000.0 / 8;
 	}
+	double expected_seconds = connect_seconds + ADDRESS_SCORE_REFERENCE_BYTES / throughput;
+	// every failed connect costs the time until the next attempt, so unreliable addresses are worse
+	// the rate is capped, otherwise an address that once failed a few times would never be good again
+	double failure_rate = entry->failure_rate < 0.9 ? entry->failure_rate : 0.9;
+	return expected_seconds / (1 - failure_rate);
+}
+
+// returns 1 if the last connect to this address failed recently
+int is_avoided(const ip_address_entry_type* entry) {
+	return entry->failure_count > 0 && get_passed_time(entry->last_failure) < ADDRESS_FAILURE_HOLD_SECONDS;
+}
+
+// returns 1 if entry is a better choice than other_entry
+// the order is strict and total, ties are decided by the family and finally by the position in memory
+int is_ranked_before(const ip_address_entry_type* entry, const ip_address_entry_type* other_entry) {
+	// addresses that failed lately come last no matter how fast they were before
+	int entry_is_avoided = is_avoided(entry);
+	int other_entry_is_avoided = is_avoided(other_entry);
+	if(entry_is_avoided != other_entry_is_avoided) {
+		return entry_is_avoided < other_entry_is_avoided;
+	}
+	double expected_seconds = get_expected_seconds(entry);
+	double other_expected_seconds = get_expected_seconds(other_entry);
+	if(expected_seconds != other_expected_seconds) {
+		return expected_seconds < other_expected_seconds;
+	}
+	if(entry->ip_address.ss_family != other_entry->ip_address.ss_family) {
+		return entry->ip_address.ss_family == AF_INET6;
+	}
+	return entry < other_entry;
+}
+
+double update_average(double average, double sample) {
+	return average + ADDRESS_AVERAGE_WEIGHT * (sample - average);
 }
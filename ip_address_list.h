@@ -1,19 +1,40 @@
 /**
  * @file ip_address_list.h
  * @brief This file provides a data structure and appropriate algorithms to store ip addresses with a timestamp in a list.
+ *
+ * Every address also keeps what was measured when it was used: the time a connect took, the throughput of transfers
+ * and how often connects failed. All of them are exponentially weighted moving averages, so recent measurements count
+ * most and a link that got worse or better is noticed after a few connections. get_best_address() ranks the addresses
+ * by them, see there.
  */
 
 #ifndef IP_ADDRESS_LIST_H
 #define IP_ADDRESS_LIST_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 
+#define ADDRESS_AVERAGE_WEIGHT 0.25 // the weight of a new measurement in the moving averages
+#define ADDRESS_SCORE_REFERENCE_BYTES (1024 * 1024) // the addresses are ranked by how long a transfer of this size would take
+#define ADDRESS_THROUGHPUT_MIN_BYTES (256 * 1024) // smaller transfers do not count for the throughput
+#define ADDRESS_FAILURE_HOLD_SECONDS 30.0 // an address is avoided for this long after a failed connect
+#define ADDRESS_DEFAULT_CONNECT_SECONDS 0.005 // the connect time assumed for an address that was never connected
+#define ADDRESS_DEFAULT_LINK_SPEED 100 // the speed in Mbit/s assumed for a link of unknown speed
+
 /// A single entry or the head of an ip address list
 typedef struct ip_address_entry {
 	struct ip_address_entry* next_entry; //!< A link to the next entry in the list
 	struct sockaddr_storage ip_address; //!< The ip address of a peer
 	struct timeval last_seen; //!< When was this ip address last seen
+	unsigned int interface_index; //!< The local interface the address was learned on, 0 if unknown
+	int link_speed; //!< The speed of that interface in Mbit/s, 0 if unknown
+	double connect_seconds; //!< The average time a connect took, 0 if never connected
+	double throughput; //!< The average throughput of transfers in bytes/s, 0 if never measured
+	double failure_rate; //!< The average share of failed connects between 0 and 1
+	unsigned int failure_count; //!< The count of connects that failed in a row
+	struct timeval last_failure; //!< When the last connect failed
 } ip_address_entry_type;
 
 /**
@@ -26,25 +47,78 @@ void free_ip_address_list(ip_address_entry_type** list);
  * @brief Insert an ip address into the list. If the ip is already in the list its timestamp is updated.
  * @param list A pointer to the address where the head of the list resides
  * @param ip_address The ip address to insert
+ * @param interface_index The local interface the address was learned on, 0 if unknown
+ * @param link_speed The speed of that interface in Mbit/s, 0 if unknown
  * @param last_seen When was this ip last seen
  */
-void add_or_update_entry(ip_address_entry_type** list, struct sockaddr* ip_address, struct timeval last_seen);
+void add_or_update_entry(ip_address_entry_type** list, struct sockaddr* ip_address, unsigned int interface_index, int link_speed, struct timeval last_seen);
 
-// this prefers ipv6 addresses over ipv4
-// if no address is found it returns 0 otherwise 1
 /**
  * @brief This gets the best address out of an ip address list.
  *
  * For each discovered peer there is one ip address list. It contains all the address that belong to this peer.
  * These might be many e.g. one link over ethernet, another over wifi, etc. and both IPv4 and IPv6.
- * This function gives the "best" which in this case is the first IPv6 address. If no IPv6 address is found
- * an IPv4 address is returned instead. If no address is found the function returns 0.
+ * This function gives the "best" which in this case is the address that is expected to transfer
+ * ADDRESS_SCORE_REFERENCE_BYTES the fastest, including the connect. The measured averages are used for that, an
+ * address without measurements is estimated by the speed of its link. So a peer that is connected over a fast storage
+ * network and a slow wifi is reached over the fast one, unless the fast one turns out to be slower in practice.
+ * Addresses whose last connect failed less than ADDRESS_FAILURE_HOLD_SECONDS ago come after all others, so the next
+ * connect falls back to another address. Among equally good addresses IPv6 is preferred. If no address is found the
+ * function returns 0.
  * @param list A pointer to the address where the head of the list resides
  * @param ip_address A pointer to a memory location where the "best" ip should be copied to
  * @return
  */
 int get_best_address(ip_address_entry_type** list, struct sockaddr_storage* ip_address);
 
+/**
+ * @brief Gets the addresses of an ip address list from the best to the worst, see get_best_address().
+ * @param list A pointer to the address where the head of the list resides
+ * @param ip_addresses An array that receives the addresses
+ * @param max_count The size of @p ip_addresses, only the best addresses are copied if there are more
+ * @return The count of copied addresses
+ */
+size_t get_ranked_addresses(ip_address_entry_type** list, struct sockaddr_storage* ip_addresses, size_t max_count);
+
+/**
+ * @brief Records the result of a connect to an address.
+ * @param list A pointer to the address where the head of the list resides
+ * @param ip_address The address that was connected to, the port is ignored
+ * @param seconds How long the connect took
+ * @param success 1 if the connect succeeded, 0 if it failed
+ * @return 1 if the address is in the list. Otherwise 0 is returned.
+ */
+int record_connect_result(ip_address_entry_type** list, const struct sockaddr* ip_address, double seconds, int success);
+
+/**
+ * @brief Records the throughput of a transfer from an address.
+ *
+ * Transfers smaller than ADDRESS_THROUGHPUT_MIN_BYTES are ignored, their duration says more about the latency than
+ * about the throughput.
+ * @param list A pointer to the address where the head of the list resides
+ * @param ip_address The address the data was transferred from, the port is ignored
+ * @param bytes The count of transferred bytes
+ * @param seconds How long the transfer took
+ * @return 1 if the address is in the list. Otherwise 0 is returned.
+ */
+int record_transfer(ip_address_entry_type** list, const struct sockaddr* ip_address, uint64_t bytes, double seconds);
+
+/**
+ * @brief Removes all entries that were not seen for a while.
+ * @param list A pointer to the address where the head of the list resides
+ * @param ttl_seconds Entries that were last seen longer ago than this are removed
+ * @return The count of removed entries
+ */
+size_t remove_expired_entries(ip_address_entry_type** list, double ttl_seconds);
+
+/**
+ * @brief Finds the entry that was not seen for the longest time, its expiry comes next.
+ * @param list A pointer to the address where the head of the list resides
+ * @param last_seen Receives when the oldest entry was last seen
+ * @return 1 if the list is not empty. Otherwise 0 is returned.
+ */
+int get_oldest_entry(ip_address_entry_type** list, struct timeval* last_seen);
+
 // convenient if list is always **
 /**
  * @brief Print out an ip address list given its head node using the logger module
@@ -0,0 +1,307 @@
+#define _GNU_SOURCE // for copy_file_range()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "broadcast.h"
+#include "defines.h"
+#include "file_index.h"
+#include "logger.h"
+#include "util.h"
+
+#include "local_file.h"
+
+#define CONFLICT_HASH_BYTES 4 // how much of the content hash goes into the name of a conflict copy
+#define COPY_BUFFER_SIZE (64 * 1024) // the buffer size if the kernel cannot copy a file by itself
+
+// helper functions for this module
+static int copy_contents(int source_fd, int fd, uint64_t size);
+static int get_parent_path(const char* local_path, char* buffer, size_t buffer_size);
+static int keep_local_version(const char* path, const unsigned char hash[SHA256_HASH_SIZE]);
+static int write_all(int fd, const char* data, size_t size);
+
+int local_file_is_temporary(const char* name) {
+	return strncmp(name, LOCAL_FILE_TEMP_PREFIX, strlen(LOCAL_FILE_TEMP_PREFIX)) == 0;
+}
+
+int local_file_create_temporary(const char* path, char* temp_path, size_t temp_path_size) {
+	char local_path[PATH_MAX];
+	char parent_path[PATH_MAX];
+	if(snprintf(local_path, sizeof(local_path), "%s%s", BASE_PATH, path) >= sizeof(local_path) || get_parent_path(local_path, parent_path, sizeof(parent_path)) == -1) {
+		LOGD("invalid path %s\n", path);
+		return -1;
+	}
+	mkdirp(parent_path);
+	// the temporary file has to be in the same directory, otherwise it could not be renamed atomically
+	if(snprintf(temp_path, temp_path_size, "%s/%sXXXXXX", parent_path, LOCAL_FILE_TEMP_PREFIX) >= temp_path_size) {
+		return -1;
+	}
+	int fd = mkstemp(temp_path);
+	if(fd == -1) {
+		LOGE("mkstemp %s %s\n", temp_path, strerror(errno));
+		return -1;
+	}
+	return fd;
+}
+
+int local_file_commit(int fd, const char* temp_path, const char* path, uint32_t mode, int64_t mtime_ns) {
+	// mkstemp creates the file with 0600, so without a remote mode we fall back to what open() would have done
+	if(mode == 0) {
+		mode_t mask = umask(0);
+		umask(mask);
+		mode = 0666 & ~mask;
+	}
+	if(fchmod(fd, mode & 07777) != 0) {
+		LOGD("fchmod %s\n", strerror(errno));
+	}
+	if(mtime_ns != 0) {
+		// with the same modification time on both sides the file is not considered changed by either peer
+		struct timespec times[2];
+		times[0].tv_sec = 0;
+		times[0].tv_nsec = UTIME_OMIT;
+		times[1].tv_sec = mtime_ns / 1000000000LL;
+		times[1].tv_nsec = mtime_ns % 1000000000LL;
+		if(futimens(fd, times) != 0) {
+			LOGD("futimens %s\n", strerror(errno));
+		}
+	}
+	if(close(fd) != 0) {
+		LOGE("close %s %s\n", temp_path, strerror(errno));
+		unlink(temp_path);
+		return -1;
+	}
+	char local_path[PATH_MAX];
+	if(snprintf(local_path, sizeof(local_path), "%s%s", BASE_PATH, path) >= sizeof(local_path) || rename(temp_path, local_path) != 0) {
+		LOGE("rename %s %s\n", temp_path, strerror(errno));
+		unlink(temp_path);
+		return -1;
+	}
+	// the new file has to be in the index, otherwise we would download it again
+	file_index_update_path(path);
+	return 0;
+}
+
+void local_file_discard(int fd, const char* temp_path) {
+	close(fd);
+	unlink(temp_path);
+}
+
+int local_file_write(const char* path, const char* data, size_t size, uint32_t mode, int64_t mtime_ns) {
+	char temp_path[PATH_MAX];
+	int fd = local_file_create_temporary(path, temp_path, sizeof(temp_path));
+	if(fd == -1) {
+		return -1;
+	}
+	if(write_all(fd, data, size) == -1) {
+		LOGE("write %s %s\n", temp_path, strerror(errno));
+		local_file_discard(fd, temp_path);
+		return -1;
+	}
+	return local_file_commit(fd, temp_path, path, mode, mtime_ns);
+}
+
+int local_file_commit_remote(int fd, const char* temp_path, const char* path, const unsigned char hash[SHA256_HASH_SIZE], uint32_t mode, int64_t mtime_ns, int keep_local_copy) {
+	if(keep_local_copy && keep_local_version(path, hash) == -1) {
+		local_file_discard(fd, temp_path);
+		return -1;
+	}
+	if(local_file_commit(fd, temp_path, path, mode, mtime_ns) == -1) {
+		return -1;
+	}
+	// both sides have this version now, so it is the common ancestor for the next comparison
+	// without a remote hash we take the one the index calculated for the new file
+	file_index_entry_type entry;
+	if(hash != NULL) {
+		file_index_mark_synced(path, hash);
+	} else if(file_index_lookup(path, &entry)) {
+		file_index_mark_synced(path, entry.hash);
+	}
+	return 0;
+}
+
+int local_file_store_remote(const char* path, const char* data, size_t size, uint32_t mode, int64_t mtime_ns, int keep_local_copy) {
+	unsigned char hash[SHA256_HASH_SIZE];
+	sha256_context_type context;
+	sha256_init(&context);
+	sha256_update(&context, data, size);
+	sha256_final(&context, hash);
+	char temp_path[PATH_MAX];
+	int fd = local_file_create_temporary(path, temp_path, sizeof(temp_path));
+	if(fd == -1) {
+		return -1;
+	}
+	if(write_all(fd, data, size) == -1) {
+		LOGE("write %s %s\n", temp_path, strerror(errno));
+		local_file_discard(fd, temp_path);
+		return -1;
+	}
+	return local_file_commit_remote(fd, temp_path, path, hash, mode, mtime_ns, keep_local_copy);
+}
+
+int local_file_store_local_copy(const char* path, const unsigned char hash[SHA256_HASH_SIZE], uint64_t size, uint32_t mode, int64_t mtime_ns, int keep_local_copy) {
+	char source_path[PATH_MAX];
+	char local_source_path[PATH_MAX];
+	file_index_entry_type source_entry;
+	if(!file_index_find_content(hash, size, source_path, sizeof(source_path)) || !file_index_lookup(source_path, &source_entry)
+			|| snprintf(local_source_path, sizeof(local_source_path), "%s%s", BASE_PATH, source_path) >= sizeof(local_source_path)) {
+		return -1;
+	}
+	int source_fd = open(local_source_path, O_RDONLY);
+	if(source_fd == -1) {
+		return -1;
+	}
+	// the index only knows the contents as long as the file did not change since it was hashed
+	struct stat info;
+	if(fstat(source_fd, &info) != 0 || !S_ISREG(info.st_mode) || (uint64_t)info.st_size != size || (int64_t)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec != source_entry.mtime_ns) {
+		LOGD("%s changed since it was indexed, not copying it\n", source_path);
+		close(source_fd);
+		return -1;
+	}
+	char temp_path[PATH_MAX];
+	int fd = local_file_create_temporary(path, temp_path, sizeof(temp_path));
+	if(fd == -1) {
+		close(source_fd);
+		return -1;
+	}
+	int copied = copy_contents(source_fd, fd, size);
+	close(source_fd);
+	if(copied == -1) {
+		local_file_discard(fd, temp_path);
+		return -1;
+	}
+	if(local_file_commit_remote(fd, temp_path, path, hash, mode, mtime_ns, keep_local_copy) == -1) {
+		return -1;
+	}
+	LOGI("%s has the same contents as %s, copied it instead of downloading it\n", path, source_path);
+	return 0;
+}
+
+int local_file_make_conflict_copy(const char* path, const unsigned char hash[SHA256_HASH_SIZE]) {
+	char date_buffer[32];
+	time_t now = time(NULL);
+	struct tm now_time;
+	localtime_r(&now, &now_time);
+	strftime(date_buffer, sizeof(date_buffer), "%Y%m%d-%H%M%S", &now_time);
+	char hash_buffer[2 * CONFLICT_HASH_BYTES + 1];
+	get_hex_string(hash, CONFLICT_HASH_BYTES, hash_buffer, sizeof(hash_buffer));
+
+	char conflict_path[PATH_MAX];
+	if(snprintf(conflict_path, sizeof(conflict_path), "%s.conflict-%s-%s", path, date_buffer, hash_buffer) >= sizeof(conflict_path) || strlen(strrchr(conflict_path, '/') + 1) > NAME_MAX) {
+		LOGW("the name of %s is too long for a conflict copy\n", path);
+		return -1;
+	}
+	char local_path[PATH_MAX];
+	char local_conflict_path[PATH_MAX];
+	snprintf(local_path, sizeof(local_path), "%s%s", BASE_PATH, path);
+	if(snprintf(local_conflict_path, sizeof(local_conflict_path), "%s%s", BASE_PATH, conflict_path) >= sizeof(local_conflict_path)) {
+		return -1;
+	}
+	// link() instead of rename() so an existing conflict copy is never overwritten and the file never vanishes in between
+	if(link(local_path, local_conflict_path) != 0) {
+		LOGE("link %s %s\n", local_conflict_path, strerror(errno));
+		return -1;
+	}
+	LOGI("conflict copy of %s is %s\n", path, conflict_path);
+	file_index_update_path(conflict_path);
+	// the file watcher finds the copy already indexed, but unlike downloaded files the peers do not have this version yet
+	char* changed_path = conflict_path;
+	broadcast_changed_paths(&changed_path, 1);
+	return 0;
+}
+
+// MODULE SCOPED FUNTCIONS BEGIN
+
+// copies size bytes from the start of source_fd, the kernel copies the data itself if it can
+// returns 0 on success or -1 on failure, e.g. if the source is shorter than expected
+int copy_contents(int source_fd, int fd, uint64_t size) {
+	// copy on write file systems like btrfs and XFS share the data blocks, so the copy takes neither time nor space
+	if(ioctl(fd, FICLONE, source_fd) == 0) {
+		return 0;
+	}
+	uint64_t copied = 0;
+	while(copied < size) {
+		ssize_t copy_return = copy_file_range(source_fd, NULL, fd, NULL, size - copied, 0);
+		if(copy_return == -1 && errno == EINTR) {
+			continue;
+		}
+		if(copy_return == -1 && copied == 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+			// older kernels and some file systems cannot do it, so we copy through a buffer instead
+			break;
+		}
+		if(copy_return <= 0) {
+			LOGD("copy_file_range %s\n", copy_return == 0 ? "source too short" : strerror(errno));
+			return -1;
+		}
+		copied += copy_return;
+	}
+	if(copied == size) {
+		return 0;
+	}
+	char* buffer = (char*)malloc(COPY_BUFFER_SIZE);
+	while(copied < size) {
+		ssize_t read_return = read(source_fd, buffer, size - copied < COPY_BUFFER_SIZE ? size - copied : COPY_BUFFER_SIZE);
+		if(read_return == -1 && errno == EINTR) {
+			continue;
+		}
+		if(read_return <= 0) {
+			LOGD("read %s\n", read_return == 0 ? "source too short" : strerror(errno));
+			free(buffer);
+			return -1;
+		}
+		if(write_all(fd, buffer, read_return) == -1) {
+			LOGE("write %s\n", strerror(errno));
+			free(buffer);
+			return -1;
+		}
+		copied += read_return;
+	}
+	free(buffer);
+	return 0;
+}
+
+// cuts the last component off a local path
+int get_parent_path(const char* local_path, char* buffer, size_t buffer_size) {
+	const char* last_slash = strrchr(local_path, '/');
+	if(last_slash == NULL || last_slash == local_path || last_slash - local_path >= buffer_size) {
+		return -1;
+	}
+	memcpy(buffer, local_path, last_slash - local_path);
+	buffer[last_slash - local_path] = 0;
+	return 0;
+}
+
+// keeps the local version of a file as a conflict copy if it differs from the version with the given hash
+// without a hash every local version is kept
+// returns 0 if the file can be replaced or -1 if the local version could not be kept
+int keep_local_version(const char* path, const unsigned char hash[SHA256_HASH_SIZE]) {
+	file_index_entry_type local_entry;
+	if(file_index_lookup(path, &local_entry) && local_entry.type == 'F' && (hash == NULL || memcmp(local_entry.hash, hash, SHA256_HASH_SIZE) != 0)) {
+		return local_file_make_conflict_copy(path, local_entry.hash);
+	}
+	return 0;
+}
+
+// writes the whole buffer, returns 0 on success or -1 on failure with errno set
+int write_all(int fd, const char* data, size_t size) {
+	size_t written = 0;
+	while(written < size) {
+		ssize_t write_return = write(fd, data + written, size - written);
+		if(write_return == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		written += write_return;
+	}
+	return 0;
+}
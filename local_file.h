@@ -0,0 +1,132 @@
+/**
+ * @file local_file.h
+ * @brief This module writes synced files to BASE_PATH.
+ *
+ * Files are never written in place. The contents go to a temporary file in the same directory which gets the
+ * modification time and the permission bits of the remote version and is then renamed over the old file. So other
+ * applications (and the other threads of this one) either see the old or the new version but never a partially
+ * written file, and a file that is identical to the remote one also has the same metadata, so it is not considered
+ * changed by the next comparison. Temporary files start with LOCAL_FILE_TEMP_PREFIX and are ignored by the file index
+ * and the file watcher.
+ *
+ * All paths passed to this module are relative to BASE_PATH and start with a '/'. All functions are thread safe.
+ */
+
+#ifndef LOCAL_FILE_H
+#define LOCAL_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/// The name prefix of temporary files, these files are never synced
+#define LOCAL_FILE_TEMP_PREFIX ".p2pfsync_tmp_"
+
+/**
+ * @brief Checks whether a name belongs to a temporary file of this module.
+ * @param name The name of the file without its parent path
+ * @return 1 if the name is the name of a temporary file. Otherwise 0 is returned.
+ */
+int local_file_is_temporary(const char* name);
+
+/**
+ * @brief Creates a temporary file the new version of a file can be written to. Missing parent directories are created.
+ * @param path The path of the file that will be replaced
+ * @param temp_path Receives the local path of the temporary file which has to be passed to local_file_commit()
+ * @param temp_path_size The size of @p temp_path, PATH_MAX is enough
+ * @return The file descriptor of the temporary file or -1 on failure
+ */
+int local_file_create_temporary(const char* path, char* temp_path, size_t temp_path_size);
+
+/**
+ * @brief Closes a temporary file, applies the metadata and moves it over the file it replaces.
+ *
+ * The file index is updated afterwards so the new version is known right away. On failure the temporary file is
+ * removed.
+ * @param fd The file descriptor returned by local_file_create_temporary()
+ * @param temp_path The local path returned by local_file_create_temporary()
+ * @param path The path of the file that is replaced
+ * @param mode The permission bits of the file, 0 keeps the default permissions
+ * @param mtime_ns The modification time in nanoseconds since the epoch, 0 keeps the current time
+ * @return 0 on success or -1 on failure
+ */
+int local_file_commit(int fd, const char* temp_path, const char* path, uint32_t mode, int64_t mtime_ns);
+
+/**
+ * @brief Removes a temporary file that is not needed anymore, e.g. because the download failed.
+ * @param fd The file descriptor returned by local_file_create_temporary()
+ * @param temp_path The local path returned by local_file_create_temporary()
+ */
+void local_file_discard(int fd, const char* temp_path);
+
+/**
+ * @brief Replaces a file with the given contents, see local_file_create_temporary() and local_file_commit().
+ * @param path The path of the file
+ * @param data The new contents
+ * @param size The size of @p data in bytes
+ * @param mode The permission bits of the file, 0 keeps the default permissions
+ * @param mtime_ns The modification time in nanoseconds since the epoch, 0 keeps the current time
+ * @return 0 on success or -1 on failure
+ */
+int local_file_write(const char* path, const char* data, size_t size, uint32_t mode, int64_t mtime_ns);
+
+/**
+ * @brief Commits a temporary file with a version received from a peer and remembers it as the synced version.
+ *
+ * See local_file_commit(), on failure the temporary file is removed.
+ * @param fd The file descriptor returned by local_file_create_temporary()
+ * @param temp_path The local path returned by local_file_create_temporary()
+ * @param path The path of the file that is replaced
+ * @param hash The remote content hash or NULL if it is unknown, then the hash of the received contents is used
+ * @param mode The remote permission bits, 0 if unknown
+ * @param mtime_ns The remote modification time in nanoseconds since the epoch, 0 if unknown
+ * @param keep_local_copy 1 if a different local version has to be kept with local_file_make_conflict_copy() first
+ * @return 0 on success or -1 on failure, a local version that could not be kept is never replaced
+ */
+int local_file_commit_remote(int fd, const char* temp_path, const char* path,
+		const unsigned char hash[SHA256_HASH_SIZE], uint32_t mode, int64_t mtime_ns, int keep_local_copy);
+
+/**
+ * @brief Writes a file received from a peer like local_file_write() and remembers it as the synced version.
+ * @param path The path of the file
+ * @param data The contents as received from the peer
+ * @param size The size of @p data in bytes
+ * @param mode The remote permission bits, 0 if unknown
+ * @param mtime_ns The remote modification time in nanoseconds since the epoch, 0 if unknown
+ * @param keep_local_copy 1 if a different local version has to be kept with local_file_make_conflict_copy() first
+ * @return 0 on success or -1 on failure, a local version that could not be kept is never replaced
+ */
+int local_file_store_remote(const char* path, const char* data, size_t size, uint32_t mode, int64_t mtime_ns,
+		int keep_local_copy);
+
+/**
+ * @brief Creates a file from a local file with the same contents, so it does not have to be downloaded.
+ *
+ * If a file was moved or copied on another peer, its contents are often still here under the old path. The index is
+ * searched for a file with this hash and size, which is then cloned with ioctl(FICLONE) on copy on write file systems
+ * or copied by the kernel with copy_file_range() otherwise. The old file stays where it is, because deletions are not
+ * synced. Like local_file_store_remote() the new file is remembered as the synced version.
+ * @param path The path of the file
+ * @param hash The content hash of the remote version
+ * @param size The size of the remote version in bytes
+ * @param mode The remote permission bits, 0 if unknown
+ * @param mtime_ns The remote modification time in nanoseconds since the epoch, 0 if unknown
+ * @param keep_local_copy 1 if a different local version has to be kept with local_file_make_conflict_copy() first
+ * @return 0 on success or -1 if there is no such file or it could not be copied, then the file has to be downloaded
+ */
+int local_file_store_local_copy(const char* path, const unsigned char hash[SHA256_HASH_SIZE], uint64_t size,
+		uint32_t mode, int64_t mtime_ns, int keep_local_copy);
+
+/**
+ * @brief Keeps the local version of a file that is about to be replaced by a conflicting version of another peer.
+ *
+ * The file is linked to "<name>.conflict-<date>-<hash>" in the same directory, so it is synced like any other file
+ * and the user can merge both versions. The copy is added to the file index and pushed to the peers.
+ * @param path The path of the file
+ * @param hash The content hash of the local version, it makes the name unique
+ * @return 0 on success or -1 on failure
+ */
+int local_file_make_conflict_copy(const char* path, const unsigned char hash[SHA256_HASH_SIZE]);
+
+#endif
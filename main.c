@@ -8,17 +8,18 @@
 #include "command_server.h"
 #include "defines.h"
 #include "file_client.h"
+#include "file_index.h"
 #include "file_server.h"
+#include "file_watcher.h"
+#include "gossip.h"
 #include "logger.h"
 #include "peer_list.h"
+#include "reconcile.h"
 #include "shutdown.h"
+#include "sync_scheduler.h"
+#include "timer_wheel.h"
 #include "util.h"
 
-void sigint_handler(int unused) {
-	LOGD("received SIGINT, shutting down...\n");
-	set_shutdown(1);
-}
-
 // the main function
 // - sets up all locks
 // - sets up the threads
@@ -28,6 +29,10 @@ int main() {
 	initialize_shutdown_lock();
 	initialize_logger_lock();
 	initialize_peer_list_lock();
+	initialize_file_index_lock();
+	initialize_sync_scheduler_lock();
+	initialize_reconcile_lock();
+	initialize_timer_wheel_lock();
 
 	set_shutdown(0); // make sure we do not shutdown right after starting
 
@@ -35,6 +40,11 @@ int main() {
 	mkdirp("./log");
 	// make sure the sync folder exists
 	mkdirp(BASE_PATH);
+	// make sure the state folder exists
+	mkdirp(STATE_PATH);
+
+	// load the file index, the file watcher thread brings it up to date
+	file_index_load();
 
 	//set_log_level(LOG_INFO);
 
@@ -43,9 +53,24 @@ int main() {
 	pthread_t command_server_thread_id;
 	pthread_t file_client_thread_id;
 	pthread_t file_server_thread_id;
+	pthread_t file_watcher_thread_id;
+	pthread_t gossip_thread_id;
+	pthread_t timer_wheel_thread_id;
+
+	// SIGINT is blocked before any thread is created, so all of them inherit the mask and only the main thread gets it
+	sigset_t signal_set;
+	sigemptyset(&signal_set);
+	sigaddset(&signal_set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
 
 	int success;
 
+	// the timer wheel is started first, all other threads use it
+	success = pthread_create(&timer_wheel_thread_id, NULL, timer_wheel_thread, (void*)0);
+	if(success != 0) {
+		LOGE("pthread_create failed with return code %d\n", success);
+	}
+
 	success = pthread_create(&broadcast_thread_id, NULL, broadcast_thread, (void*)0);
 	if(success != 0) {
 		LOGE("pthread_create failed with return code %d\n", success);
@@ -66,29 +91,47 @@ int main() {
 	if(success != 0) {
 		LOGE("pthread_create failed with return code %d\n", success);
 	}
-
-	// setup sigint handler
-	signal(SIGINT, sigint_handler);
-
-	while(!get_shutdown()) {
-		sleep(1);
+	success = pthread_create(&file_watcher_thread_id, NULL, file_watcher_thread, (void*)0);
+	if(success != 0) {
+		LOGE("pthread_create failed with return code %d\n", success);
+	}
+	success = pthread_create(&gossip_thread_id, NULL, gossip_thread, (void*)0);
+	if(success != 0) {
+		LOGE("pthread_create failed with return code %d\n", success);
 	}
 
+	// sleep until SIGINT arrives
+	int signal_number;
+	while(sigwait(&signal_set, &signal_number) != 0);
+	LOGD("received SIGINT, shutting down...\n");
+	set_shutdown(1);
+
 	// join all threads
 	pthread_join(broadcast_thread_id, NULL);
 	pthread_join(command_client_thread_id, NULL);
 	pthread_join(command_server_thread_id, NULL);
 	pthread_join(file_client_thread_id, NULL);
 	pthread_join(file_server_thread_id, NULL);
+	pthread_join(file_watcher_thread_id, NULL);
+	pthread_join(gossip_thread_id, NULL);
+	pthread_join(timer_wheel_thread_id, NULL);
 
 	LOGD("threads are down\n");
 
 	// cleanup
 	free_peer_list();
+	file_index_free();
+	free_sync_scheduler();
+	reconcile_free();
+	free_timer_wheel();
 
 	// destroy all locks
 	destroy_shutdown_lock();
 	destroy_peer_list_lock();
+	destroy_file_index_lock();
+	destroy_sync_scheduler_lock();
+	destroy_reconcile_lock();
+	destroy_timer_wheel_lock();
 	destroy_logger_lock();
 
 	pthread_exit(NULL); // should be at end of main function
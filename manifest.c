@@ -0,0 +1,342 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "defines.h"
+#include "file_index.h"
+#include "logger.h"
+#include "util.h"
+
+#include "manifest.h"
+
+#define MANIFEST_PATH STATE_PATH "/manifest"
+#define WRITE_BUFFER_ENTRIES 1024 // how many entries are collected before they are written
+#define REFRESH_INTERVAL_SECONDS 5.0 // a changing index rewrites the manifest at most this often, so a long sync does not rewrite it all the time
+
+/// The state while a manifest is written
+typedef struct {
+	int fd; //!< The file the manifest is written to
+	uint64_t entry_count; //!< How many entries were added so far
+	manifest_entry_type buffer[WRITE_BUFFER_ENTRIES]; //!< Entries that were not written yet
+	uint64_t buffer_start; //!< The index of the first entry in buffer
+	size_t buffer_count; //!< How many entries are in buffer
+	char* paths; //!< All paths added so far, they are written after the entries
+	size_t paths_size; //!< The used size of paths
+	size_t paths_capacity; //!< The allocated size of paths
+	int failed; //!< Set if anything could not be written
+} manifest_writer_type;
+
+// helper functions for this module
+static uint64_t add_entry(manifest_writer_type* writer, const char* path, const file_index_entry_type* entry);
+static void add_directory(manifest_writer_type* writer, const char* path, uint64_t directory_index);
+static int compare_paths(const char* a, const char* b);
+static void flush_entries(manifest_writer_type* writer);
+static void set_subtree_end(manifest_writer_type* writer, uint64_t index, uint64_t subtree_end);
+static int write_all(int fd, const void* data, size_t size, off_t offset);
+static int write_manifest();
+
+// static variables for this module
+static uint64_t manifest_generation = 0; // the index generation the manifest was written at
+static struct timeval manifest_write_time; // when the manifest was written the last time
+static int manifest_written = 0; // the manifest is written at least once per run, generations start over after a restart
+
+void manifest_refresh_local() {
+	// the generation is read first, so a change while writing only causes another rewrite later
+	uint64_t generation = file_index_get_generation();
+	int written = __atomic_load_n(&manifest_written, __ATOMIC_ACQUIRE);
+	if(written && (generation == manifest_generation || get_passed_time(manifest_write_time) < REFRESH_INTERVAL_SECONDS)) {
+		return;
+	}
+	struct timeval start_time;
+	gettimeofday(&start_time, NULL);
+	if(write_manifest() == -1) {
+		return;
+	}
+	manifest_generation = generation;
+	manifest_write_time = start_time;
+	// the command server only sends manifests that were written during this run
+	__atomic_store_n(&manifest_written, 1, __ATOMIC_RELEASE);
+	LOGD("manifest written in %.3f seconds\n", get_passed_time(start_time));
+}
+
+int manifest_open_local(uint64_t* size) {
+	if(!__atomic_load_n(&manifest_written, __ATOMIC_ACQUIRE)) {
+		// the manifest on disk is from the last run and may not match the index
+		return -1;
+	}
+	int fd = open(MANIFEST_PATH, O_RDONLY);
+	if(fd == -1) {
+		LOGE("open %s %s\n", MANIFEST_PATH, strerror(errno));
+		return -1;
+	}
+	struct stat info;
+	if(fstat(fd, &info) != 0) {
+		LOGE("fstat %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	*size = info.st_size;
+	return fd;
+}
+
+int manifest_map(const char* file_path, manifest_type* manifest) {
+	memset(manifest, 0, sizeof(manifest_type));
+	int fd = open(file_path, O_RDONLY);
+	if(fd == -1) {
+		LOGE("open %s %s\n", file_path, strerror(errno));
+		return -1;
+	}
+	struct stat info;
+	if(fstat(fd, &info) != 0 || info.st_size < sizeof(manifest_header_type)) {
+		LOGD("%s is too small for a manifest\n", file_path);
+		close(fd);
+		return -1;
+	}
+	char* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// the mapping stays valid after the file is closed
+	close(fd);
+	if(data == MAP_FAILED) {
+		LOGE("mmap %s\n", strerror(errno));
+		return -1;
+	}
+	uint64_t size = info.st_size;
+	const manifest_header_type* header = (const manifest_header_type*)data;
+	uint32_t entry_size = le32toh(header->entry_size);
+	uint64_t entry_count = le64toh(header->entry_count);
+	uint64_t entries_offset = le64toh(header->entries_offset);
+	uint64_t paths_offset = le64toh(header->paths_offset);
+	uint64_t paths_size = le64toh(header->paths_size);
+	// everything is checked once here, so the accessors do not have to
+	if(memcmp(header->magic, MANIFEST_MAGIC, MANIFEST_MAGIC_SIZE) != 0 || entry_size < sizeof(manifest_entry_type)
+			|| entries_offset > size || entry_count > (size - entries_offset) / entry_size
+			|| paths_offset > size || paths_size > size - paths_offset || paths_size == 0 || data[paths_offset + paths_size - 1] != 0) {
+		LOGD("%s is not a valid manifest\n", file_path);
+		munmap(data, info.st_size);
+		return -1;
+	}
+	manifest->data = data;
+	manifest->size = info.st_size;
+	manifest->entries = (const manifest_entry_type*)(data + entries_offset);
+	manifest->entry_count = entry_count;
+	manifest->entry_size = entry_size;
+	manifest->paths = data + paths_offset;
+	manifest->paths_size = paths_size;
+	return 0;
+}
+
+void manifest_unmap(manifest_type* manifest) {
+	if(manifest->data != NULL) {
+		munmap((void*)manifest->data, manifest->size);
+	}
+	memset(manifest, 0, sizeof(manifest_type));
+}
+
+void manifest_get_entry(const manifest_type* manifest, uint64_t index, manifest_entry_info_type* info) {
+	const manifest_entry_type* entry = (const manifest_entry_type*)((const char*)manifest->entries + index * manifest->entry_size);
+	uint64_t path_offset = le64toh(entry->path_offset);
+	// a broken offset only results in an empty path, the paths section is known to end with a 0
+	info->path = path_offset < manifest->paths_size ? manifest->paths + path_offset : manifest->paths + manifest->paths_size - 1;
+	const char* last_slash = strrchr(info->path, '/');
+	info->name = last_slash != NULL ? last_slash + 1 : info->path;
+	info->type = (char)entry->type;
+	info->mode = le32toh(entry->mode);
+	info->size = le64toh(entry->size);
+	info->mtime_ns = (int64_t)le64toh((uint64_t)entry->mtime_ns);
+	info->subtree_end = le64toh(entry->subtree_end);
+	// the subtree end always moves forward, so loops over the children are guaranteed to end
+	if(info->subtree_end <= index || info->subtree_end > manifest->entry_count) {
+		info->subtree_end = index + 1;
+	}
+	info->hash = entry->hash;
+	info->synced_hash = entry->synced_hash;
+}
+
+int64_t manifest_find(const manifest_type* manifest, const char* path) {
+	char search_path[PATH_MAX];
+	strncpy(search_path, path, sizeof(search_path) - 1);
+	search_path[sizeof(search_path) - 1] = 0;
+	size_t length = strlen(search_path);
+	if(length > 1 && search_path[length - 1] == '/') {
+		search_path[length - 1] = 0;
+	}
+	uint64_t low = 0;
+	uint64_t high = manifest->entry_count;
+	while(low < high) {
+		uint64_t middle = low + (high - low) / 2;
+		manifest_entry_info_type info;
+		manifest_get_entry(manifest, middle, &info);
+		int order = compare_paths(info.path, search_path);
+		if(order == 0) {
+			return middle;
+		}
+		if(order < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return -1;
+}
+
+uint64_t manifest_next_child(const manifest_type* manifest, uint64_t child) {
+	manifest_entry_info_type info;
+	manifest_get_entry(manifest, child, &info);
+	return info.subtree_end;
+}
+
+// MODULE SCOPED FUNTCIONS BEGIN
+
+// appends an entry and its path, returns the index of the entry
+uint64_t add_entry(manifest_writer_type* writer, const char* path, const file_index_entry_type* entry) {
+	if(writer->buffer_count == WRITE_BUFFER_ENTRIES) {
+		flush_entries(writer);
+	}
+	uint64_t index = writer->entry_count++;
+	manifest_entry_type* record = &writer->buffer[writer->buffer_count++];
+	memset(record, 0, sizeof(manifest_entry_type));
+	record->path_offset = htole64(writer->paths_size);
+	record->subtree_end = htole64(index + 1);
+	record->size = htole64(entry->size);
+	record->mtime_ns = (int64_t)htole64((uint64_t)entry->mtime_ns);
+	record->mode = htole32(entry->mode);
+	record->type = (uint8_t)entry->type;
+	memcpy(record->hash, entry->hash, SHA256_HASH_SIZE);
+	memcpy(record->synced_hash, entry->synced_hash, SHA256_HASH_SIZE);
+
+	size_t path_size = strlen(path) + 1;
+	if(writer->paths_size + path_size > writer->paths_capacity) {
+		writer->paths_capacity = (writer->paths_capacity + path_size) * 2;
+		writer->paths = (char*)realloc(writer->paths, writer->paths_capacity);
+	}
+	memcpy(writer->paths + writer->paths_size, path, path_size);
+	writer->paths_size += path_size;
+	return index;
+}
+
+// adds all entries below a directory in depth first order, the directory itself was added already
+void add_directory(manifest_writer_type* writer, const char* path, uint64_t directory_index) {
+	file_index_entry_type* entries;
+	size_t entry_count;
+	if(!file_index_list_directory(path, &entries, &entry_count)) {
+		// the directory was removed in the meantime
+		return;
+	}
+	char child_path[PATH_MAX];
+	size_t i;
+	for(i = 0; i < entry_count && !writer->failed; i++) {
+		if(snprintf(child_path, sizeof(child_path), "%s%s%s", path, strcmp(path, "/") == 0 ? "" : "/", entries[i].name) >= sizeof(child_path)) {
+			continue;
+		}
+		uint64_t child_index = add_entry(writer, child_path, &entries[i]);
+		if(entries[i].type == 'D') {
+			add_directory(writer, child_path, child_index);
+		}
+	}
+	free(entries);
+	set_subtree_end(writer, directory_index, writer->entry_count);
+}
+
+// compares paths in the order of the manifest, '/' comes before every other character
+// so a directory is followed by everything below it before the next entry of its parent
+int compare_paths(const char* a, const char* b) {
+	while(*a != 0 && *a == *b) {
+		a++;
+		b++;
+	}
+	int character_a = *a == '/' ? 1 : (unsigned char)*a;
+	int character_b = *b == '/' ? 1 : (unsigned char)*b;
+	return character_a - character_b;
+}
+
+void flush_entries(manifest_writer_type* writer) {
+	if(writer->buffer_count == 0 || writer->failed) {
+		return;
+	}
+	off_t offset = sizeof(manifest_header_type) + writer->buffer_start * sizeof(manifest_entry_type);
+	if(write_all(writer->fd, writer->buffer, writer->buffer_count * sizeof(manifest_entry_type), offset) == -1) {
+		writer->failed = 1;
+	}
+	writer->buffer_start += writer->buffer_count;
+	writer->buffer_count = 0;
+}
+
+// the subtree end of a directory is only known after everything below it was added
+void set_subtree_end(manifest_writer_type* writer, uint64_t index, uint64_t subtree_end) {
+	if(index >= writer->buffer_start) {
+		writer->buffer[index - writer->buffer_start].subtree_end = htole64(subtree_end);
+		return;
+	}
+	uint64_t value = htole64(subtree_end);
+	off_t offset = sizeof(manifest_header_type) + index * sizeof(manifest_entry_type) + offsetof(manifest_entry_type, subtree_end);
+	if(write_all(writer->fd, &value, sizeof(value), offset) == -1) {
+		writer->failed = 1;
+	}
+}
+
+int write_all(int fd, const void* data, size_t size, off_t offset) {
+	size_t written_bytes = 0;
+	while(written_bytes < size) {
+		ssize_t write_return = pwrite(fd, (const char*)data + written_bytes, size - written_bytes, offset + written_bytes);
+		if(write_return == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			LOGE("pwrite %s\n", strerror(errno));
+			return -1;
+		}
+		written_bytes += write_return;
+	}
+	return 0;
+}
+
+// writes a new manifest of the local index and replaces the old one with it
+// peers that are still reading the old manifest keep the old file
+int write_manifest() {
+	char temp_path[PATH_MAX];
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", MANIFEST_PATH);
+	manifest_writer_type* writer = (manifest_writer_type*)malloc(sizeof(manifest_writer_type));
+	memset(writer, 0, sizeof(manifest_writer_type));
+	writer->fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(writer->fd == -1) {
+		LOGE("open %s %s\n", temp_path, strerror(errno));
+		free(writer);
+		return -1;
+	}
+	file_index_entry_type root;
+	if(file_index_lookup("/", &root)) {
+		uint64_t root_index = add_entry(writer, "/", &root);
+		add_directory(writer, "/", root_index);
+	}
+	flush_entries(writer);
+
+	manifest_header_type header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MANIFEST_MAGIC, MANIFEST_MAGIC_SIZE);
+	header.header_size = htole32(sizeof(manifest_header_type));
+	header.entry_size = htole32(sizeof(manifest_entry_type));
+	header.entry_count = htole64(writer->entry_count);
+	header.entries_offset = htole64(sizeof(manifest_header_type));
+	header.paths_offset = htole64(sizeof(manifest_header_type) + writer->entry_count * sizeof(manifest_entry_type));
+	header.paths_size = htole64(writer->paths_size);
+	if(!writer->failed && (write_all(writer->fd, writer->paths, writer->paths_size, le64toh(header.paths_offset)) == -1 || write_all(writer->fd, &header, sizeof(header), 0) == -1)) {
+		writer->failed = 1;
+	}
+	int success = !writer->failed;
+	close(writer->fd);
+	free(writer->paths);
+	free(writer);
+	if(!success || rename(temp_path, MANIFEST_PATH) != 0) {
+		LOGE("could not write the manifest %s\n", strerror(errno));
+		unlink(temp_path);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,139 @@
+/**
+ * @file manifest.h
+ * @brief This module reads and writes manifests, binary snapshots of the whole file index.
+ *
+ * A manifest describes every file and directory of a tree in a single file that can be used right where it lies,
+ * e.g. after mapping it with mmap(). Nothing has to be parsed or allocated to look up a path or to list a directory:
+ * - the header tells the size and the position of all sections, so newer versions can append fields
+ * - the entries have a fixed size and are sorted in depth first order, every directory is followed by everything
+ *   below it and the children of a directory are sorted by name. So paths can be found with a binary search
+ * - every directory entry knows where its subtree ends, so listing a directory skips over the subdirectories
+ * - the paths are stored in a separate section, each terminated by a 0
+ * All numbers are stored in little endian byte order.
+ *
+ * The file watcher keeps a manifest of the local index in STATE_PATH and the command server sends it to peers that
+ * want to compare everything at once. It is only rebuilt if the index changed since it was written.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+#define MANIFEST_MAGIC "P2PFMAN1" // the last character is the format version
+#define MANIFEST_MAGIC_SIZE 8
+
+/// The header at the start of every manifest
+typedef struct {
+	char magic[MANIFEST_MAGIC_SIZE]; //!< MANIFEST_MAGIC
+	uint32_t header_size; //!< The size of this header, the entries may start later
+	uint32_t entry_size; //!< The size of a single entry, later versions may append fields
+	uint64_t entry_count; //!< The count of entries
+	uint64_t entries_offset; //!< Where the entries start, counted from the start of the manifest
+	uint64_t paths_offset; //!< Where the paths start, counted from the start of the manifest
+	uint64_t paths_size; //!< The size of all paths including their terminating 0
+} __attribute__((packed)) manifest_header_type;
+
+/// A single file or directory in a manifest
+typedef struct {
+	uint64_t path_offset; //!< Where the path starts, counted from paths_offset
+	uint64_t subtree_end; //!< For directories: the index of the first entry that is not below this directory. For files: the own index + 1
+	uint64_t size; //!< The size in bytes, 0 for directories
+	int64_t mtime_ns; //!< The modification time in nanoseconds since the epoch
+	uint32_t mode; //!< The permission bits
+	uint8_t type; //!< 'F' for regular files, 'D' for directories
+	uint8_t reserved[3]; //!< Always 0
+	unsigned char hash[SHA256_HASH_SIZE]; //!< The content hash, for directories the merkle hash
+	unsigned char synced_hash[SHA256_HASH_SIZE]; //!< The content hash of the last synced version, zero for directories
+} __attribute__((packed)) manifest_entry_type;
+
+/// A manifest mapped into memory
+typedef struct {
+	const char* data; //!< The start of the mapping, NULL if nothing is mapped
+	size_t size; //!< The size of the mapping
+	const manifest_entry_type* entries; //!< Points to the first entry, use manifest_get_entry() to access them
+	uint64_t entry_count; //!< The count of entries
+	uint32_t entry_size; //!< The size of a single entry as written
+	const char* paths; //!< Points to the paths section
+	uint64_t paths_size; //!< The size of the paths section
+} manifest_type;
+
+/// The decoded fields of a single entry
+typedef struct {
+	const char* path; //!< The full path, this points into the mapping
+	const char* name; //!< The name without its parent path, this points into the mapping
+	char type; //!< 'F' for regular files, 'D' for directories
+	uint32_t mode; //!< The permission bits
+	uint64_t size; //!< The size in bytes
+	int64_t mtime_ns; //!< The modification time in nanoseconds since the epoch
+	uint64_t subtree_end; //!< See manifest_entry_type::subtree_end
+	const unsigned char* hash; //!< The content hash, this points into the mapping
+	const unsigned char* synced_hash; //!< The content hash of the last synced version, this points into the mapping
+} manifest_entry_info_type;
+
+/**
+ * @brief Rewrites the manifest of the local index in STATE_PATH if the index changed since it was written.
+ *
+ * While the index keeps changing the manifest is rewritten at most every few seconds.
+ * This must only be called from a single thread, the file watcher.
+ */
+void manifest_refresh_local();
+
+/**
+ * @brief Opens the latest manifest of the local index. Nothing is written here, manifest_refresh_local() keeps it
+ * up to date.
+ * @param size Receives the size of the manifest
+ * @return A file descriptor of the manifest opened for reading or -1 if there is no manifest of this run yet.
+ * The caller has to close it.
+ */
+int manifest_open_local(uint64_t* size);
+
+/**
+ * @brief Maps a manifest file into memory and checks that it is well formed.
+ * @param file_path The path of the manifest file
+ * @param manifest Receives the mapping
+ * @return 0 on success or -1 if the file could not be mapped or is not a valid manifest.
+ */
+int manifest_map(const char* file_path, manifest_type* manifest);
+
+/**
+ * @brief Releases a mapping created by manifest_map().
+ * @param manifest The mapped manifest
+ */
+void manifest_unmap(manifest_type* manifest);
+
+/**
+ * @brief Decodes a single entry. The paths and hashes are not copied.
+ * @param manifest The mapped manifest
+ * @param index The index of the entry, it has to be smaller than manifest_type::entry_count
+ * @param info Receives the fields of the entry
+ */
+void manifest_get_entry(const manifest_type* manifest, uint64_t index, manifest_entry_info_type* info);
+
+/**
+ * @brief Finds a path with a binary search.
+ * @param manifest The mapped manifest
+ * @param path The path relative to BASE_PATH, a trailing slash is ignored
+ * @return The index of the entry or -1 if the path is not in the manifest.
+ */
+int64_t manifest_find(const manifest_type* manifest, const char* path);
+
+/**
+ * @brief Gets the next direct child of a directory.
+ *
+ * \code{.c}
+ * uint64_t child;
+ * for(child = directory + 1; child < directory_info.subtree_end; child = manifest_next_child(&manifest, child)) {
+ *     ...
+ * }
+ * \endcode
+ * @param manifest The mapped manifest
+ * @param child The index of a child of the directory
+ * @return The index of the next child, if it is >= subtree_end of the directory there are no more children.
+ */
+uint64_t manifest_next_child(const manifest_type* manifest, uint64_t child);
+
+#endif
@@ -1,17 +1,55 @@
+#include <errno.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "logger.h"
 #include "message_queue.h"
 
+// helper functions for this module
+static void append_message(message_queue_type* message_queue, message_queue_entry_type* message);
+static void message_added(message_queue_type* message_queue);
+static void message_removed(message_queue_type* message_queue);
+
 message_queue_type* message_queue_create_queue() {
+	return message_queue_create_bounded_queue(0);
+}
+
+message_queue_type* message_queue_create_bounded_queue(size_t capacity) {
 	message_queue_type* new_queue = (message_queue_type*)malloc(sizeof(message_queue_type));
 	memset(new_queue, 0, sizeof(message_queue_type));
+	new_queue->capacity = capacity;
 	if(pthread_mutex_init(&new_queue->mutex, NULL) != 0) {
 		LOGE("pthread_mutex_init failed\n");
 	}
+	// the timeouts of message_queue_wait() must not jump with the wall clock
+	pthread_condattr_t condition_attributes;
+	pthread_condattr_init(&condition_attributes);
+	pthread_condattr_setclock(&condition_attributes, CLOCK_MONOTONIC);
+	if(pthread_cond_init(&new_queue->not_empty, &condition_attributes) != 0 || pthread_cond_init(&new_queue->not_full, &condition_attributes) != 0) {
+		LOGE("pthread_cond_init failed\n");
+	}
+	pthread_condattr_destroy(&condition_attributes);
+	new_queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(new_queue->event_fd == -1) {
+		LOGE("eventfd %s\n", strerror(errno));
+	}
 	return new_queue;
 }
 
+void message_queue_close(message_queue_type* message_queue) {
+	pthread_mutex_lock(&message_queue->mutex);
+	message_queue->closed = 1;
+	pthread_cond_broadcast(&message_queue->not_full);
+	// the waiting producers still use the mutex when they wake up, so the queue must not be freed before they left
+	while(message_queue->waiting_count > 0) {
+		pthread_cond_wait(&message_queue->not_full, &message_queue->mutex);
+	}
+	pthread_mutex_unlock(&message_queue->mutex);
+}
+
 // the callers have to make sure that this is not called while another thread wants to use
 // synchronized functions...
 void message_queue_free_queue(message_queue_type* message_queue) {
@@ -23,6 +61,11 @@ void message_queue_free_queue(message_queue_type* message_queue) {
 		message_iterator = saved_next;
 	}
 	// last we free the message_queue
+	if(message_queue->event_fd != -1) {
+		close(message_queue->event_fd);
+	}
+	pthread_cond_destroy(&message_queue->not_empty);
+	pthread_cond_destroy(&message_queue->not_full);
 	if(pthread_mutex_destroy(&message_queue->mutex) != 0) {
 		LOGE("pthread_mutex_destroy failed\n");
 	}
@@ -30,32 +73,89 @@ void message_queue_free_queue(message_queue_type* message_queue) {
 }
 
 // messages coming in here should always have next = NULL
-void message_queue_push(message_queue_type* message_queue, message_queue_entry_type* message) {
+int message_queue_push(message_queue_type* message_queue, message_queue_entry_type* message) {
 	pthread_mutex_lock(&message_queue->mutex);
-	// find the end and append the message;
-	if(message_queue->head == NULL) {
-		// queue is empty, special case
-		message_queue->head = message;
+	message_queue->waiting_count++;
+	while(!message_queue->closed && message_queue->capacity > 0 && message_queue->count >= message_queue->capacity) {
+		pthread_cond_wait(&message_queue->not_full, &message_queue->mutex);
 	}
-	else {
-		// apped at end
-		message_queue_entry_type* iterator;
-		for(iterator = message_queue->head; iterator->next != NULL; iterator = iterator->next);
-		iterator->next = message;
+	message_queue->waiting_count--;
+	int pushed = !message_queue->closed;
+	if(pushed) {
+		append_message(message_queue, message);
+	} else {
+		// message_queue_close() waits for the last producer to leave
+		pthread_cond_broadcast(&message_queue->not_full);
+	}
+	pthread_mutex_unlock(&message_queue->mutex);
+	if(!pushed) {
+		message_queue_free_message(message);
+	}
+	return pushed;
+}
+
+int message_queue_try_push(message_queue_type* message_queue, message_queue_entry_type* message) {
+	int pushed = 0;
+	pthread_mutex_lock(&message_queue->mutex);
+	if(!message_queue->closed && (message_queue->capacity == 0 || message_queue->count < message_queue->capacity)) {
+		append_message(message_queue, message);
+		pushed = 1;
+	}
+	pthread_mutex_unlock(&message_queue->mutex);
+	return pushed;
+}
+
+void message_queue_push_front(message_queue_type* message_queue, message_queue_entry_type* message) {
+	pthread_mutex_lock(&message_queue->mutex);
+	message->next = message_queue->head;
+	message_queue->head = message;
+	if(message_queue->tail == NULL) {
+		message_queue->tail = message;
 	}
+	message_added(message_queue);
 	pthread_mutex_unlock(&message_queue->mutex);
 }
+
 message_queue_entry_type* message_queue_pop(message_queue_type* message_queue) {
 	pthread_mutex_lock(&message_queue->mutex);
 	message_queue_entry_type* message = NULL;
 	if(message_queue->head != NULL) {
 		message = message_queue->head;
 		message_queue->head = message_queue->head->next;
+		if(message_queue->head == NULL) {
+			message_queue->tail = NULL;
+		}
+		message->next = NULL;
+		message_removed(message_queue);
 	}
 	pthread_mutex_unlock(&message_queue->mutex);
 	return message;
 }
 
+int message_queue_wait(message_queue_type* message_queue, double timeout_seconds) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += (time_t)timeout_seconds;
+	deadline.tv_nsec += (long)((timeout_seconds - (time_t)timeout_seconds) * 1000000000);
+	if(deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&message_queue->mutex);
+	while(message_queue->head == NULL) {
+		if(pthread_cond_timedwait(&message_queue->not_empty, &message_queue->mutex, &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	int has_message = message_queue->head != NULL;
+	pthread_mutex_unlock(&message_queue->mutex);
+	return has_message;
+}
+
+int message_queue_get_fd(message_queue_type* message_queue) {
+	return message_queue->event_fd;
+}
+
 // helper functions for messages
 // the create function allocates new memory and copies the id and the arguments
 message_queue_entry_type* message_queue_create_message(const char* message_id, const void* arguments, size_t arguments_size) {
@@ -84,3 +184,45 @@ void message_queue_free_message(message_queue_entry_type* message) {
 	}
 	free(message);
 }
+
+// MODULE SCOPED FUNTCIONS BEGIN
+
+// MUST BE CALLED WITH THE LOCK HELD
+void append_message(message_queue_type* message_queue, message_queue_entry_type* message) {
+	if(message_queue->tail == NULL) {
+		// queue is empty, special case
+		message_queue->head = message;
+	}
+	else {
+		message_queue->tail->next = message;
+	}
+	message_queue->tail = message;
+	message_added(message_queue);
+}
+
+// MUST BE CALLED WITH THE LOCK HELD
+// wakes up the consumer, the eventfd only changes when the queue stops being empty, so most pushes cost no system call
+void message_added(message_queue_type* message_queue) {
+	message_queue->count++;
+	if(message_queue->count == 1 && message_queue->event_fd != -1) {
+		uint64_t value = 1;
+		if(write(message_queue->event_fd, &value, sizeof(value)) != sizeof(value)) {
+			LOGE("write eventfd %s\n", strerror(errno));
+		}
+	}
+	pthread_cond_signal(&message_queue->not_empty);
+}
+
+// MUST BE CALLED WITH THE LOCK HELD
+void message_removed(message_queue_type* message_queue) {
+	if(message_queue->count-- == message_queue->capacity) {
+		pthread_cond_broadcast(&message_queue->not_full);
+	}
+	if(message_queue->count == 0 && message_queue->event_fd != -1) {
+		// the queue is empty again, so select() should not return for it anymore
+		uint64_t value;
+		if(read(message_queue->event_fd, &value, sizeof(value)) != sizeof(value)) {
+			LOGE("read eventfd %s\n", strerror(errno));
+		}
+	}
+}
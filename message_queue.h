@@ -1,6 +1,11 @@
 /**
  * @file message_queue.h
  * @brief This file provides a thread safe queue data structure and appropriate algorithms to work with it
+ *
+ * A thread that owns a queue does not have to poll it. It either blocks in message_queue_wait() until a message
+ * arrives, or it adds message_queue_get_fd() to the set of its select() call, so it wakes up for its sockets and its
+ * messages alike. A queue can have a capacity, then message_queue_push() blocks while the queue is full, which slows
+ * down a producer that is faster than the consumer instead of letting the queue grow without bound.
  */
 
 #ifndef MESSAGE_QUEUE_H
@@ -22,7 +27,15 @@ typedef struct message_queue_entry {
 /// This represents a message queue
 typedef struct {
 	message_queue_entry_type* head; //!< The first entry of the message queue
+	message_queue_entry_type* tail; //!< The last entry of the message queue, so appending takes constant time
+	size_t count; //!< The count of queued messages
+	size_t capacity; //!< The count of messages message_queue_push() waits at, 0 for no limit
+	int event_fd; //!< An eventfd that is readable while the queue is not empty
+	int closed; //!< Set by message_queue_close(), then no more messages are accepted
+	int waiting_count; //!< The count of threads that wait in message_queue_push() for the queue to get space
 	pthread_mutex_t mutex; //!< A mutex for this message queue to ensure thread safety
+	pthread_cond_t not_empty; //!< Signaled when a message is added
+	pthread_cond_t not_full; //!< Signaled when a message is removed from a full queue
 } message_queue_type;
 
 // this function creates a new queue with a mutex and
@@ -33,6 +46,22 @@ typedef struct {
  */
 message_queue_type* message_queue_create_queue();
 
+/**
+ * @brief This function creates a new message queue that holds a limited count of messages
+ * @param capacity The count of messages message_queue_push() waits at
+ * @return The memory address where the created queue resides
+ */
+message_queue_type* message_queue_create_bounded_queue(size_t capacity);
+
+/**
+ * @brief Stops a message queue from accepting messages
+ *
+ * Threads that wait in message_queue_push() give up their message, this returns after all of them left. It has to
+ * be called before a bounded queue is freed while other threads may still push to it.
+ * @param message_queue A pointer to the message queue to close
+ */
+void message_queue_close(message_queue_type* message_queue);
+
 // this function frees the queue and destroys the mutex
 /**
  * @brief Frees the message queue and all messages currently queued up
@@ -43,10 +72,31 @@ void message_queue_free_queue(message_queue_type* message_queue);
 // synchronized function that enqueues a message
 /**
  * @brief This function is used to append a message to a queue in a thread safe manner
+ *
+ * If the queue has a capacity and is full this waits until the consumer removed a message or the queue was closed.
  * @param message_queue A pointer to the message queue that the message should be appended to
- * @param message The message to append
+ * @param message The message to append, it is freed if the queue was closed
+ * @return 1 if the message was appended. 0 if the queue was closed.
  */
-void message_queue_push(message_queue_type* message_queue, message_queue_entry_type* message);
+int message_queue_push(message_queue_type* message_queue, message_queue_entry_type* message);
+
+/**
+ * @brief This function appends a message to a queue unless the queue is full
+ * @param message_queue A pointer to the message queue that the message should be appended to
+ * @param message The message to append, it still belongs to the caller if it was not appended
+ * @return 1 if the message was appended. 0 if the queue is full or closed.
+ */
+int message_queue_try_push(message_queue_type* message_queue, message_queue_entry_type* message);
+
+/**
+ * @brief This function is used to put a message in front of all other messages of a queue in a thread safe manner
+ *
+ * This is meant for events that change how the messages already in the queue have to be handled. It never waits,
+ * not even if the queue is full, so it can be used from the callbacks of the timer wheel.
+ * @param message_queue A pointer to the message queue that the message should be prepended to
+ * @param message The message to prepend
+ */
+void message_queue_push_front(message_queue_type* message_queue, message_queue_entry_type* message);
 
 // synchronized function that dequeues a message
 /**
@@ -56,6 +106,24 @@ void message_queue_push(message_queue_type* message_queue, message_queue_entry_t
  */
 message_queue_entry_type* message_queue_pop(message_queue_type* message_queue);
 
+/**
+ * @brief Waits until a message is in the queue, it is not removed.
+ * @param message_queue The message queue to wait for
+ * @param timeout_seconds The maximum time to wait
+ * @return 1 if there is a message in the queue. 0 if the time ran out.
+ */
+int message_queue_wait(message_queue_type* message_queue, double timeout_seconds);
+
+/**
+ * @brief Gets a file descriptor that is readable while messages are in the queue.
+ *
+ * It can be added to the read set of select() to wake up as soon as a message arrives. It must not be read from, the
+ * queue resets it when the last message is removed.
+ * @param message_queue The message queue
+ * @return The file descriptor, -1 if the kernel does not support it
+ */
+int message_queue_get_fd(message_queue_type* message_queue);
+
 // helper functions for messages
 // THESE FUNCTIONS ARE NOT CALLED ON A SPECIFIC message_queue
 // the create function allocates new memory and copies the id and the arguments
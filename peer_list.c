@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,23 +10,56 @@
 #include "peer_list.h"
 #include "ip_address_list.h"
 #include "broadcast.h"
+#include "command_client.h"
+#include "file_client.h"
+#include "timer_wheel.h"
 #include "util.h"
 
-void append_peer(char id[6]);
+#define PEER_TABLE_MIN_CAPACITY 16 // must be a power of two
+#define PEER_TABLE_MAX_LOAD 0.5 // the table grows when more slots than this are used, so the probe sequences stay short
 
-/// A single node in the peer list
+/// A single slot of the peer table
 typedef struct peer {
-	// link to the next peer
-	struct peer* next_peer; //!< A link to the next peer
+	int used; //!< 1 if this slot holds a peer
 
 	// id of the peer
 	char id[6]; //!< The id of this peer
 
-	// a list of ip addresses
+	int has_address; //!< 1 if best_address is set
+	struct sockaddr_storage best_address; //!< The best address of ip_address, this is what the readers get
+
+	// everything below is only touched with the lock held
 	struct ip_address_entry* ip_address; //!< A list of known ip addresses of this peer
+	struct timeval last_seen; //!< When any address of this peer was last seen
+	uint64_t expiry_timer; //!< The timer that removes expired addresses and finally the peer itself
 } peer_t;
 
+/// An open addressing hash table with linear probing
+typedef struct peer_table {
+	size_t capacity; //!< The count of slots, a power of two
+	size_t count; //!< The count of used slots
+	struct peer_table* retired_next; //!< Replaced tables are kept in a list until the peer list is freed
+	peer_t slots[]; //!< The slots
+} peer_table_type;
+
+static void expire_peer(void* argument);
+static peer_t* find_peer(const char id[6]);
+static size_t get_home_slot(const peer_table_type* peer_table, const char id[6]);
+static int grow_table();
+static peer_table_type* new_table(size_t capacity);
+static int read_begin();
+static int read_retry(int sequence);
+static void unlink_peer(peer_t* peer);
+static void update_best_address(peer_t* peer);
+static void write_begin();
+static void write_end();
+
+// the writers are serialized by the lock, the readers do not take it at all
+// instead they check the sequence that is odd while a writer changes what they read and retry (seqlock)
 static pthread_mutex_t peer_list_lock;
+static int sequence = 0;
+static peer_table_type* table = NULL;
+static peer_table_type* retired_tables = NULL; // a reader might still look at them, the memory is small compared to the current table
 
 void initialize_peer_list_lock() {
 	if(pthread_mutex_init(&peer_list_lock, NULL) != 0) {
@@ -39,120 +73,402 @@ void destroy_peer_list_lock() {
 	}
 }
 
-static peer_t* peer_list = NULL;
-
-// helper function
-// this function MUST NOT LOCK THE MUTEX as it is called by the other locking functions
-peer_t* find_peer(char id[6]) {
-	peer_t* peer_iterator = NULL;
-	for(peer_iterator = peer_list; peer_iterator != NULL; peer_iterator = peer_iterator->next_peer) {
-		if(memcmp(peer_iterator->id, id, 6) == 0) {
-			break;
-		}
-	}
-	return peer_iterator;
-}
-
-void add_ip_to_peer(char id[6], struct sockaddr* ip_address, struct timeval last_seen) {
+int add_ip_to_peer(char id[6], struct sockaddr* ip_address, unsigned int interface_index, int link_speed, struct timeval last_seen) {
+	int is_new = 0;
 	pthread_mutex_lock(&peer_list_lock);
 	peer_t* peer = find_peer(id);
 	if(peer == NULL) {
 		LOGD("peer not in list\n");
-		append_peer(id);
-		peer = find_peer(id);
+		if((table == NULL || table->count + 1 > table->capacity * PEER_TABLE_MAX_LOAD) && !grow_table()) {
+			pthread_mutex_unlock(&peer_list_lock);
+			return 0;
+		}
+		size_t index = get_home_slot(table, id);
+		while(table->slots[index].used) {
+			index = (index + 1) & (table->capacity - 1);
+		}
+		peer = &table->slots[index];
+		write_begin();
+		memset(peer, 0, sizeof(peer_t));
+		memcpy(peer->id, id, 6);
+		peer->used = 1;
+		table->count++;
+		write_end();
+		// the timer is only started once, it checks when the next address expires whenever it fires
+		peer->expiry_timer = timer_wheel_start(ADDRESS_TTL_SECONDS, expire_peer, id, 6);
+		is_new = 1;
 	}
 	// the peer is valid
-	add_or_update_entry(&peer->ip_address, ip_address, last_seen);
+	add_or_update_entry(&peer->ip_address, ip_address, interface_index, link_speed, last_seen);
+	if(timercmp(&last_seen, &peer->last_seen, >)) {
+		peer->last_seen = last_seen;
+	}
+	update_best_address(peer);
 	pthread_mutex_unlock(&peer_list_lock);
+	return is_new;
 }
 
-// internal helper function! MUST NOT LOCK MUTEX
-void append_peer(char id[6]) {
-	if(find_peer(id) != NULL) {
-		LOGD("peer already in list\n");
-		return;
+int is_peer_in_list(char id[6]) {
+	int found;
+	int read_sequence;
+	do {
+		read_sequence = read_begin();
+		found = 0;
+		peer_table_type* peer_table = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+		if(peer_table != NULL) {
+			size_t index;
+			for(index = get_home_slot(peer_table, id); peer_table->slots[index].used; index = (index + 1) & (peer_table->capacity - 1)) {
+				if(memcmp(peer_table->slots[index].id, id, 6) == 0) {
+					found = 1;
+					break;
+				}
+			}
+		}
+	} while(read_retry(read_sequence));
+	return found;
+}
+
+int get_peer_ip_address(char id[6], struct sockaddr_storage* ip_address) {
+	int found;
+	int read_sequence;
+	do {
+		read_sequence = read_begin();
+		found = 0;
+		peer_table_type* peer_table = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+		if(peer_table != NULL) {
+			size_t index;
+			for(index = get_home_slot(peer_table, id); peer_table->slots[index].used; index = (index + 1) & (peer_table->capacity - 1)) {
+				if(memcmp(peer_table->slots[index].id, id, 6) == 0) {
+					if(peer_table->slots[index].has_address) {
+						memcpy(ip_address, &peer_table->slots[index].best_address, sizeof(struct sockaddr_storage));
+						found = 1;
+					}
+					break;
+				}
+			}
+		}
+	} while(read_retry(read_sequence));
+	return found;
+}
+
+size_t get_peer_count() {
+	size_t peer_count;
+	int read_sequence;
+	do {
+		read_sequence = read_begin();
+		peer_table_type* peer_table = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+		peer_count = peer_table != NULL ? peer_table->count : 0;
+	} while(read_retry(read_sequence));
+	return peer_count;
+}
+
+size_t get_known_peers(known_peer_type** peers) {
+	size_t capacity = 0;
+	*peers = NULL;
+	size_t index;
+	int read_sequence;
+	do {
+		read_sequence = read_begin();
+		peer_table_type* peer_table = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+		size_t peer_count = peer_table != NULL ? peer_table->count : 0;
+		if(peer_count > capacity || *peers == NULL) {
+			// allocating while reading is fine, the sequence is checked again afterwards anyway
+			free(*peers);
+			capacity = peer_count;
+			*peers = (known_peer_type*)malloc(capacity * sizeof(known_peer_type) + 1);
+		}
+		index = 0;
+		size_t slot;
+		for(slot = 0; peer_table != NULL && slot < peer_table->capacity && index < capacity; slot++) {
+			if(peer_table->slots[slot].used && peer_table->slots[slot].has_address) {
+				memcpy((*peers)[index].id, peer_table->slots[slot].id, 6);
+				memcpy(&(*peers)[index].address, &peer_table->slots[slot].best_address, sizeof(struct sockaddr_storage));
+				index++;
+			}
+		}
+	} while(read_retry(read_sequence));
+	return index;
+}
+
+int connect_to_peer(char id[6], const struct sockaddr_storage* fallback_address, unsigned short port, double timeout_seconds, struct sockaddr_storage* used_address) {
+	struct sockaddr_storage addresses[CONNECT_CANDIDATE_MAX_COUNT];
+	size_t address_count = 0;
+	pthread_mutex_lock(&peer_list_lock);
+	peer_t* peer = find_peer(id);
+	if(peer != NULL) {
+		address_count = get_ranked_addresses(&peer->ip_address, addresses, CONNECT_CANDIDATE_MAX_COUNT);
 	}
-	peer_t* peer = (peer_t*)malloc(sizeof(peer_t));
-	memset(peer, 0, sizeof(peer_t));
-	memcpy(&peer->id, id, 6);
-	if(peer_list == NULL) {
-		// the list is empty
-		peer_list = peer;
-		return;
+	pthread_mutex_unlock(&peer_list_lock);
+	if(address_count == 0) {
+		memcpy(&addresses[0], fallback_address, sizeof(struct sockaddr_storage));
+		address_count = 1;
+	}
+
+	// the families take turns, so a broken IPv6 or IPv4 setup costs a single delay and not one per address
+	connect_attempt_type attempts[CONNECT_CANDIDATE_MAX_COUNT];
+	memset(attempts, 0, sizeof(attempts));
+	int used[CONNECT_CANDIDATE_MAX_COUNT] = {0};
+	sa_family_t family = addresses[0].ss_family;
+	size_t attempt_index;
+	for(attempt_index = 0; attempt_index < address_count; attempt_index++) {
+		size_t address_index;
+		for(address_index = 0; address_index < address_count && (used[address_index] || addresses[address_index].ss_family != family); address_index++);
+		if(address_index == address_count) {
+			// no address of this family is left, so the best remaining one is taken
+			for(address_index = 0; used[address_index]; address_index++);
+		}
+		used[address_index] = 1;
+		memcpy(&attempts[attempt_index].address, &addresses[address_index], sizeof(struct sockaddr_storage));
+		family = addresses[address_index].ss_family == AF_INET6 ? AF_INET : AF_INET6;
+	}
+
+	int socketfd = connect_parallel(attempts, address_count, port, CONNECT_ATTEMPT_DELAY_SECONDS, timeout_seconds);
+	for(attempt_index = 0; attempt_index < address_count; attempt_index++) {
+		// attempts that were cancelled or not started tell nothing about their address
+		if(attempts[attempt_index].state == CONNECT_ATTEMPT_FAILED || attempts[attempt_index].state == CONNECT_ATTEMPT_SUCCEEDED) {
+			report_peer_connect(id, (struct sockaddr*)&attempts[attempt_index].address, attempts[attempt_index].seconds, attempts[attempt_index].state == CONNECT_ATTEMPT_SUCCEEDED);
+		}
+		if(attempts[attempt_index].state == CONNECT_ATTEMPT_SUCCEEDED) {
+			memcpy(used_address, &attempts[attempt_index].address, sizeof(struct sockaddr_storage));
+		}
 	}
-	peer_t* peer_iterator;
-	for(peer_iterator = peer_list; peer_iterator->next_peer != NULL; peer_iterator = peer_iterator->next_peer);
-	peer_iterator->next_peer = peer;
+	if(socketfd == -1) {
+		char id_buffer[13];
+		get_hex_string((unsigned char*)id, 6, id_buffer, sizeof(id_buffer));
+		LOGW("connecting to %s failed on %zu addresses\n", id_buffer, address_count);
+		memcpy(used_address, &attempts[0].address, sizeof(struct sockaddr_storage));
+	}
+	return socketfd;
 }
 
-int is_peer_in_list(char id[6]) {
-	int found = 0;
+void report_peer_connect(char id[6], const struct sockaddr* ip_address, double seconds, int success) {
 	pthread_mutex_lock(&peer_list_lock);
-	if(find_peer(id) != NULL) {
-		found = 1;
+	peer_t* peer = find_peer(id);
+	if(peer != NULL && record_connect_result(&peer->ip_address, ip_address, seconds, success)) {
+		update_best_address(peer);
 	}
 	pthread_mutex_unlock(&peer_list_lock);
-	return found;
 }
 
-int get_peer_ip_address(char id[6], struct sockaddr_storage* ip_address) {
-	int found = 0;
+void report_peer_transfer(char id[6], const struct sockaddr* ip_address, uint64_t bytes, double seconds) {
 	pthread_mutex_lock(&peer_list_lock);
 	peer_t* peer = find_peer(id);
-	if(peer != NULL) {
-		found = get_best_address(&peer->ip_address, ip_address);
+	if(peer != NULL && record_transfer(&peer->ip_address, ip_address, bytes, seconds)) {
+		update_best_address(peer);
 	}
 	pthread_mutex_unlock(&peer_list_lock);
-	return found;
 }
 
 void remove_peer(char id[6]) {
 	pthread_mutex_lock(&peer_list_lock);
-	if(peer_list == NULL) {
-		// we cannot remove something from an empty list
-		goto end;
-	}
 	peer_t* peer = find_peer(id);
 	if(peer == NULL) {
 		LOGD("cannot remove peer, not in list\n");
-		goto end;
-	}
-	if(peer_list == peer) {
-		// we want to remove the head
-		peer_list = peer->next_peer;
-		free(peer);
-		goto end;
-	}
-
-	// otherwise we search for the peer in the list
-	peer_t* peer_iterator;
-	peer_t* previous_peer;
-	for(peer_iterator = peer_list; (peer_iterator != peer && peer_iterator != NULL); previous_peer = peer_iterator, peer_iterator = peer_iterator->next_peer);
-	previous_peer->next_peer = peer_iterator->next_peer;
-	free(peer_iterator);
-end:
+	} else {
+		unlink_peer(peer);
+	}
 	pthread_mutex_unlock(&peer_list_lock);
 }
 
 void print_peer_list() {
 	pthread_mutex_lock(&peer_list_lock);
-	peer_t* peer_iterator;
-	for(peer_iterator = peer_list; peer_iterator != NULL; peer_iterator = peer_iterator->next_peer) {
+	size_t slot;
+	for(slot = 0; table != NULL && slot < table->capacity; slot++) {
+		if(!table->slots[slot].used) {
+			continue;
+		}
 		char hex_buffer[128];
-		get_hex_string((unsigned char*)peer_iterator->id, 6, hex_buffer, sizeof(hex_buffer));
+		get_hex_string((unsigned char*)table->slots[slot].id, 6, hex_buffer, sizeof(hex_buffer));
 		LOGD("[%s]\n", hex_buffer);
-		print_ip_address_list(&peer_iterator->ip_address);
+		print_ip_address_list(&table->slots[slot].ip_address);
 	}
 	pthread_mutex_unlock(&peer_list_lock);
 }
 
 void free_peer_list() {
 	pthread_mutex_lock(&peer_list_lock);
-	peer_t* next_peer;
-	while(peer_list != NULL) {
-		next_peer = peer_list->next_peer;
-		free(peer_list);
-		peer_list = next_peer;
+	size_t slot;
+	for(slot = 0; table != NULL && slot < table->capacity; slot++) {
+		if(table->slots[slot].used) {
+			free_ip_address_list(&table->slots[slot].ip_address);
+		}
+	}
+	free(table);
+	table = NULL;
+	while(retired_tables != NULL) {
+		peer_table_type* next_table = retired_tables->retired_next;
+		free(retired_tables);
+		retired_tables = next_table;
+	}
+	pthread_mutex_unlock(&peer_list_lock);
+}
+
+// called by the timer wheel, removes the expired addresses of a peer
+// if there are none left and the peer was not seen for PEER_TTL_SECONDS the peer is removed as well
+void expire_peer(void* argument) {
+	char* id = (char*)argument;
+	int lost = 0;
+	pthread_mutex_lock(&peer_list_lock);
+	peer_t* peer = find_peer(id);
+	if(peer == NULL) {
+		pthread_mutex_unlock(&peer_list_lock);
+		return;
+	}
+	// the peers announce themselves less often in large networks
+	double scale = broadcast_get_interval_scale(table->count);
+	remove_expired_entries(&peer->ip_address, ADDRESS_TTL_SECONDS * scale);
+	update_best_address(peer);
+	double next_check;
+	struct timeval oldest_last_seen;
+	if(get_oldest_entry(&peer->ip_address, &oldest_last_seen)) {
+		next_check = ADDRESS_TTL_SECONDS * scale - get_passed_time(oldest_last_seen);
+	} else {
+		next_check = PEER_TTL_SECONDS * scale - get_passed_time(peer->last_seen);
+		lost = next_check <= 0;
+	}
+	if(lost) {
+		unlink_peer(peer);
+	} else {
+		peer->expiry_timer = timer_wheel_start(next_check, expire_peer, id, 6);
 	}
 	pthread_mutex_unlock(&peer_list_lock);
+
+	if(lost) {
+		char hex_buffer[20];
+		get_hex_string((unsigned char*)id, 6, hex_buffer, sizeof(hex_buffer));
+		LOGI("peer lost: %s\n", hex_buffer);
+		// the clients are told outside of the lock, they ask the peer list themselves
+		message_data_peer_lost_type peer_lost_data;
+		memcpy(peer_lost_data.peer_id, id, 6);
+		command_client_thread_send_message(message_queue_create_message("peer_lost", &peer_lost_data, sizeof(peer_lost_data)));
+		file_client_peer_lost(id);
+	}
+}
+
+// MUST BE CALLED WITH THE LOCK HELD
+peer_t* find_peer(const char id[6]) {
+	if(table == NULL) {
+		return NULL;
+	}
+	size_t index;
+	for(index = get_home_slot(table, id); table->slots[index].used; index = (index + 1) & (table->capacity - 1)) {
+		if(memcmp(table->slots[index].id, id, 6) == 0) {
+			return &table->slots[index];
+		}
+	}
+	return NULL;
+}
+
+// the ids are mac addresses, their bits are mixed so the vendor prefix does not cluster the slots
+size_t get_home_slot(const peer_table_type* peer_table, const char id[6]) {
+	uint64_t key = 0;
+	memcpy(&key, id, 6);
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key & (peer_table->capacity - 1);
+}
+
+// doubles the capacity, the old table is retired and not freed because readers might still be in it
+// MUST BE CALLED WITH THE LOCK HELD
+int grow_table() {
+	peer_table_type* new_peer_table = new_table(table == NULL ? PEER_TABLE_MIN_CAPACITY : table->capacity * 2);
+	if(new_peer_table == NULL) {
+		return 0;
+	}
+	size_t slot;
+	for(slot = 0; table != NULL && slot < table->capacity; slot++) {
+		if(!table->slots[slot].used) {
+			continue;
+		}
+		size_t index = get_home_slot(new_peer_table, table->slots[slot].id);
+		while(new_peer_table->slots[index].used) {
+			index = (index + 1) & (new_peer_table->capacity - 1);
+		}
+		new_peer_table->slots[index] = table->slots[slot];
+		new_peer_table->count++;
+	}
+	write_begin();
+	if(table != NULL) {
+		table->retired_next = retired_tables;
+		retired_tables = table;
+	}
+	__atomic_store_n(&table, new_peer_table, __ATOMIC_RELEASE);
+	write_end();
+	return 1;
+}
+
+peer_table_type* new_table(size_t capacity) {
+	peer_table_type* peer_table = (peer_table_type*)calloc(1, sizeof(peer_table_type) + capacity * sizeof(peer_t));
+	if(peer_table == NULL) {
+		LOGD("calloc failed\n");
+		return NULL;
+	}
+	peer_table->capacity = capacity;
+	return peer_table;
+}
+
+// waits until no writer is active, a writer only holds it for a few copies so spinning is fine
+int read_begin() {
+	int read_sequence;
+	while((read_sequence = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE)) & 1);
+	return read_sequence;
+}
+
+// returns 1 if a writer changed something while reading, the read has to be repeated then
+int read_retry(int read_sequence) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&sequence, __ATOMIC_RELAXED) != read_sequence;
+}
+
+// removes a peer from the table and frees its addresses
+// the following peers of the same probe sequence are shifted back, so the table needs no tombstones
+// MUST BE CALLED WITH THE LOCK HELD
+void unlink_peer(peer_t* peer) {
+	timer_wheel_cancel(peer->expiry_timer);
+	free_ip_address_list(&peer->ip_address);
+	size_t mask = table->capacity - 1;
+	size_t hole = peer - table->slots;
+	write_begin();
+	size_t index = (hole + 1) & mask;
+	while(table->slots[index].used) {
+		size_t home = get_home_slot(table, table->slots[index].id);
+		// the peer can fill the hole if the hole lies between its home slot and its current slot
+		if(((index - home) & mask) >= ((index - hole) & mask)) {
+			table->slots[hole] = table->slots[index];
+			hole = index;
+		}
+		index = (index + 1) & mask;
+	}
+	memset(&table->slots[hole], 0, sizeof(peer_t));
+	table->count--;
+	write_end();
+}
+
+// the readers only see the best address, so they are only disturbed when it changes
+// MUST BE CALLED WITH THE LOCK HELD
+void update_best_address(peer_t* peer) {
+	struct sockaddr_storage best_address;
+	memset(&best_address, 0, sizeof(best_address));
+	int has_address = get_best_address(&peer->ip_address, &best_address);
+	if(has_address == peer->has_address && (!has_address || memcmp(&best_address, &peer->best_address, sizeof(best_address)) == 0)) {
+		return;
+	}
+	write_begin();
+	peer->has_address = has_address;
+	memcpy(&peer->best_address, &best_address, sizeof(best_address));
+	write_end();
+}
+
+// MUST BE CALLED WITH THE LOCK HELD
+void write_begin() {
+	__atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// MUST BE CALLED WITH THE LOCK HELD
+void write_end() {
+	__atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELEASE);
 }
@@ -1,14 +1,37 @@
 /**
  * @file peer_list.h
  * @brief This file provides a single thread safe list to store peers (id, ip addresses)
+ *
+ * The peers are kept in an open addressing hash table keyed by their id, so lookups take constant time even with
+ * thousands of peers. Changes are serialized by a mutex, but the readers (is_peer_in_list(), get_peer_ip_address(),
+ * get_peer_count() and get_known_peers()) never take it. They read the table optimistically and retry if a writer
+ * changed it meanwhile (a seqlock), so they never block the discovery and the discovery never blocks them. Only
+ * new peers, removed peers and a change of the best address are changes for the readers, a peer that is simply seen
+ * again does not disturb them.
+ *
+ * Addresses that were not seen for ADDRESS_TTL_SECONDS are removed, so stale addresses (e.g. after a new DHCP lease)
+ * are not used anymore. A peer without any address that was not seen for PEER_TTL_SECONDS is removed as well and a
+ * "peer_lost" message is sent to the command client and the file client. Both is driven by a timer of the timer wheel
+ * for every peer, see timer_wheel.h. In large networks peers announce themselves less often, so both TTLs grow with
+ * the discovery interval, see broadcast_get_interval_scale().
  */
 
 #ifndef PEER_LIST_H
 #define PEER_LIST_H
 
+#include <stdint.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 
+#define CONNECT_CANDIDATE_MAX_COUNT 8 // connect_to_peer() tries at most this many addresses of a peer
+#define CONNECT_ATTEMPT_DELAY_SECONDS 0.25 // the delay between two connect attempts recommended by RFC 8305
+
+// this is sent along as arguments with messages of type "peer_lost"
+/// This is a wrapper structure to tell the clients that a peer is gone
+typedef struct {
+	char peer_id[6]; //!< The id of the lost peer
+} message_data_peer_lost_type;
+
 /**
  * @brief This function initializes the mutex of the peer list. This should be called before first usage
  */
@@ -19,14 +42,48 @@ void initialize_peer_list_lock();
  */
 void destroy_peer_list_lock();
 
-// addIpToPeer should automatically append the peer if it is not in the list
 /**
- * @brief This function adds an ip address to a peer
+ * @brief This function adds an ip address to a peer, the peer is added to the list if it is not in it yet.
  * @param id The id of the peer to add the ip address to
  * @param ip_address The ip address
+ * @param interface_index The local interface the address was learned on, 0 if unknown
+ * @param link_speed The speed of that interface in Mbit/s, 0 if unknown
  * @param last_seen The timestamp when the ip address was last seen
+ * @return 1 if the peer was not in the list before. Otherwise 0 is returned.
+ */
+int add_ip_to_peer(char id[6], struct sockaddr* ip_address, unsigned int interface_index, int link_speed, struct timeval last_seen);
+
+/**
+ * @brief Connects to a peer and records how that went, see get_best_address().
+ *
+ * All addresses of the peer are raced against each other with connect_parallel(). They are started from the best to
+ * the worst, but IPv6 and IPv4 take turns, so a broken family does not delay the connect more than once.
+ * @param id The peer's id
+ * @param fallback_address The address that is used if the peer has no address in the list
+ * @param port The destination port
+ * @param timeout_seconds The timeout of the whole connect
+ * @param used_address Receives the address that was connected to
+ * @return The socket file descriptor if the connection succeeds. Otherwise -1 is returned.
  */
-void add_ip_to_peer(char id[6], struct sockaddr* ip_address, struct timeval last_seen);
+int connect_to_peer(char id[6], const struct sockaddr_storage* fallback_address, unsigned short port, double timeout_seconds, struct sockaddr_storage* used_address);
+
+/**
+ * @brief Records the result of a connect to an address of a peer, this changes which address is the best one.
+ * @param id The peer's id
+ * @param ip_address The address that was connected to
+ * @param seconds How long the connect took
+ * @param success 1 if the connect succeeded, 0 if it failed
+ */
+void report_peer_connect(char id[6], const struct sockaddr* ip_address, double seconds, int success);
+
+/**
+ * @brief Records the throughput of a transfer from an address of a peer, this changes which address is the best one.
+ * @param id The peer's id
+ * @param ip_address The address the data was transferred from
+ * @param bytes The count of transferred bytes
+ * @param seconds How long the transfer took
+ */
+void report_peer_transfer(char id[6], const struct sockaddr* ip_address, uint64_t bytes, double seconds);
 
 /**
  * @brief Removes a peer from the list given its id
@@ -49,6 +106,25 @@ int is_peer_in_list(char id[6]);
  */
 int get_peer_ip_address(char id[6], struct sockaddr_storage* ip_address);
 
+/// The id and the currently best address of a known peer
+typedef struct {
+	char id[6]; //!< The id of the peer
+	struct sockaddr_storage address; //!< The best known address of the peer
+} known_peer_type;
+
+/**
+ * @brief Gets the count of known peers.
+ * @return The count of peers in the list
+ */
+size_t get_peer_count();
+
+/**
+ * @brief Gets all known peers together with their best address.
+ * @param peers Receives an array allocated with malloc, the caller has to free it
+ * @return The count of peers in the array
+ */
+size_t get_known_peers(known_peer_type** peers);
+
 /**
  * @brief Prints out the peer list.
  */
@@ -0,0 +1,350 @@
+#include <endian.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_index.h"
+#include "logger.h"
+#include "util.h"
+
+#include "reconcile.h"
+
+#define PART_SEED 0x9e3779b97f4a7c15ULL // spreads the ids differently for every part of a table
+#define CHECK_SEED 0xd6e8feb86659fd93ULL
+
+/// A cell as it is sent to peers
+typedef struct {
+	int32_t count; //!< See reconcile_cell_type
+	uint64_t id_sum; //!< See reconcile_cell_type
+	uint64_t check_sum; //!< See reconcile_cell_type
+} __attribute__((packed)) encoded_cell_type;
+
+/// A local entry in the id cache
+typedef struct {
+	uint64_t id; //!< The id of the entry
+	size_t path_offset; //!< Where the path of the entry starts in cached_paths
+} cached_entry_type;
+
+/// Is called for every entry of the index, see visit_directory()
+typedef void (*entry_visitor_type)(const char* path, uint64_t id, void* user_data);
+
+// helper functions for this module
+static void add_id(reconcile_table_type* table, uint64_t id, int32_t count);
+static void cache_id(const char* path, uint64_t id, void* user_data);
+static int compare_cached_entries(const void* a, const void* b);
+static uint64_t get_cell_index(const reconcile_table_type* table, uint64_t id, int part);
+static uint64_t get_check_sum(uint64_t id);
+static int is_pure_cell(const reconcile_cell_type* cell);
+static uint64_t mix_bits(uint64_t value);
+static void update_id_cache();
+static void visit_directory(const char* path, entry_visitor_type visitor, void* user_data);
+
+// static variables for this module
+static pthread_mutex_t reconcile_lock;
+// the ids of all local entries sorted by id together with their paths, they are only collected again after the index changed
+// so the paths a peer is missing are found with a binary search instead of walking the index for every request
+static cached_entry_type* cached_entries = NULL;
+static size_t cached_entry_count = 0;
+static size_t cached_entry_capacity = 0;
+static char* cached_paths = NULL;
+static size_t cached_paths_size = 0;
+static size_t cached_paths_capacity = 0;
+static uint64_t cached_generation = 0;
+static int cache_valid = 0;
+
+void initialize_reconcile_lock() {
+	if(pthread_mutex_init(&reconcile_lock, NULL) != 0) {
+		printf("pthread_mutex_init failed\n");
+	}
+}
+
+void destroy_reconcile_lock() {
+	if(pthread_mutex_destroy(&reconcile_lock) != 0) {
+		printf("pthread_mutex_destroy failed\n");
+	}
+}
+
+uint64_t reconcile_get_entry_id(const char* path, char type, const unsigned char hash[SHA256_HASH_SIZE]) {
+	uint64_t id = mix_bits(get_string_hash(path) ^ (unsigned char)type);
+	if(type == 'F') {
+		// the first bytes of a SHA-256 hash are as good as any other 64 bits of it
+		uint64_t content;
+		memcpy(&content, hash, sizeof(content));
+		id ^= le64toh(content);
+	}
+	return mix_bits(id);
+}
+
+int reconcile_is_valid_cell_count(uint32_t cell_count) {
+	return cell_count >= RECONCILE_MIN_CELLS && cell_count <= RECONCILE_MAX_CELLS && cell_count % RECONCILE_HASH_COUNT == 0;
+}
+
+int reconcile_create_local_table(uint32_t cell_count, reconcile_table_type* table) {
+	if(!reconcile_is_valid_cell_count(cell_count)) {
+		return -1;
+	}
+	table->cell_count = cell_count;
+	table->cells = (reconcile_cell_type*)calloc(cell_count, sizeof(reconcile_cell_type));
+	pthread_mutex_lock(&reconcile_lock);
+	update_id_cache();
+	size_t i;
+	for(i = 0; i < cached_entry_count; i++) {
+		add_id(table, cached_entries[i].id, 1);
+	}
+	pthread_mutex_unlock(&reconcile_lock);
+	return 0;
+}
+
+void reconcile_free_table(reconcile_table_type* table) {
+	free(table->cells);
+	table->cells = NULL;
+	table->cell_count = 0;
+}
+
+void reconcile_encode_table(const reconcile_table_type* table, char* buffer) {
+	encoded_cell_type encoded_cell;
+	uint32_t i;
+	for(i = 0; i < table->cell_count; i++) {
+		encoded_cell.count = (int32_t)htole32((uint32_t)table->cells[i].count);
+		encoded_cell.id_sum = htole64(table->cells[i].id_sum);
+		encoded_cell.check_sum = htole64(table->cells[i].check_sum);
+		memcpy(buffer + i * sizeof(encoded_cell), &encoded_cell, sizeof(encoded_cell));
+	}
+}
+
+int reconcile_decode_table(const char* data, size_t size, reconcile_table_type* table) {
+	if(size % sizeof(encoded_cell_type) != 0 || !reconcile_is_valid_cell_count(size / sizeof(encoded_cell_type))) {
+		return -1;
+	}
+	table->cell_count = size / sizeof(encoded_cell_type);
+	table->cells = (reconcile_cell_type*)malloc(table->cell_count * sizeof(reconcile_cell_type));
+	encoded_cell_type encoded_cell;
+	uint32_t i;
+	for(i = 0; i < table->cell_count; i++) {
+		memcpy(&encoded_cell, data + i * sizeof(encoded_cell), sizeof(encoded_cell));
+		table->cells[i].count = (int32_t)le32toh((uint32_t)encoded_cell.count);
+		table->cells[i].id_sum = le64toh(encoded_cell.id_sum);
+		table->cells[i].check_sum = le64toh(encoded_cell.check_sum);
+	}
+	return 0;
+}
+
+int reconcile_find_differences(reconcile_table_type* remote_table, const reconcile_table_type* local_table, uint64_t** remote_ids, size_t* remote_id_count, size_t* local_id_count) {
+	*remote_ids = NULL;
+	*remote_id_count = 0;
+	*local_id_count = 0;
+	if(remote_table->cell_count != local_table->cell_count) {
+		return -1;
+	}
+	uint32_t cell_count = remote_table->cell_count;
+	uint32_t i;
+	// afterwards the ids both sides have are gone, ids only we have are counted negative
+	for(i = 0; i < cell_count; i++) {
+		remote_table->cells[i].count -= local_table->cells[i].count;
+		remote_table->cells[i].id_sum ^= local_table->cells[i].id_sum;
+		remote_table->cells[i].check_sum ^= local_table->cells[i].check_sum;
+	}
+	// cells that hold a single id are peeled off, which can leave other cells with a single id
+	size_t pending_capacity = cell_count;
+	uint32_t* pending_cells = (uint32_t*)malloc(pending_capacity * sizeof(uint32_t));
+	size_t pending_count = 0;
+	for(i = 0; i < cell_count; i++) {
+		if(is_pure_cell(&remote_table->cells[i])) {
+			pending_cells[pending_count++] = i;
+		}
+	}
+	size_t remote_id_capacity = 0;
+	// a table cannot hold more differences than it has cells, so this also ends the loop if a check sum matched by chance
+	while(pending_count > 0 && *remote_id_count + *local_id_count < cell_count) {
+		const reconcile_cell_type* cell = &remote_table->cells[pending_cells[--pending_count]];
+		if(!is_pure_cell(cell)) {
+			// the id was peeled off through another cell already
+			continue;
+		}
+		uint64_t id = cell->id_sum;
+		int32_t count = cell->count;
+		if(count > 0) {
+			if(*remote_id_count == remote_id_capacity) {
+				remote_id_capacity = remote_id_capacity == 0 ? 16 : remote_id_capacity * 2;
+				*remote_ids = (uint64_t*)realloc(*remote_ids, remote_id_capacity * sizeof(uint64_t));
+			}
+			(*remote_ids)[(*remote_id_count)++] = id;
+		} else {
+			(*local_id_count)++;
+		}
+		add_id(remote_table, id, -count);
+		int part;
+		for(part = 0; part < RECONCILE_HASH_COUNT; part++) {
+			uint64_t index = get_cell_index(remote_table, id, part);
+			if(is_pure_cell(&remote_table->cells[index])) {
+				if(pending_count == pending_capacity) {
+					pending_capacity *= 2;
+					pending_cells = (uint32_t*)realloc(pending_cells, pending_capacity * sizeof(uint32_t));
+				}
+				pending_cells[pending_count++] = index;
+			}
+		}
+	}
+	free(pending_cells);
+	// anything left over means that some cells hold too many ids to tell them apart
+	for(i = 0; i < cell_count; i++) {
+		const reconcile_cell_type* cell = &remote_table->cells[i];
+		if(cell->count != 0 || cell->id_sum != 0 || cell->check_sum != 0) {
+			free(*remote_ids);
+			*remote_ids = NULL;
+			*remote_id_count = 0;
+			*local_id_count = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+size_t reconcile_find_paths(const uint64_t* ids, size_t id_count, char** paths) {
+	size_t found_count = 0;
+	size_t paths_size = 0;
+	size_t paths_capacity = 4096;
+	*paths = (char*)malloc(paths_capacity);
+	pthread_mutex_lock(&reconcile_lock);
+	// this usually finds the cache of the table that was just created for the same peer
+	update_id_cache();
+	size_t i;
+	for(i = 0; i < id_count; i++) {
+		cached_entry_type key;
+		key.id = ids[i];
+		cached_entry_type* entry = (cached_entry_type*)bsearch(&key, cached_entries, cached_entry_count, sizeof(cached_entry_type), compare_cached_entries);
+		if(entry == NULL) {
+			continue;
+		}
+		const char* path = cached_paths + entry->path_offset;
+		size_t path_size = strlen(path) + 1;
+		if(paths_size + path_size > paths_capacity) {
+			paths_capacity = (paths_size + path_size) * 2;
+			*paths = (char*)realloc(*paths, paths_capacity);
+		}
+		memcpy(*paths + paths_size, path, path_size);
+		paths_size += path_size;
+		found_count++;
+	}
+	pthread_mutex_unlock(&reconcile_lock);
+	return found_count;
+}
+
+void reconcile_free() {
+	pthread_mutex_lock(&reconcile_lock);
+	free(cached_entries);
+	cached_entries = NULL;
+	cached_entry_count = 0;
+	cached_entry_capacity = 0;
+	free(cached_paths);
+	cached_paths = NULL;
+	cached_paths_size = 0;
+	cached_paths_capacity = 0;
+	cache_valid = 0;
+	pthread_mutex_unlock(&reconcile_lock);
+}
+
+// MODULE SCOPED FUNTCIONS BEGIN
+
+// adds an id to all its cells, a negative count removes it
+void add_id(reconcile_table_type* table, uint64_t id, int32_t count) {
+	uint64_t check_sum = get_check_sum(id);
+	int part;
+	for(part = 0; part < RECONCILE_HASH_COUNT; part++) {
+		reconcile_cell_type* cell = &table->cells[get_cell_index(table, id, part)];
+		cell->count += count;
+		cell->id_sum ^= id;
+		cell->check_sum ^= check_sum;
+	}
+}
+
+// entry visitor that appends the id and the path to the cache, the cache lock is held
+void cache_id(const char* path, uint64_t id, void* user_data) {
+	if(cached_entry_count == cached_entry_capacity) {
+		cached_entry_capacity = cached_entry_capacity == 0 ? 1024 : cached_entry_capacity * 2;
+		cached_entries = (cached_entry_type*)realloc(cached_entries, cached_entry_capacity * sizeof(cached_entry_type));
+	}
+	size_t path_size = strlen(path) + 1;
+	if(cached_paths_size + path_size > cached_paths_capacity) {
+		cached_paths_capacity = (cached_paths_size + path_size) * 2;
+		cached_paths = (char*)realloc(cached_paths, cached_paths_capacity);
+	}
+	memcpy(cached_paths + cached_paths_size, path, path_size);
+	cached_entries[cached_entry_count].id = id;
+	cached_entries[cached_entry_count].path_offset = cached_paths_size;
+	cached_entry_count++;
+	cached_paths_size += path_size;
+}
+
+int compare_cached_entries(const void* a, const void* b) {
+	uint64_t id_a = ((const cached_entry_type*)a)->id;
+	uint64_t id_b = ((const cached_entry_type*)b)->id;
+	return id_a < id_b ? -1 : id_a > id_b ? 1 : 0;
+}
+
+// every part of the table gets one of the cells, so an id never ends up in the same cell twice
+uint64_t get_cell_index(const reconcile_table_type* table, uint64_t id, int part) {
+	uint64_t part_size = table->cell_count / RECONCILE_HASH_COUNT;
+	return part * part_size + mix_bits(id + (part + 1) * PART_SEED) % part_size;
+}
+
+uint64_t get_check_sum(uint64_t id) {
+	return mix_bits(id ^ CHECK_SEED);
+}
+
+// a pure cell holds exactly one id, either from the remote or from the local table
+int is_pure_cell(const reconcile_cell_type* cell) {
+	return (cell->count == 1 || cell->count == -1) && cell->check_sum == get_check_sum(cell->id_sum);
+}
+
+// the finalizer of splitmix64, every input bit changes about half of the output bits
+uint64_t mix_bits(uint64_t value) {
+	value ^= value >> 30;
+	value *= 0xbf58476d1ce4e5b9ULL;
+	value ^= value >> 27;
+	value *= 0x94d049bb133111ebULL;
+	value ^= value >> 31;
+	return value;
+}
+
+// collects the ids of the whole index again if it changed, the cache lock is held
+void update_id_cache() {
+	// the generation is read first, so a change while collecting only causes another update later
+	uint64_t generation = file_index_get_generation();
+	if(cache_valid && generation == cached_generation) {
+		return;
+	}
+	struct timeval start_time;
+	gettimeofday(&start_time, NULL);
+	cached_entry_count = 0;
+	cached_paths_size = 0;
+	visit_directory("/", cache_id, NULL);
+	qsort(cached_entries, cached_entry_count, sizeof(cached_entry_type), compare_cached_entries);
+	cached_generation = generation;
+	cache_valid = 1;
+	LOGD("collected %lu ids in %.3f seconds\n", (unsigned long)cached_entry_count, get_passed_time(start_time));
+}
+
+// calls the visitor for every entry below a directory
+void visit_directory(const char* path, entry_visitor_type visitor, void* user_data) {
+	file_index_entry_type* entries;
+	size_t entry_count;
+	if(!file_index_list_directory(path, &entries, &entry_count)) {
+		// the directory was removed in the meantime
+		return;
+	}
+	char child_path[PATH_MAX];
+	size_t i;
+	for(i = 0; i < entry_count; i++) {
+		if(snprintf(child_path, sizeof(child_path), "%s%s%s", path, strcmp(path, "/") == 0 ? "" : "/", entries[i].name) >= sizeof(child_path)) {
+			continue;
+		}
+		visitor(child_path, reconcile_get_entry_id(child_path, entries[i].type, entries[i].hash), user_data);
+		if(entries[i].type == 'D') {
+			visit_directory(child_path, visitor, user_data);
+		}
+	}
+	free(entries);
+}
@@ -0,0 +1,126 @@
+/**
+ * @file reconcile.h
+ * @brief This module finds the differences between the file sets of two peers with invertible Bloom lookup tables.
+ *
+ * Every file and directory of the index is reduced to a 64 bit id that is calculated from its path, its type and (for
+ * files) its content hash. So two peers have the same id for an entry exactly if they have the same version of it.
+ * All ids are added to a table with a fixed count of cells, every id goes to RECONCILE_HASH_COUNT cells which count
+ * the ids and sum them up with xor. When one table is subtracted from another the entries both sides have cancel out
+ * and only the differences remain. As long as there are not too many of them, they can be read back one by one.
+ *
+ * The size of a table only depends on the count of cells and not on the count of files, so two peers that differ in a
+ * handful of files out of millions find out which ones with a few kilobytes. If decoding fails the difference is too
+ * large for the table and either a larger one or the manifest has to be used instead.
+ *
+ * The ids of the local index are cached until the index changes. All functions are thread safe.
+ */
+
+#ifndef RECONCILE_H
+#define RECONCILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+#define RECONCILE_HASH_COUNT 3 // every id is added to this many cells, one in each part of the table
+#define RECONCILE_MIN_CELLS (RECONCILE_HASH_COUNT * 64) // enough for a few dozen differences
+#define RECONCILE_MAX_CELLS (RECONCILE_HASH_COUNT * 4096) // with more differences the manifest is cheaper
+#define RECONCILE_CELL_SIZE 20 // the encoded size of a single cell
+
+/// A single cell of a table
+typedef struct {
+	int32_t count; //!< How many ids were added minus how many were removed
+	uint64_t id_sum; //!< The xor of all ids
+	uint64_t check_sum; //!< The xor of a second hash of all ids, it tells whether a cell holds exactly one id
+} reconcile_cell_type;
+
+/// An invertible Bloom lookup table
+typedef struct {
+	uint32_t cell_count; //!< The count of cells, a multiple of RECONCILE_HASH_COUNT
+	reconcile_cell_type* cells; //!< The cells
+} reconcile_table_type;
+
+/**
+ * @brief This function initializes the lock for the id cache. It must be called once before any other function of this module.
+ */
+void initialize_reconcile_lock();
+
+/**
+ * @brief This function destroys the lock for the id cache. It must be called once after this module is not needed anymore.
+ */
+void destroy_reconcile_lock();
+
+/**
+ * @brief Calculates the id of an entry.
+ * @param path The path relative to BASE_PATH without a trailing slash, e.g. "/dir/file"
+ * @param type 'F' for files or 'D' for directories
+ * @param hash The content hash, it is ignored for directories because their merkle hash changes with every file below them
+ * @return The id of the entry
+ */
+uint64_t reconcile_get_entry_id(const char* path, char type, const unsigned char hash[SHA256_HASH_SIZE]);
+
+/**
+ * @brief Checks whether a peer may ask for a table of this size.
+ * @param cell_count The count of cells
+ * @return 1 if the count is a multiple of RECONCILE_HASH_COUNT between RECONCILE_MIN_CELLS and RECONCILE_MAX_CELLS, 0 otherwise
+ */
+int reconcile_is_valid_cell_count(uint32_t cell_count);
+
+/**
+ * @brief Creates a table with the ids of all entries of the local index.
+ * @param cell_count The count of cells, see reconcile_is_valid_cell_count()
+ * @param table Receives the table, it has to be freed with reconcile_free_table()
+ * @return 0 on success or -1 if the cell count is invalid
+ */
+int reconcile_create_local_table(uint32_t cell_count, reconcile_table_type* table);
+
+/**
+ * @brief Frees the cells of a table.
+ * @param table The table
+ */
+void reconcile_free_table(reconcile_table_type* table);
+
+/**
+ * @brief Encodes a table to be sent to a peer. All numbers are stored in little endian byte order.
+ * @param table The table
+ * @param buffer Receives the encoded table, it must hold cell_count * RECONCILE_CELL_SIZE bytes
+ */
+void reconcile_encode_table(const reconcile_table_type* table, char* buffer);
+
+/**
+ * @brief Decodes a table received from a peer.
+ * @param data The encoded table
+ * @param size The size of @p data in bytes
+ * @param table Receives the table, it has to be freed with reconcile_free_table()
+ * @return 0 on success or -1 if the size does not belong to a valid table
+ */
+int reconcile_decode_table(const char* data, size_t size, reconcile_table_type* table);
+
+/**
+ * @brief Subtracts the local table from a remote one and reads back the ids that are only on one side.
+ * @param remote_table The table of the peer, it is modified
+ * @param local_table The local table with the same count of cells
+ * @param remote_ids Receives the ids only the peer has, the array has to be freed by the caller
+ * @param remote_id_count Receives the count of @p remote_ids
+ * @param local_id_count Receives the count of ids only the local index has
+ * @return 0 on success or -1 if the difference is too large for the tables
+ */
+int reconcile_find_differences(reconcile_table_type* remote_table, const reconcile_table_type* local_table, uint64_t** remote_ids, size_t* remote_id_count, size_t* local_id_count);
+
+/**
+ * @brief Finds the paths of local entries by their ids. Ids that are not in the index (anymore) are skipped.
+ * The paths come from the cached ids, the index is only walked again after it changed.
+ * @param ids The ids
+ * @param id_count The count of @p ids
+ * @param paths Receives the found paths, each terminated by a 0. It has to be freed by the caller.
+ * @return The count of found paths
+ */
+size_t reconcile_find_paths(const uint64_t* ids, size_t id_count, char** paths);
+
+/**
+ * @brief Frees the id cache.
+ */
+void reconcile_free();
+
+#endif
@@ -0,0 +1,140 @@
+#include <string.h>
+
+#include "sha256.h"
+
+static void process_block(sha256_context_type* context, const unsigned char block[64]);
+
+static const uint32_t round_constants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTATE_RIGHT(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(sha256_context_type* context) {
+	context->state[0] = 0x6a09e667;
+	context->state[1] = 0xbb67ae85;
+	context->state[2] = 0x3c6ef372;
+	context->state[3] = 0xa54ff53a;
+	context->state[4] = 0x510e527f;
+	context->state[5] = 0x9b05688c;
+	context->state[6] = 0x1f83d9ab;
+	context->state[7] = 0x5be0cd19;
+	context->bit_count = 0;
+	context->block_length = 0;
+}
+
+void sha256_update(sha256_context_type* context, const void* data, size_t length) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	context->bit_count += (uint64_t)length * 8;
+	// first fill up a partially filled block
+	if(context->block_length > 0) {
+		size_t missing = 64 - context->block_length;
+		size_t count = length < missing ? length : missing;
+		memcpy(context->block + context->block_length, bytes, count);
+		context->block_length += count;
+		bytes += count;
+		length -= count;
+		if(context->block_length < 64) {
+			return;
+		}
+		process_block(context, context->block);
+		context->block_length = 0;
+	}
+	// then process whole blocks directly from the input
+	while(length >= 64) {
+		process_block(context, bytes);
+		bytes += 64;
+		length -= 64;
+	}
+	// and keep the rest for later
+	memcpy(context->block, bytes, length);
+	context->block_length = length;
+}
+
+void sha256_final(sha256_context_type* context, unsigned char hash[SHA256_HASH_SIZE]) {
+	uint64_t bit_count = context->bit_count;
+	// padding is a single 1 bit, zeros and the message length as 64 bit big endian number
+	context->block[context->block_length++] = 0x80;
+	if(context->block_length > 56) {
+		memset(context->block + context->block_length, 0, 64 - context->block_length);
+		process_block(context, context->block);
+		context->block_length = 0;
+	}
+	memset(context->block + context->block_length, 0, 56 - context->block_length);
+	int i;
+	for(i = 0; i < 8; i++) {
+		context->block[63 - i] = (unsigned char)(bit_count >> (8 * i));
+	}
+	process_block(context, context->block);
+
+	for(i = 0; i < 8; i++) {
+		hash[4 * i] = (unsigned char)(context->state[i] >> 24);
+		hash[4 * i + 1] = (unsigned char)(context->state[i] >> 16);
+		hash[4 * i + 2] = (unsigned char)(context->state[i] >> 8);
+		hash[4 * i + 3] = (unsigned char)(context->state[i]);
+	}
+}
+
+void sha256(const void* data, size_t length, unsigned char hash[SHA256_HASH_SIZE]) {
+	sha256_context_type context;
+	sha256_init(&context);
+	sha256_update(&context, data, length);
+	sha256_final(&context, hash);
+}
+
+// MODULE SCOPED FUNTCIONS BEGIN
+
+void process_block(sha256_context_type* context, const unsigned char block[64]) {
+	uint32_t schedule[64];
+	int i;
+	for(i = 0; i < 16; i++) {
+		schedule[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) | ((uint32_t)block[4 * i + 2] << 8) | (uint32_t)block[4 * i + 3];
+	}
+	for(i = 16; i < 64; i++) {
+		uint32_t s0 = ROTATE_RIGHT(schedule[i - 15], 7) ^ ROTATE_RIGHT(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+		uint32_t s1 = ROTATE_RIGHT(schedule[i - 2], 17) ^ ROTATE_RIGHT(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+		schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+	}
+
+	uint32_t a = context->state[0];
+	uint32_t b = context->state[1];
+	uint32_t c = context->state[2];
+	uint32_t d = context->state[3];
+	uint32_t e = context->state[4];
+	uint32_t f = context->state[5];
+	uint32_t g = context->state[6];
+	uint32_t h = context->state[7];
+
+	for(i = 0; i < 64; i++) {
+		uint32_t s1 = ROTATE_RIGHT(e, 6) ^ ROTATE_RIGHT(e, 11) ^ ROTATE_RIGHT(e, 25);
+		uint32_t choice = (e & f) ^ (~e & g);
+		uint32_t temp1 = h + s1 + choice + round_constants[i] + schedule[i];
+		uint32_t s0 = ROTATE_RIGHT(a, 2) ^ ROTATE_RIGHT(a, 13) ^ ROTATE_RIGHT(a, 22);
+		uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t temp2 = s0 + majority;
+		h = g;
+		g = f;
+		f = e;
+		e = d + temp1;
+		d = c;
+		c = b;
+		b = a;
+		a = temp1 + temp2;
+	}
+
+	context->state[0] += a;
+	context->state[1] += b;
+	context->state[2] += c;
+	context->state[3] += d;
+	context->state[4] += e;
+	context->state[5] += f;
+	context->state[6] += g;
+	context->state[7] += h;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file sha256.h
+ * @brief This file provides a self contained SHA-256 implementation.
+ *
+ * The hash is used to identify file contents so peers can compare files without transferring them.
+ * The context can be fed incrementally so large files can be hashed while they are read or received.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// The size of a SHA-256 digest in bytes
+#define SHA256_HASH_SIZE 32
+
+/// The state of a running SHA-256 computation
+typedef struct {
+	uint32_t state[8]; //!< The intermediate hash value
+	uint64_t bit_count; //!< How many bits have been processed so far
+	unsigned char block[64]; //!< Buffer for a partially filled block
+	size_t block_length; //!< How many bytes of block are in use
+} sha256_context_type;
+
+/**
+ * @brief Initializes a context. This has to be called before sha256_update().
+ * @param context The context to initialize
+ */
+void sha256_init(sha256_context_type* context);
+
+/**
+ * @brief Feeds data into a running hash computation.
+ * @param context The context of the computation
+ * @param data The data to hash
+ * @param length The count of bytes in @p data
+ */
+void sha256_update(sha256_context_type* context, const void* data, size_t length);
+
+/**
+ * @brief Finishes a hash computation and writes the digest.
+ * @param context The context of the computation. It has to be initialized again before it can be reused.
+ * @param hash The memory location the digest is written to
+ */
+void sha256_final(sha256_context_type* context, unsigned char hash[SHA256_HASH_SIZE]);
+
+/**
+ * @brief Convenience function to hash a single memory area.
+ * @param data The data to hash
+ * @param length The count of bytes in @p data
+ * @param hash The memory location the digest is written to
+ */
+void sha256(const void* data, size_t length, unsigned char hash[SHA256_HASH_SIZE]);
+
+#endif
@@ -0,0 +1,331 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "command_client.h"
+#include "file_index.h"
+#include "logger.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+#include "sync_scheduler.h"
+
+#define SYNC_INTERVAL_SECONDS 60.0 // the average time between two reconciliations with the same peer
+#define SYNC_INTERVAL_JITTER 0.5 // the interval is randomized by +- this fraction
+#define SYNC_START_DELAY_SECONDS 2.0 // new peers are synced within this time, so many nodes seeing a new peer do not hit it at once
+#define BACKOFF_BASE_SECONDS 5.0 // the delay after the first failure, it doubles with every further failure
+#define BACKOFF_MAX_SECONDS 300.0
+
+static int compare_timeval(struct timeval a, struct timeval b);
+static sync_peer_status_type* find_peer(char peer_id[6]);
+static int is_reconciled(const sync_peer_status_type* peer);
+static void notify_sync_due(void* argument);
+static double random_fraction();
+static void schedule_in(sync_peer_status_type* peer, double seconds);
+static void schedule_next(sync_peer_status_type* peer);
+static const char* state_string(sync_state_type state);
+
+static pthread_mutex_t sync_scheduler_lock;
+
+static sync_peer_status_type* peers = NULL;
+static size_t peer_count = 0;
+static size_t peer_capacity = 0;
+static unsigned int random_seed = 0;
+
+void initialize_sync_scheduler_lock() {
+	if(pthread_mutex_init(&sync_scheduler_lock, NULL) != 0) {
+		printf("pthread_mutex_init failed\n");
+	}
+	random_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+}
+
+void destroy_sync_scheduler_lock() {
+	if(pthread_mutex_destroy(&sync_scheduler_lock) != 0) {
+		printf("pthread_mutex_destroy failed\n");
+	}
+}
+
+void sync_scheduler_peer_seen(char peer_id[6], struct sockaddr* address) {
+	pthread_mutex_lock(&sync_scheduler_lock);
+	sync_peer_status_type* peer = find_peer(peer_id);
+	if(peer == NULL) {
+		if(peer_count == peer_capacity) {
+			peer_capacity = peer_capacity == 0 ? 16 : peer_capacity * 2;
+			peers = (sync_peer_status_type*)realloc(peers, peer_capacity * sizeof(sync_peer_status_type));
+		}
+		peer = &peers[peer_count++];
+		memset(peer, 0, sizeof(sync_peer_status_type));
+		memcpy(peer->peer_id, peer_id, 6);
+		peer->state = SYNC_STATE_IDLE;
+		schedule_in(peer, random_fraction() * SYNC_START_DELAY_SECONDS);
+	}
+	memcpy(&peer->address, address, address->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+	pthread_mutex_unlock(&sync_scheduler_lock);
+}
+
+void sync_scheduler_request_sync(char peer_id[6]) {
+	pthread_mutex_lock(&sync_scheduler_lock);
+	sync_peer_status_type* peer = find_peer(peer_id);
+	if(peer != NULL && (peer->state == SYNC_STATE_IDLE || peer->state == SYNC_STATE_BACKOFF)) {
+		// an explicit request is not skipped because the peer advertises the reconciled state
+		peer->reconciled_state.valid = 0;
+		schedule_in(peer, 0);
+	}
+	pthread_mutex_unlock(&sync_scheduler_lock);
+}
+
+void sync_scheduler_peer_state(char peer_id[6], uint64_t generation, const unsigned char root_hash[SHA256_HASH_SIZE]) {
+	// the local root hash is fetched before locking, the index has its own lock
+	unsigned char local_root_hash[SHA256_HASH_SIZE];
+	file_index_get_root_hash(local_root_hash);
+	pthread_mutex_lock(&sync_scheduler_lock);
+	sync_peer_status_type* peer = find_peer(peer_id);
+	if(peer != NULL) {
+		peer->advertised_state.valid = 1;
+		peer->advertised_state.generation = generation;
+		memcpy(peer->advertised_state.root_hash, root_hash, SHA256_HASH_SIZE);
+		if(memcmp(root_hash, local_root_hash, SHA256_HASH_SIZE) == 0) {
+			// both trees are the same, so a sync would not find anything
+			peer->reconciled_state = peer->advertised_state;
+		} else if(!is_reconciled(peer) && peer->state == SYNC_STATE_IDLE) {
+			schedule_in(peer, 0);
+		}
+	}
+	pthread_mutex_unlock(&sync_scheduler_lock);
+}
+
+unsigned int sync_scheduler_peer_lost(char peer_id[6]) {
+	unsigned int pending_downloads = 0;
+	pthread_mutex_lock(&sync_scheduler_lock);
+	sync_peer_status_type* peer = find_peer(peer_id);
+	if(peer != NULL) {
+		pending_downloads = peer->pending_downloads;
+		timer_wheel_cancel(peer->due_timer);
+		// the order of the peers does not matter, so the last one takes the free place
+		*peer = peers[--peer_count];
+	}
+	pthread_mutex_unlock(&sync_scheduler_lock);
+	return pending_downloads;
+}
+
+int sync_scheduler_next_due(char peer_id[6], struct sockaddr_storage* address) {
+	int picked = 0;
+	pthread_mutex_lock(&sync_scheduler_lock);
+	size_t active_count = 0;
+	sync_peer_status_type* most_overdue = NULL;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	size_t i;
+	for(i = 0; i < peer_count; i++) {
+		sync_peer_status_type* peer = &peers[i];
+		if(peer->state == SYNC_STATE_LISTING) {
+			active_count++;
+			continue;
+		}
+		if(peer->state == SYNC_STATE_DOWNLOADING || compare_timeval(peer->next_sync, now) > 0) {
+			continue;
+		}
+		if(peer->state == SYNC_STATE_IDLE && is_reconciled(peer)) {
+			// nothing changed at the peer since the last sync, so there is no need to connect
+			schedule_next(peer);
+			continue;
+		}
+		if(most_overdue == NULL || compare_timeval(peer->next_sync, most_overdue->next_sync) < 0) {
+			most_overdue = peer;
+		}
+	}
+	if(most_overdue != NULL && active_count < MAX_CONCURRENT_SYNCS) {
+		most_overdue->state = SYNC_STATE_LISTING;
+		most_overdue->last_sync_start = now;
+		most_overdue->listed_state = most_overdue->advertised_state;
+		memcpy(peer_id, most_overdue->peer_id, 6);
+		memcpy(address, &most_overdue->address, sizeof(struct sockaddr_storage));
+		picked = 1;
+	}
+	pthread_mutex_unlock(&sync_scheduler_lock);
+	return picked;
+}
+
+void sync_scheduler_listing_finished(char peer_id[6], int success, unsigned int download_count) {
+	pthread_mutex_lock(&sync_scheduler_lock);
+	sync_peer_status_type* peer = find_peer(peer_id);
+	if(peer != NULL && peer->state == SYNC_STATE_LISTING) {
+		peer->last_listing_seconds = get_passed_time(peer->last_sync_start);
+		peer->pending_downloads += download_count;
+		if(!success) {
+			peer->failure_count++;
+			peer->state = SYNC_STATE_BACKOFF;
+			schedule_next(peer);
+		} else if(peer->pending_downloads > 0) {
+			peer->state = SYNC_STATE_DOWNLOADING;
+		} else {
+			peer->failure_count = 0;
+			gettimeofday(&peer->last_success, NULL);
+			peer->reconciled_state = peer->listed_state;
+			peer->state = SYNC_STATE_IDLE;
+			schedule_next(peer);
+		}
+	}
+	pthread_mutex_unlock(&sync_scheduler_lock);
+	// the finished listing frees a place for peers that had to wait for it
+	notify_sync_due(NULL);
+}
+
+void sync_scheduler_downloads_added(char peer_id[6], unsigned int download_count) {
+	pthread_mutex_lock(&sync_scheduler_lock);
+	sync_peer_status_type* peer = find_peer(peer_id);
+	if(peer != NULL && download_count > 0) {
+		peer->pending_downloads += download_count;
+		if(peer->state == SYNC_STATE_IDLE) {
+			peer->state = SYNC_STATE_DOWNLOADING;
+		}
+	}
+	pthread_mutex_unlock(&sync_scheduler_lock);
+}
+
+void sync_scheduler_download_finished(char peer_id[6], int success) {
+	pthread_mutex_lock(&sync_scheduler_lock);
+	sync_peer_status_type* peer = find_peer(peer_id);
+	if(peer != NULL && peer->pending_downloads > 0) {
+		peer->pending_downloads--;
+		if(!success) {
+			// the failure count is only reset when a whole sync went through
+			peer->failure_count++;
+		}
+		if(peer->pending_downloads == 0 && peer->state == SYNC_STATE_DOWNLOADING) {
+			if(peer->failure_count > 0) {
+				peer->state = SYNC_STATE_BACKOFF;
+			} else {
+				gettimeofday(&peer->last_success, NULL);
+				peer->reconciled_state = peer->listed_state;
+				peer->state = SYNC_STATE_IDLE;
+			}
+			schedule_next(peer);
+		}
+	}
+	pthread_mutex_unlock(&sync_scheduler_lock);
+}
+
+int sync_scheduler_get_status(char peer_id[6], sync_peer_status_type* status) {
+	int found = 0;
+	pthread_mutex_lock(&sync_scheduler_lock);
+	sync_peer_status_type* peer = find_peer(peer_id);
+	if(peer != NULL) {
+		memcpy(status, peer, sizeof(sync_peer_status_type));
+		found = 1;
+	}
+	pthread_mutex_unlock(&sync_scheduler_lock);
+	return found;
+}
+
+void print_sync_scheduler() {
+	pthread_mutex_lock(&sync_scheduler_lock);
+	size_t i;
+	for(i = 0; i < peer_count; i++) {
+		sync_peer_status_type* peer = &peers[i];
+		char id_buffer[13];
+		get_hex_string((unsigned char*)peer->peer_id, 6, id_buffer, sizeof(id_buffer));
+		LOGD("[%s] %-11s next sync in %.1fs, last listing took %.3fs, %u failures, %u pending downloads\n", id_buffer, state_string(peer->state), -get_passed_time(peer->next_sync), peer->last_listing_seconds, peer->failure_count, peer->pending_downloads);
+	}
+	pthread_mutex_unlock(&sync_scheduler_lock);
+}
+
+void free_sync_scheduler() {
+	pthread_mutex_lock(&sync_scheduler_lock);
+	free(peers);
+	peers = NULL;
+	peer_count = peer_capacity = 0;
+	pthread_mutex_unlock(&sync_scheduler_lock);
+}
+
+// MODULE SCOPED FUNTCIONS BEGIN
+
+// returns < 0 if a is before b, 0 if they are equal and > 0 if a is after b
+int compare_timeval(struct timeval a, struct timeval b) {
+	if(a.tv_sec != b.tv_sec) {
+		return a.tv_sec < b.tv_sec ? -1 : 1;
+	}
+	if(a.tv_usec != b.tv_usec) {
+		return a.tv_usec < b.tv_usec ? -1 : 1;
+	}
+	return 0;
+}
+
+// MUST BE CALLED WITH THE LOCK HELD
+sync_peer_status_type* find_peer(char peer_id[6]) {
+	size_t i;
+	for(i = 0; i < peer_count; i++) {
+		if(memcmp(peers[i].peer_id, peer_id, 6) == 0) {
+			return &peers[i];
+		}
+	}
+	return NULL;
+}
+
+// returns 1 if the peer still advertises the state of the last successful sync
+// MUST BE CALLED WITH THE LOCK HELD
+int is_reconciled(const sync_peer_status_type* peer) {
+	return peer->advertised_state.valid && peer->reconciled_state.valid
+			&& peer->advertised_state.generation == peer->reconciled_state.generation
+			&& memcmp(peer->advertised_state.root_hash, peer->reconciled_state.root_hash, SHA256_HASH_SIZE) == 0;
+}
+
+// called by the timer wheel when a peer is due
+void notify_sync_due(void* argument) {
+	command_client_thread_send_message(message_queue_create_message("sync_due", NULL, 0));
+}
+
+// returns a random number in [0, 1)
+// MUST BE CALLED WITH THE LOCK HELD
+double random_fraction() {
+	return rand_r(&random_seed) / ((double)RAND_MAX + 1.0);
+}
+
+// MUST BE CALLED WITH THE LOCK HELD
+void schedule_in(sync_peer_status_type* peer, double seconds) {
+	gettimeofday(&peer->next_sync, NULL);
+	long microseconds = peer->next_sync.tv_usec + (long)(seconds * 1000000);
+	peer->next_sync.tv_sec += microseconds / 1000000;
+	peer->next_sync.tv_usec = microseconds % 1000000;
+	// the command client is only woken up when the peer is due instead of checking all peers every second
+	timer_wheel_cancel(peer->due_timer);
+	peer->due_timer = timer_wheel_start(seconds, notify_sync_due, NULL, 0);
+}
+
+// schedules the next reconciliation depending on the state, either after the regular interval or after a backoff
+// MUST BE CALLED WITH THE LOCK HELD
+void schedule_next(sync_peer_status_type* peer) {
+	double delay;
+	if(peer->state == SYNC_STATE_BACKOFF) {
+		delay = BACKOFF_BASE_SECONDS;
+		unsigned int i;
+		for(i = 1; i < peer->failure_count && delay < BACKOFF_MAX_SECONDS; i++) {
+			delay *= 2;
+		}
+		if(delay > BACKOFF_MAX_SECONDS) {
+			delay = BACKOFF_MAX_SECONDS;
+		}
+	} else {
+		delay = SYNC_INTERVAL_SECONDS;
+	}
+	delay *= 1.0 - SYNC_INTERVAL_JITTER + 2.0 * SYNC_INTERVAL_JITTER * random_fraction();
+	schedule_in(peer, delay);
+}
+
+const char* state_string(sync_state_type state) {
+	switch(state) {
+	case SYNC_STATE_IDLE:
+		return "idle";
+	case SYNC_STATE_LISTING:
+		return "listing";
+	case SYNC_STATE_DOWNLOADING:
+		return "downloading";
+	case SYNC_STATE_BACKOFF:
+		return "backoff";
+	}
+	return "invalid";
+}
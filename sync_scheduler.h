@@ -0,0 +1,159 @@
+/**
+ * @file sync_scheduler.h
+ * @brief This module decides when the files of which peer are reconciled.
+ *
+ * Apart from the immediate sync when a peer is discovered, every peer is reconciled periodically so changes that
+ * were missed (e.g. lost change notifications) are picked up eventually. The scheduler keeps a sync state for every
+ * peer (idle, listing, downloading, backoff) together with some timings:
+ * - the interval between two reconciliations is jittered, so a big network does not hit a single peer at the same time
+ * - after a failed sync the peer is put into backoff with an exponentially growing (and jittered) delay
+ * - at most MAX_CONCURRENT_SYNCS peers are listed at the same time
+ *
+ * Peers advertise the change generation and the root hash of their index in their discovery packets. After a
+ * successful sync the advertised state is remembered and as long as the peer keeps advertising it, the periodic
+ * reconciliations are skipped without connecting to the peer. A changed state makes the peer due right away.
+ *
+ * Whenever a peer becomes due or a listing finished, a timer of the timer wheel sends the command client a "sync_due"
+ * message (see timer_wheel.h). Only then the command client asks the scheduler which peer is due, and it reports back
+ * when listings and downloads are done. All functions are thread safe.
+ */
+
+#ifndef SYNC_SCHEDULER_H
+#define SYNC_SCHEDULER_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "sha256.h"
+
+/// How many peers can be listed at the same time
+#define MAX_CONCURRENT_SYNCS 16
+
+/// The sync state of a single peer
+typedef enum {
+	SYNC_STATE_IDLE = 0, //!< Nothing is going on, the peer is reconciled again when next_sync is reached
+	SYNC_STATE_LISTING = 1, //!< The remote files are being enumerated
+	SYNC_STATE_DOWNLOADING = 2, //!< Download jobs for this peer are queued at the file client
+	SYNC_STATE_BACKOFF = 3 //!< The last sync failed, the peer is retried when next_sync is reached
+} sync_state_type;
+
+/// The state of a peer's index as advertised in its discovery packets
+typedef struct {
+	int valid; //!< 1 if the other fields are set
+	uint64_t generation; //!< The change generation of the peer's index
+	unsigned char root_hash[SHA256_HASH_SIZE]; //!< The merkle hash of the peer's whole tree
+} peer_index_state_type;
+
+/// The sync state and timings of a single peer
+typedef struct {
+	char peer_id[6]; //!< The id of the peer
+	struct sockaddr_storage address; //!< The last address the peer was seen with
+	sync_state_type state; //!< The current state
+	struct timeval next_sync; //!< When the next reconciliation is due
+	struct timeval last_sync_start; //!< When the last listing started
+	struct timeval last_success; //!< When the last sync finished successfully, zero if it never did
+	double last_listing_seconds; //!< How long the last listing took
+	unsigned int failure_count; //!< How many syncs failed in a row, this determines the backoff
+	unsigned int pending_downloads; //!< How many download jobs are still queued for this peer
+	peer_index_state_type advertised_state; //!< The state the peer advertised last, invalid if the peer does not advertise it
+	peer_index_state_type listed_state; //!< The advertised state when the last listing started
+	peer_index_state_type reconciled_state; //!< The state after the last successful sync, periodic syncs are skipped while it is advertised
+	uint64_t due_timer; //!< The timer that wakes up the command client when next_sync is reached
+} sync_peer_status_type;
+
+/**
+ * @brief This function initializes the mutex of the scheduler. This should be called before first usage
+ */
+void initialize_sync_scheduler_lock();
+
+/**
+ * @brief When the scheduler is not needed anymore its mutex should be destroyed by calling this function.
+ */
+void destroy_sync_scheduler_lock();
+
+/**
+ * @brief Registers a peer. A new peer is due for a sync (almost) immediately.
+ * @param peer_id The id of the peer
+ * @param address The address the peer was seen with
+ */
+void sync_scheduler_peer_seen(char peer_id[6], struct sockaddr* address);
+
+/**
+ * @brief Forgets a peer that was lost, see peer_list.h.
+ * @param peer_id The id of the peer
+ * @return How many download jobs of the peer were still queued
+ */
+unsigned int sync_scheduler_peer_lost(char peer_id[6]);
+
+/**
+ * @brief Makes a peer due for a sync right away, unless it is currently being synced. The sync is not skipped if the
+ * peer still advertises the state that was reconciled last.
+ * @param peer_id The id of the peer
+ */
+void sync_scheduler_request_sync(char peer_id[6]);
+
+/**
+ * @brief Stores the index state a peer advertised in a discovery packet.
+ *
+ * If the state differs from the one that was last reconciled the peer is made due right away, unless it is currently
+ * being synced or in backoff. If the peer has the same root hash as the local tree there is nothing to fetch, so the
+ * state counts as reconciled without a sync.
+ * @param peer_id The id of the peer
+ * @param generation The change generation of the peer's index
+ * @param root_hash The merkle hash of the peer's whole tree
+ */
+void sync_scheduler_peer_state(char peer_id[6], uint64_t generation, const unsigned char root_hash[SHA256_HASH_SIZE]);
+
+/**
+ * @brief Picks the peer that is due for a sync the longest, if the concurrency limit allows it.
+ *
+ * The picked peer is put into SYNC_STATE_LISTING, sync_scheduler_listing_finished() has to be called afterwards.
+ * Idle peers that still advertise their reconciled state are not picked, their next sync is just rescheduled.
+ * @param peer_id Receives the id of the picked peer
+ * @param address Receives the last address of the picked peer
+ * @return 1 if a peer was picked. Otherwise 0 is returned.
+ */
+int sync_scheduler_next_due(char peer_id[6], struct sockaddr_storage* address);
+
+/**
+ * @brief Reports that listing the files of a peer is done.
+ * @param peer_id The id of the peer
+ * @param success 1 if the listing succeeded, 0 if it failed
+ * @param download_count How many download jobs were created for this peer
+ */
+void sync_scheduler_listing_finished(char peer_id[6], int success, unsigned int download_count);
+
+/**
+ * @brief Reports download jobs that were created outside of a scheduled sync, e.g. because of a change notification.
+ * @param peer_id The id of the peer
+ * @param download_count How many download jobs were created
+ */
+void sync_scheduler_downloads_added(char peer_id[6], unsigned int download_count);
+
+/**
+ * @brief Reports that a download job of a peer is done.
+ * @param peer_id The id of the peer
+ * @param success 1 if the download succeeded, 0 if it failed
+ */
+void sync_scheduler_download_finished(char peer_id[6], int success);
+
+/**
+ * @brief Gets the state and the timings of a peer.
+ * @param peer_id The id of the peer
+ * @param status A memory location the status is copied to
+ * @return 1 if the peer is known to the scheduler. Otherwise 0 is returned.
+ */
+int sync_scheduler_get_status(char peer_id[6], sync_peer_status_type* status);
+
+/**
+ * @brief Prints the states and timings of all peers using the logger module.
+ */
+void print_sync_scheduler();
+
+/**
+ * @brief Frees all memory held by the scheduler.
+ */
+void free_sync_scheduler();
+
+#endif
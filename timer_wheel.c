@@ -0,0 +1,352 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logger.h"
+#include "shutdown.h"
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOT_COUNT - 1)
+#define NO_NODE -1
+#define SLOT_NONE -1 // the node is not running
+#define SLOT_FIRING -2 // the node was taken out of its slot and its callback is about to be called
+#define WAIT_MAX_SECONDS 1 // the thread still has to notice the shutdown
+
+/// A single timer, the timers of a slot are linked by their index
+typedef struct {
+	uint64_t expiry_tick; //!< The tick the timer expires at
+	timer_callback_type callback; //!< The function to call
+	unsigned char argument[TIMER_ARGUMENT_MAX_SIZE]; //!< The copy of the argument
+	int has_argument; //!< 0 if the callback gets NULL
+	uint32_t generation; //!< Incremented whenever the node is reused, so old ids do not match anymore
+	int32_t slot; //!< The slot the node is linked into (level * TIMER_WHEEL_SLOT_COUNT + index), SLOT_NONE or SLOT_FIRING
+	int32_t next; //!< The next node in the slot or in the free list
+	int32_t previous; //!< The previous node in the slot
+} timer_node_type;
+
+// helper functions for this module
+static int32_t allocate_node();
+static void cascade(int level);
+static void fire_current_slot();
+static uint64_t get_now_milliseconds();
+static uint64_t get_now_tick();
+static uint64_t get_wakeup_tick(uint64_t now_tick);
+static void insert_node(int32_t index);
+static void release_node(int32_t index);
+static void unlink_node(int32_t index);
+
+static pthread_mutex_t timer_wheel_lock;
+static pthread_cond_t timer_wheel_condition;
+
+static timer_node_type* nodes = NULL;
+static int32_t node_capacity = 0;
+static int32_t free_nodes = NO_NODE;
+static int32_t slots[TIMER_WHEEL_LEVEL_COUNT * TIMER_WHEEL_SLOT_COUNT];
+static size_t level_counts[TIMER_WHEEL_LEVEL_COUNT]; // how many timers are in each wheel
+static uint64_t current_tick = 0; // all slots up to this tick are processed
+static struct timespec start_time;
+
+void initialize_timer_wheel_lock() {
+	if(pthread_mutex_init(&timer_wheel_lock, NULL) != 0) {
+		printf("pthread_mutex_init failed\n");
+	}
+	// the deadlines are measured with the monotonic clock, so changing the system time does not fire any timers
+	pthread_condattr_t condition_attributes;
+	pthread_condattr_init(&condition_attributes);
+	pthread_condattr_setclock(&condition_attributes, CLOCK_MONOTONIC);
+	if(pthread_cond_init(&timer_wheel_condition, &condition_attributes) != 0) {
+		printf("pthread_cond_init failed\n");
+	}
+	pthread_condattr_destroy(&condition_attributes);
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	int i;
+	for(i = 0; i < TIMER_WHEEL_LEVEL_COUNT * TIMER_WHEEL_SLOT_COUNT; i++) {
+		slots[i] = NO_NODE;
+	}
+}
+
+void destroy_timer_wheel_lock() {
+	if(pthread_cond_destroy(&timer_wheel_condition) != 0) {
+		printf("pthread_cond_destroy failed\n");
+	}
+	if(pthread_mutex_destroy(&timer_wheel_lock) != 0) {
+		printf("pthread_mutex_destroy failed\n");
+	}
+}
+
+void* timer_wheel_thread(void* user_data) {
+	LOGD("started\n");
+	pthread_mutex_lock(&timer_wheel_lock);
+	while(!get_shutdown()) {
+		uint64_t now_tick = get_now_tick();
+		while(current_tick < now_tick && !get_shutdown()) {
+			current_tick++;
+			// a wheel is cascaded whenever the wheel below completes a turn
+			int level;
+			for(level = 1; level < TIMER_WHEEL_LEVEL_COUNT; level++) {
+				if((current_tick & ((1ULL << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) != 0) {
+					break;
+				}
+				cascade(level);
+			}
+			fire_current_slot();
+		}
+		// sleep until something has to be done, starting a timer wakes us up early
+		uint64_t wakeup_tick = get_wakeup_tick(now_tick);
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += WAIT_MAX_SECONDS;
+		if(wakeup_tick != UINT64_MAX) {
+			uint64_t wakeup_milliseconds = wakeup_tick * TIMER_WHEEL_TICK_MILLISECONDS;
+			struct timespec wakeup_time = start_time;
+			wakeup_time.tv_sec += wakeup_milliseconds / 1000;
+			wakeup_time.tv_nsec += (wakeup_milliseconds % 1000) * 1000000;
+			if(wakeup_time.tv_nsec >= 1000000000) {
+				wakeup_time.tv_sec++;
+				wakeup_time.tv_nsec -= 1000000000;
+			}
+			if(wakeup_time.tv_sec < deadline.tv_sec || (wakeup_time.tv_sec == deadline.tv_sec && wakeup_time.tv_nsec < deadline.tv_nsec)) {
+				deadline = wakeup_time;
+			}
+		}
+		int success = pthread_cond_timedwait(&timer_wheel_condition, &timer_wheel_lock, &deadline);
+		if(success != 0 && success != ETIMEDOUT) {
+			LOGE("pthread_cond_timedwait: %s\n", strerror(success));
+		}
+	}
+	pthread_mutex_unlock(&timer_wheel_lock);
+	LOGD("ended\n");
+	return NULL;
+}
+
+uint64_t timer_wheel_start(double seconds, timer_callback_type callback, const void* argument, size_t argument_size) {
+	if(seconds < 0) {
+		seconds = 0;
+	}
+	if(argument_size > TIMER_ARGUMENT_MAX_SIZE) {
+		LOGE("timer argument too large: %zu bytes\n", argument_size);
+		argument_size = TIMER_ARGUMENT_MAX_SIZE;
+	}
+	pthread_mutex_lock(&timer_wheel_lock);
+	int32_t index = allocate_node();
+	timer_node_type* node = &nodes[index];
+	// rounded up, so a timer never fires early
+	uint64_t expiry_milliseconds = get_now_milliseconds() + (uint64_t)(seconds * 1000.0 + 0.999);
+	node->expiry_tick = (expiry_milliseconds + TIMER_WHEEL_TICK_MILLISECONDS - 1) / TIMER_WHEEL_TICK_MILLISECONDS;
+	if(node->expiry_tick <= current_tick) {
+		// the slot of the current tick is processed already
+		node->expiry_tick = current_tick + 1;
+	}
+	node->callback = callback;
+	node->has_argument = argument != NULL;
+	if(argument != NULL) {
+		memcpy(node->argument, argument, argument_size);
+	}
+	insert_node(index);
+	uint64_t timer_id = ((uint64_t)node->generation << 32) | (uint32_t)index;
+	pthread_cond_signal(&timer_wheel_condition);
+	pthread_mutex_unlock(&timer_wheel_lock);
+	return timer_id;
+}
+
+int timer_wheel_cancel(uint64_t timer_id) {
+	if(timer_id == 0) {
+		return 0;
+	}
+	int cancelled = 0;
+	int32_t index = (int32_t)(timer_id & 0xFFFFFFFF);
+	uint32_t generation = (uint32_t)(timer_id >> 32);
+	pthread_mutex_lock(&timer_wheel_lock);
+	if(index < node_capacity && nodes[index].generation == generation && nodes[index].slot >= 0) {
+		unlink_node(index);
+		release_node(index);
+		cancelled = 1;
+	}
+	pthread_mutex_unlock(&timer_wheel_lock);
+	return cancelled;
+}
+
+void free_timer_wheel() {
+	pthread_mutex_lock(&timer_wheel_lock);
+	free(nodes);
+	nodes = NULL;
+	node_capacity = 0;
+	free_nodes = NO_NODE;
+	int i;
+	for(i = 0; i < TIMER_WHEEL_LEVEL_COUNT * TIMER_WHEEL_SLOT_COUNT; i++) {
+		slots[i] = NO_NODE;
+	}
+	memset(level_counts, 0, sizeof(level_counts));
+	pthread_mutex_unlock(&timer_wheel_lock);
+}
+
+// MODULE SCOPED FUNTCIONS BEGIN
+
+// takes a node from the free list, the array grows if there is none
+// MUST BE CALLED WITH THE LOCK HELD
+int32_t allocate_node() {
+	if(free_nodes == NO_NODE) {
+		int32_t new_capacity = node_capacity == 0 ? 64 : node_capacity * 2;
+		nodes = (timer_node_type*)realloc(nodes, new_capacity * sizeof(timer_node_type));
+		memset(nodes + node_capacity, 0, (new_capacity - node_capacity) * sizeof(timer_node_type));
+		int32_t i;
+		for(i = new_capacity - 1; i >= node_capacity; i--) {
+			nodes[i].slot = SLOT_NONE;
+			nodes[i].next = free_nodes;
+			free_nodes = i;
+		}
+		node_capacity = new_capacity;
+	}
+	int32_t index = free_nodes;
+	free_nodes = nodes[index].next;
+	nodes[index].generation++;
+	if(nodes[index].generation == 0) {
+		// the id must never be 0
+		nodes[index].generation++;
+	}
+	return index;
+}
+
+// moves all timers of the current slot of a wheel to the wheels below
+// MUST BE CALLED WITH THE LOCK HELD
+void cascade(int level) {
+	int32_t* slot = &slots[level * TIMER_WHEEL_SLOT_COUNT + ((current_tick >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK)];
+	int32_t index = *slot;
+	*slot = NO_NODE;
+	while(index != NO_NODE) {
+		int32_t next = nodes[index].next;
+		level_counts[level]--;
+		insert_node(index);
+		index = next;
+	}
+}
+
+// calls the callbacks of all timers in the slot of the current tick
+// MUST BE CALLED WITH THE LOCK HELD, it is released while the callbacks are running
+void fire_current_slot() {
+	int32_t* slot = &slots[current_tick & SLOT_MASK];
+	int32_t index = *slot;
+	*slot = NO_NODE;
+	// the whole slot is taken out first, so the callbacks can start timers that end up in the same slot
+	int32_t firing = NO_NODE;
+	while(index != NO_NODE) {
+		int32_t next = nodes[index].next;
+		level_counts[0]--;
+		if(nodes[index].expiry_tick > current_tick) {
+			// this can only be a timer that did not fit into the wheels when it was started
+			insert_node(index);
+		} else {
+			nodes[index].slot = SLOT_FIRING;
+			nodes[index].next = firing;
+			firing = index;
+		}
+		index = next;
+	}
+	while(firing != NO_NODE) {
+		index = firing;
+		firing = nodes[index].next;
+		timer_callback_type callback = nodes[index].callback;
+		unsigned char argument[TIMER_ARGUMENT_MAX_SIZE];
+		memcpy(argument, nodes[index].argument, TIMER_ARGUMENT_MAX_SIZE);
+		int has_argument = nodes[index].has_argument;
+		release_node(index);
+		pthread_mutex_unlock(&timer_wheel_lock);
+		callback(has_argument ? argument : NULL);
+		pthread_mutex_lock(&timer_wheel_lock);
+	}
+}
+
+// returns the milliseconds since the timer wheel was initialized
+uint64_t get_now_milliseconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - start_time.tv_sec) * 1000 + (now.tv_nsec - start_time.tv_nsec) / 1000000;
+}
+
+uint64_t get_now_tick() {
+	return get_now_milliseconds() / TIMER_WHEEL_TICK_MILLISECONDS;
+}
+
+// returns the tick at which the next timer of the first wheel expires or the next wheel has to be cascaded
+// UINT64_MAX is returned if there are no timers at all
+// MUST BE CALLED WITH THE LOCK HELD
+uint64_t get_wakeup_tick(uint64_t now_tick) {
+	uint64_t wakeup_tick = UINT64_MAX;
+	if(level_counts[0] > 0) {
+		uint64_t tick;
+		for(tick = current_tick + 1; tick <= current_tick + TIMER_WHEEL_SLOT_COUNT; tick++) {
+			if(slots[tick & SLOT_MASK] != NO_NODE) {
+				wakeup_tick = tick;
+				break;
+			}
+		}
+	}
+	int level;
+	for(level = 1; level < TIMER_WHEEL_LEVEL_COUNT; level++) {
+		if(level_counts[level] > 0) {
+			// the next turn of the first wheel cascades the second one and so on
+			uint64_t cascade_tick = (current_tick | SLOT_MASK) + 1;
+			if(cascade_tick < wakeup_tick) {
+				wakeup_tick = cascade_tick;
+			}
+			break;
+		}
+	}
+	if(wakeup_tick == UINT64_MAX) {
+		return wakeup_tick;
+	}
+	return wakeup_tick < now_tick ? now_tick : wakeup_tick;
+}
+
+// links a node into the slot that fits its expiry tick, the expiry tick must not be before the current tick
+// MUST BE CALLED WITH THE LOCK HELD
+void insert_node(int32_t index) {
+	timer_node_type* node = &nodes[index];
+	uint64_t expiry_tick = node->expiry_tick < current_tick ? current_tick : node->expiry_tick;
+	uint64_t delta = expiry_tick - current_tick;
+	int level;
+	for(level = 0; level < TIMER_WHEEL_LEVEL_COUNT - 1; level++) {
+		if(delta < (1ULL << (TIMER_WHEEL_SLOT_BITS * (level + 1)))) {
+			break;
+		}
+	}
+	if(delta >= (1ULL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVEL_COUNT))) {
+		// too far in the future, it is put into the last slot of the top wheel and cascaded again from there
+		expiry_tick = current_tick + (1ULL << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVEL_COUNT)) - 1;
+	}
+	node->slot = level * TIMER_WHEEL_SLOT_COUNT + ((expiry_tick >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK);
+	node->previous = NO_NODE;
+	node->next = slots[node->slot];
+	if(node->next != NO_NODE) {
+		nodes[node->next].previous = index;
+	}
+	slots[node->slot] = index;
+	level_counts[level]++;
+}
+
+// MUST BE CALLED WITH THE LOCK HELD
+void release_node(int32_t index) {
+	nodes[index].slot = SLOT_NONE;
+	nodes[index].next = free_nodes;
+	free_nodes = index;
+}
+
+// removes a node from its slot
+// MUST BE CALLED WITH THE LOCK HELD
+void unlink_node(int32_t index) {
+	timer_node_type* node = &nodes[index];
+	if(node->previous != NO_NODE) {
+		nodes[node->previous].next = node->next;
+	} else {
+		slots[node->slot] = node->next;
+	}
+	if(node->next != NO_NODE) {
+		nodes[node->next].previous = node->previous;
+	}
+	level_counts[node->slot / TIMER_WHEEL_SLOT_COUNT]--;
+	node->slot = SLOT_NONE;
+}
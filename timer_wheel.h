@@ -0,0 +1,78 @@
+/**
+ * @file timer_wheel.h
+ * @brief This module provides timers for all other modules with a hierarchical timer wheel.
+ *
+ * This module has its own thread. Instead of every module checking its deadlines periodically, they start a timer
+ * that calls back when the deadline is reached. The timers are kept in TIMER_WHEEL_LEVEL_COUNT wheels with
+ * TIMER_WHEEL_SLOT_COUNT slots each. A slot of the first wheel holds the timers of a single tick, a slot of the
+ * second wheel the timers of a whole turn of the first wheel and so on. Whenever a wheel completes a turn, the next
+ * slot of the wheel above is cascaded down. So starting and cancelling a timer takes constant time no matter how
+ * many timers are running, and the thread only wakes up when a timer is due or a slot has to be cascaded.
+ *
+ * The callbacks are called from the timer thread without holding any lock of this module, so they can start and
+ * cancel timers themselves. They should return quickly, usually they just send a message to another thread.
+ * All functions are thread safe.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_TICK_MILLISECONDS 100 // the resolution of all timers
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOT_COUNT (1 << TIMER_WHEEL_SLOT_BITS) // the slots of a single wheel
+#define TIMER_WHEEL_LEVEL_COUNT 4 // with 100ms ticks timers up to ~19 days fit in, longer ones are cascaded again
+#define TIMER_ARGUMENT_MAX_SIZE 16 // the maximum size of the argument that is copied into a timer
+
+/// The function that is called when a timer expires, it gets a pointer to the copy of the argument
+typedef void (*timer_callback_type)(void* argument);
+
+/**
+ * @brief This function initializes the lock of the timer wheel. This should be called before first usage
+ */
+void initialize_timer_wheel_lock();
+
+/**
+ * @brief When the timer wheel is not needed anymore its lock should be destroyed by calling this function.
+ */
+void destroy_timer_wheel_lock();
+
+/**
+ * @brief This is the thread's main function. It is started from the main thread before all other threads.
+ *
+ * \code{.c}
+ * pthread_create(&timer_wheel_thread_id, NULL, timer_wheel_thread, (void*)0);
+ * \endcode
+ * Once the shutdown is set no callbacks are called anymore.
+ * @param user_data This parameter can be used to supply user data to the thread
+ */
+void* timer_wheel_thread(void* user_data);
+
+/**
+ * @brief Starts a timer.
+ * @param seconds After how many seconds the callback is called, it is rounded up to the next tick
+ * @param callback The function to call
+ * @param argument The argument that is copied into the timer, it may be NULL
+ * @param argument_size The size of @p argument, at most TIMER_ARGUMENT_MAX_SIZE
+ * @return The id of the timer, it is never 0
+ */
+uint64_t timer_wheel_start(double seconds, timer_callback_type callback, const void* argument, size_t argument_size);
+
+/**
+ * @brief Cancels a timer.
+ *
+ * If the callback is already about to be called this cannot be stopped anymore, so callbacks have to check whether
+ * they are still relevant.
+ * @param timer_id The id returned by timer_wheel_start(), 0 is ignored
+ * @return 1 if the timer was cancelled. 0 if it already expired or the id is unknown.
+ */
+int timer_wheel_cancel(uint64_t timer_id);
+
+/**
+ * @brief Frees all timers, the thread has to be ended already.
+ */
+void free_timer_wheel();
+
+#endif
@@ -0,0 +1,314 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "logger.h"
+#include "shutdown.h"
+
+#include "tree_scanner.h"
+
+#define DIRENT_BUFFER_SIZE (256 * 1024) // big buffers mean few system calls for big directories
+#define MAX_THREAD_COUNT 64
+#define THREADS_PER_CORE 2 // the threads mostly wait for the disk, more threads mean more requests in flight
+#define IDLE_SLEEP_MICROSECONDS 200 // how long a thread without work waits before it looks for work again
+
+/// The layout of the records returned by the getdents64 system call
+typedef struct {
+	uint64_t d_ino; //!< The inode number
+	int64_t d_off; //!< The offset to the next record
+	unsigned short d_reclen; //!< The size of this record
+	unsigned char d_type; //!< The file type, DT_UNKNOWN if the file system does not provide it
+	char d_name[]; //!< The zero terminated name
+} linux_dirent64_type;
+
+/// The queue of directories of a single thread, the owner works at the end, other threads steal from the start
+typedef struct {
+	pthread_mutex_t lock; //!< Protects the queue
+	char** paths; //!< The paths of the directories that still have to be scanned
+	size_t start; //!< The index of the first path that was not stolen yet
+	size_t end; //!< The index after the last path
+	size_t capacity; //!< The allocated count of paths
+} work_queue_type;
+
+struct scan;
+
+/// A single scanner thread
+typedef struct {
+	struct scan* scan; //!< The scan this thread belongs to
+	size_t index; //!< The index of the thread inside of the scan
+	pthread_t thread_id; //!< The id of the thread
+	work_queue_type queue; //!< The own queue of the thread
+	char* dirent_buffer; //!< The buffer for getdents64
+	tree_scanner_entry_type* entries; //!< The entries of the current directory
+	size_t entry_capacity; //!< The allocated count of entries
+	char* names; //!< The names of the entries of the current directory
+	size_t names_capacity; //!< The allocated size of names
+} worker_type;
+
+/// The state shared by all threads of a scan
+typedef struct scan {
+	const char* root; //!< The root directory as passed by the caller
+	int root_fd; //!< The opened root directory, all directories are opened relative to it
+	tree_scanner_callback_type callback; //!< Called for every directory
+	void* user_data; //!< Passed to the callback
+	worker_type* workers; //!< All threads
+	size_t worker_count; //!< The count of threads
+	size_t pending_count; //!< The count of directories that were queued but not completely scanned yet
+	long directory_count; //!< The count of scanned directories
+} scan_type;
+
+// helper functions for this module
+static char* pop_path(worker_type* worker);
+static void push_path(worker_type* worker, char* path);
+static void scan_path(worker_type* worker, const char* path);
+static char* steal_path(worker_type* worker);
+static void* worker_thread(void* user_data);
+
+long tree_scanner_scan(const char* root, const char* path, int thread_count, tree_scanner_callback_type callback, void* user_data) {
+	scan_type scan;
+	memset(&scan, 0, sizeof(scan));
+	scan.root = root;
+	scan.callback = callback;
+	scan.user_data = user_data;
+	scan.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(scan.root_fd == -1) {
+		LOGD("open %s %s\n", root, strerror(errno));
+		return -1;
+	}
+	// check the start directory here so the caller can tell whether anything was scanned
+	int start_fd = openat(scan.root_fd, strcmp(path, "/") == 0 ? "." : path + 1, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if(start_fd == -1) {
+		close(scan.root_fd);
+		return -1;
+	}
+	close(start_fd);
+
+	if(thread_count <= 0) {
+		long core_count = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = core_count > 0 ? core_count * THREADS_PER_CORE : THREADS_PER_CORE;
+	}
+	if(thread_count > MAX_THREAD_COUNT) {
+		thread_count = MAX_THREAD_COUNT;
+	}
+	scan.worker_count = thread_count;
+	scan.workers = (worker_type*)calloc(scan.worker_count, sizeof(worker_type));
+	size_t i;
+	for(i = 0; i < scan.worker_count; i++) {
+		scan.workers[i].scan = &scan;
+		scan.workers[i].index = i;
+		pthread_mutex_init(&scan.workers[i].queue.lock, NULL);
+	}
+	push_path(&scan.workers[0], strdup(path));
+
+	if(scan.worker_count == 1) {
+		// no need for any threads
+		worker_thread(&scan.workers[0]);
+	} else {
+		for(i = 0; i < scan.worker_count; i++) {
+			int success = pthread_create(&scan.workers[i].thread_id, NULL, worker_thread, &scan.workers[i]);
+			if(success != 0) {
+				// the other threads steal the work of this one
+				LOGE("pthread_create failed with return code %d\n", success);
+				scan.workers[i].thread_id = 0;
+			}
+		}
+		for(i = 0; i < scan.worker_count; i++) {
+			if(scan.workers[i].thread_id != 0) {
+				pthread_join(scan.workers[i].thread_id, NULL);
+			}
+		}
+	}
+
+	for(i = 0; i < scan.worker_count; i++) {
+		free(scan.workers[i].queue.paths);
+		pthread_mutex_destroy(&scan.workers[i].queue.lock);
+	}
+	free(scan.workers);
+	close(scan.root_fd);
+	return scan.directory_count;
+}
+
+// MODULE SCOPED FUNTCIONS BEGIN
+
+// the owner takes the most recently queued directory, this keeps the scan depth first for each thread
+char* pop_path(worker_type* worker) {
+	work_queue_type* queue = &worker->queue;
+	char* path = NULL;
+	pthread_mutex_lock(&queue->lock);
+	if(queue->end > queue->start) {
+		path = queue->paths[--queue->end];
+		if(queue->end == queue->start) {
+			queue->start = queue->end = 0;
+		}
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return path;
+}
+
+// takes ownership of path
+void push_path(worker_type* worker, char* path) {
+	__atomic_add_fetch(&worker->scan->pending_count, 1, __ATOMIC_ACQ_REL);
+	work_queue_type* queue = &worker->queue;
+	pthread_mutex_lock(&queue->lock);
+	if(queue->end == queue->capacity) {
+		if(queue->start > 0) {
+			// reuse the space of stolen paths first
+			memmove(queue->paths, queue->paths + queue->start, (queue->end - queue->start) * sizeof(char*));
+			queue->end -= queue->start;
+			queue->start = 0;
+		}
+		if(queue->end == queue->capacity) {
+			queue->capacity = queue->capacity == 0 ? 64 : queue->capacity * 2;
+			queue->paths = (char**)realloc(queue->paths, queue->capacity * sizeof(char*));
+		}
+	}
+	queue->paths[queue->end++] = path;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void scan_path(worker_type* worker, const char* path) {
+	scan_type* scan = worker->scan;
+	int directory_fd = openat(scan->root_fd, strcmp(path, "/") == 0 ? "." : path + 1, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if(directory_fd == -1) {
+		if(errno != ENOENT && errno != ENOTDIR) {
+			LOGD("openat %s%s %s\n", scan->root, path, strerror(errno));
+		}
+		return;
+	}
+	struct stat info;
+	if(fstat(directory_fd, &info) != 0) {
+		close(directory_fd);
+		return;
+	}
+	if(worker->dirent_buffer == NULL) {
+		worker->dirent_buffer = (char*)malloc(DIRENT_BUFFER_SIZE);
+	}
+
+	// the names are collected in one buffer, so the entries only store offsets until the buffer is complete
+	size_t entry_count = 0;
+	size_t names_size = 0;
+	while(1) {
+		long read_bytes = syscall(SYS_getdents64, directory_fd, worker->dirent_buffer, DIRENT_BUFFER_SIZE);
+		if(read_bytes <= 0) {
+			if(read_bytes == -1) {
+				LOGD("getdents64 %s%s %s\n", scan->root, path, strerror(errno));
+			}
+			break;
+		}
+		long offset;
+		for(offset = 0; offset < read_bytes; offset += ((linux_dirent64_type*)(worker->dirent_buffer + offset))->d_reclen) {
+			linux_dirent64_type* dirent = (linux_dirent64_type*)(worker->dirent_buffer + offset);
+			if(dirent->d_type != DT_REG && dirent->d_type != DT_DIR && dirent->d_type != DT_UNKNOWN) {
+				// we only want to deal with regular files and directories
+				continue;
+			}
+			if(strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+				continue;
+			}
+			if(entry_count == worker->entry_capacity) {
+				worker->entry_capacity = worker->entry_capacity == 0 ? 256 : worker->entry_capacity * 2;
+				worker->entries = (tree_scanner_entry_type*)realloc(worker->entries, worker->entry_capacity * sizeof(tree_scanner_entry_type));
+			}
+			tree_scanner_entry_type* entry = &worker->entries[entry_count];
+			if(fstatat(directory_fd, dirent->d_name, &entry->info, AT_SYMLINK_NOFOLLOW) != 0 || (!S_ISREG(entry->info.st_mode) && !S_ISDIR(entry->info.st_mode))) {
+				continue;
+			}
+			size_t name_length = strlen(dirent->d_name) + 1;
+			while(names_size + name_length > worker->names_capacity) {
+				worker->names_capacity = worker->names_capacity == 0 ? 16384 : worker->names_capacity * 2;
+				worker->names = (char*)realloc(worker->names, worker->names_capacity);
+			}
+			memcpy(worker->names + names_size, dirent->d_name, name_length);
+			entry->name = (const char*)(uintptr_t)names_size;
+			entry->descend = S_ISDIR(entry->info.st_mode);
+			names_size += name_length;
+			entry_count++;
+		}
+	}
+	close(directory_fd);
+
+	size_t i;
+	for(i = 0; i < entry_count; i++) {
+		worker->entries[i].name = worker->names + (uintptr_t)worker->entries[i].name;
+	}
+	scan->callback(path, &info, worker->entries, entry_count, scan->user_data);
+	__atomic_add_fetch(&scan->directory_count, 1, __ATOMIC_RELAXED);
+
+	// the subdirectories are only queued now, so they are always reported after their parent
+	for(i = 0; i < entry_count; i++) {
+		tree_scanner_entry_type* entry = &worker->entries[i];
+		if(!S_ISDIR(entry->info.st_mode) || !entry->descend) {
+			continue;
+		}
+		char child_path[PATH_MAX];
+		int length = snprintf(child_path, sizeof(child_path), "%s%s%s", path, strcmp(path, "/") == 0 ? "" : "/", entry->name);
+		if(length < 0 || length >= sizeof(child_path)) {
+			LOGD("path too long %s/%s\n", path, entry->name);
+			continue;
+		}
+		push_path(worker, strdup(child_path));
+	}
+}
+
+// other threads take the oldest queued directory, which is usually the biggest subtree
+char* steal_path(worker_type* worker) {
+	scan_type* scan = worker->scan;
+	size_t i;
+	for(i = 1; i < scan->worker_count; i++) {
+		work_queue_type* queue = &scan->workers[(worker->index + i) % scan->worker_count].queue;
+		char* path = NULL;
+		pthread_mutex_lock(&queue->lock);
+		if(queue->end > queue->start) {
+			path = queue->paths[queue->start++];
+			if(queue->end == queue->start) {
+				queue->start = queue->end = 0;
+			}
+		}
+		pthread_mutex_unlock(&queue->lock);
+		if(path != NULL) {
+			return path;
+		}
+	}
+	return NULL;
+}
+
+void* worker_thread(void* user_data) {
+	worker_type* worker = (worker_type*)user_data;
+	scan_type* scan = worker->scan;
+	while(1) {
+		char* path = pop_path(worker);
+		if(path == NULL) {
+			path = steal_path(worker);
+		}
+		if(path == NULL) {
+			// a directory is only done after its subdirectories were queued, so the scan is done once nothing is pending
+			if(__atomic_load_n(&scan->pending_count, __ATOMIC_ACQUIRE) == 0) {
+				break;
+			}
+			usleep(IDLE_SLEEP_MICROSECONDS);
+			continue;
+		}
+		if(!get_shutdown()) {
+			scan_path(worker, path);
+		}
+		free(path);
+		__atomic_sub_fetch(&scan->pending_count, 1, __ATOMIC_ACQ_REL);
+	}
+	free(worker->dirent_buffer);
+	free(worker->entries);
+	free(worker->names);
+	worker->dirent_buffer = NULL;
+	worker->entries = NULL;
+	worker->names = NULL;
+	worker->entry_capacity = worker->names_capacity = 0;
+	return NULL;
+}
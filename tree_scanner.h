@@ -0,0 +1,49 @@
+/**
+ * @file tree_scanner.h
+ * @brief This file provides a parallel directory tree scanner.
+ *
+ * The scanner walks a directory tree with a pool of threads. Every thread has its own queue of directories and
+ * takes work from the queues of the other threads when its own queue runs dry, so wide as well as deep trees keep
+ * all threads busy. Directories are opened relative to the root with openat(), read with large getdents64 buffers
+ * and their entries are stat'ed with fstatat() relative to the directory, so no path has to be resolved twice.
+ *
+ * For every directory the callback receives all of its regular files and subdirectories at once. The callback is
+ * called from the scanner threads, possibly for many directories at the same time, so it has to be thread safe. A
+ * directory is always reported before any of its subdirectories.
+ */
+
+#ifndef TREE_SCANNER_H
+#define TREE_SCANNER_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/// A single entry of a scanned directory
+typedef struct {
+	const char* name; //!< The name of the entry without its parent path
+	struct stat info; //!< The result of fstatat() for the entry, only regular files and directories are reported
+	int descend; //!< Only for directories: 1 if the directory will be scanned, the callback can set this to 0 to skip it
+} tree_scanner_entry_type;
+
+/**
+ * @brief The callback invoked for every scanned directory.
+ * @param path The path of the directory relative to the root of the scan, it starts with a '/'
+ * @param info The result of fstat() for the directory
+ * @param entries The regular files and subdirectories of the directory in no particular order
+ * @param entry_count The count of entries
+ * @param user_data The user data passed to tree_scanner_scan()
+ */
+typedef void (*tree_scanner_callback_type)(const char* path, const struct stat* info, tree_scanner_entry_type* entries, size_t entry_count, void* user_data);
+
+/**
+ * @brief Scans a directory and everything below it. This blocks until the whole tree is scanned.
+ * @param root The root directory, e.g. BASE_PATH
+ * @param path The directory to start at relative to root, "/" for the root itself
+ * @param thread_count How many threads are used. 1 scans in the calling thread, 0 picks a count depending on the count of cores
+ * @param callback This is called for every directory
+ * @param user_data This is passed to the callback
+ * @return The count of scanned directories or -1 if the start directory could not be opened.
+ */
+long tree_scanner_scan(const char* root, const char* path, int thread_count, tree_scanner_callback_type callback, void* user_data);
+
+#endif
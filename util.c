@@ -2,12 +2,15 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 
 #include "logger.h"
@@ -17,6 +20,7 @@
 static int create_listener_socket(const char* port, int ai_socktype);
 static double get_time_difference_seconds(struct timeval t1, struct timeval t2);
 static int receive_tcp_n(int socketfd, char* buffer, size_t buffer_size, size_t n, double timeout_seconds);
+static int start_connect(struct sockaddr_storage* address, unsigned short port, int* socketfd);
 static struct timeval timeval_from_double(double time_seconds);
 
 // module structure should be
@@ -35,69 +39,136 @@ static struct timeval timeval_from_double(double time_seconds);
 // \n
 // implementation of module scoped functions
 
+int connect_parallel(connect_attempt_type* attempts, size_t attempt_count, unsigned short port, double attempt_delay_seconds, double timeout_seconds) {
+	int* socketfds = (int*)malloc(attempt_count * sizeof(int));
+	struct timeval* start_times = (struct timeval*)malloc(attempt_count * sizeof(struct timeval));
+	if(attempt_count > 0 && (socketfds == NULL || start_times == NULL)) {
+		LOGE("out of memory :/\n");
+		free(socketfds);
+		free(start_times);
+		return -1;
+	}
+	size_t attempt_index;
+	for(attempt_index = 0; attempt_index < attempt_count; attempt_index++) {
+		socketfds[attempt_index] = -1;
+		attempts[attempt_index].state = CONNECT_ATTEMPT_NOT_STARTED;
+		attempts[attempt_index].seconds = 0;
+	}
+	struct timeval start_time;
+	gettimeofday(&start_time, NULL);
+	double next_attempt_seconds = 0; // when the next attempt is started, counted from start_time
+	size_t started_count = 0;
+	size_t pending_count = 0;
+	int winner = -1;
+	while(winner == -1) {
+		double passed_seconds = get_passed_time(start_time);
+		if(passed_seconds >= timeout_seconds) {
+			break;
+		}
+		if(started_count < attempt_count && (passed_seconds >= next_attempt_seconds || pending_count == 0)) {
+			attempt_index = started_count++;
+			next_attempt_seconds = passed_seconds + attempt_delay_seconds;
+			gettimeofday(&start_times[attempt_index], NULL);
+			int connect_return = start_connect(&attempts[attempt_index].address, port, &socketfds[attempt_index]);
+			if(connect_return == 1) {
+				winner = attempt_index;
+			} else if(connect_return == 0) {
+				pending_count++;
+			} else {
+				attempts[attempt_index].state = CONNECT_ATTEMPT_FAILED;
+				attempts[attempt_index].seconds = get_passed_time(start_times[attempt_index]);
+				// the next address is tried right away
+				next_attempt_seconds = passed_seconds;
+			}
+			continue;
+		}
+		if(pending_count == 0) {
+			// all attempts failed
+			break;
+		}
+		// wait for one of the pending attempts or until the next one is due
+		double wait_seconds = timeout_seconds - passed_seconds;
+		if(started_count < attempt_count && next_attempt_seconds - passed_seconds < wait_seconds) {
+			wait_seconds = next_attempt_seconds - passed_seconds;
+		}
+		fd_set write_set;
+		FD_ZERO(&write_set);
+		int maxfd = -1;
+		for(attempt_index = 0; attempt_index < started_count; attempt_index++) {
+			if(socketfds[attempt_index] != -1) {
+				FD_SET(socketfds[attempt_index], &write_set);
+				maxfd = socketfds[attempt_index] > maxfd ? socketfds[attempt_index] : maxfd;
+			}
+		}
+		struct timeval timeout = timeval_from_double(wait_seconds > 0 ? wait_seconds : 0);
+		int select_return = select(maxfd + 1, NULL, &write_set, NULL, &timeout);
+		if(select_return == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			LOGE("select %s\n", strerror(errno));
+			break;
+		}
+		for(attempt_index = 0; attempt_index < started_count && winner == -1; attempt_index++) {
+			if(socketfds[attempt_index] == -1 || !FD_ISSET(socketfds[attempt_index], &write_set)) {
+				continue;
+			}
+			socklen_t option_length = sizeof(int);
+			int option_value = 0;
+			if(getsockopt(socketfds[attempt_index], SOL_SOCKET, SO_ERROR, (void*)(&option_value), &option_length) < 0) {
+				option_value = errno;
+			}
+			if(option_value == 0) {
+				winner = attempt_index;
+				continue;
+			}
+			char ip_buffer[128];
+			get_ip_address_string_prefixed((struct sockaddr*)&attempts[attempt_index].address, ip_buffer, sizeof(ip_buffer));
+			LOGD("connecting to %s failed: %s\n", ip_buffer, strerror(option_value));
+			close(socketfds[attempt_index]);
+			socketfds[attempt_index] = -1;
+			pending_count--;
+			attempts[attempt_index].state = CONNECT_ATTEMPT_FAILED;
+			attempts[attempt_index].seconds = get_passed_time(start_times[attempt_index]);
+			next_attempt_seconds = get_passed_time(start_time);
+		}
+	}
+	// the winner gets its socket back in blocking mode, all others are closed
+	int socketfd = -1;
+	for(attempt_index = 0; attempt_index < started_count; attempt_index++) {
+		if(socketfds[attempt_index] == -1) {
+			continue;
+		}
+		if((int)attempt_index == winner) {
+			attempts[attempt_index].seconds = get_passed_time(start_times[attempt_index]);
+			if(fcntl(socketfds[attempt_index], F_SETFL, fcntl(socketfds[attempt_index], F_GETFL, 0) & ~O_NONBLOCK) == -1) {
+				LOGE("fcntl clear O_NONBLOCK\n");
+				attempts[attempt_index].state = CONNECT_ATTEMPT_FAILED;
+				close(socketfds[attempt_index]);
+				continue;
+			}
+			attempts[attempt_index].state = CONNECT_ATTEMPT_SUCCEEDED;
+			socketfd = socketfds[attempt_index];
+		} else {
+			// attempts that were still pending when the time ran out failed, the others just lost
+			attempts[attempt_index].state = winner == -1 ? CONNECT_ATTEMPT_FAILED : CONNECT_ATTEMPT_CANCELLED;
+			attempts[attempt_index].seconds = get_passed_time(start_times[attempt_index]);
+			close(socketfds[attempt_index]);
+		}
+	}
+	if(winner == -1) {
+		LOGD("connection attempt timed out or failed\n");
+	}
+	free(socketfds);
+	free(start_times);
+	return socketfd;
+}
+
 int connect_with_timeout(const struct sockaddr* address, unsigned short port, double timeout_seconds) {
-    // first we need to set the port
-    if(address->sa_family == AF_INET) {
-        // ipv4
-        struct sockaddr_in* ipv4_address = (struct sockaddr_in*)address;
-        ipv4_address->sin_port = htons(port);
-    } else {
-        // ipv6
-        struct sockaddr_in6* ipv6_address = (struct sockaddr_in6*)address;
-        ipv6_address->sin6_port = htons(port);
-    }
-
-    // now we create a non-blocking socket
-    int socketfd = socket(address->sa_family, SOCK_STREAM, 0);
-
-    if(fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL, 0) | O_NONBLOCK) == -1) {
-        LOGE("fcntl set O_NONBLOCK\n");
-        return -1;
-    }
-
-    int connect_return = connect(socketfd, address, address->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
-    if(errno != EINPROGRESS && connect_return != 0) {
-        LOGE("connect %s\n", strerror(errno));
-        return -1;
-    }
-
-    fd_set write_set;
-    FD_ZERO(&write_set);
-    FD_SET(socketfd, &write_set);
-    struct timeval timeout;
-    timeout.tv_sec = (int)timeout_seconds;
-    timeout.tv_usec = (int)((timeout_seconds - (int)timeout_seconds) * 1000000);
-    int select_return = select(socketfd + 1, NULL, &write_set, NULL, &timeout);
-    if(select_return == -1) {
-        // error
-        LOGE("select %s\n", strerror(errno));
-        return -1;
-    }
-    else if(select_return == 0) {
-    	// timeout
-        LOGD("connection attempt timed out\n");
-        return -1;
-    }
-    else {
-        // not timed out
-        socklen_t option_length = sizeof(int);
-        int option_value = 0;
-        if(getsockopt(socketfd, SOL_SOCKET, SO_ERROR, (void*)(&option_value), &option_length) < 0) {
-            LOGE("getsockopt() %s\n", strerror(errno));
-            return -1;
-        }
-        if(option_value) {
-            LOGE("error in delayed connection %s\n", strerror(option_value));
-            return -1;
-        }
-        // connection established successfully
-        // remove the O_NONBLOCK, otherwise all function calls fail
-        if(fcntl(socketfd, F_SETFL, ~fcntl(socketfd, F_GETFL, 0) & O_NONBLOCK) == -1) {
-            LOGE("fcntl clear O_NONBLOCK\n");
-            return -1;
-        }
-    }
-    return socketfd;
+	connect_attempt_type attempt;
+	memset(&attempt, 0, sizeof(attempt));
+	memcpy(&attempt.address, address, address->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+	return connect_parallel(&attempt, 1, port, 0, timeout_seconds);
 }
 
 int create_tcp_listener(const char* port) {
@@ -116,6 +187,26 @@ void get_hex_string(const unsigned char* in_buffer, const size_t count, char* bu
 	buffer[2 * i] = 0;
 }
 
+int parse_hex_string(const char* string, unsigned char* out_buffer, const size_t count) {
+	if(strlen(string) != 2 * count) {
+		return -1;
+	}
+	size_t i;
+	for(i = 0; i < 2 * count; i++) {
+		char c = string[i];
+		int value = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if(value == -1) {
+			return -1;
+		}
+		if(i % 2 == 0) {
+			out_buffer[i / 2] = value << 4;
+		} else {
+			out_buffer[i / 2] |= value;
+		}
+	}
+	return 0;
+}
+
 void get_ip_address_string_prefixed(struct sockaddr* address, char* buffer, size_t buffer_size) {
 	size_t index = 0;
 	if(address->sa_family == AF_INET) {
@@ -154,6 +245,16 @@ double get_passed_time(struct timeval t) {
 	return get_time_difference_seconds(now, t);
 }
 
+// 64 bit FNV-1a
+uint64_t get_string_hash(const char* string) {
+	uint64_t hash = 14695981039346656037ULL;
+	for(; *string; string++) {
+		hash ^= (unsigned char)*string;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
 // returns whether some ipv6 address is actually an ipv6 mapped
 // ipv4 address
 int is_ipv4_mapped(struct sockaddr* address) {
@@ -186,6 +287,7 @@ void mkdirp(const char* path) {
 		}
 	}
     mkdir(path_copy, S_IRWXU);
+    free(path_copy);
 }
 
 // this is a helper function to receive a length prefixed tcp message with a maximum length and a timeout, THIS IS A BLOCKING OPERATION
@@ -197,24 +299,25 @@ int tcp_message_receive(int socketfd, char* buffer, size_t buffer_size, double t
 
 	char message_size_buffer[4];
 	int receive_return = receive_tcp_n(socketfd, message_size_buffer, sizeof(message_size_buffer), 4, timeout_seconds);
-	if(receive_return <= 0) {
-		return receive_return;
-	}
 	if(receive_return != 4) {
 		// we need EXACTLY 4 bytes...
 		// if we do not get them we close the connection
-		return 0;
+		return -1;
 	}
 	uint32_t message_size = ntohl(*((uint32_t*)message_size_buffer));
-
-	receive_return = receive_tcp_n(socketfd, buffer, buffer_size, message_size, 2.0);
-	if(receive_return <= 0) {
-		return receive_return;
+	if(message_size > buffer_size) {
+		LOGD("message of %u bytes does not fit into %zu bytes\n", message_size, buffer_size);
+		return -1;
 	}
+	if(message_size == 0) {
+		return 0;
+	}
+
+	receive_return = receive_tcp_n(socketfd, buffer, buffer_size, message_size, timeout_seconds - get_passed_time(start_time));
 	if(receive_return != message_size) {
 		// we are only interested in full messages
 		// if we do not get a full message we close the connection
-		return 0;
+		return -1;
 	}
 	return receive_return;
 }
@@ -228,26 +331,98 @@ int tcp_message_send(int socketfd, char* buffer, uint32_t buffer_size, double ti
 		// error printing is done by the calling thread
 		return -1;
 	}*/
-	// first we need to send the size
+	// the size and the buffer are sent together, otherwise small messages wait for the delayed ack of the size
 	uint32_t network_buffer_size = htonl(buffer_size);
-	int send_return = send(socketfd, (void*)&network_buffer_size, 4, 0);
+	size_t message_size = sizeof(network_buffer_size) + buffer_size;
+	size_t bytes_sent = 0;
+	while(bytes_sent < message_size) {
+		struct iovec parts[2];
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = parts;
+		if(bytes_sent < sizeof(network_buffer_size)) {
+			parts[message.msg_iovlen].iov_base = (char*)&network_buffer_size + bytes_sent;
+			parts[message.msg_iovlen].iov_len = sizeof(network_buffer_size) - bytes_sent;
+			message.msg_iovlen++;
+		}
+		if(buffer_size > 0) {
+			size_t buffer_sent = bytes_sent > sizeof(network_buffer_size) ? bytes_sent - sizeof(network_buffer_size) : 0;
+			parts[message.msg_iovlen].iov_base = buffer + buffer_sent;
+			parts[message.msg_iovlen].iov_len = buffer_size - buffer_sent;
+			message.msg_iovlen++;
+		}
+		int send_return = sendmsg(socketfd, &message, 0);
+		if(send_return <= 0) {
+			// there was an error sending or the remote closed the connection
+			// error printing should be done by the calling thread so we just return
+			return send_return;
+		}
+		bytes_sent += send_return;
+	}
+	return 1; // return 0 = remote closed socket, return -1 = error
+}
+
+int64_t tcp_message_receive_file(int socketfd, int fd, uint64_t max_size, double timeout_seconds) {
+	struct timeval start_time;
+	gettimeofday(&start_time, NULL);
+
+	char message_size_buffer[4];
+	if(receive_tcp_n(socketfd, message_size_buffer, sizeof(message_size_buffer), 4, timeout_seconds) != 4) {
+		return -1;
+	}
+	uint32_t message_size = ntohl(*((uint32_t*)message_size_buffer));
+	if(message_size > max_size) {
+		LOGD("message of %u bytes is bigger than %llu bytes\n", message_size, (unsigned long long)max_size);
+		return -1;
+	}
+	char buffer[65536];
+	uint64_t received_size = 0;
+	while(received_size < message_size) {
+		size_t chunk_size = message_size - received_size < sizeof(buffer) ? message_size - received_size : sizeof(buffer);
+		int receive_return = receive_tcp_n(socketfd, buffer, sizeof(buffer), chunk_size, timeout_seconds - get_passed_time(start_time));
+		if(receive_return != chunk_size) {
+			return -1;
+		}
+		size_t written_bytes = 0;
+		while(written_bytes < chunk_size) {
+			ssize_t write_return = write(fd, buffer + written_bytes, chunk_size - written_bytes);
+			if(write_return == -1) {
+				if(errno == EINTR) {
+					continue;
+				}
+				LOGE("write %s\n", strerror(errno));
+				return -1;
+			}
+			written_bytes += write_return;
+		}
+		received_size += chunk_size;
+	}
+	return received_size;
+}
+
+int tcp_message_send_file(int socketfd, int fd, uint64_t offset, uint64_t size) {
+	if(size > UINT32_MAX) {
+		LOGE("file of %llu bytes is too big for a message\n", (unsigned long long)size);
+		return -1;
+	}
+	uint32_t network_buffer_size = htonl((uint32_t)size);
+	int send_return = send(socketfd, (void*)&network_buffer_size, 4, size > 0 ? MSG_MORE : 0);
 	if(send_return <= 0) {
-		// there was an error sending or the remote closed the connection
-		// error printing should be done by the calling thread so we just return
 		return send_return;
 	}
-	// now send the buffer
-	size_t bytes_sent = 0;
-	while(bytes_sent < buffer_size) {
-        send_return = send(socketfd, buffer + bytes_sent, buffer_size - bytes_sent, 0);
-        if(send_return <= 0) {
-            // there was an error sending or the remote closed the connection
-            // error printing should be done by the calling thread so we just return
-            return send_return;
-        }
-        bytes_sent += send_return;
+	off_t file_offset = offset;
+	uint64_t end = offset + size;
+	while((uint64_t)file_offset < end) {
+		ssize_t sent_bytes = sendfile(socketfd, fd, &file_offset, end - file_offset);
+		if(sent_bytes <= 0) {
+			if(sent_bytes == -1 && errno == EINTR) {
+				continue;
+			}
+			// the file shrunk, an error occurred or the remote closed the connection
+			return sent_bytes == 0 ? -1 : sent_bytes;
+		}
 	}
-	return 1; // return 0 = remote closed socket, return -1 = error
+	return 1;
 }
 
 // MODULE SCOPED FUNTCIONS BEGIN
@@ -320,20 +495,8 @@ double get_time_difference_seconds(struct timeval t1, struct timeval t2) {
 }
 
 // another helper function to receive exactly n bytes of a tcp stream with a timeout used by receive_tcp_message
-/*
- *
- *
- * THE TIMEOUT NEEDS FIXING
- * THE TIMEOUT NEEDS FIXING
- * THE TIMEOUT NEEDS FIXING
- * THE TIMEOUT NEEDS FIXING
- * THE TIMEOUT NEEDS FIXING
- * THE TIMEOUT NEEDS FIXING
- * THE TIMEOUT NEEDS FIXING
- * THE TIMEOUT NEEDS FIXING
- *
- *
- */
+// it stops early if the buffer is smaller than n
+// returns the count of received bytes, 0 if the connection was closed or -1 on errors and timeouts
 int receive_tcp_n(int socketfd, char* buffer, size_t buffer_size, size_t n, double timeout_seconds) {
 	// receive timeout will be handled with select
 	// and a timer
@@ -344,30 +507,28 @@ int receive_tcp_n(int socketfd, char* buffer, size_t buffer_size, size_t n, doub
 	FD_ZERO(&master_read_set);
 	FD_SET(socketfd, &master_read_set);
 
-	int buffer_index = 0;
+	size_t wanted_bytes = n < buffer_size ? n : buffer_size;
+	size_t buffer_index = 0;
 
-	while(buffer_index < buffer_size && buffer_index < n) {
+	while(buffer_index < wanted_bytes) {
+		double remaining_time = timeout_seconds - get_passed_time(start_time);
+		if(remaining_time <= 0) {
+			// timeout
+			errno = ETIMEDOUT;
+			return -1;
+		}
 		fd_set read_set = master_read_set;
-		struct timeval select_timeout;
-		select_timeout.tv_sec = (int)timeout_seconds;
-		select_timeout.tv_usec = 0;
+		struct timeval select_timeout = timeval_from_double(remaining_time);
 		int select_return = select(socketfd + 1, &read_set, NULL, NULL, &select_timeout);
 		if(select_return == -1) {
 			// on select
 			LOGE("select %s\n", strerror(errno));
 			return select_return;
 		}
-		double passed_time = get_passed_time(start_time);
-        if(passed_time > timeout_seconds) {
-            // timeout
-        	//LOGD("select timedout\n");
-            //return select_return;
-        }
 		// maybe the socket is ready :)
 		if(FD_ISSET(socketfd, &read_set)) {
-			// calculate the maximum bytes that still can be received
-			int max_recv = buffer_size > n ? buffer_size - buffer_index : n - buffer_index;
-			int recv_return = recv(socketfd, (void*)(buffer + buffer_index), max_recv - buffer_index, 0);
+			// never read more than requested, the rest belongs to the next message
+			int recv_return = recv(socketfd, (void*)(buffer + buffer_index), wanted_bytes - buffer_index, 0);
 			if(recv_return <= 0) {
 				// error or disconnected
 				return recv_return;
@@ -378,6 +539,42 @@ int receive_tcp_n(int socketfd, char* buffer, size_t buffer_size, size_t n, doub
 	return buffer_index;
 }
 
+// starts a non-blocking connect, the socket is only kept if the connect did not fail
+// returns 1 if the connection is established already, 0 if it is in progress and -1 if it failed
+int start_connect(struct sockaddr_storage* address, unsigned short port, int* socketfd) {
+	socklen_t address_length;
+	if(address->ss_family == AF_INET) {
+		((struct sockaddr_in*)address)->sin_port = htons(port);
+		address_length = sizeof(struct sockaddr_in);
+	} else {
+		((struct sockaddr_in6*)address)->sin6_port = htons(port);
+		address_length = sizeof(struct sockaddr_in6);
+	}
+	*socketfd = socket(address->ss_family, SOCK_STREAM, 0);
+	if(*socketfd == -1) {
+		LOGE("socket %s\n", strerror(errno));
+		return -1;
+	}
+	if(fcntl(*socketfd, F_SETFL, fcntl(*socketfd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+		LOGE("fcntl set O_NONBLOCK\n");
+		close(*socketfd);
+		*socketfd = -1;
+		return -1;
+	}
+	if(connect(*socketfd, (struct sockaddr*)address, address_length) == 0) {
+		return 1;
+	}
+	if(errno == EINPROGRESS) {
+		return 0;
+	}
+	char ip_buffer[128];
+	get_ip_address_string_prefixed((struct sockaddr*)address, ip_buffer, sizeof(ip_buffer));
+	LOGD("connect to %s %s\n", ip_buffer, strerror(errno));
+	close(*socketfd);
+	*socketfd = -1;
+	return -1;
+}
+
 struct timeval timeval_from_double(double time_seconds) {
     struct timeval timeout;
     timeout.tv_sec = (int)time_seconds;
@@ -13,6 +13,39 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 
+/// The state of a single attempt of connect_parallel()
+typedef enum {
+	CONNECT_ATTEMPT_NOT_STARTED = 0, //!< Another attempt won before this one was started
+	CONNECT_ATTEMPT_FAILED, //!< The attempt failed or timed out
+	CONNECT_ATTEMPT_CANCELLED, //!< Another attempt won while this one was still in progress
+	CONNECT_ATTEMPT_SUCCEEDED //!< This attempt won
+} connect_attempt_state_type;
+
+/// A single address to try with connect_parallel()
+typedef struct {
+	struct sockaddr_storage address; //!< The destination address, its port is set by connect_parallel()
+	connect_attempt_state_type state; //!< What became of the attempt
+	double seconds; //!< How long the attempt took until it failed or succeeded
+} connect_attempt_type;
+
+/**
+ * @brief Connects to the first address of a set that answers (happy eyeballs, RFC 8305).
+ *
+ * The attempts are started in the given order, each one @p attempt_delay_seconds after the previous one or right
+ * away when the previous one failed. They run in parallel and the first connection that is established wins, all
+ * others are closed. So a stale address costs only the delay instead of the whole timeout.
+ *
+ * TCP Fast Open is not used on purpose. Its connect completes before a single packet was sent, so the first address
+ * would win every race, even a dead one.
+ * @param attempts The addresses to try, receive the states of the attempts
+ * @param attempt_count The count of @p attempts
+ * @param port The destination port
+ * @param attempt_delay_seconds The delay between starting two attempts
+ * @param timeout_seconds The timeout of the whole connect
+ * @return The socket file descriptor of the winning attempt. If all fail -1 is returned.
+ */
+int connect_parallel(connect_attempt_type* attempts, size_t attempt_count, unsigned short port, double attempt_delay_seconds, double timeout_seconds);
+
 /**
  * @brief Connect a socket with a timeout
  *
@@ -56,6 +89,16 @@ int create_udp_listener(const char* port);
  */
 void get_hex_string(const unsigned char* in_buffer, const size_t count, char* buffer, const size_t buffer_size);
 
+/**
+ * @brief Parses a hex string as printed by get_hex_string().
+ *
+ * @param string The hex string, it has to consist of exactly 2 * @p count hex digits
+ * @param out_buffer The memory area the bytes are written to
+ * @param count How many bytes to parse
+ * @return 0 on success or -1 if the string is not a valid hex string of this length
+ */
+int parse_hex_string(const char* string, unsigned char* out_buffer, const size_t count);
+
 /**
  * @brief Creates a readable string of an ip address
  *
@@ -77,6 +120,14 @@ void get_ip_address_string_prefixed(struct sockaddr* address, char* buffer, cons
  */
 double get_passed_time(struct timeval t);
 
+/**
+ * @brief Calculates a fast non cryptographic hash (64 bit FNV-1a) of a string, e.g. for hash tables
+ *
+ * @param string The zero terminated string
+ * @return The hash of @p string
+ */
+uint64_t get_string_hash(const char* string);
+
 /**
  * @brief Checks if a given IPv6 address is a mapped IPv4 address
  *
@@ -111,8 +162,9 @@ void mkdirp(const char* path);
  * @param socketfd The socket to use for receiving
  * @param buffer The buffer to write the received data to
  * @param buffer_size The size of the buffer
- * @param timeout_seconds The maximum wait time before returning with an error
- * @return If successful returns how many bytes were received. Otherwise -1 or 0 is returned.
+ * @param timeout_seconds The maximum wait time for the whole message before returning with an error
+ * @return If successful returns how many bytes were received, this is 0 for an empty message. If the connection
+ * was closed, the message does not fit into the buffer, the timeout expired or an error occurred -1 is returned.
  */
 int tcp_message_receive(int socketfd, char* buffer, size_t buffer_size, double timeout_seconds);
 
@@ -131,4 +183,31 @@ int tcp_message_receive(int socketfd, char* buffer, size_t buffer_size, double t
  */
 int tcp_message_send(int socketfd, char* buffer, uint32_t buffer_size, double timeout_seconds);
 
+/**
+ * @brief Receives a length prefixed tcp "message" directly into a file
+ *
+ * This is the same as tcp_message_receive() for messages that are too big to be kept in memory.
+ *
+ * @param socketfd The socket to use for receiving
+ * @param fd The file to write the received data to at its current position
+ * @param max_size The maximum size of the message
+ * @param timeout_seconds The maximum wait time for the whole message before returning with an error
+ * @return If successful returns how many bytes were received. If the connection was closed, the message is too
+ * big, the timeout expired or an error occurred -1 is returned.
+ */
+int64_t tcp_message_receive_file(int socketfd, int fd, uint64_t max_size, double timeout_seconds);
+
+/**
+ * @brief Sends (a part of) a file as a length prefixed tcp "message" without copying it through user space
+ *
+ * The message can be received with tcp_message_receive() or tcp_message_receive_file().
+ *
+ * @param socketfd The socket to use for sending
+ * @param fd The file to send, its position is not used or changed
+ * @param offset Where the message starts in the file
+ * @param size The size of the message, it has to fit into 32 bits
+ * @return If successful returns 1. Otherwise -1 or 0 is returned.
+ */
+int tcp_message_send_file(int socketfd, int fd, uint64_t offset, uint64_t size);
+
 #endif